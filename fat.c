@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fat.h"
+#include "fatindex.h"
+#include "fatstats.h"
+
+const int NOT_USED = 0x00;
+const int DELETED = 0xe5;
+const int ACTUAL_E5 = 0x05;
+const int DIRECTORY = 0x2e;
+
+const int ATTR_READ_ONLY = 0x01;
+const int ATTR_HIDDEN = 0x02;
+const int ATTR_SYSTEM_FILE = 0x04;
+const int ATTR_VOLUME_LABEL = 0x08;
+const int ATTR_SUB_DIR = 0x10;
+const int ATTR_ARCHIVE = 0x20;
+const int ATTR_UNUSED1 = 0x40;
+const int ATTR_UNUSED2 = 0x80;
+
+const int AVAILABLE_12 = 0x000;
+const int AVAILABLE_16 = 0x0000;
+const int RESERVED_12 = 0x001;
+const int RESERVED_16 = 0x0001;
+const int BAD_CLUSTER_12 = 0xff7;
+const int BAD_CLUSTER_16 = 0xfff7;
+const int END_MARKER_12 = 0xff8;
+const int END_MARKER_16 = 0xfff8;
+const int BAD_CLUSTER_32 = 0x0ffffff7;
+const int END_MARKER_32 = 0x0ffffff8;
+
+const int FIRST_ROOT_CLUSTER = 2;
+
+/**
+ * Converts a two-byte little-endian value to a big-endian integer
+ *
+ * @param bytes The bytes to convert
+ * @return The big-endian value of `bytes`
+ */
+int le2be2(BytePair bytes) {
+	return (bytes.bytes[0] + (bytes.bytes[1] << 8));
+}
+
+/**
+ * Converts a four-byte little-endian value to a big-endian integer
+ *
+ * @param bytes The bytes to convert
+ * @return The big-endian value of `bytes`
+ */
+int le2be4(ByteQuad bytes) {
+	int res = bytes.bytes[0];
+	int i;
+	for (i = 1; i < 4; i++) {
+		res += bytes.bytes[i] << (8 * i);
+	}
+	return res;
+}
+
+/**
+ * Gets the size of one copy of the FAT, which FAT32 keeps in its extended BPB
+ *
+ * @param bs The bootsector of the filesystem
+ * @return The number of sectors in each copy of the FAT
+ */
+int getNumberFATSectors(BootSector* bs) {
+	if (le2be2(bs->numSectorsInFAT) != 0) {
+		return le2be2(bs->numSectorsInFAT);
+	}
+	return le2be4(((BootSector32*)bs)->numSectorsInFAT);
+}
+
+/**
+ * Calculates the total number of clusters in the filesystem
+ *
+ * @param bs The bootsector of the filesystem
+ * @return The number of clusters in the filesystem
+ */
+int getNumberClusters(BootSector* bs) {
+	unsigned int root_dir_sectors = ((le2be2(bs->numEntriesRootDir) * 32) + (le2be2(bs->numBytesPerSector) - 1)) / le2be2(bs->numBytesPerSector);
+	unsigned int data_sectors;
+	if (le2be2(bs->numSectors) != 0) {
+		data_sectors = le2be2(bs->numSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * getNumberFATSectors(bs)) + root_dir_sectors);
+	} else {
+		data_sectors = (unsigned int)le2be4(bs->largeSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * getNumberFATSectors(bs)) + root_dir_sectors);
+	}
+	return (int)(data_sectors / bs->numSectorsPerCluster);
+}
+
+/**
+ * Determines if the FAT is FAT12, FAT16, or FAT32
+ *
+ * @param bs The bootsector of the filesystem
+ * @return The number version of FAT
+ */
+int getFATType(BootSector* bs) {
+	int total_clusters = getNumberClusters(bs);
+	if (total_clusters < 4085) {
+		return 12;
+	} else {
+		if (total_clusters < 65525) {
+			return 16;
+		} else {
+			return 32;
+		}
+	}
+}
+
+/**
+ * Reads the free cluster hints from a FAT32 FSInfo sector
+ *
+ * The hints are left at -1 if the sector is missing, its signatures
+ * don't match, or the volume says it doesn't know.
+ *
+ * @param img The disk image
+ * @param info The volume to receive the hints
+ * @param sector The FSInfo sector, from the extended BPB
+ */
+static void readFSInfo(Image* img, FATInfo* info, int sector) {
+	if (sector == 0 || sector >= info->reservedSectors) {
+		return;
+	}
+	ByteQuad fields[4];
+	ByteQuad leadSig;
+	readImage(img, (long)info->sizeofSector * sector, sizeof(leadSig), &leadSig);
+	readImage(img, (long)info->sizeofSector * sector + 484, sizeof(fields), fields);
+	if ((unsigned int)le2be4(leadSig) != 0x41615252 || (unsigned int)le2be4(fields[0]) != 0x61417272) {
+		return;
+	}
+	info->fsInfoSector = sector;
+	unsigned int freeCount = le2be4(fields[1]);
+	unsigned int nextFree = le2be4(fields[2]);
+	if (freeCount != 0xffffffff && freeCount <= (unsigned int)info->numClusters) {
+		info->freeClusters = freeCount;
+	}
+	if (nextFree != 0xffffffff && nextFree < (unsigned int)info->numClusters + 2) {
+		info->nextFreeCluster = nextFree;
+	}
+}
+
+/**
+ * Reads information from the bootstrap sector into a BootSector object
+ * and works out the layout of the volume
+ *
+ * @param img The disk image
+ * @param bs The BootSector object to receive the data
+ * @return The volume's layout, to be freed with freeFATInfo
+ */
+FATInfo* readBootStrapSector(Image* img, BootSector* bs) {
+	readImage(img, 0, sizeof(BootSector), bs);
+
+	FATInfo* info = malloc(sizeof(FATInfo));
+	info->fatType = getFATType(bs);
+	info->numClusters = getNumberClusters(bs);
+	info->numFATSectors = getNumberFATSectors(bs);
+	info->numCopiesFAT = bs->numCopiesFAT;
+	info->sizeofSector = le2be2(bs->numBytesPerSector);
+	info->sectorsPerCluster = bs->numSectorsPerCluster;
+	info->sizeofCluster = info->sectorsPerCluster * info->sizeofSector;
+	info->reservedSectors = le2be2(bs->numReservedSectors);
+	// the root directory of FAT12/16, or the first data cluster of FAT32
+	info->firstDataSector = info->reservedSectors + info->numCopiesFAT * info->numFATSectors;
+	info->numRootEntries = le2be2(bs->numEntriesRootDir);
+	info->numRootClusters = info->numRootEntries * sizeof(DirectoryEntry) / info->sizeofSector;
+	info->rootCluster = FIRST_ROOT_CLUSTER;
+	info->freeClusters = -1;
+	info->nextFreeCluster = -1;
+	info->fsInfoSector = 0;
+	info->volumeSerial = (unsigned int)le2be4(bs->volumeSN);
+	info->index = NULL;
+
+	int activeFAT = 0;
+	info->mirrorFAT = 1;
+	if (info->fatType == 32) {
+		BootSector32* bs32 = (BootSector32*)bs;
+		// the root directory is an ordinary cluster chain
+		info->rootCluster = le2be4(bs32->rootCluster) & FAT32_ENTRY_MASK;
+		info->volumeSerial = (unsigned int)le2be4(bs32->volumeSN);
+		if (le2be2(bs32->extFlags) & 0x80) {
+			// mirroring is off and only one FAT is kept up to date
+			activeFAT = le2be2(bs32->extFlags) & 0x0f;
+			info->mirrorFAT = 0;
+		}
+		readFSInfo(img, info, le2be2(bs32->fsInfoSector));
+	}
+
+	// decode the FAT up front so chains can be followed without I/O
+	info->fatOffset = (long)info->sizeofSector * (info->reservedSectors + activeFAT * info->numFATSectors);
+	info->table = loadFATTable(img, info->fatType, info->fatOffset,
+		(long)info->numFATSectors * info->sizeofSector, info->numClusters + 2);
+
+	return info;
+}
+
+/**
+ * Prints out the information in the bootstrap sector
+ */
+void displayBootStrapInfo(FATInfo* info, BootSector* bs) {
+	printf("OEM:                 %.*s\n", 8, bs->OEM);
+	printf("Bytes Per Sector:    %d\n", le2be2(bs->numBytesPerSector));
+	printf("Sectors Per Cluster: %d\n", bs->numSectorsPerCluster);
+	printf("Reserved Sectors:    %d\n", le2be2(bs->numReservedSectors));
+	printf("FATs:                %d\n", bs->numCopiesFAT);
+	printf("Entries in Root:     %d\n", le2be2(bs->numEntriesRootDir));
+	printf("Sectors:             %d\n", le2be2(bs->numSectors));
+	printf("Media:               0x%02x\n", bs->mediaDescriptor);
+	printf("FAT Sectors:         %d\n", info->numFATSectors);
+	printf("Sectors Per Track:   %d\n", le2be2(bs->numSectorsPerTrack));
+	printf("Sides:               %d\n", le2be2(bs->numSides));
+	printf("Hidden Sectors:      %d\n", le2be4(bs->numHiddenSectors));
+	printf("Large Sectors:       %u\n", (unsigned int)le2be4(bs->largeSectors));
+	if (info->fatType == 32) {
+		BootSector32* bs32 = (BootSector32*)bs;
+		printf("Root Cluster:        %d\n", info->rootCluster);
+		printf("Disk Number:         %d\n", bs32->physicalDiskNum);
+		printf("Current Head:        %d\n", bs32->currentHead);
+		printf("Signature:           0x%02x\n", bs32->signature);
+		printf("Volume SN:           0x%08x\n", le2be4(bs32->volumeSN));
+		printf("Volume Label:        %.*s\n", 11, bs32->volumeLabel);
+		printf("Format Type:         %.*s\n", 8, bs32->formatType);
+		if (info->freeClusters >= 0) {
+			printf("Free Clusters:       %ld (FSInfo)\n", info->freeClusters);
+		}
+	} else {
+		printf("Disk Number:         %d\n", bs->physicalDiskNum);
+		printf("Current Head:        %d\n", bs->currentHead);
+		printf("Signature:           0x%02x\n", bs->signature);
+		printf("Volume SN:           0x%08x\n", le2be4(bs->volumeSN));
+		printf("Volume Label:        %.*s\n", 11, bs->volumeLabel);
+		printf("Format Type:         %.*s\n", 8, bs->formatType);
+	}
+	printf("FAT Type is FAT%d, disk has %d clusters\n", info->fatType, getNumberClusters(bs));
+}
+
+/**
+ * Calculates a cluster's actual position in the user data section
+ * because of the fact that clusters are numbered starting at 2
+ *
+ * @param info The volume
+ * @param relativeCluster The cluster whose position is to be calculated
+ * @return The actual position of the cluster in the user data section
+ */
+int getAbsoluteCluster(FATInfo* info, int relativeCluster) {
+	return relativeCluster - 2 + info->firstDataSector;
+}
+
+/**
+ * Calculates a cluster's position in the filesystem
+ * after the boot sector and FATs
+ *
+ * @param info The volume
+ * @param absoluteCluster The cluster's position in the user data section
+ * @return The position of the cluster after the boot sector and FATs
+ */
+int clusterRelativeToRoot(FATInfo* info, int absoluteCluster) {
+	return absoluteCluster + info->numRootClusters;
+}
+
+/**
+ * Calculates where a cluster of file data starts in the disk image
+ *
+ * @param info The volume
+ * @param cluster The cluster, numbered from 2 like the FAT
+ * @return The byte offset of the cluster in the disk image
+ */
+long getClusterOffset(FATInfo* info, int cluster) {
+	int sector = clusterRelativeToRoot(info, info->firstDataSector + (cluster - 2) * info->sectorsPerCluster);
+	return (long)info->sizeofSector * sector;
+}
+
+/**
+ * Gets the first cluster of a directory entry
+ *
+ * Only FAT32 uses the upper half, so anything stored there by other
+ * systems on FAT12/16 volumes is ignored.
+ *
+ * @param info The volume
+ * @param de The entry
+ * @return The entry's first cluster
+ */
+int getEntryCluster(FATInfo* info, const DirectoryEntry* de) {
+	if (info->fatType != 32) {
+		return entryStartingCluster(de);
+	}
+	return (entryStartingCluster(de) | (readLE16(de->startingClusterUpper) << 16)) & FAT32_ENTRY_MASK;
+}
+
+/**
+ * Gets the next cluster in a file's cluster chain
+ *
+ * @param info The volume
+ * @param cluster The current cluster in the chain
+ * @return The next cluster in the chain
+ */
+int getNextCluster(FATInfo* info, int cluster) {
+	return getFATEntry(info->table, cluster);
+}
+
+/**
+ * Passes an entry to a visitor, or adds it to the long name being collected
+ *
+ * @param img The disk image
+ * @param de The entry
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param longName Slots found so far, or NULL to visit long name slots as
+ *                 they are
+ * @param visit The visitor
+ * @param context Passed through to `visit`
+ */
+static void visitEntry(Image* img, const DirectoryEntry* de, long posInFile,
+	LongName* longName, EntryVisitor visit, void* context
+) {
+	if (longName == NULL) {
+		visit(img, de, NULL, posInFile, context);
+	} else if (isLongNameSlot(de)) {
+		addLongNameSlot(longName, de, posInFile);
+	} else {
+		int named = finishLongName(longName, de);
+		visit(img, de, named ? longName : NULL, posInFile, context);
+		longName->numSlots = 0;
+	}
+}
+
+/**
+ * Passes each entry in use in part of a directory to a visitor
+ *
+ * @param img The disk image
+ * @param info The volume
+ * @param directory The entries to scan
+ * @param len Size of `directory` in bytes
+ * @param posInFile Byte offset of `directory` in the disk image
+ * @param skipDeleted 1 if deleted entries should not be visited
+ * @param longName Long name slots found so far in the directory, or NULL
+ *                 to visit them as they are
+ * @param visit The visitor
+ * @param context Passed through to `visit`
+ * @return 1 if a never used entry ended the directory within `directory`,
+ *         otherwise 0
+ */
+static int scanDirectoryEntries(Image* img, FATInfo* info, Sector directory, int len, long posInFile,
+	int skipDeleted, LongName* longName, EntryVisitor visit, void* context
+) {
+	int sizeofDirEntry = sizeof(DirectoryEntry);
+	int numEntries = len / sizeofDirEntry;
+
+	int e;
+	int numDecoded = 0;
+	int ended = 0;
+	// jump straight to the entries that are in use
+	for (e = findLiveEntry(directory, 0, numEntries, skipDeleted); e < numEntries;
+		e = findLiveEntry(directory, e + 1, numEntries, skipDeleted)
+	) {
+		int offset = e * sizeofDirEntry;
+		if (directory[offset] == NOT_USED) {
+			ended = 1;
+			break;
+		}
+		visitEntry(img, (const DirectoryEntry*)(directory + offset), posInFile + offset, longName, visit, context);
+		numDecoded++;
+	}
+	countStat(STAT_ENTRIES, numDecoded);
+	return ended;
+}
+
+/**
+ * Reads through a directory and passes each entry in use to a visitor
+ *
+ * Reading stops at the first entry that was never used, which ends the
+ * directory. The FAT12/16 root directory is read a cluster's worth of
+ * sectors first and then twice as many each time it goes on. Other
+ * directories have their first run of consecutive clusters read, and the
+ * rest of their runs all at once only if the directory goes on past it;
+ * mapped images are scanned in place a cluster at a time.
+ *
+ * @param img - The disk image
+ * @param info - The volume
+ * @param cluster - The cluster to start at
+ * @param maxClusters - Only used for root directories.
+ *                      Indicates how many contiguous sectors to check
+ * @param skipDeleted - 1 if deleted entries should not be visited
+ * @param longName - Where to collect long names, or NULL to visit their
+ *                   slots as they are
+ * @param visit - The visitor
+ * @param context - Passed through to `visit`
+ */
+static void readDirectory(Image* img, FATInfo* info, int cluster, int maxClusters,
+	int skipDeleted, LongName* longName, EntryVisitor visit, void* context
+) {
+	if (longName != NULL) {
+		longName->numSlots = 0;
+	}
+	if (maxClusters > 0) {
+		long offset = (long)info->sizeofSector * getAbsoluteCluster(info, cluster);
+		int numSectors = info->sectorsPerCluster;
+
+		// only written to if the image is not mapped
+		Sector buffer = malloc((long)maxClusters * info->sizeofSector);
+		int ended = 0;
+		while (!ended && maxClusters > 0) {
+			if (numSectors > maxClusters) {
+				numSectors = maxClusters;
+			}
+			int len = numSectors * info->sizeofSector;
+			Sector root = getImageSector(img, offset, len, buffer);
+			ended = scanDirectoryEntries(img, info, root, len, offset, skipDeleted, longName, visit, context);
+			offset += len;
+			maxClusters -= numSectors;
+			numSectors *= 2;
+		}
+		free(buffer);
+		return;
+	}
+
+	int sizeofCluster = info->sizeofCluster;
+	// a chain longer than the largest directory allowed must loop
+	int maxDirClusters = (MAX_DIRECTORY_ENTRIES * (long)sizeof(DirectoryEntry) + sizeofCluster - 1) / sizeofCluster;
+
+	if (img->map == NULL) {
+		// resolve the chain first so each run of clusters is one read,
+		// and so the uring backend can have every read in flight at once
+		ClusterChain chain = { 0 };
+		getClusterChain(info->table, cluster, maxDirClusters, &chain);
+
+		Sector data = malloc((long)chain.numClusters * sizeofCluster + 1);
+		ImageRead* reads = malloc((chain.numRuns + 1) * sizeof(ImageRead));
+		long at = 0;
+		int r;
+		for (r = 0; r < chain.numRuns; r++) {
+			reads[r].offset = getClusterOffset(info, chain.runs[r].start);
+			reads[r].len = chain.runs[r].length * sizeofCluster;
+			reads[r].dest = data + at;
+			at += reads[r].len;
+		}
+		// most directories are one run, and the rest are
+		// only read if the directory doesn't end in the first
+		readImageBatch(img, reads, chain.numRuns > 0 ? 1 : 0);
+
+		int ended = 0;
+		for (r = 0; r < chain.numRuns && !ended; r++) {
+			if (r == 1) {
+				readImageBatch(img, reads + 1, chain.numRuns - 1);
+			}
+			int c;
+			for (c = 0; c < chain.runs[r].length && !ended; c++) {
+				long offset = (long)c * sizeofCluster;
+				ended = scanDirectoryEntries(img, info, reads[r].dest + offset, sizeofCluster,
+					reads[r].offset + offset, skipDeleted, longName, visit, context);
+			}
+		}
+
+		free(reads);
+		free(data);
+		freeClusterChain(&chain);
+		return;
+	}
+
+	// mapped images are scanned in place, a cluster at a time
+	int nextCluster = cluster;
+	int clusterCount = 0;
+
+	// only written to for a cluster that runs past the end of the image
+	Sector clusterBuffer = malloc(sizeofCluster);
+
+	int ended = 0;
+	while (!ended && isChainCluster(info->table, nextCluster) && clusterCount < maxDirClusters) {
+		long offset = getClusterOffset(info, nextCluster);
+		Sector data = getImageSector(img, offset, sizeofCluster, clusterBuffer);
+		ended = scanDirectoryEntries(img, info, data, sizeofCluster, offset, skipDeleted, longName, visit, context);
+
+		clusterCount++;
+		nextCluster = getNextCluster(info, nextCluster);
+	}
+
+	free(clusterBuffer);
+}
+
+typedef struct entrylist {
+	IndexedEntry* entries;
+	int count;
+	int capacity;
+} EntryList;
+
+/**
+ * Collects the entries of a directory being read into an index
+ */
+static void recordEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context) {
+	EntryList* list = context;
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->entries = realloc(list->entries, list->capacity * sizeof(IndexedEntry));
+	}
+	list->entries[list->count].posInFile = posInFile;
+	list->entries[list->count].entry = *de;
+	list->count++;
+}
+
+/**
+ * Scans through a directory and passes each entry in use to a visitor
+ *
+ * With an index attached to the volume, the directory's recorded entries
+ * are visited instead, and a directory that hasn't been recorded yet is
+ * read into the index first.
+ *
+ * Long name slots are not visited themselves; the entry they name is
+ * visited with its long name, once all of its slots check out.
+ *
+ * The visitor decides whether to descend into subdirectories, normally
+ * by queueing them on a DirWalk so the tree is scanned level by level.
+ *
+ * @param img - The disk image
+ * @param info - The volume
+ * @param cluster - The cluster to start at
+ * @param maxClusters - Only used for root directories.
+ *                      Indicates how many contiguous sectors to check
+ * @param skipDeleted - 1 if deleted entries should not be visited
+ * @param visit - The visitor
+ * @param context - Passed through to `visit`
+ */
+void scanDirectory(Image* img, FATInfo* info, int cluster, int maxClusters,
+	int skipDeleted, EntryVisitor visit, void* context
+) {
+	// collected here instead of allocated per entry
+	LongName longName;
+	if (info->index == NULL) {
+		readDirectory(img, info, cluster, maxClusters, skipDeleted, &longName, visit, context);
+		return;
+	}
+
+	IndexedDir* dir = findIndexedDir(info->index, cluster, maxClusters);
+	if (dir == NULL) {
+		// record the whole directory before visiting any of it,
+		// since visitors scan subdirectories as they go
+		EntryList list = { 0 };
+		readDirectory(img, info, cluster, maxClusters, 0, NULL, recordEntry, &list);
+		dir = addIndexedDir(info->index, cluster, maxClusters, list.entries, list.count);
+		free(list.entries);
+	}
+
+	// more directories may be added while this one is visited
+	IndexedEntry* entries = dir->entries;
+	int numEntries = dir->numEntries;
+	int e;
+	int numDecoded = 0;
+	longName.numSlots = 0;
+	for (e = 0; e < numEntries; e++) {
+		if (skipDeleted && entries[e].entry.filename[0] == DELETED) {
+			continue;
+		}
+		visitEntry(img, &entries[e].entry, entries[e].posInFile, &longName, visit, context);
+		numDecoded++;
+	}
+	countStat(STAT_ENTRIES, numDecoded);
+}
+
+/**
+ * Frees a volume's layout and its decoded FAT
+ *
+ * @param info The volume to free
+ */
+void freeFATInfo(FATInfo* info) {
+	freeDirIndex(info->index);
+	freeFATTable(info->table);
+	free(info);
+}
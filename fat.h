@@ -0,0 +1,186 @@
+/**
+ * BootStrapSector is the first 512 bytes of the FAT.
+ * Two byte fields are little-endian
+ *
+ * The format of this sector is:
+ * byte(s) contents
+ * ------- -------------------------------------------------------
+ *  00-02	first instruction of bootstrap routine
+ *  03-10	OEM name
+ *  11-12	number of bytes per sector
+ *     13	number of sectors per cluster
+ *  14-15	number of reserved sectors
+ *     16	number of copies of the file allocation table
+ *  17-18	number of entries in root directory
+ *  19-20	total number of sectors
+ *     21	media descriptor byte
+ *  22-23	number of sectors in each copy of file allocation table
+ *  24-25	number of sectors per track
+ *  26-27	number of sides
+ *  28-29	number of hidden sectors
+ *  30-509	bootstrap routine and partition information
+ *     510	hexadecimal 55
+ *     511	hexadecimal AA
+ *
+ * FAT32 keeps the first 36 bytes and replaces the rest (see BootSector32):
+ *  36-39	number of sectors in each copy of file allocation table
+ *  40-41	flags; bit 7 set means only the FAT numbered in bits 0-3 is used
+ *  42-43	version
+ *  44-47	first cluster of the root directory
+ *  48-49	sector holding the FSInfo structure
+ *  50-51	sector holding a backup of the boot sector
+ *  52-63	reserved
+ *  64-89	drive number, signature, serial, label and type as at 36-61
+ *
+ * libfat: the volume layout and directory walk shared by the msdos tools,
+ * on top of the image, FAT table, directory entry and arena modules.
+ */
+
+#ifndef FAT_H
+#define FAT_H
+
+#include "fatimage.h"
+#include "fattable.h"
+#include "fatdirent.h"
+#include "fatarena.h"
+
+typedef struct bootsector {
+	ByteTriplet firstInstruction; // This is often a jump instruction to the boot sector code itself
+	BYTE OEM[8];
+	BytePair numBytesPerSector;
+	BYTE numSectorsPerCluster;
+	BytePair numReservedSectors;
+	BYTE numCopiesFAT;
+	BytePair numEntriesRootDir;
+	BytePair numSectors;
+	BYTE mediaDescriptor;
+	BytePair numSectorsInFAT;
+	BytePair numSectorsPerTrack;
+	BytePair numSides;
+	ByteQuad numHiddenSectors;
+	ByteQuad largeSectors;
+	BYTE physicalDiskNum;
+	BYTE currentHead;
+	BYTE signature;
+	ByteQuad volumeSN;
+	BYTE volumeLabel[11];
+	BYTE formatType[8]; // FAT12 or FAT16; FAT32 keeps these fields in BootSector32
+	BYTE bootstrap[448];
+	BYTE hex55AA[2]; // the last bytes of the boot sector are, by definition, 55 AA.  This is a sanity check.
+} BootSector;
+
+typedef struct bootsector32 {
+	BYTE common[36]; // laid out as in BootSector
+	ByteQuad numSectorsInFAT;
+	BytePair extFlags;
+	BytePair version;
+	ByteQuad rootCluster;
+	BytePair fsInfoSector;
+	BytePair backupBootSector;
+	BYTE reserved[12];
+	BYTE physicalDiskNum;
+	BYTE currentHead;
+	BYTE signature;
+	ByteQuad volumeSN;
+	BYTE volumeLabel[11];
+	BYTE formatType[8];
+	BYTE bootstrap[420];
+	BYTE hex55AA[2];
+} BootSector32;
+
+typedef struct info {
+	int fatType;
+	int numClusters;
+	int numFATSectors;
+	int numCopiesFAT;
+	int sizeofSector;
+	int sectorsPerCluster;
+	int sizeofCluster;
+	int firstDataSector;
+	int numRootEntries;
+	int numRootClusters;
+	int reservedSectors;
+	int rootCluster; // where scanning the root directory starts
+	long freeClusters; // FAT32 FSInfo hints, -1 when unknown
+	long nextFreeCluster;
+	int fsInfoSector; // the FAT32 FSInfo sector, 0 if there is no valid one
+	long volumeSerial;
+	long fatOffset; // byte offset of the active FAT in the image
+	int mirrorFAT; // 1 if every copy of the FAT is kept the same, 0 if only the active one is
+	FATTable* table; // the active FAT, decoded when the volume is opened
+	struct dirindex* index; // saved directory contents, NULL if not in use
+} FATInfo;
+
+typedef BYTE* Sector;
+
+/*
+ * Called by scanDirectory for each entry in use
+ *
+ * img		The disk image
+ * de		The entry, pointing into the directory sector
+ * longName	The entry's long name, NULL if it has none; only valid
+ *		during the call
+ * posInFile	Byte offset of the entry in the disk image
+ * context	Whatever was passed to scanDirectory
+ */
+typedef void (*EntryVisitor)(Image* img, const DirectoryEntry* de, const LongName* longName,
+	long posInFile, void* context);
+
+/*
+ * Directory entry special values for first byte
+ * 0x00	Filename never used.
+ * 0xe5	The filename has been used, but the file has been deleted.
+ * 0x05	The first character of the filename is actually 0xe5.
+ * 0x2e	The entry is for a directory, not a normal file.
+ * 	If the second byte is also 0x2e, the cluster field contains the cluster number of this directory's parent directory.
+ *	If the parent directory is the root directory (which is statically allocated and doesn't have a cluster number), cluster number 0x0000 is specified here.
+ */
+extern const int NOT_USED;
+extern const int DELETED;
+extern const int ACTUAL_E5;
+extern const int DIRECTORY;
+
+// Directory entry attributes
+extern const int ATTR_READ_ONLY; // File is read only
+extern const int ATTR_HIDDEN; // Hidden file
+extern const int ATTR_SYSTEM_FILE; // Indicates a system file. These are hidden as well
+extern const int ATTR_VOLUME_LABEL; // Disk's volume label. Only found in the root directory
+extern const int ATTR_SUB_DIR; // The entry describes a subdirectory
+extern const int ATTR_ARCHIVE; // Archive flag. Set when the file is modified. Used by backup programs
+extern const int ATTR_UNUSED1; // Not used; must be set to 0
+extern const int ATTR_UNUSED2; // Not used; must be set to 0
+
+// FAT entry special values
+extern const int AVAILABLE_12;
+extern const int AVAILABLE_16;
+extern const int RESERVED_12;
+extern const int RESERVED_16;
+extern const int BAD_CLUSTER_12;
+extern const int BAD_CLUSTER_16;
+extern const int END_MARKER_12;
+extern const int END_MARKER_16;
+extern const int BAD_CLUSTER_32;
+extern const int END_MARKER_32;
+
+extern const int FIRST_ROOT_CLUSTER;
+
+// the most entries the FAT specification allows a directory to hold
+#define MAX_DIRECTORY_ENTRIES 65536
+
+int le2be2(BytePair bytes);
+int le2be4(ByteQuad bytes);
+int getNumberFATSectors(BootSector* bs);
+int getNumberClusters(BootSector* bs);
+int getFATType(BootSector* bs);
+FATInfo* readBootStrapSector(Image* img, BootSector* bs);
+void displayBootStrapInfo(FATInfo* info, BootSector* bs);
+int getAbsoluteCluster(FATInfo* info, int relativeCluster);
+int clusterRelativeToRoot(FATInfo* info, int absoluteCluster);
+long getClusterOffset(FATInfo* info, int cluster);
+int getNextCluster(FATInfo* info, int cluster);
+int getEntryCluster(FATInfo* info, const DirectoryEntry* de);
+void scanDirectory(Image* img, FATInfo* info, int cluster, int maxClusters,
+	int skipDeleted, EntryVisitor visit, void* context);
+void freeFATInfo(FATInfo* info);
+
+#endif
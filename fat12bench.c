@@ -0,0 +1,152 @@
+/**
+ * Microbenchmark for FAT12 decoding.
+ *
+ * Compares the old per-cluster getNextCluster path (a heap allocated
+ * ByteTriplet and le2be3 for every lookup) against decoding the whole
+ * table with the scalar and vector kernels from fattable.h.
+ *
+ * usage: fat12bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fattable.h"
+
+typedef unsigned char BYTE;
+typedef struct triplet {
+	BYTE bytes[3];
+} ByteTriplet;
+
+// the largest FAT12 volume, including the two reserved entries
+#define NUM_ENTRIES 4086
+
+int le2be3(ByteTriplet bytes, int which);
+int oldGetNextCluster(BYTE* fatSector, int cluster);
+double now();
+
+int main (int argc, char *argv[]) {
+	int iterations = 2000;
+	if (argc > 1) {
+		iterations = atoi(argv[1]);
+	}
+
+	int numBytes = NUM_ENTRIES * 3 / 2;
+	BYTE* fat = malloc(numBytes);
+	srand(12);
+	int i;
+	for (i = 0; i < numBytes; i++) {
+		fat[i] = rand() & 0xff;
+	}
+	uint16_t* scalar = malloc(NUM_ENTRIES * sizeof(uint16_t));
+	uint16_t* vector = malloc(NUM_ENTRIES * sizeof(uint16_t));
+	long checksum = 0;
+	int it;
+
+	double start = now();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < NUM_ENTRIES; i++) {
+			checksum += oldGetNextCluster(fat, i);
+		}
+	}
+	double oldTime = now() - start;
+
+	start = now();
+	for (it = 0; it < iterations; it++) {
+		decodeFAT12Scalar(fat, scalar, NUM_ENTRIES);
+		checksum += scalar[it % NUM_ENTRIES];
+	}
+	double scalarTime = now() - start;
+
+	start = now();
+	for (it = 0; it < iterations; it++) {
+		decodeFAT12(fat, vector, NUM_ENTRIES);
+		checksum += vector[it % NUM_ENTRIES];
+	}
+	double vectorTime = now() - start;
+
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		if (scalar[i] != oldGetNextCluster(fat, i) || vector[i] != scalar[i]) {
+			printf("mismatch at entry %d: old %03x scalar %03x vector %03x\n",
+				i, oldGetNextCluster(fat, i), scalar[i], vector[i]);
+			return 1;
+		}
+	}
+
+	double entries = (double)iterations * NUM_ENTRIES;
+	printf("%d entries x %d iterations (vector kernel: %s, checksum %ld)\n",
+		NUM_ENTRIES, iterations, decodeFAT12Kernel(), checksum);
+	printf("getNextCluster  %8.3f ns/entry\n", oldTime * 1e9 / entries);
+	printf("decode scalar   %8.3f ns/entry  %6.1fx\n", scalarTime * 1e9 / entries, oldTime / scalarTime);
+	printf("decode vector   %8.3f ns/entry  %6.1fx\n", vectorTime * 1e9 / entries, oldTime / vectorTime);
+
+	free(fat);
+	free(scalar);
+	free(vector);
+	return 0;
+}
+
+/**
+ * Extracts a twelve-bit little-endian value from a trio of bytes
+ * and converts it to a big-endian integer
+ *
+ * @param bytes The bytes to convert
+ * @param which The first or second value stored in `bytes`
+ * @return The extracted value
+ */
+int le2be3(ByteTriplet bytes, int which) {
+	if (which != 1 && which != 2) {
+		which = 1;
+	}
+
+	int firstByte = (int)bytes.bytes[0];
+	int secondByte = (int)bytes.bytes[1];
+	int thirdByte = (int)bytes.bytes[2];
+	int result = 0;
+	//UV WX YZ --> XUV YZW
+
+	if (which == 1) {
+		result = firstByte; // UV
+		result += ((secondByte & 0x0f) << 8); // X
+	} else {
+		result = (thirdByte << 4); // YZ
+		result += ((secondByte & 0xf0) >> 4); // W
+	}
+
+	return result;
+}
+
+/**
+ * The FAT12 half of getNextCluster as the tools used to do it
+ *
+ * @param fatSector The FAT containing the current cluster
+ * @param cluster The current cluster in the chain
+ * @return The next cluster in the chain
+ */
+int oldGetNextCluster(BYTE* fatSector, int cluster) {
+	int nextCluster;
+	int offset;
+	ByteTriplet *bt = malloc(sizeof(ByteTriplet));
+	if (cluster % 2) {
+		offset = (cluster - 1) / 2 * 3 + 1;
+		bt->bytes[1] = fatSector[offset];
+		bt->bytes[2] = fatSector[offset + 1];
+		nextCluster = le2be3(*bt, 2);
+	} else {
+		offset = cluster / 2 * 3;
+		bt->bytes[0] = fatSector[offset];
+		bt->bytes[1] = fatSector[offset + 1];
+		nextCluster = le2be3(*bt, 1);
+	}
+	free(bt);
+	return nextCluster;
+}
+
+/**
+ * @return A monotonic timestamp in seconds
+ */
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
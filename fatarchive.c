@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fatarchive.h"
+
+#define TAR_BLOCK 512
+#define TAR_NAME 100
+#define TAR_PREFIX 155
+
+// newc header: magic then 13 eight digit hex fields
+#define CPIO_HEADER 110
+#define CPIO_TRAILER "TRAILER!!!"
+
+static const unsigned char zeros[TAR_BLOCK];
+
+/**
+ * Gets the archive format with the given name
+ *
+ * @param name "tar" or "cpio"
+ * @return ARCHIVE_TAR or ARCHIVE_CPIO, or -1 if the name is not known
+ */
+int archiveFormat(const char* name) {
+	if (strcmp(name, "tar") == 0) {
+		return ARCHIVE_TAR;
+	}
+	if (strcmp(name, "cpio") == 0) {
+		return ARCHIVE_CPIO;
+	}
+	return -1;
+}
+
+/**
+ * Starts an archive on an output stream
+ *
+ * The stream is given a buffer of ARCHIVE_BUFFER bytes, so it must not
+ * have been written to yet.
+ *
+ * @param out The stream to write to
+ * @param format ARCHIVE_TAR or ARCHIVE_CPIO
+ * @return The new archive
+ */
+Archive* openArchive(FILE* out, int format) {
+	Archive* ar = malloc(sizeof(Archive));
+	ar->out = out;
+	ar->format = format;
+	ar->inode = 0;
+	setvbuf(out, NULL, _IOFBF, ARCHIVE_BUFFER);
+	return ar;
+}
+
+/**
+ * Fills in a tar header and its checksum
+ *
+ * @param header A zeroed TAR_BLOCK byte header
+ * @param name The name field; the caller makes sure it fits
+ * @param prefix The prefix field, or NULL
+ * @param type The type flag
+ * @param mode Permission bits
+ * @param size Size of the data that follows the header
+ * @param mtime Modification time in seconds since the epoch
+ */
+static void fillTarHeader(unsigned char* header, const char* name, const char* prefix, char type,
+	int mode, long size, long mtime) {
+	char* h = (char*)header;
+	strncpy(h, name, TAR_NAME);
+	snprintf(h + 100, 8, "%07o", mode);
+	snprintf(h + 108, 8, "%07o", 0);
+	snprintf(h + 116, 8, "%07o", 0);
+	snprintf(h + 124, 12, "%011lo", (unsigned long)size);
+	snprintf(h + 136, 12, "%011lo", (unsigned long)mtime);
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	if (prefix != NULL) {
+		strncpy(h + 345, prefix, TAR_PREFIX);
+	}
+
+	// the checksum is taken with its own field filled with spaces
+	memset(h + 148, ' ', 8);
+	unsigned int sum = 0;
+	int i;
+	for (i = 0; i < TAR_BLOCK; i++) {
+		sum += header[i];
+	}
+	snprintf(h + 148, 8, "%06o", sum);
+}
+
+/**
+ * Writes a pax extended header carrying a path that ustar cannot hold
+ *
+ * @param ar The archive
+ * @param path The full path
+ * @param mtime Modification time of the member it describes
+ * @return 1 on success, otherwise 0
+ */
+static int writePaxPath(Archive* ar, const char* path, long mtime) {
+	// a record is "<length> path=<path>\n", its length counting its own digits
+	int pathLen = strlen(path);
+	int length = pathLen + 7;
+	int digits = snprintf(NULL, 0, "%d", length);
+	while (snprintf(NULL, 0, "%d", length + digits) != digits) {
+		digits++;
+	}
+	length += digits;
+
+	unsigned char header[TAR_BLOCK] = { 0 };
+	fillTarHeader(header, "././@PaxHeader", NULL, 'x', 0644, length, mtime);
+	if (fwrite(header, TAR_BLOCK, 1, ar->out) != 1
+		|| fprintf(ar->out, "%d path=%s\n", length, path) != length) {
+		return 0;
+	}
+	return finishArchiveMember(ar, length);
+}
+
+/**
+ * Writes the ustar header of a member, preceded by a pax header if needed
+ *
+ * @param ar The archive
+ * @param path Path of the member, with a trailing '/' for directories
+ * @param isDir 1 for a directory
+ * @param size Size of the member's data
+ * @param mtime Modification time in seconds since the epoch
+ * @return 1 on success, otherwise 0
+ */
+static int writeTarHeader(Archive* ar, const char* path, int isDir, long size, long mtime) {
+	int pathLen = strlen(path);
+	char name[TAR_NAME + 1];
+	char prefix[TAR_PREFIX + 1];
+	int hasPrefix = 0;
+
+	if (pathLen <= TAR_NAME) {
+		strcpy(name, path);
+	} else {
+		// split at a '/' that leaves both halves short enough
+		int split;
+		for (split = pathLen - 1; split > 0; split--) {
+			if (path[split] == '/' && split <= TAR_PREFIX && pathLen - split - 1 <= TAR_NAME) {
+				break;
+			}
+		}
+		if (split > 0 && pathLen - split - 1 > 0) {
+			memcpy(prefix, path, split);
+			prefix[split] = 0;
+			strcpy(name, path + split + 1);
+			hasPrefix = 1;
+		} else {
+			if (!writePaxPath(ar, path, mtime)) {
+				return 0;
+			}
+			// readers that ignore the pax header still get a readable name
+			memcpy(name, path, TAR_NAME);
+			name[TAR_NAME] = 0;
+		}
+	}
+
+	unsigned char header[TAR_BLOCK] = { 0 };
+	fillTarHeader(header, name, hasPrefix ? prefix : NULL, isDir ? '5' : '0',
+		isDir ? 0755 : 0644, isDir ? 0 : size, mtime);
+	return fwrite(header, TAR_BLOCK, 1, ar->out) == 1;
+}
+
+/**
+ * Writes a newc header and the member's name
+ *
+ * @param ar The archive
+ * @param path Path of the member
+ * @param mode File type and permission bits
+ * @param nlink Number of links
+ * @param size Size of the member's data
+ * @param mtime Modification time in seconds since the epoch
+ * @return 1 on success, otherwise 0
+ */
+static int writeCpioHeader(Archive* ar, const char* path, int mode, int nlink, long size, long mtime) {
+	int nameSize = strlen(path) + 1;
+	long inode = strcmp(path, CPIO_TRAILER) == 0 ? 0 : ++ar->inode;
+	if (fprintf(ar->out, "070701%08lX%08X%08X%08X%08X%08lX%08lX%08X%08X%08X%08X%08X%08X",
+		inode, mode, 0, 0, nlink, mtime, size, 0, 0, 0, 0, nameSize, 0) != CPIO_HEADER) {
+		return 0;
+	}
+	// the name is padded so the data starts on a multiple of 4
+	int pad = (4 - (CPIO_HEADER + nameSize) % 4) % 4;
+	return fwrite(path, nameSize, 1, ar->out) == 1
+		&& (pad == 0 || fwrite(zeros, pad, 1, ar->out) == 1);
+}
+
+/**
+ * Writes the header of the next member
+ *
+ * The member's data, if any, is written straight to ar->out after this,
+ * followed by a call to finishArchiveMember.
+ *
+ * @param ar The archive
+ * @param path Path of the member from the root directory, e.g. DOCS/REPORT.TXT
+ * @param isDir 1 for a directory, which has no data
+ * @param size Size of the member's data
+ * @param mtime Modification time in seconds since the epoch
+ * @return 1 on success, otherwise 0
+ */
+int writeArchiveHeader(Archive* ar, const char* path, int isDir, long size, long mtime) {
+	if (ar->format == ARCHIVE_CPIO) {
+		return writeCpioHeader(ar, path, isDir ? 040755 : 0100644, isDir ? 2 : 1, isDir ? 0 : size, mtime);
+	}
+	if (!isDir) {
+		return writeTarHeader(ar, path, 0, size, mtime);
+	}
+	// tar marks directories with a trailing '/'
+	int pathLen = strlen(path);
+	char* dirPath = malloc(pathLen + 2);
+	memcpy(dirPath, path, pathLen);
+	dirPath[pathLen] = '/';
+	dirPath[pathLen + 1] = 0;
+	int ok = writeTarHeader(ar, dirPath, 1, 0, mtime);
+	free(dirPath);
+	return ok;
+}
+
+/**
+ * Pads a member's data out to the format's alignment
+ *
+ * @param ar The archive
+ * @param size Size of the data written since the member's header
+ * @return 1 on success, otherwise 0
+ */
+int finishArchiveMember(Archive* ar, long size) {
+	int align = ar->format == ARCHIVE_CPIO ? 4 : TAR_BLOCK;
+	int pad = (align - size % align) % align;
+	return pad == 0 || fwrite(zeros, pad, 1, ar->out) == 1;
+}
+
+/**
+ * Writes the end of the archive, flushes it and frees `ar`
+ *
+ * @param ar The archive
+ * @return 1 if everything written reached the output, otherwise 0
+ */
+int closeArchive(Archive* ar) {
+	int ok;
+	if (ar->format == ARCHIVE_CPIO) {
+		ok = writeCpioHeader(ar, CPIO_TRAILER, 0, 1, 0, 0);
+	} else {
+		// two empty blocks mark the end of a tar archive
+		ok = fwrite(zeros, TAR_BLOCK, 1, ar->out) == 1 && fwrite(zeros, TAR_BLOCK, 1, ar->out) == 1;
+	}
+	ok = fflush(ar->out) == 0 && ok;
+	free(ar);
+	return ok;
+}
@@ -0,0 +1,35 @@
+/**
+ * Archive streams written by msdosextr instead of loose files.
+ *
+ * Every member is appended to one output stream: a header, the member's
+ * data copied straight from the image, then whatever padding the format
+ * needs. Two formats are written:
+ *  tar	POSIX ustar; paths too long for the ustar name and prefix
+ *	fields are carried in a pax extended header
+ *  cpio	the SVR4 "newc" format, without checksums
+ */
+
+#ifndef FATARCHIVE_H
+#define FATARCHIVE_H
+
+#include <stdio.h>
+
+#define ARCHIVE_TAR 0
+#define ARCHIVE_CPIO 1
+
+// stdio buffer put on the output, so headers and small files are batched
+#define ARCHIVE_BUFFER (1 << 20)
+
+typedef struct archive {
+	FILE* out;
+	int format;
+	long inode; // cpio only; numbers the members in the order written
+} Archive;
+
+int archiveFormat(const char* name);
+Archive* openArchive(FILE* out, int format);
+int writeArchiveHeader(Archive* ar, const char* path, int isDir, long size, long mtime);
+int finishArchiveMember(Archive* ar, long size);
+int closeArchive(Archive* ar);
+
+#endif
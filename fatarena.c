@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include "fatarena.h"
+#include "fatstats.h"
+
+// keeps the first allocation in each block aligned
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+/**
+ * Creates an empty arena
+ *
+ * @param blockSize Bytes to reserve each time the arena runs out of space
+ * @return The new arena
+ */
+Arena* newArena(size_t blockSize) {
+	Arena* arena = malloc(sizeof(Arena));
+	arena->blocks = NULL;
+	arena->blockSize = blockSize;
+	return arena;
+}
+
+/**
+ * Allocates memory that lives until the arena is reset or freed
+ *
+ * @param arena The arena to allocate from
+ * @param size Number of bytes wanted
+ * @return Uninitialised memory aligned to ARENA_ALIGN
+ */
+void* arenaAlloc(Arena* arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	ArenaBlock* block = arena->blocks;
+	if (block == NULL || block->used + size > block->size) {
+		size_t blockSize = arena->blockSize > size ? arena->blockSize : size;
+		block = malloc(ARENA_HEADER + blockSize);
+		countStat(STAT_ALLOCATIONS, 1);
+		block->used = 0;
+		block->size = blockSize;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	void* p = (char*)block + ARENA_HEADER + block->used;
+	block->used += size;
+	return p;
+}
+
+/**
+ * Throws away everything allocated from an arena, keeping one block for reuse
+ *
+ * @param arena The arena to reset
+ */
+void resetArena(Arena* arena) {
+	if (arena->blocks == NULL) {
+		return;
+	}
+	ArenaBlock* block = arena->blocks->next;
+	while (block != NULL) {
+		ArenaBlock* next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->blocks->next = NULL;
+	arena->blocks->used = 0;
+}
+
+/**
+ * Frees an arena and everything allocated from it
+ *
+ * @param arena The arena to free
+ */
+void freeArena(Arena* arena) {
+	resetArena(arena);
+	free(arena->blocks);
+	free(arena);
+}
+
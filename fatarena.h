@@ -0,0 +1,32 @@
+/**
+ * Bump allocator for the nodes built while scanning a directory tree.
+ *
+ * Allocations are carved out of large blocks and are never freed one
+ * at a time; the whole arena is reset or freed once the scan's results
+ * are no longer needed.
+ */
+
+#ifndef FATARENA_H
+#define FATARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 16
+
+typedef struct arenablock {
+	struct arenablock* next;
+	size_t used;
+	size_t size;
+} ArenaBlock;
+
+typedef struct arena {
+	ArenaBlock* blocks; // the block being filled, followed by full ones
+	size_t blockSize;
+} Arena;
+
+Arena* newArena(size_t blockSize);
+void* arenaAlloc(Arena* arena, size_t size);
+void resetArena(Arena* arena);
+void freeArena(Arena* arena);
+
+#endif
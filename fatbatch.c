@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "fatbatch.h"
+
+/**
+ * Copies out the output of every finished image that is next in order
+ *
+ * @param batch The batch, with its lock held
+ */
+static void writeFinished(Batch* batch) {
+	while (batch->written < batch->count && batch->images[batch->written].done) {
+		BatchImage* image = &batch->images[batch->written];
+		if (image->outputLen > 0) {
+			fwrite(image->output, image->outputLen, 1, batch->out);
+		}
+		free(image->output);
+		image->output = NULL;
+		batch->written++;
+	}
+}
+
+/**
+ * Processes images until there are none left
+ *
+ * @param arg The batch, shared by all workers
+ * @return NULL
+ */
+static void* batchWorker(void* arg) {
+	Batch* batch = arg;
+	int i;
+	while ((i = atomic_fetch_add(&batch->nextImage, 1)) < batch->count) {
+		BatchImage* image = &batch->images[i];
+		FILE* out = open_memstream(&image->output, &image->outputLen);
+		if (out == NULL) {
+			image->status = 1;
+		} else {
+			image->status = batch->job(image->filename, out, batch->arg);
+			fclose(out);
+		}
+
+		pthread_mutex_lock(&batch->lock);
+		image->done = 1;
+		writeFinished(batch);
+		pthread_mutex_unlock(&batch->lock);
+	}
+	return NULL;
+}
+
+/**
+ * Runs a job for every image on a pool of threads
+ *
+ * With one thread each job prints straight to `out` as it runs.
+ *
+ * @param filenames The images, in the order their output is wanted
+ * @param count Number of images
+ * @param numThreads Number of images processed at once
+ * @param job The job to run for each image
+ * @param arg Passed to every job, which must only read it
+ * @param out Where every job's output goes
+ * @return The highest status returned by any job, 0 if all succeeded
+ */
+int runImageBatch(char* const* filenames, int count, int numThreads, ImageJob job, void* arg, FILE* out) {
+	int status = 0;
+	int i;
+	if (numThreads <= 1) {
+		for (i = 0; i < count; i++) {
+			int s = job(filenames[i], out, arg);
+			if (s > status) {
+				status = s;
+			}
+		}
+		return status;
+	}
+
+	Batch batch;
+	batch.images = calloc(count, sizeof(BatchImage));
+	for (i = 0; i < count; i++) {
+		batch.images[i].filename = filenames[i];
+	}
+	batch.count = count;
+	batch.job = job;
+	batch.arg = arg;
+	batch.out = out;
+	atomic_store(&batch.nextImage, 0);
+	batch.written = 0;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	// jobs print to their own streams, so whatever was
+	// printed before must go out ahead of them
+	fflush(out);
+
+	if (numThreads > count) {
+		numThreads = count;
+	}
+	pthread_t* threads = malloc(numThreads * sizeof(pthread_t));
+	int started;
+	for (started = 0; started < numThreads; started++) {
+		if (pthread_create(&threads[started], NULL, batchWorker, &batch) != 0) {
+			break;
+		}
+	}
+	// if no thread could be started, do the work here instead
+	if (started == 0) {
+		batchWorker(&batch);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (batch.images[i].status > status) {
+			status = batch.images[i].status;
+		}
+	}
+	pthread_mutex_destroy(&batch.lock);
+	free(threads);
+	free(batch.images);
+	return status;
+}
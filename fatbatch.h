@@ -0,0 +1,48 @@
+/**
+ * Running a tool over many disk images at once.
+ *
+ * Each image is handed to a job on a pool of threads. A job gets its own
+ * in-memory stream to print to, and the streams are copied to the real
+ * output in the order the images were given, each as soon as every
+ * image before it is done. The output is therefore the same as if the
+ * images had been processed one after another.
+ *
+ * Jobs run at the same time, so whatever a tool keeps about an image
+ * has to live in a per-image context rather than in globals.
+ */
+
+#ifndef FATBATCH_H
+#define FATBATCH_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Processes one image, printing to `out` only
+ * Returns the image's exit status, 0 for success
+ */
+typedef int (*ImageJob)(const char* filename, FILE* out, void* arg);
+
+typedef struct batchimage {
+	const char* filename;
+	char* output; // everything the job printed, once it is done
+	size_t outputLen;
+	int status;
+	int done;
+} BatchImage;
+
+typedef struct batch {
+	BatchImage* images;
+	int count;
+	ImageJob job;
+	void* arg;
+	FILE* out;
+	atomic_int nextImage; // next image for a worker to take
+	int written; // images already copied to `out`, in order
+	pthread_mutex_t lock; // guards `done` and `written`
+} Batch;
+
+int runImageBatch(char* const* filenames, int count, int numThreads, ImageJob job, void* arg, FILE* out);
+
+#endif
@@ -0,0 +1,682 @@
+/**
+ * Benchmark suite for the msdos tools.
+ *
+ * usage: fatbench [-b bindir] [-o dir] [-k] [-r runs] [-t 12|16|32]
+ *                 [-n files] [-d depth] [-f fragmentation] [-c sectors]
+ *                 [-x deleted] [-z size] [-s seed]
+ *
+ * Generates a synthetic FAT12, FAT16 and FAT32 image (see fatgen.h) and
+ * times the tools on each: msdosdir listing every entry, msdosextr
+ * extracting every file to a tar stream, msdosdel deleting every file in
+ * one batch, and msdosundel checking and restoring every deleted file.
+ * Each tool runs `runs` times in its own process and the fastest run is
+ * reported, with its throughput in entries and in megabytes of file data
+ * per second, and the largest peak resident set size of any run. The
+ * image msdosundel leaves behind is then checked: no cluster may be
+ * cross-linked and every live file must still hold its generated data.
+ *
+ * -t benchmarks one FAT type only, and -n, -d, -f, -c, -x, -z and -s
+ * replace its file count, directory depth, fragmentation ratio, sectors
+ * per cluster, share of deleted files, mean file size and seed. The
+ * tools are run from bindir, by default the directory fatbench is in.
+ * Images are made in a temporary directory, or in dir, and are removed
+ * afterwards unless -k is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "fatgen.h"
+
+typedef struct timing {
+	double seconds; // the fastest run
+	long peakRSS; // in kilobytes, the largest of any run
+	int status; // exit status of the last run, -1 if it did not exit
+} Timing;
+
+void applyOverrides(GenParams* params, const GenParams* overrides, int haveSeed);
+char* toolPath(const char* binDir, const char* tool);
+int copyFile(const char* from, const char* to);
+Timing timeTool(char* const* argv, const char* image, const char* original, int runs);
+void report(const char* task, Timing t, long entries, long bytes);
+int checkImage(char* msdosdir, char* msdosextr, char* image, const char* liveList, long numLive);
+long countCrossLinked(char* msdosdir, char* image);
+long countIntactFiles(char* msdosextr, char* image, const char* liveList);
+int hasGeneratedData(const char* path, const unsigned char* data, long size);
+unsigned char* readMember(FILE* in, long size);
+char** readLines(const char* filename, long* numLines);
+int comparePaths(const void* a, const void* b);
+FILE* startTool(char* const* argv, pid_t* pid);
+int finishTool(FILE* out, pid_t pid);
+double now();
+
+int main (int argc, char *argv[]) {
+	// the volumes benchmarked by default, from a floppy up
+	GenParams scenarios[] = {
+		{ 12, 400, 2, 0.1, 1, 0.1, 2048, 1 },
+		{ 16, 4000, 3, 0.1, 4, 0.1, 8192, 1 },
+		{ 32, 20000, 3, 0.1, 8, 0.1, 4096, 1 },
+	};
+	int numScenarios = 3;
+	const char* binDir = NULL;
+	const char* outDir = NULL;
+	int keep = 0;
+	int runs = 3;
+	int only = 0;
+	// -1 for every parameter left as it is
+	GenParams overrides = { 0, -1, -1, -1, -1, -1, -1, 0 };
+	int haveSeed = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:o:kr:t:n:d:f:c:x:z:s:")) != -1) {
+		switch (opt) {
+		case 'b':
+			binDir = optarg;
+			break;
+		case 'o':
+			outDir = optarg;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 't':
+			only = atoi(optarg);
+			break;
+		case 'n':
+			overrides.numFiles = atoi(optarg);
+			break;
+		case 'd':
+			overrides.depth = atoi(optarg);
+			break;
+		case 'f':
+			overrides.fragmentation = atof(optarg);
+			break;
+		case 'c':
+			overrides.sectorsPerCluster = atoi(optarg);
+			break;
+		case 'x':
+			overrides.deletedRatio = atof(optarg);
+			break;
+		case 'z':
+			overrides.meanFileSize = atol(optarg);
+			break;
+		case 's':
+			overrides.seed = strtoul(optarg, NULL, 10);
+			haveSeed = 1;
+			break;
+		default:
+			printf("usage: %s [-b bindir] [-o dir] [-k] [-r runs] [-t 12|16|32]\n"
+				"       [-n files] [-d depth] [-f fragmentation] [-c sectors] [-x deleted] [-z size] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (runs < 1 || (only != 0 && only != 12 && only != 16 && only != 32)) {
+		printf("-r needs at least one run and -t one of 12, 16 or 32\n");
+		return 1;
+	}
+	GenParams unchanged = scenarios[0];
+	applyOverrides(&unchanged, &overrides, haveSeed);
+	if (only == 0 && memcmp(&unchanged, &scenarios[0], sizeof(GenParams)) != 0) {
+		printf("Choose the FAT type with -t to change its parameters\n");
+		return 1;
+	}
+
+	// the tools are found beside fatbench unless told otherwise
+	char* defaultBinDir = NULL;
+	if (binDir == NULL) {
+		defaultBinDir = strdup(argv[0]);
+		char* slash = strrchr(defaultBinDir, '/');
+		if (slash != NULL) {
+			*slash = '\0';
+		} else {
+			strcpy(defaultBinDir, ".");
+		}
+		binDir = defaultBinDir;
+	}
+	char* msdosdir = toolPath(binDir, "msdosdir");
+	char* msdosextr = toolPath(binDir, "msdosextr");
+	char* msdosdel = toolPath(binDir, "msdosdel");
+	char* msdosundel = toolPath(binDir, "msdosundel");
+
+	char tempDir[] = "/tmp/fatbench.XXXXXX";
+	if (outDir == NULL) {
+		if (mkdtemp(tempDir) == NULL) {
+			printf("Could not create a temporary directory\n");
+			return 1;
+		}
+		outDir = tempDir;
+	} else {
+		// so a failure to write there isn't taken for bad parameters
+		struct stat dirStat;
+		int error = stat(outDir, &dirStat) != 0 ? errno : !S_ISDIR(dirStat.st_mode) ? ENOTDIR : 0;
+		if (error != 0) {
+			printf("Cannot make images in %s: %s\n", outDir, strerror(error));
+			return 1;
+		}
+	}
+	int dirLen = strlen(outDir);
+	char* original = malloc(dirLen + 32);
+	char* image = malloc(dirLen + 32);
+	char* liveList = malloc(dirLen + 32);
+	char* deletedList = malloc(dirLen + 32);
+
+	int status = 0;
+	int s;
+	for (s = 0; s < numScenarios; s++) {
+		GenParams params = scenarios[s];
+		if (only != 0 && params.fatType != only) {
+			continue;
+		}
+		applyOverrides(&params, &overrides, haveSeed);
+
+		sprintf(original, "%s/fat%d.img", outDir, params.fatType);
+		sprintf(image, "%s/fat%d.run.img", outDir, params.fatType);
+		sprintf(liveList, "%s/fat%d.live", outDir, params.fatType);
+		sprintf(deletedList, "%s/fat%d.deleted", outDir, params.fatType);
+
+		FILE* live = fopen(liveList, "w");
+		if (live == NULL) {
+			printf("Could not create %s: %s\n", liveList, strerror(errno));
+			status = 1;
+			continue;
+		}
+		FILE* deleted = fopen(deletedList, "w");
+		if (deleted == NULL) {
+			printf("Could not create %s: %s\n", deletedList, strerror(errno));
+			fclose(live);
+			status = 1;
+			continue;
+		}
+		GenStats stats;
+		double start = now();
+		int generated = generateImage(original, &params, live, deleted, &stats);
+		double genTime = now() - start;
+		fclose(live);
+		fclose(deleted);
+		if (!generated) {
+			printf("Could not generate a FAT%d image with these parameters\n", params.fatType);
+			status = 1;
+			continue;
+		}
+
+		printf("FAT%d: %d files (%d deleted) in %d directories, depth %d, %d-byte clusters,"
+			" fragmentation %.2f, %.1f MB image, generated in %.2f s\n",
+			params.fatType, stats.numFiles, stats.numDeleted, stats.numDirs, params.depth,
+			params.sectorsPerCluster * 512, params.fragmentation, stats.imageSize / 1048576.0, genTime);
+
+		long numEntries = stats.numFiles + stats.numDirs;
+		long numLive = stats.numFiles - stats.numDeleted;
+
+		char* dirArgs[] = { msdosdir, "-o", "jsonl", image, NULL };
+		Timing t = timeTool(dirArgs, image, original, runs);
+		report("msdosdir -o jsonl", t, numEntries, stats.liveBytes);
+		status |= t.status != 0;
+
+		char* extrArgs[] = { msdosextr, "-o", "tar", image, NULL };
+		t = timeTool(extrArgs, image, original, runs);
+		report("msdosextr -o tar", t, numLive, stats.liveBytes);
+		status |= t.status != 0;
+
+		char* delArgs[] = { msdosdel, "-f", liveList, image, NULL };
+		t = timeTool(delArgs, image, original, runs);
+		report("msdosdel -f", t, numLive, stats.liveBytes);
+		status |= t.status != 0;
+
+		// msdosundel exits with 1 if any file cannot be restored, which
+		// fragmented files may well not be, so only a crash counts
+		char* undelArgs[] = { msdosundel, "-f", deletedList, image, NULL };
+		t = timeTool(undelArgs, image, original, runs);
+		report("msdosundel -f", t, stats.numDeleted, stats.deletedBytes);
+		status |= t.status < 0;
+		if (t.status >= 0 && t.status != 127) {
+			status |= !checkImage(msdosdir, msdosextr, image, liveList, numLive);
+		}
+
+		if (!keep) {
+			unlink(original);
+			unlink(image);
+			unlink(liveList);
+			unlink(deletedList);
+		}
+	}
+
+	if (outDir == tempDir && !keep) {
+		rmdir(tempDir);
+	} else if (keep) {
+		printf("Images kept in %s\n", outDir);
+	}
+
+	free(original);
+	free(image);
+	free(liveList);
+	free(deletedList);
+	free(msdosdir);
+	free(msdosextr);
+	free(msdosdel);
+	free(msdosundel);
+	free(defaultBinDir);
+	return status;
+}
+
+/**
+ * Replaces the parameters of a volume with those given on the command line
+ *
+ * @param params The volume's parameters
+ * @param overrides The parameters given, -1 for those that were not
+ * @param haveSeed 1 if a seed was given
+ */
+void applyOverrides(GenParams* params, const GenParams* overrides, int haveSeed) {
+	if (overrides->numFiles >= 0) {
+		params->numFiles = overrides->numFiles;
+	}
+	if (overrides->depth >= 0) {
+		params->depth = overrides->depth;
+	}
+	if (overrides->fragmentation >= 0) {
+		params->fragmentation = overrides->fragmentation;
+	}
+	if (overrides->sectorsPerCluster >= 0) {
+		params->sectorsPerCluster = overrides->sectorsPerCluster;
+	}
+	if (overrides->deletedRatio >= 0) {
+		params->deletedRatio = overrides->deletedRatio;
+	}
+	if (overrides->meanFileSize >= 0) {
+		params->meanFileSize = overrides->meanFileSize;
+	}
+	if (haveSeed) {
+		params->seed = overrides->seed;
+	}
+}
+
+/**
+ * @param binDir Directory the tools are in
+ * @param tool Name of the tool
+ * @return The path of the tool, to be freed
+ */
+char* toolPath(const char* binDir, const char* tool) {
+	char* path = malloc(strlen(binDir) + strlen(tool) + 2);
+	sprintf(path, "%s/%s", binDir, tool);
+	return path;
+}
+
+/**
+ * Copies a file
+ *
+ * @param from The file to copy
+ * @param to Where to copy it, replacing anything already there
+ * @return 1 on success, otherwise 0
+ */
+int copyFile(const char* from, const char* to) {
+	FILE* in = fopen(from, "rb");
+	if (in == NULL) {
+		return 0;
+	}
+	FILE* out = fopen(to, "wb");
+	if (out == NULL) {
+		fclose(in);
+		return 0;
+	}
+
+	char* buffer = malloc(1 << 20);
+	int ok = 1;
+	size_t n;
+	while ((n = fread(buffer, 1, 1 << 20, in)) > 0 && ok) {
+		ok = fwrite(buffer, n, 1, out) == 1;
+	}
+	free(buffer);
+	fclose(in);
+	return fclose(out) == 0 && ok;
+}
+
+/**
+ * Runs a tool on a fresh copy of an image several times
+ *
+ * Only the tool's run is timed, not the copy. Its output is thrown away.
+ *
+ * @param argv The tool and its arguments
+ * @param image The image the tool is given
+ * @param original The image `image` is copied from before each run
+ * @param runs Number of times to run the tool
+ * @return The fastest run and the largest peak RSS
+ */
+Timing timeTool(char* const* argv, const char* image, const char* original, int runs) {
+	Timing t = { -1, 0, -1 };
+	int r;
+	for (r = 0; r < runs; r++) {
+		if (!copyFile(original, image)) {
+			t.status = -1;
+			return t;
+		}
+
+		double start = now();
+		pid_t pid = fork();
+		if (pid == 0) {
+			// the tools ask before changing anything, so give them no input
+			int null = open("/dev/null", O_RDWR);
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			execv(argv[0], argv);
+			_exit(127);
+		}
+		int status;
+		struct rusage usage;
+		if (pid < 0 || wait4(pid, &status, 0, &usage) != pid) {
+			t.status = -1;
+			return t;
+		}
+		double seconds = now() - start;
+
+		if (t.seconds < 0 || seconds < t.seconds) {
+			t.seconds = seconds;
+		}
+		if (usage.ru_maxrss > t.peakRSS) {
+			t.peakRSS = usage.ru_maxrss;
+		}
+		t.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+	return t;
+}
+
+/**
+ * Prints the results for one tool
+ *
+ * @param task What was timed
+ * @param t The timing
+ * @param entries Number of entries the tool handled
+ * @param bytes Bytes of file data those entries hold
+ */
+void report(const char* task, Timing t, long entries, long bytes) {
+	if (t.seconds < 0 || t.status == 127) {
+		printf("  %-20s could not be run\n", task);
+		return;
+	}
+	// a run too quick for the clock still counts as some time
+	double seconds = t.seconds > 1e-6 ? t.seconds : 1e-6;
+	printf("  %-20s %8.3f s %12.0f entries/s %9.1f MB/s %8ld KB peak RSS",
+		task, t.seconds, entries / seconds, bytes / seconds / 1048576.0, t.peakRSS);
+	if (t.status < 0) {
+		printf("  (crashed)");
+	} else if (t.status > 0) {
+		printf("  (exit status %d)", t.status);
+	}
+	printf("\n");
+}
+
+/**
+ * Checks the image msdosundel left behind and prints the result
+ *
+ * timeTool leaves `image` as the last run made it.
+ *
+ * @param msdosdir Path of msdosdir
+ * @param msdosextr Path of msdosextr
+ * @param image The image
+ * @param liveList The file listing the paths of the live files
+ * @param numLive Number of live files
+ * @return 1 if no cluster is cross-linked and every live file is intact
+ */
+int checkImage(char* msdosdir, char* msdosextr, char* image, const char* liveList, long numLive) {
+	long crossLinked = countCrossLinked(msdosdir, image);
+	long intact = countIntactFiles(msdosextr, image, liveList);
+	if (crossLinked < 0 || intact < 0) {
+		printf("  %-20s could not be run\n", "image check");
+		return 0;
+	}
+	printf("  %-20s %ld cross-linked clusters, %ld of %ld live files intact\n",
+		"image check", crossLinked, intact, numLive);
+	return crossLinked == 0 && intact == numLive;
+}
+
+/**
+ * @param msdosdir Path of msdosdir
+ * @param image The image
+ * @return The number of cross-linked clusters msdosdir -a reports, or -1
+ * if it reported none
+ */
+long countCrossLinked(char* msdosdir, char* image) {
+	char* args[] = { msdosdir, "-a", "-o", "jsonl", image, NULL };
+	pid_t pid;
+	FILE* in = startTool(args, &pid);
+	if (in == NULL) {
+		return -1;
+	}
+
+	// the usage summary is the only line that isn't an entry
+	long crossLinked = -1;
+	char* line = NULL;
+	size_t capacity = 0;
+	while (getline(&line, &capacity, in) > 0) {
+		char* field = strstr(line, "\"cross_linked\":");
+		if (strncmp(line, "{\"clusters\":", 12) == 0 && field != NULL) {
+			crossLinked = atol(field + 15);
+		}
+	}
+	free(line);
+	return finishTool(in, pid) == 0 ? crossLinked : -1;
+}
+
+/**
+ * Extracts an image to a tar stream and checks the live files in it
+ *
+ * @param msdosextr Path of msdosextr
+ * @param image The image
+ * @param liveList The file listing the paths of the live files
+ * @return The number of live files extracted with their generated data,
+ * or -1 if the image could not be extracted
+ */
+long countIntactFiles(char* msdosextr, char* image, const char* liveList) {
+	long numPaths;
+	char** paths = readLines(liveList, &numPaths);
+	if (paths == NULL) {
+		return -1;
+	}
+	qsort(paths, numPaths, sizeof(char*), comparePaths);
+
+	char* args[] = { msdosextr, "-o", "tar", image, NULL };
+	pid_t pid;
+	FILE* in = startTool(args, &pid);
+	long intact = -1;
+	if (in != NULL) {
+		intact = 0;
+		char* paxPath = NULL;
+		unsigned char header[512];
+		while (fread(header, 512, 1, in) == 1 && header[0] != 0) {
+			char field[13];
+			memcpy(field, header + 124, 12);
+			field[12] = 0;
+			long size = strtol(field, NULL, 8);
+			unsigned char* data = readMember(in, size);
+			if (data == NULL) {
+				intact = -1;
+				break;
+			}
+
+			// a pax header carries the path of the member after it
+			char path[258];
+			char* record = header[156] == 'x' ? strstr((char*)data, " path=") : NULL;
+			if (record != NULL) {
+				record += 6;
+				free(paxPath);
+				paxPath = strndup(record, strcspn(record, "\n"));
+			} else if (paxPath != NULL) {
+				snprintf(path, sizeof(path), "%s", paxPath);
+				free(paxPath);
+				paxPath = NULL;
+			} else if (header[345] != 0) {
+				snprintf(path, sizeof(path), "%.155s/%.100s", header + 345, header);
+			} else {
+				snprintf(path, sizeof(path), "%.100s", header);
+			}
+
+			char* key = path;
+			if (header[156] == '0' && bsearch(&key, paths, numPaths, sizeof(char*), comparePaths) != NULL) {
+				intact += hasGeneratedData(path, data, size);
+			}
+			free(data);
+		}
+		free(paxPath);
+		if (finishTool(in, pid) != 0) {
+			intact = -1;
+		}
+	}
+
+	long i;
+	for (i = 0; i < numPaths; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	return intact;
+}
+
+/**
+ * Checks data against what fatgen writes: the file's name without its
+ * extension and a space, "F0000012 " for F0000012.DAT, over and over
+ *
+ * @param path Path of the file
+ * @param data The file's data
+ * @param size Size of the data
+ * @return 1 if the data is as generated, otherwise 0
+ */
+int hasGeneratedData(const char* path, const unsigned char* data, long size) {
+	const char* name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+	char tag[16];
+	int tagLen = snprintf(tag, sizeof(tag), "%.*s ", (int)strcspn(name, "."), name);
+	if (tagLen >= (int)sizeof(tag)) {
+		return 0;
+	}
+	long i;
+	for (i = 0; i < size; i++) {
+		if (data[i] != (unsigned char)tag[i % tagLen]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Reads the data of a tar member and the padding after it
+ *
+ * @param in The tar stream, just past the member's header
+ * @param size Size of the member's data
+ * @return The data with a NUL after it, to be freed, or NULL if the
+ * stream ended early
+ */
+unsigned char* readMember(FILE* in, long size) {
+	long padded = (size + 511) / 512 * 512;
+	unsigned char* data = malloc(padded + 1);
+	if (padded > 0 && fread(data, padded, 1, in) != 1) {
+		free(data);
+		return NULL;
+	}
+	data[size] = 0;
+	return data;
+}
+
+/**
+ * Reads a file one line to a string
+ *
+ * @param filename The file
+ * @param numLines Set to the number of lines
+ * @return The lines without their newlines, each and the array to be
+ * freed, or NULL if the file could not be read
+ */
+char** readLines(const char* filename, long* numLines) {
+	FILE* in = fopen(filename, "r");
+	if (in == NULL) {
+		return NULL;
+	}
+	long capacity = 64;
+	char** lines = malloc(capacity * sizeof(char*));
+	*numLines = 0;
+	char* line = NULL;
+	size_t lineCapacity = 0;
+	ssize_t len;
+	while ((len = getline(&line, &lineCapacity, in)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = 0;
+		}
+		if (*numLines == capacity) {
+			capacity *= 2;
+			lines = realloc(lines, capacity * sizeof(char*));
+		}
+		lines[(*numLines)++] = strdup(line);
+	}
+	free(line);
+	fclose(in);
+	return lines;
+}
+
+/**
+ * Orders paths for qsort and bsearch
+ */
+int comparePaths(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Starts a tool with its output going to a pipe
+ *
+ * @param argv The tool and its arguments
+ * @param pid Set to the tool's process
+ * @return The read end of the pipe, or NULL if the tool could not be
+ * started
+ */
+FILE* startTool(char* const* argv, pid_t* pid) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		return NULL;
+	}
+	*pid = fork();
+	if (*pid == 0) {
+		int null = open("/dev/null", O_RDWR);
+		dup2(null, STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (*pid < 0) {
+		close(fds[0]);
+		return NULL;
+	}
+	return fdopen(fds[0], "r");
+}
+
+/**
+ * Closes the pipe from a tool and waits for it to exit
+ *
+ * @param out The read end of the tool's pipe
+ * @param pid The tool's process
+ * @return The tool's exit status, -1 if it did not exit
+ */
+int finishTool(FILE* out, pid_t pid) {
+	fclose(out);
+	int status;
+	if (waitpid(pid, &status, 0) != pid) {
+		return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * @return A monotonic timestamp in seconds
+ */
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fatcarve.h"
+#include "fatstats.h"
+
+/**
+ * Reads which clusters are free from the FAT
+ *
+ * @param table The decoded FAT
+ * @return The new map
+ */
+FreeMap* buildFreeMap(FATTable* table) {
+	FreeMap* map = malloc(sizeof(FreeMap));
+	map->numEntries = table->numEntries;
+	map->numWords = (table->numEntries + 63) / 64;
+	map->bits = calloc(map->numWords, sizeof(uint64_t));
+	map->numFree = 0;
+
+	// clusters 0 and 1 are reserved and never free
+	int c;
+	for (c = 2; c < table->numEntries; c++) {
+		int entry = table->fatType != 32 ? table->next[c] : getFATEntry(table, c);
+		if (entry == 0) {
+			map->bits[c / 64] |= (uint64_t)1 << (c % 64);
+			map->numFree++;
+		}
+	}
+	return map;
+}
+
+/**
+ * Checks if a cluster is free
+ *
+ * @param map The free clusters
+ * @param cluster The cluster to check
+ * @return 1 if `cluster` is free, otherwise 0
+ */
+int isFreeCluster(const FreeMap* map, int cluster) {
+	if (cluster < 0 || cluster >= map->numEntries) {
+		return 0;
+	}
+	return (map->bits[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+/**
+ * Finds the first free cluster at or after `cluster`
+ *
+ * @param map The free clusters
+ * @param cluster Where to start looking
+ * @return The free cluster, or map->numEntries if there is none
+ */
+int nextFreeCluster(const FreeMap* map, int cluster) {
+	if (cluster < 0) {
+		cluster = 0;
+	}
+	if (cluster >= map->numEntries) {
+		return map->numEntries;
+	}
+	int w = cluster / 64;
+	// ignore the clusters before `cluster` in its word
+	uint64_t word = map->bits[w] & (~(uint64_t)0 << (cluster % 64));
+	while (word == 0) {
+		if (++w == map->numWords) {
+			return map->numEntries;
+		}
+		word = map->bits[w];
+	}
+	return w * 64 + __builtin_ctzll(word);
+}
+
+/**
+ * Adds the next cluster to the end of a chain
+ *
+ * @param chain The chain
+ * @param cluster The cluster to add
+ */
+static void appendCluster(ClusterChain* chain, int cluster) {
+	if (chain->numRuns > 0 && chain->runs[chain->numRuns - 1].start + chain->runs[chain->numRuns - 1].length == cluster) {
+		chain->runs[chain->numRuns - 1].length++;
+	} else {
+		if (chain->numRuns == chain->capacity) {
+			chain->capacity = chain->capacity ? chain->capacity * 2 : 8;
+			chain->runs = realloc(chain->runs, chain->capacity * sizeof(ClusterRun));
+			countStat(STAT_ALLOCATIONS, 1);
+		}
+		chain->runs[chain->numRuns].start = cluster;
+		chain->runs[chain->numRuns].length = 1;
+		chain->numRuns++;
+	}
+	chain->numClusters++;
+}
+
+/**
+ * Rebuilds the chain of a deleted file
+ *
+ * @param map The free clusters
+ * @param start The file's first cluster
+ * @param numClusters Number of clusters the file's size needs
+ * @param maxGap Most clusters in use to step over at a time in a gap search
+ * @param chain Receives the rebuilt chain; zero it before first use and
+ *              free it with freeClusterChain
+ * @return CARVE_CONTIGUOUS or CARVE_GAPS for how the chain was found,
+ *         or CARVE_NONE if it could not be, leaving `chain` empty
+ */
+int carveChain(const FreeMap* map, int start, int numClusters, int maxGap, ClusterChain* chain) {
+	chain->numRuns = 0;
+	chain->numClusters = 0;
+	if (numClusters <= 0 || !isFreeCluster(map, start)) {
+		return CARVE_NONE;
+	}
+
+	// every cluster from the first on, if they are all still free
+	if (start + numClusters <= map->numEntries) {
+		int c = start;
+		while (c < start + numClusters && isFreeCluster(map, c)) {
+			c++;
+		}
+		if (c == start + numClusters) {
+			appendCluster(chain, start);
+			chain->runs[0].length = numClusters;
+			chain->numClusters = numClusters;
+			return CARVE_CONTIGUOUS;
+		}
+	}
+
+	// otherwise step over whatever was written since, taking free clusters
+	int cluster = start;
+	appendCluster(chain, cluster);
+	while (chain->numClusters < numClusters) {
+		int next = nextFreeCluster(map, cluster + 1);
+		if (next >= map->numEntries || next - cluster - 1 > maxGap) {
+			chain->numRuns = 0;
+			chain->numClusters = 0;
+			return CARVE_NONE;
+		}
+		appendCluster(chain, next);
+		cluster = next;
+	}
+	return CARVE_GAPS;
+}
+
+/**
+ * Marks the clusters of a chain as no longer free
+ *
+ * @param map The free clusters
+ * @param chain A chain about to be restored
+ */
+void claimChain(FreeMap* map, const ClusterChain* chain) {
+	int r;
+	for (r = 0; r < chain->numRuns; r++) {
+		int c;
+		for (c = chain->runs[r].start; c < chain->runs[r].start + chain->runs[r].length; c++) {
+			if (isFreeCluster(map, c)) {
+				map->bits[c / 64] &= ~((uint64_t)1 << (c % 64));
+				map->numFree--;
+			}
+		}
+	}
+}
+
+/**
+ * Frees a map of free clusters
+ *
+ * @param map The map to free
+ */
+void freeFreeMap(FreeMap* map) {
+	if (map != NULL) {
+		free(map->bits);
+		free(map);
+	}
+}
@@ -0,0 +1,49 @@
+/**
+ * Rebuilding the cluster chains of deleted files.
+ *
+ * DOS frees a deleted file's clusters by zeroing their FAT entries, so
+ * its chain can no longer be followed; all that is left is the first
+ * cluster and the size in the directory entry. Files are usually written
+ * into free clusters in ascending order, so a chain is rebuilt by
+ * assuming, in turn:
+ *  contiguous	the clusters straight on from the first one, if every one
+ *		of them is free
+ *  gap search	the first cluster followed by the next free clusters after
+ *		it, stepping over clusters in use, as long as no more than
+ *		`maxGap` clusters in use are stepped over at a time
+ *
+ * Which clusters are free is read from the FAT once, in one pass, into a
+ * bitmap. Finding the next free cluster skips 64 clusters in use per
+ * step, so carving thousands of files stays linear in the size of the
+ * FAT and of the files. Chains that are going to be restored are claimed
+ * so that no two carved files share a cluster.
+ */
+
+#ifndef FATCARVE_H
+#define FATCARVE_H
+
+#include <stdint.h>
+#include "fattable.h"
+
+#define CARVE_NONE 0
+#define CARVE_CONTIGUOUS 1
+#define CARVE_GAPS 2
+
+// default for the longest run of clusters in use a gap search steps over
+#define CARVE_MAX_GAP 64
+
+typedef struct freemap {
+	int numEntries;
+	uint64_t* bits; // bit c % 64 of word c / 64 is set if cluster c is free
+	int numWords;
+	int numFree;
+} FreeMap;
+
+FreeMap* buildFreeMap(FATTable* table);
+int isFreeCluster(const FreeMap* map, int cluster);
+int nextFreeCluster(const FreeMap* map, int cluster);
+int carveChain(const FreeMap* map, int start, int numClusters, int maxGap, ClusterChain* chain);
+void claimChain(FreeMap* map, const ClusterChain* chain);
+void freeFreeMap(FreeMap* map);
+
+#endif
@@ -0,0 +1,158 @@
+#include "fatchain.h"
+
+/**
+ * Changes one entry in a copy of the FAT
+ *
+ * @param wb The buffer to make the change in
+ * @param fatType 12, 16 or 32
+ * @param fat Byte offset of the copy of the FAT in the image
+ * @param cluster The entry to change
+ * @param value The new entry
+ * @return The entry before the change, counting changes already in `wb`
+ */
+static int setEntryInCopy(WriteBuffer* wb, int fatType, long fat, int cluster, int value) {
+	unsigned char bytes[4];
+	int old;
+	if (fatType == 12) {
+		// two entries share the middle byte of every three
+		long offset = fat + cluster + cluster / 2;
+		bufferRead(wb, offset, bytes, 2);
+		int pair = getLE(bytes, 2);
+		if (cluster % 2 == 0) {
+			old = pair & 0x0fff;
+			pair = (pair & 0xf000) | (value & 0x0fff);
+		} else {
+			old = pair >> 4;
+			pair = (pair & 0x000f) | ((value & 0x0fff) << 4);
+		}
+		putLE(bytes, pair, 2);
+		bufferWrite(wb, offset, bytes, 2);
+	} else if (fatType == 16) {
+		bufferRead(wb, fat + 2L * cluster, bytes, 2);
+		old = getLE(bytes, 2);
+		putLE(bytes, value & 0xffff, 2);
+		bufferWrite(wb, fat + 2L * cluster, bytes, 2);
+	} else {
+		// the top four bits of a FAT32 entry are reserved and kept
+		long offset = fat + 4L * cluster;
+		bufferRead(wb, offset, bytes, 4);
+		uint32_t entry = getLE(bytes, 4);
+		old = entry & FAT32_ENTRY_MASK;
+		entry = (entry & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK);
+		putLE(bytes, entry, 4);
+		bufferWrite(wb, offset, bytes, 4);
+	}
+	return old;
+}
+
+/**
+ * Changes the FAT entry for a cluster once `wb` is flushed
+ *
+ * @param wb The buffer to make the change in
+ * @param info The volume
+ * @param cluster The entry to change
+ * @param value The new entry
+ * @return The entry in the active FAT before the change, or -1 if
+ *         `cluster` has no entry
+ */
+int setFATEntry(WriteBuffer* wb, FATInfo* info, int cluster, int value) {
+	if (cluster < 2 || cluster >= info->table->numEntries) {
+		return -1;
+	}
+	if (!info->mirrorFAT) {
+		return setEntryInCopy(wb, info->fatType, info->fatOffset, cluster, value);
+	}
+	long sizeofFAT = (long)info->numFATSectors * info->sizeofSector;
+	long fat = (long)info->reservedSectors * info->sizeofSector;
+	int old = -1;
+	int copy;
+	for (copy = 0; copy < info->numCopiesFAT; copy++) {
+		int entry = setEntryInCopy(wb, info->fatType, fat + copy * sizeofFAT, cluster, value);
+		if (fat + copy * sizeofFAT == info->fatOffset) {
+			old = entry;
+		}
+	}
+	return old;
+}
+
+/**
+ * Brings the FAT32 FSInfo free cluster hints up to date once `wb` is flushed
+ *
+ * A count or hint the volume didn't know is left unknown.
+ *
+ * @param wb The buffer to make the change in
+ * @param info The volume, whose hints are changed to match
+ * @param freed Clusters freed, or less than 0 for clusters taken
+ * @param lowestFreed The lowest cluster freed, or -1 if none were
+ */
+static void updateFSInfo(WriteBuffer* wb, FATInfo* info, long freed, int lowestFreed) {
+	if (info->fsInfoSector == 0 || (freed == 0 && lowestFreed < 0)) {
+		return;
+	}
+	if (info->freeClusters >= 0) {
+		info->freeClusters += freed;
+		if (info->freeClusters < 0) {
+			info->freeClusters = 0;
+		} else if (info->freeClusters > info->numClusters) {
+			info->freeClusters = info->numClusters;
+		}
+	}
+	// the hint is where to start looking, so a lower free cluster replaces it
+	if (info->nextFreeCluster >= 0 && lowestFreed >= 2 && lowestFreed < info->nextFreeCluster) {
+		info->nextFreeCluster = lowestFreed;
+	}
+	unsigned char fields[8];
+	putLE(fields, info->freeClusters >= 0 ? info->freeClusters : 0xffffffff, 4);
+	putLE(fields + 4, info->nextFreeCluster >= 0 ? info->nextFreeCluster : 0xffffffff, 4);
+	bufferWrite(wb, (long)info->fsInfoSector * info->sizeofSector + 488, fields, sizeof(fields));
+}
+
+/**
+ * Marks every cluster of a chain as free
+ *
+ * @param wb The buffer to make the changes in
+ * @param info The volume
+ * @param chain The clusters to free
+ */
+void freeChain(WriteBuffer* wb, FATInfo* info, const ClusterChain* chain) {
+	// clusters shared with a chain freed before are counted once
+	long freed = 0;
+	int lowest = -1;
+	int r;
+	for (r = 0; r < chain->numRuns; r++) {
+		int c;
+		for (c = chain->runs[r].start; c < chain->runs[r].start + chain->runs[r].length; c++) {
+			if (setFATEntry(wb, info, c, 0) > 0) {
+				freed++;
+				if (lowest < 0 || c < lowest) {
+					lowest = c;
+				}
+			}
+		}
+	}
+	updateFSInfo(wb, info, freed, lowest);
+}
+
+/**
+ * Links the clusters of a chain in order and ends it with an end marker
+ *
+ * @param wb The buffer to make the changes in
+ * @param info The volume
+ * @param chain The clusters to link
+ */
+void linkChain(WriteBuffer* wb, FATInfo* info, const ClusterChain* chain) {
+	int end = info->fatType == 12 ? END_MARKER_12 : info->fatType == 16 ? END_MARKER_16 : END_MARKER_32;
+	long taken = 0;
+	int r;
+	for (r = 0; r < chain->numRuns; r++) {
+		const ClusterRun* run = &chain->runs[r];
+		int c;
+		for (c = run->start; c < run->start + run->length - 1; c++) {
+			taken += setFATEntry(wb, info, c, c + 1) == 0;
+		}
+		// the last cluster of a run leads to the next run
+		int next = r + 1 < chain->numRuns ? chain->runs[r + 1].start : end;
+		taken += setFATEntry(wb, info, run->start + run->length - 1, next) == 0;
+	}
+	updateFSInfo(wb, info, -taken, -1);
+}
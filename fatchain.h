@@ -0,0 +1,30 @@
+/**
+ * Changing cluster chains in the FAT.
+ *
+ * Deleting a file frees its chain by zeroing its FAT entries, and
+ * restoring one links its clusters again, each to the next and the last
+ * to an end marker. Every entry is changed in every copy of the FAT, or
+ * only in the active one when a FAT32 volume has mirroring turned off.
+ *
+ * The entries go through a WriteBuffer, so every FAT sector touched is
+ * read once and written once however many entries in it change, and
+ * flushWriteBuffer writes the sectors of all the copies in one pass in
+ * ascending order. They are covered by the undo journal like any other
+ * change. The decoded table is left as the volume was opened.
+ *
+ * On FAT32 the free cluster count and next free hint in the FSInfo sector
+ * are kept up to date through the same buffer, counting only the entries
+ * that actually go from used to free or back.
+ */
+
+#ifndef FATCHAIN_H
+#define FATCHAIN_H
+
+#include "fat.h"
+#include "fatwrite.h"
+
+int setFATEntry(WriteBuffer* wb, FATInfo* info, int cluster, int value);
+void freeChain(WriteBuffer* wb, FATInfo* info, const ClusterChain* chain);
+void linkChain(WriteBuffer* wb, FATInfo* info, const ClusterChain* chain);
+
+#endif
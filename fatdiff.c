@@ -0,0 +1,453 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fatdiff.h"
+#include "fatwalk.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+
+typedef struct diffentry {
+	DirectoryEntry entry; // first, so entries compare by name
+	int nameAt; // where its long name is in DiffEntries.names, -1 if it has none
+} DiffEntry;
+
+typedef struct diffentries {
+	DiffEntry* entries;
+	char* matched; // 1 for each entry paired with one on the other side
+	int count;
+	int capacity;
+	char* names; // the long names, each ending in '\0'
+	int namesLen;
+	int namesCapacity;
+} DiffEntries;
+
+// a directory on the current image and where its pair is in the snapshot
+typedef struct paireddir {
+	const char* path;
+	int oldCluster; // -1 if the snapshot doesn't have it
+	int oldMaxClusters;
+} PairedDir;
+
+typedef struct diff {
+	Snapshot* old;
+	FATInfo* oldInfo; // the snapshot's volume, or the current one for a saved index
+	Image* img;
+	FATInfo* info;
+	uint64_t* fatHashes; // hash of each FAT sector of the current image
+	int sameFAT; // 1 if every FAT sector hashes the same on both sides
+	DiffVisitor visit;
+	void* context;
+	DiffStats* stats;
+	DirWalk* walk;
+	Arena* pathArena; // owns every PairedDir and its path
+	DiffEntries now; // the entries of the directory being compared
+	DiffEntries before; // and of its pair
+	ClusterChain chain; // reused for every chain that is compared
+	ClusterChain oldChain;
+} Diff;
+
+/**
+ * Adds bytes to a 64-bit FNV-1a hash
+ *
+ * @param hash The hash so far, FNV_OFFSET to start
+ * @param bytes The bytes
+ * @param len Number of bytes
+ * @return The new hash
+ */
+static uint64_t hashBytes(uint64_t hash, const unsigned char* bytes, long len) {
+	long i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/**
+ * Hashes each sector of the active FAT
+ *
+ * @param img The disk image
+ * @param info The volume
+ * @return A hash for each of the info->numFATSectors sectors
+ */
+static uint64_t* hashFATSectors(Image* img, FATInfo* info) {
+	int sizeofSector = info->sizeofSector;
+	int numSectors = info->numFATSectors;
+	int perRead = IMAGE_COPY_CHUNK / sizeofSector;
+	uint64_t* hashes = malloc((numSectors + 1) * sizeof(uint64_t));
+
+	unsigned char* buffer = malloc((long)perRead * sizeofSector);
+	int s;
+	for (s = 0; s < numSectors; s += perRead) {
+		int n = numSectors - s < perRead ? numSectors - s : perRead;
+		const unsigned char* fat = getImageSector(img, info->fatOffset + (long)s * sizeofSector,
+			n * sizeofSector, buffer);
+		int k;
+		for (k = 0; k < n; k++) {
+			hashes[s + k] = hashBytes(FNV_OFFSET, fat + (long)k * sizeofSector, sizeofSector);
+		}
+	}
+	free(buffer);
+	return hashes;
+}
+
+/**
+ * Opens an earlier snapshot of a volume
+ *
+ * @param filename A disk image, or a directory index saved from one
+ * @param backend How an image is read, as for openImage
+ * @return The snapshot, or NULL if it could not be opened
+ */
+Snapshot* openSnapshot(const char* filename, int backend) {
+	FILE* in = fopen(filename, "rb");
+	if (in == NULL) {
+		return NULL;
+	}
+	char magic[8];
+	int isIndex = fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, DIR_INDEX_MAGIC, 8) == 0;
+	fclose(in);
+
+	Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+	if (isIndex) {
+		snapshot->index = readDirIndex(filename);
+		if (snapshot->index == NULL) {
+			free(snapshot);
+			return NULL;
+		}
+		return snapshot;
+	}
+
+	snapshot->img = openImage(filename, 0, backend);
+	if (snapshot->img == NULL) {
+		free(snapshot);
+		return NULL;
+	}
+	snapshot->bs = malloc(sizeof(BootSector));
+	snapshot->info = readBootStrapSector(snapshot->img, snapshot->bs);
+	snapshot->fatHashes = hashFATSectors(snapshot->img, snapshot->info);
+	return snapshot;
+}
+
+/**
+ * Collects the entries of a directory that are compared
+ */
+static void collectEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context) {
+	if (de->attributes & (ATTR_HIDDEN | ATTR_SYSTEM_FILE | ATTR_VOLUME_LABEL)
+		|| de->filename[0] == DIRECTORY
+	) {
+		return;
+	}
+	DiffEntries* list = context;
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->entries = realloc(list->entries, list->capacity * sizeof(DiffEntry));
+		list->matched = realloc(list->matched, list->capacity);
+	}
+	list->entries[list->count].entry = *de;
+	list->entries[list->count].nameAt = -1;
+	if (longName != NULL) {
+		if (list->namesLen + longName->nameLen + 1 > list->namesCapacity) {
+			list->namesCapacity = (list->namesLen + longName->nameLen + 1) * 2;
+			list->names = realloc(list->names, list->namesCapacity);
+		}
+		list->entries[list->count].nameAt = list->namesLen;
+		memcpy(list->names + list->namesLen, longName->name, longName->nameLen + 1);
+		list->namesLen += longName->nameLen + 1;
+	}
+	list->matched[list->count] = 0;
+	list->count++;
+}
+
+/**
+ * Reads the entries of the snapshot's directory paired with one on the current image
+ *
+ * @param d The comparison
+ * @param pair Where the directory was in the snapshot
+ * @param list Receives the entries
+ */
+static void readPairedDir(Diff* d, const PairedDir* pair, DiffEntries* list) {
+	list->count = 0;
+	list->namesLen = 0;
+	if (pair->oldCluster < 0) {
+		return;
+	}
+	if (d->old->img != NULL) {
+		scanDirectory(d->old->img, d->old->info, pair->oldCluster, pair->oldMaxClusters, 1, collectEntry, list);
+		return;
+	}
+
+	// the index keeps long name slots as they were on disk
+	IndexedDir* dir = findIndexedDir(d->old->index, pair->oldCluster, pair->oldMaxClusters);
+	LongName longName;
+	longName.numSlots = 0;
+	int e;
+	for (e = 0; dir != NULL && e < dir->numEntries; e++) {
+		const DirectoryEntry* de = &dir->entries[e].entry;
+		if (de->filename[0] == DELETED) {
+			continue;
+		}
+		if (isLongNameSlot(de)) {
+			addLongNameSlot(&longName, de, dir->entries[e].posInFile);
+			continue;
+		}
+		int named = finishLongName(&longName, de);
+		collectEntry(NULL, de, named ? &longName : NULL, dir->entries[e].posInFile, list);
+		longName.numSlots = 0;
+	}
+}
+
+static int compareNames(const void* a, const void* b) {
+	// the name and extension are next to each other
+	return memcmp(((const DirectoryEntry*)a)->filename, ((const DirectoryEntry*)b)->filename, 11);
+}
+
+/**
+ * Checks if the FAT entry of a cluster is in a sector that differs
+ * between the snapshot and the current image
+ *
+ * @param d The comparison
+ * @param cluster The cluster
+ * @return 1 if the sector differs, otherwise 0
+ */
+static int fatSectorChanged(Diff* d, int cluster) {
+	int fatType = d->info->fatType;
+	long first = fatType == 12 ? cluster + cluster / 2 : (long)cluster * (fatType / 8);
+	// a FAT12 entry can straddle two sectors
+	long last = first + (fatType == 12 ? 1 : fatType / 8 - 1);
+	long s;
+	for (s = first / d->info->sizeofSector; s <= last / d->info->sizeofSector; s++) {
+		if (s >= d->old->info->numFATSectors || s >= d->info->numFATSectors
+			|| d->fatHashes[s] != d->old->fatHashes[s]
+		) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Checks if a file whose entry is unchanged has a different chain
+ *
+ * @param d The comparison
+ * @param de The file's entry, the same on both sides
+ * @return 1 if the chain differs, otherwise 0
+ */
+static int chainChanged(Diff* d, const DirectoryEntry* de) {
+	if (d->old->img == NULL || d->sameFAT) {
+		return 0;
+	}
+	int sizeofCluster = d->info->sizeofCluster;
+	int maxClusters = (entryFileSize(de) + sizeofCluster - 1) / sizeofCluster;
+	if (maxClusters == 0) {
+		return 0;
+	}
+	getClusterChain(d->info->table, getEntryCluster(d->info, de), maxClusters, &d->chain);
+
+	// the chains only need comparing if part of one is in a changed sector
+	int r;
+	int changed = 0;
+	for (r = 0; r < d->chain.numRuns && !changed; r++) {
+		int c;
+		for (c = d->chain.runs[r].start; c < d->chain.runs[r].start + d->chain.runs[r].length && !changed; c++) {
+			changed = fatSectorChanged(d, c);
+		}
+	}
+	if (!changed) {
+		return 0;
+	}
+	getClusterChain(d->old->info->table, getEntryCluster(d->oldInfo, de), maxClusters, &d->oldChain);
+	return d->chain.numRuns != d->oldChain.numRuns
+		|| memcmp(d->chain.runs, d->oldChain.runs, d->chain.numRuns * sizeof(ClusterRun)) != 0;
+}
+
+/**
+ * Checks if a file or directory's entry has changed
+ *
+ * @param d The comparison
+ * @param was The entry in the snapshot
+ * @param de The entry on the current image
+ * @return 1 if its size, first cluster or modification time differ, otherwise 0
+ */
+static int entryChanged(Diff* d, const DirectoryEntry* was, const DirectoryEntry* de) {
+	return entryFileSize(was) != entryFileSize(de)
+		|| getEntryCluster(d->oldInfo, was) != getEntryCluster(d->info, de)
+		|| entryDateModified(was) != entryDateModified(de)
+		|| entryTimeModified(was) != entryTimeModified(de);
+}
+
+/**
+ * Makes the path of an entry from its directory's path
+ *
+ * @param path Receives the path; room for `parentLen` + ENTRY_NAME_MAX + 1 characters
+ * @param parent Path of the directory, "" for the root
+ * @param parentLen Length of `parent`
+ * @param list The directory's entries
+ * @param e The entry, in `list`
+ * @return Length of `path`
+ */
+static int joinPath(char* path, const char* parent, int parentLen, const DiffEntries* list, const DiffEntry* e) {
+	memcpy(path, parent, parentLen);
+	if (parentLen > 0) {
+		path[parentLen++] = '/';
+	}
+	if (e->nameAt < 0) {
+		return parentLen + entryName(&e->entry, path + parentLen);
+	}
+	int nameLen = strlen(list->names + e->nameAt);
+	memcpy(path + parentLen, list->names + e->nameAt, nameLen + 1);
+	return parentLen + nameLen;
+}
+
+/**
+ * Hashes the entries of a directory, leaving out their long names
+ *
+ * @param list The entries
+ * @return The hash
+ */
+static uint64_t hashEntries(const DiffEntries* list) {
+	uint64_t hash = FNV_OFFSET;
+	int e;
+	for (e = 0; e < list->count; e++) {
+		hash = hashBytes(hash, (const unsigned char*)&list->entries[e].entry, sizeof(DirectoryEntry));
+	}
+	return hash;
+}
+
+/**
+ * Compares a directory on the current image with its pair in the snapshot,
+ * and pairs up its subdirectories for the next level
+ *
+ * @param d The comparison
+ * @param cluster The cluster the directory starts at
+ * @param maxClusters As passed to scanDirectory
+ * @param pair Its path, and where it was in the snapshot
+ */
+static void diffDirectory(Diff* d, int cluster, int maxClusters, const PairedDir* pair) {
+	DiffEntries* now = &d->now;
+	DiffEntries* before = &d->before;
+	now->count = 0;
+	now->namesLen = 0;
+	scanDirectory(d->img, d->info, cluster, maxClusters, 1, collectEntry, now);
+	readPairedDir(d, pair, before);
+	d->stats->numDirs++;
+
+	int same = pair->oldCluster >= 0 && now->count == before->count
+		&& hashEntries(now) == hashEntries(before);
+	if (same) {
+		d->stats->numSame++;
+	} else {
+		qsort(before->entries, before->count, sizeof(DiffEntry), compareNames);
+	}
+
+	int parentLen = strlen(pair->path);
+	int e;
+	for (e = 0; e < now->count; e++) {
+		const DirectoryEntry* de = &now->entries[e].entry;
+		DiffEntry* found = same ? &before->entries[e]
+			: bsearch(&now->entries[e], before->entries, before->count, sizeof(DiffEntry), compareNames);
+		const DirectoryEntry* was = found != NULL ? &found->entry : NULL;
+		char path[parentLen + ENTRY_NAME_MAX + 1];
+		int pathLen = joinPath(path, pair->path, parentLen, now, &now->entries[e]);
+
+		int isDirectory = (de->attributes & ATTR_SUB_DIR) != 0;
+		int change = -1;
+		if (was == NULL) {
+			change = DIFF_ADDED;
+		} else {
+			before->matched[found - before->entries] = 1;
+			if ((!same && entryChanged(d, was, de)) || (!isDirectory && chainChanged(d, de))) {
+				change = DIFF_CHANGED;
+			}
+		}
+		if (change >= 0) {
+			d->visit(change, de, path, d->context);
+			d->stats->numChanges++;
+		}
+
+		if (isDirectory) {
+			PairedDir* sub = arenaAlloc(d->pathArena, sizeof(PairedDir));
+			char* subPath = arenaAlloc(d->pathArena, pathLen + 1);
+			memcpy(subPath, path, pathLen + 1);
+			sub->path = subPath;
+			sub->oldCluster = was != NULL ? getEntryCluster(d->oldInfo, was) : -1;
+			sub->oldMaxClusters = 0;
+			queueDirectory(d->walk, getEntryCluster(d->info, de), sub);
+		}
+	}
+
+	for (e = 0; e < before->count && !same; e++) {
+		if (!before->matched[e]) {
+			char path[parentLen + ENTRY_NAME_MAX + 1];
+			joinPath(path, pair->path, parentLen, before, &before->entries[e]);
+			d->visit(DIFF_REMOVED, &before->entries[e].entry, path, d->context);
+			d->stats->numChanges++;
+		}
+	}
+}
+
+/**
+ * Finds every change to a volume since an earlier snapshot of it
+ *
+ * @param old The snapshot
+ * @param img The current image of the volume
+ * @param info The current volume
+ * @param visit Called for each change, in the order of the directory walk
+ * @param context Passed through to `visit`
+ * @param stats Receives how many directories were read and how many
+ *              changes were found
+ */
+void diffSnapshot(Snapshot* old, Image* img, FATInfo* info, DiffVisitor visit, void* context,
+	DiffStats* stats
+) {
+	Diff d = { 0 };
+	d.old = old;
+	d.oldInfo = old->info != NULL ? old->info : info;
+	d.img = img;
+	d.info = info;
+	d.visit = visit;
+	d.context = context;
+	d.stats = stats;
+	memset(stats, 0, sizeof(DiffStats));
+	if (old->img != NULL) {
+		d.fatHashes = hashFATSectors(img, info);
+		d.sameFAT = info->numFATSectors == old->info->numFATSectors
+			&& memcmp(d.fatHashes, old->fatHashes, info->numFATSectors * sizeof(uint64_t)) == 0;
+	}
+
+	PairedDir root = { "", d.oldInfo->rootCluster, d.oldInfo->numRootClusters };
+	d.pathArena = newArena(64 * 1024);
+	d.walk = startDirWalk(img, info, &root);
+	int cluster;
+	int maxClusters;
+	void* pair;
+	while (nextDirectory(d.walk, &cluster, &maxClusters, &pair)) {
+		diffDirectory(&d, cluster, maxClusters, pair);
+	}
+	freeDirWalk(d.walk);
+	freeArena(d.pathArena);
+
+	free(d.now.entries);
+	free(d.now.matched);
+	free(d.now.names);
+	free(d.before.entries);
+	free(d.before.matched);
+	free(d.before.names);
+	freeClusterChain(&d.chain);
+	freeClusterChain(&d.oldChain);
+	free(d.fatHashes);
+}
+
+/**
+ * Closes an earlier snapshot of a volume
+ *
+ * @param snapshot The snapshot
+ */
+void freeSnapshot(Snapshot* snapshot) {
+	if (snapshot->img != NULL) {
+		free(snapshot->fatHashes);
+		freeFATInfo(snapshot->info);
+		free(snapshot->bs);
+		closeImage(snapshot->img);
+	} else {
+		freeDirIndex(snapshot->index);
+	}
+	free(snapshot);
+}
@@ -0,0 +1,69 @@
+/**
+ * Changes to a volume since an earlier snapshot of it.
+ *
+ * The earlier snapshot is another image of the same volume, or a
+ * directory index saved from one (see fatindex.h). The current image's
+ * tree is walked level by level, and each directory is paired with the
+ * directory at the same path in the snapshot.
+ *
+ * A directory is hashed before anything else is done with it. If it
+ * hashes the same as its pair, none of its entries have changed and
+ * they are not compared; only its subdirectories are paired up. FAT
+ * records nothing about a subdirectory's contents in its parent, so
+ * every directory is still read, but the files whose entries are
+ * unchanged are never read and need not be extracted again.
+ *
+ * Otherwise entries are matched by short name, though changes are
+ * reported under long names where there are any. A file or directory is added
+ * or removed if only one side has it, and changed if its size, first
+ * cluster or modification time differ. Against an image, a file whose
+ * entry is the same can still have had its chain relinked; the FAT is
+ * hashed a sector at a time on both sides, and the chains are only
+ * compared when a FAT sector the file's chain runs through differs.
+ *
+ * Hidden and system entries are left out, as they are from the walks of
+ * the msdos tools, and the contents of a removed directory are not
+ * reported, only the directory.
+ */
+
+#ifndef FATDIFF_H
+#define FATDIFF_H
+
+#include <stdint.h>
+#include "fat.h"
+#include "fatindex.h"
+
+#define DIFF_ADDED 0
+#define DIFF_CHANGED 1
+#define DIFF_REMOVED 2
+
+/*
+ * Called for every change found
+ *
+ * change	DIFF_ADDED, DIFF_CHANGED or DIFF_REMOVED
+ * de	The entry on the current image, or in the snapshot if removed
+ * path	The entry's path from the root directory
+ * context	Whatever was passed to diffSnapshot
+ */
+typedef void (*DiffVisitor)(int change, const DirectoryEntry* de, const char* path, void* context);
+
+typedef struct snapshot {
+	Image* img; // NULL when the snapshot is a saved index
+	BootSector* bs;
+	FATInfo* info;
+	DirIndex* index; // the saved index when img is NULL
+	uint64_t* fatHashes; // hash of each FAT sector, when img is not NULL
+} Snapshot;
+
+typedef struct diffstats {
+	int numDirs; // directories read on the current image
+	int numSame; // of those, the ones whose entries were not compared
+	int numChanges;
+} DiffStats;
+
+Snapshot* openSnapshot(const char* filename, int backend);
+void diffSnapshot(Snapshot* old, Image* img, FATInfo* info, DiffVisitor visit, void* context,
+	DiffStats* stats);
+void freeSnapshot(Snapshot* snapshot);
+
+#endif
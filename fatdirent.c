@@ -0,0 +1,318 @@
+#include <string.h>
+#include "fatdirent.h"
+
+/**
+ * Builds the NAME.EXT form of an entry's name, without trailing spaces
+ *
+ * A leading 0x05 stands for a real 0xe5 and is converted back.
+ *
+ * @param de The entry
+ * @param name Receives the name; must hold at least 13 bytes
+ * @return The length of `name`
+ */
+int entryName(const DirectoryEntry* de, char* name) {
+	int nameLen = 8;
+	int extLen = 3;
+	// the first character is always kept, even if it is a space
+	while (nameLen > 1 && de->filename[nameLen - 1] == ' ') {
+		nameLen--;
+	}
+	while (extLen > 0 && de->extension[extLen - 1] == ' ') {
+		extLen--;
+	}
+
+	memcpy(name, de->filename, nameLen);
+	if (de->filename[0] == 0x05) {
+		name[0] = (char)0xe5;
+	}
+	int pos = nameLen;
+	if (extLen > 0) {
+		name[pos] = '.';
+		memcpy(name + pos + 1, de->extension, extLen);
+		pos += extLen + 1;
+	}
+	name[pos] = 0;
+	return pos;
+}
+
+/**
+ * Gives an entry's long name if it has one, otherwise its NAME.EXT
+ *
+ * @param de The entry
+ * @param longName Its long name, or NULL if it has none
+ * @param name Receives the name; must hold at least ENTRY_NAME_MAX bytes
+ * @return The length of `name`
+ */
+int entryLongName(const DirectoryEntry* de, const LongName* longName, char* name) {
+	if (longName == NULL) {
+		return entryName(de, name);
+	}
+	memcpy(name, longName->name, longName->nameLen + 1);
+	return longName->nameLen;
+}
+
+/**
+ * Works out the checksum long name slots give for their short name
+ *
+ * @param shortName The 11 bytes of name and extension, as on disk
+ * @return The checksum
+ */
+BYTE shortNameChecksum(const BYTE* shortName) {
+	BYTE sum = 0;
+	int i;
+	for (i = 0; i < 11; i++) {
+		sum = (BYTE)(((sum & 1) << 7) + (sum >> 1) + shortName[i]);
+	}
+	return sum;
+}
+
+/**
+ * Adds the next long name slot found in a directory
+ *
+ * A slot with LONG_NAME_LAST set, or a deleted one once the checksum
+ * changes, starts a new name; anything else must carry on the one
+ * before it. Slots that can't leave the name invalid until the next
+ * short entry is finished.
+ *
+ * @param longName The name so far
+ * @param de The slot
+ * @param posInFile Byte offset of the slot in the image
+ */
+void addLongNameSlot(LongName* longName, const DirectoryEntry* de, long posInFile) {
+	const BYTE* raw = (const BYTE*)de;
+	BYTE seq = raw[0];
+	BYTE checksum = raw[13];
+	if (seq == 0xe5 ? longName->numSlots == 0 || longName->first != 0xe5 || checksum != longName->checksum
+			: (seq & LONG_NAME_LAST) != 0) {
+		longName->numSlots = 0;
+		longName->invalid = 0;
+		longName->first = seq;
+		longName->checksum = checksum;
+	} else if (longName->numSlots == 0 || checksum != longName->checksum
+			|| (seq != 0xe5 && (seq != (longName->first & 0x1f) - longName->numSlots || longName->first == 0xe5))) {
+		longName->invalid = 1;
+	}
+	if (longName->invalid || longName->numSlots == LONG_NAME_SLOTS) {
+		longName->invalid = 1;
+		return;
+	}
+
+	// 5 characters, then 6 after the attributes and checksum, then 2 after the cluster
+	unsigned short* chars = longName->chars + longName->numSlots * LONG_NAME_CHARS;
+	static const int offsets[LONG_NAME_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	int i;
+	for (i = 0; i < LONG_NAME_CHARS; i++) {
+		chars[i] = (unsigned short)(raw[offsets[i]] | raw[offsets[i] + 1] << 8);
+	}
+	longName->slotPos[longName->numSlots++] = posInFile;
+}
+
+/**
+ * Checks the slots found before a short entry and decodes its long name
+ *
+ * Either way the slots are left in place, so call this once per short
+ * entry and set numSlots to 0 afterwards.
+ *
+ * The name becomes a path component wherever it is used, so one that
+ * holds '/', '\' or a control character, or is "." or "..", is turned
+ * down and the entry keeps its short name.
+ *
+ * @param longName The slots found since the last short entry
+ * @param de The short entry
+ * @return 1 if the slots make up the entry's long name, now in
+ *         longName->name, otherwise 0
+ */
+int finishLongName(LongName* longName, const DirectoryEntry* de) {
+	longName->nameLen = 0;
+	longName->name[0] = 0;
+	if (longName->numSlots == 0 || longName->invalid) {
+		return 0;
+	}
+	if (de->filename[0] == 0xe5) {
+		// the short name has lost its first letter, so its checksum can't be checked
+		if (longName->first != 0xe5) {
+			return 0;
+		}
+	} else if (longName->first == 0xe5 || (longName->first & 0x1f) != longName->numSlots
+			|| longName->checksum != shortNameChecksum(de->filename)) {
+		return 0;
+	}
+
+	// the first slot found holds the end of the name
+	char* out = longName->name;
+	int slot;
+	for (slot = longName->numSlots - 1; slot >= 0; slot--) {
+		const unsigned short* chars = longName->chars + slot * LONG_NAME_CHARS;
+		int i;
+		for (i = 0; i < LONG_NAME_CHARS && chars[i] != 0; i++) {
+			unsigned int c = chars[i];
+			if (c >= 0xd800 && c < 0xdc00 && i + 1 < LONG_NAME_CHARS
+					&& chars[i + 1] >= 0xdc00 && chars[i + 1] < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (chars[++i] - 0xdc00);
+			} else if (c >= 0xd800 && c < 0xe000) {
+				// half a surrogate pair, or one split over two slots
+				c = '?';
+			} else if (c < 0x20 || (c >= 0x7f && c < 0xa0) || c == '/' || c == '\\') {
+				longName->name[0] = 0;
+				return 0;
+			}
+			if (c < 0x80) {
+				*out++ = (char)c;
+			} else if (c < 0x800) {
+				*out++ = (char)(0xc0 | c >> 6);
+				*out++ = (char)(0x80 | (c & 0x3f));
+			} else if (c < 0x10000) {
+				*out++ = (char)(0xe0 | c >> 12);
+				*out++ = (char)(0x80 | ((c >> 6) & 0x3f));
+				*out++ = (char)(0x80 | (c & 0x3f));
+			} else {
+				*out++ = (char)(0xf0 | c >> 18);
+				*out++ = (char)(0x80 | ((c >> 12) & 0x3f));
+				*out++ = (char)(0x80 | ((c >> 6) & 0x3f));
+				*out++ = (char)(0x80 | (c & 0x3f));
+			}
+		}
+		if (i < LONG_NAME_CHARS && slot > 0) {
+			// the name ended before its last slot
+			return 0;
+		}
+	}
+	*out = 0;
+	if (strcmp(longName->name, ".") == 0 || strcmp(longName->name, "..") == 0) {
+		longName->name[0] = 0;
+		return 0;
+	}
+	longName->nameLen = out - longName->name;
+	return longName->nameLen > 0;
+}
+
+/**
+ * Converts a FAT date and time to seconds since the epoch
+ *
+ * FAT stores local time with no zone, so it is taken to be UTC.
+ *
+ * @param date Packed as years since 1980 (7 bits), month (4), day (5)
+ * @param time Packed as hour (5 bits), minute (6), seconds / 2 (5)
+ * @return Seconds since 1970-01-01 00:00 UTC
+ */
+long fatTimestamp(int date, int time) {
+	int year = 1980 + ((date >> 9) & 0x7f);
+	int month = (date >> 5) & 0x0f;
+	int day = date & 0x1f;
+	// a zeroed date is read as 1980-01-01
+	if (month < 1 || month > 12) {
+		month = 1;
+	}
+	if (day < 1) {
+		day = 1;
+	}
+
+	// days from the civil date, counting years from March so the
+	// leap day falls at the end
+	int y = month <= 2 ? year - 1 : year;
+	int era = y / 400;
+	int yearOfEra = y - era * 400;
+	int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+	long days = (long)era * 146097 + dayOfEra - 719468;
+
+	return days * 86400 + ((time >> 11) & 0x1f) * 3600 + ((time >> 5) & 0x3f) * 60 + (time & 0x1f) * 2;
+}
+
+/*
+ * Finding the next entry worth decoding. The first entry that was never
+ * used (0x00) ends the directory, so the only slots to step over are
+ * deleted ones (0xe5). Directories that have had many files deleted are
+ * full of them, so the vector kernels test the first byte of sixteen
+ * entries at once and only stop in blocks that hold another entry.
+ */
+#if !defined(FAT_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+
+/**
+ * Tests the first bytes of sixteen entries with two AVX2 gathers
+ *
+ * @param dir The first of the sixteen entries
+ * @return A bit per entry, set if that entry is not deleted
+ */
+static int liveEntryMask(const unsigned char* dir) {
+	const __m256i stride = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+	const __m256i firstByte = _mm256_set1_epi32(0xff);
+	const __m256i deleted = _mm256_set1_epi32(0xe5);
+	int mask = 0;
+	int half;
+	for (half = 0; half < 2; half++) {
+		__m256i v = _mm256_i32gather_epi32((const int*)(dir + half * 256), stride, 1);
+		v = _mm256_and_si256(v, firstByte);
+		__m256i skip = _mm256_cmpeq_epi32(v, deleted);
+		mask |= (~_mm256_movemask_ps(_mm256_castsi256_ps(skip)) & 0xff) << (half * 8);
+	}
+	return mask;
+}
+#elif !defined(FAT_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+
+/**
+ * Tests the first bytes of sixteen entries with SSE2
+ *
+ * The first byte of each entry is brought together by four rounds of
+ * interleaving, leaving all sixteen in one register.
+ *
+ * @param dir The first of the sixteen entries
+ * @return A bit per entry, set if that entry is not deleted
+ */
+static int liveEntryMask(const unsigned char* dir) {
+	__m128i v[16];
+	int k;
+	for (k = 0; k < 16; k++) {
+		v[k] = _mm_loadu_si128((const __m128i*)(dir + k * 32));
+	}
+	for (k = 0; k < 8; k++) {
+		v[k] = _mm_unpacklo_epi8(v[2 * k], v[2 * k + 1]);
+	}
+	for (k = 0; k < 4; k++) {
+		v[k] = _mm_unpacklo_epi16(v[2 * k], v[2 * k + 1]);
+	}
+	for (k = 0; k < 2; k++) {
+		v[k] = _mm_unpacklo_epi32(v[2 * k], v[2 * k + 1]);
+	}
+	__m128i first = _mm_unpacklo_epi64(v[0], v[1]);
+	__m128i skip = _mm_cmpeq_epi8(first, _mm_set1_epi8((char)0xe5));
+	return ~_mm_movemask_epi8(skip) & 0xffff;
+}
+#elif !defined(FAT_NO_SIMD)
+#define FAT_NO_SIMD
+#endif
+
+/**
+ * Finds the next entry that is in use, or the end of the directory
+ *
+ * @param dir The entries to search
+ * @param start The first entry to look at
+ * @param count The number of entries in `dir`
+ * @param skipDeleted 1 if deleted entries should be skipped too
+ * @return The index of the next live entry or of the never used entry
+ *         that ends the directory, whichever comes first, or `count`
+ *         if there is neither
+ */
+int findLiveEntry(const unsigned char* dir, int start, int count, int skipDeleted) {
+	if (!skipDeleted) {
+		// every entry is either visited or ends the directory
+		return start < count ? start : count;
+	}
+	int e = start;
+#ifndef FAT_NO_SIMD
+	for (; e + 16 <= count; e += 16) {
+		int mask = liveEntryMask(dir + e * 32);
+		if (mask) {
+			return e + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for (; e < count; e++) {
+		if (dir[e * 32] != 0xe5) {
+			return e;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,147 @@
+/**
+ * Directory entries read in place.
+ *
+ * DirectoryEntry is laid out exactly like an entry on disk, so a pointer
+ * into a directory sector can be used as one without copying it. Every
+ * multi-byte field is little-endian and is read through the accessors
+ * below, which works whatever the host byte order is.
+ *
+ * A VFAT long name is kept in extra slots just before the short entry
+ * it belongs to, 13 UTF-16 characters in each, the last part first.
+ * They are collected into a LongName as a directory is scanned, with no
+ * allocation, and turned into UTF-8 once the short entry is reached and
+ * its checksum matches the one in every slot. A deleted long name has
+ * lost the sequence numbers in its first bytes, but not its characters,
+ * so it is put together from where its slots are instead.
+ */
+
+#ifndef FATDIRENT_H
+#define FATDIRENT_H
+
+#if defined(__GNUC__)
+#define FAT_PACKED __attribute__((packed))
+#else
+#define FAT_PACKED
+#endif
+
+typedef unsigned char BYTE;
+typedef struct pair {
+	BYTE bytes[2];
+} BytePair;
+
+typedef struct triplet {
+	BYTE bytes[3];
+} ByteTriplet;
+
+typedef struct quad {
+	BYTE bytes[4];
+} ByteQuad;
+
+/*
+ * 00-07	Filename
+ * 08-10	Filename extension
+ *    11	File attributes
+ *    12	Reserved for use by WinNT
+ *    13	Time created (tenth of a second)
+ * 14-15	Time created
+ * 		Hour	5 bits
+ * 		Minutes	6 bits
+ * 		Seconds	5 bits
+ * 16-17	Date created
+ * 		Year	7 bits
+ * 		Month	4 bits
+ * 		Day	5 bits
+ * 18-19	Date last accessed
+ * 20-21	Upper half of entry's first cluster, 0 for FAT12 and FAT16
+ * 22-23	Time last modified
+ * 24-25	Date last modified
+ * 26-27	Lower half of entry's first cluster
+ * 28-31	File size in bytes
+ */
+typedef struct FAT_PACKED direntry {
+	BYTE filename[8];
+	BYTE extension[3];
+	BYTE attributes;
+	BYTE reserved;
+	BYTE timeCreatedTenthSec;
+	BytePair timeCreated;
+	BytePair dateCreated;
+	BytePair dateAccessed;
+	BytePair startingClusterUpper;
+	BytePair timeModified;
+	BytePair dateModified;
+	BytePair startingCluster;
+	ByteQuad fileSize;
+} DirectoryEntry;
+
+_Static_assert(sizeof(DirectoryEntry) == 32, "DirectoryEntry must match the 32-byte on-disk entry");
+
+// read only, hidden, system and volume label together mark a long name slot
+#define ATTR_LONG_NAME 0x0f
+#define LONG_NAME_SLOTS 20 // enough for the longest name, 255 characters
+#define LONG_NAME_CHARS 13 // characters in each slot
+#define LONG_NAME_LAST 0x40 // in the sequence number of the slot holding the end of the name
+
+// longest name entryLongName gives, counting the '\0'
+#define ENTRY_NAME_MAX (LONG_NAME_SLOTS * LONG_NAME_CHARS * 3 + 1)
+
+typedef struct longname {
+	unsigned short chars[LONG_NAME_SLOTS * LONG_NAME_CHARS]; // UTF-16, a slot at a time as found
+	long slotPos[LONG_NAME_SLOTS]; // byte offset of each slot in the image, as found
+	int numSlots;
+	int invalid; // 1 if the slots found so far can't all be one name
+	BYTE first; // first byte of the first slot found
+	BYTE checksum; // of the short name, as given in the slots
+	char name[ENTRY_NAME_MAX]; // UTF-8, once finished
+	int nameLen;
+} LongName;
+
+static inline int readLE16(BytePair p) {
+	return p.bytes[0] | (p.bytes[1] << 8);
+}
+
+static inline long readLE32(ByteQuad p) {
+	return p.bytes[0] | (p.bytes[1] << 8) | (p.bytes[2] << 16) | ((long)p.bytes[3] << 24);
+}
+
+static inline int entryStartingCluster(const DirectoryEntry* de) {
+	return readLE16(de->startingCluster);
+}
+
+static inline long entryFileSize(const DirectoryEntry* de) {
+	return readLE32(de->fileSize);
+}
+
+static inline int entryTimeModified(const DirectoryEntry* de) {
+	return readLE16(de->timeModified);
+}
+
+static inline int entryDateModified(const DirectoryEntry* de) {
+	return readLE16(de->dateModified);
+}
+
+static inline int entryTimeCreated(const DirectoryEntry* de) {
+	return readLE16(de->timeCreated);
+}
+
+static inline int entryDateCreated(const DirectoryEntry* de) {
+	return readLE16(de->dateCreated);
+}
+
+static inline int entryDateAccessed(const DirectoryEntry* de) {
+	return readLE16(de->dateAccessed);
+}
+
+static inline int isLongNameSlot(const DirectoryEntry* de) {
+	return (de->attributes & 0x3f) == ATTR_LONG_NAME;
+}
+
+int entryName(const DirectoryEntry* de, char* name);
+int entryLongName(const DirectoryEntry* de, const LongName* longName, char* name);
+BYTE shortNameChecksum(const BYTE* shortName);
+void addLongNameSlot(LongName* longName, const DirectoryEntry* de, long posInFile);
+int finishLongName(LongName* longName, const DirectoryEntry* de);
+long fatTimestamp(int date, int time);
+int findLiveEntry(const unsigned char* dir, int start, int count, int skipDeleted);
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fatformat.h"
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/**
+ * Creates an empty buffer in front of an output stream
+ *
+ * @param out The stream the buffer is written to
+ * @param size Size of the buffer, at least FORMAT_FIELD bytes
+ * @return The new buffer
+ */
+FormatBuffer* newFormatBuffer(FILE* out, int size) {
+	FormatBuffer* fb = malloc(sizeof(FormatBuffer));
+	fb->out = out;
+	fb->size = size < FORMAT_FIELD ? FORMAT_FIELD : size;
+	fb->data = malloc(fb->size);
+	fb->used = 0;
+	fb->failed = 0;
+	return fb;
+}
+
+/**
+ * Makes room for `len` more bytes, writing the buffer out if needed
+ *
+ * @param fb The buffer
+ * @param len Number of bytes about to be added, at most fb->size
+ * @return Where they go
+ */
+static inline char* reserve(FormatBuffer* fb, int len) {
+	if (fb->used + len > fb->size) {
+		flushFormatBuffer(fb);
+	}
+	return fb->data + fb->used;
+}
+
+/**
+ * Appends bytes as they are
+ *
+ * @param fb The buffer
+ * @param chars The bytes to add
+ * @param len Number of bytes
+ */
+void formatChars(FormatBuffer* fb, const char* chars, int len) {
+	if (len > fb->size) {
+		// too big to buffer, so it goes straight out after what is held
+		flushFormatBuffer(fb);
+		if (fwrite(chars, len, 1, fb->out) != 1) {
+			fb->failed = 1;
+		}
+		return;
+	}
+	memcpy(reserve(fb, len), chars, len);
+	fb->used += len;
+}
+
+/**
+ * Appends a decimal integer
+ *
+ * @param fb The buffer
+ * @param value The integer
+ */
+void formatInt(FormatBuffer* fb, long value) {
+	char* dest = reserve(fb, FORMAT_FIELD);
+	unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+
+	int pos = 0;
+	if (value < 0) {
+		dest[pos++] = '-';
+	}
+	while (n > 0) {
+		dest[pos++] = digits[--n];
+	}
+	fb->used += pos;
+}
+
+/**
+ * Appends an integer in hexadecimal, zero-padded to `width` digits
+ *
+ * @param fb The buffer
+ * @param value The integer
+ * @param width Number of digits, at most 16
+ */
+void formatHex(FormatBuffer* fb, unsigned long value, int width) {
+	char* dest = reserve(fb, width);
+	int i;
+	for (i = width - 1; i >= 0; i--) {
+		dest[i] = hexDigits[value & 0xf];
+		value >>= 4;
+	}
+	fb->used += width;
+}
+
+// writes a number from 0 to 99 as two digits
+static inline void twoDigits(char* dest, int value) {
+	dest[0] = '0' + value / 10;
+	dest[1] = '0' + value % 10;
+}
+
+/**
+ * Appends a FAT date as YYYY-MM-DD
+ *
+ * @param fb The buffer
+ * @param date Packed as years since 1980 (7 bits), month (4), day (5)
+ */
+void formatDate(FormatBuffer* fb, int date) {
+	char* dest = reserve(fb, 10);
+	int year = 1980 + ((date >> 9) & 0x7f);
+	twoDigits(dest, year / 100);
+	twoDigits(dest + 2, year % 100);
+	dest[4] = '-';
+	twoDigits(dest + 5, (date >> 5) & 0x0f);
+	dest[7] = '-';
+	twoDigits(dest + 8, date & 0x1f);
+	fb->used += 10;
+}
+
+/**
+ * Appends a FAT time as HH:MM:SS
+ *
+ * @param fb The buffer
+ * @param time Packed as hour (5 bits), minute (6), seconds / 2 (5)
+ */
+void formatTime(FormatBuffer* fb, int time) {
+	char* dest = reserve(fb, 8);
+	twoDigits(dest, (time >> 11) & 0x1f);
+	dest[2] = ':';
+	twoDigits(dest + 3, (time >> 5) & 0x3f);
+	dest[5] = ':';
+	twoDigits(dest + 6, (time & 0x1f) * 2);
+	fb->used += 8;
+}
+
+/**
+ * Measures the UTF-8 sequence at the start of a string
+ *
+ * Overlong forms, surrogates and code points past U+10FFFF are not valid,
+ * so the second byte's range depends on the first, as RFC 3629 gives it.
+ *
+ * @param s The bytes
+ * @param len Number of bytes
+ * @return Length of the sequence if it is a valid multibyte one, otherwise 0
+ */
+static int utf8Length(const unsigned char* s, int len) {
+	int n;
+	unsigned char low = 0x80;
+	unsigned char high = 0xbf;
+	if (s[0] >= 0xc2 && s[0] < 0xe0) {
+		n = 2;
+	} else if (s[0] >= 0xe0 && s[0] < 0xf0) {
+		n = 3;
+		if (s[0] == 0xe0) {
+			low = 0xa0;
+		} else if (s[0] == 0xed) {
+			high = 0x9f;
+		}
+	} else if (s[0] >= 0xf0 && s[0] < 0xf5) {
+		n = 4;
+		if (s[0] == 0xf0) {
+			low = 0x90;
+		} else if (s[0] == 0xf4) {
+			high = 0x8f;
+		}
+	} else {
+		return 0;
+	}
+	if (n > len || s[1] < low || s[1] > high) {
+		return 0;
+	}
+	int i;
+	for (i = 2; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+/**
+ * Appends a quoted JSON string
+ *
+ * Long names are decoded to UTF-8 and kept as they are. Short names are
+ * in an unknown code page, so other bytes above 0x7f are escaped as the
+ * Latin-1 characters of the same value, which keeps the output valid
+ * UTF-8.
+ *
+ * @param fb The buffer
+ * @param s The bytes of the string
+ * @param len Number of bytes
+ */
+void formatJSONString(FormatBuffer* fb, const char* s, int len) {
+	*reserve(fb, 1) = '"';
+	fb->used++;
+	int i;
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		char* dest = reserve(fb, 6);
+		int n = c > 0x7f ? utf8Length((const unsigned char*)s + i, len - i) : 0;
+		if (n > 0) {
+			memcpy(dest, s + i, n);
+			fb->used += n;
+			i += n - 1;
+		} else if (c == '"' || c == '\\') {
+			dest[0] = '\\';
+			dest[1] = c;
+			fb->used += 2;
+		} else if (c < 0x20 || c > 0x7e) {
+			memcpy(dest, "\\u00", 4);
+			dest[4] = hexDigits[c >> 4];
+			dest[5] = hexDigits[c & 0xf];
+			fb->used += 6;
+		} else {
+			dest[0] = c;
+			fb->used++;
+		}
+	}
+	*reserve(fb, 1) = '"';
+	fb->used++;
+}
+
+/**
+ * Appends a CSV field, quoting it only if it needs to be
+ *
+ * @param fb The buffer
+ * @param s The bytes of the field
+ * @param len Number of bytes
+ */
+void formatCSVString(FormatBuffer* fb, const char* s, int len) {
+	int quote = 0;
+	int i;
+	for (i = 0; i < len; i++) {
+		if (s[i] == ',' || s[i] == '"' || s[i] == '\n' || s[i] == '\r') {
+			quote = 1;
+			break;
+		}
+	}
+	if (!quote) {
+		formatChars(fb, s, len);
+		return;
+	}
+
+	*reserve(fb, 1) = '"';
+	fb->used++;
+	for (i = 0; i < len; i++) {
+		char* dest = reserve(fb, 2);
+		// a quote inside a quoted field is doubled
+		if (s[i] == '"') {
+			*dest++ = '"';
+			fb->used++;
+		}
+		*dest = s[i];
+		fb->used++;
+	}
+	*reserve(fb, 1) = '"';
+	fb->used++;
+}
+
+/**
+ * Writes out everything held in the buffer
+ *
+ * @param fb The buffer
+ * @return 1 if every write so far has succeeded, otherwise 0
+ */
+int flushFormatBuffer(FormatBuffer* fb) {
+	if (fb->used > 0 && fwrite(fb->data, fb->used, 1, fb->out) != 1) {
+		fb->failed = 1;
+	}
+	fb->used = 0;
+	return !fb->failed && fflush(fb->out) == 0;
+}
+
+/**
+ * Flushes the buffer and frees it
+ *
+ * @param fb The buffer
+ * @return 1 if every write has succeeded, otherwise 0
+ */
+int freeFormatBuffer(FormatBuffer* fb) {
+	int ok = flushFormatBuffer(fb);
+	free(fb->data);
+	free(fb);
+	return ok;
+}
@@ -0,0 +1,42 @@
+/**
+ * Buffered formatting of listing records.
+ *
+ * Machine-readable listings can run to millions of lines, so instead of
+ * a printf per line every field is formatted straight into one
+ * preallocated buffer by the small formatters below. The buffer is only
+ * written out when it fills up and when it is flushed.
+ */
+
+#ifndef FATFORMAT_H
+#define FATFORMAT_H
+
+#include <stdio.h>
+
+#define FORMAT_BUFFER (1 << 20)
+
+// room always left free for one field, so the formatters never check midway
+#define FORMAT_FIELD 64
+
+typedef struct formatbuffer {
+	FILE* out;
+	char* data;
+	int used;
+	int size;
+	int failed; // 1 once a write to `out` has failed
+} FormatBuffer;
+
+// appends a string literal, its length known at compile time
+#define formatLiteral(fb, s) formatChars(fb, s, sizeof(s) - 1)
+
+FormatBuffer* newFormatBuffer(FILE* out, int size);
+void formatChars(FormatBuffer* fb, const char* chars, int len);
+void formatInt(FormatBuffer* fb, long value);
+void formatHex(FormatBuffer* fb, unsigned long value, int width);
+void formatDate(FormatBuffer* fb, int date);
+void formatTime(FormatBuffer* fb, int time);
+void formatJSONString(FormatBuffer* fb, const char* s, int len);
+void formatCSVString(FormatBuffer* fb, const char* s, int len);
+int flushFormatBuffer(FormatBuffer* fb);
+int freeFormatBuffer(FormatBuffer* fb);
+
+#endif
@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "fatgen.h"
+#include "fatimage.h"
+
+#define GEN_SECTOR 512
+#define GEN_ROOT_ENTRIES 512 // size of the fixed FAT12/16 root directory
+#define GEN_END 0x0fffffff // end of chain, cut down to the FAT type when written
+
+// every entry is dated 2020-01-01 12:00:00
+#define GEN_DATE ((2020 - 1980) << 9 | 1 << 5 | 1)
+#define GEN_TIME (12 << 11)
+
+typedef struct gendir {
+	char* path; // "" for the root
+	int parent;
+	int numSubdirs;
+	int numFiles;
+	int firstCluster; // 0 for a FAT12/16 root directory
+	int numClusters;
+	unsigned char* entries;
+	int numEntries;
+} GenDir;
+
+typedef struct genfile {
+	char* path;
+	int dir;
+	long size;
+	int firstCluster;
+	int deleted;
+} GenFile;
+
+typedef struct generator {
+	const GenParams* params;
+	uint64_t random;
+	int sizeofCluster;
+	uint32_t* fat; // FAT entries, 0 for a free cluster
+	int numEntries; // clusters in the volume, plus the two reserved entries
+	int lowestFree;
+	GenDir* dirs;
+	int numDirs;
+	GenFile* files;
+} Generator;
+
+/**
+ * @param gen The generator
+ * @return The next 32 bits from the seeded xorshift generator
+ */
+static uint32_t nextRandom(Generator* gen) {
+	gen->random ^= gen->random << 13;
+	gen->random ^= gen->random >> 7;
+	gen->random ^= gen->random << 17;
+	return gen->random >> 32;
+}
+
+/**
+ * @param gen The generator
+ * @return A random number from 0 up to but not including 1
+ */
+static double randomFraction(Generator* gen) {
+	return nextRandom(gen) / 4294967296.0;
+}
+
+/**
+ * Joins a parent path and a name
+ *
+ * @param parent The parent's path, "" for the root
+ * @param name The name to add
+ * @return The new path, to be freed
+ */
+static char* joinPath(const char* parent, const char* name) {
+	char* path = malloc(strlen(parent) + strlen(name) + 2);
+	if (parent[0] == '\0') {
+		strcpy(path, name);
+	} else {
+		sprintf(path, "%s/%s", parent, name);
+	}
+	return path;
+}
+
+/**
+ * Finds a free cluster, going back to the lowest one if there are none
+ * at or after `from`
+ *
+ * @param gen The generator, which has at least one free cluster
+ * @param from Where to start looking
+ * @return The free cluster
+ */
+static int findFree(Generator* gen, int from) {
+	int c;
+	for (c = from; c < gen->numEntries; c++) {
+		if (gen->fat[c] == 0) {
+			return c;
+		}
+	}
+	return gen->lowestFree;
+}
+
+/**
+ * Allocates and links a chain of clusters
+ *
+ * @param gen The generator
+ * @param numClusters Length of the chain
+ * @param fragmentation Chance of each cluster after the first being
+ *                      taken from further on instead of the next free one
+ * @return The first cluster of the chain, or 0 for an empty one
+ */
+static int allocateChain(Generator* gen, int numClusters, double fragmentation) {
+	int first = 0;
+	int prev = 0;
+	int k;
+	for (k = 0; k < numClusters; k++) {
+		int c;
+		if (prev == 0) {
+			c = gen->lowestFree;
+		} else if (fragmentation > 0 && randomFraction(gen) < fragmentation) {
+			c = findFree(gen, prev + 2 + nextRandom(gen) % GEN_MAX_JUMP);
+		} else {
+			c = findFree(gen, prev + 1);
+		}
+
+		gen->fat[c] = GEN_END;
+		if (prev == 0) {
+			first = c;
+		} else {
+			gen->fat[prev] = c;
+		}
+		prev = c;
+		while (gen->lowestFree < gen->numEntries && gen->fat[gen->lowestFree] != 0) {
+			gen->lowestFree++;
+		}
+	}
+	return first;
+}
+
+/**
+ * Adds an entry to a directory
+ *
+ * @param dir The directory
+ * @param name The 11-byte name, padded with spaces
+ * @param attributes The entry's attributes
+ * @param cluster The entry's first cluster
+ * @param size The entry's size
+ * @return The new entry
+ */
+static unsigned char* addEntry(GenDir* dir, const char* name, int attributes, int cluster, long size) {
+	unsigned char* de = dir->entries + 32 * dir->numEntries++;
+	memset(de, 0, 32);
+	memcpy(de, name, 11);
+	de[11] = attributes;
+	putLE(de + 14, GEN_TIME, 2);
+	putLE(de + 16, GEN_DATE, 2);
+	putLE(de + 18, GEN_DATE, 2);
+	putLE(de + 20, cluster >> 16, 2);
+	putLE(de + 22, GEN_TIME, 2);
+	putLE(de + 24, GEN_DATE, 2);
+	putLE(de + 26, cluster & 0xffff, 2);
+	putLE(de + 28, size, 4);
+	return de;
+}
+
+/**
+ * Pads a short name out to the 11 bytes of a directory entry
+ *
+ * @param name Base name of up to 8 characters
+ * @param ext Extension of up to 3 characters
+ * @param entryName Receives the padded name
+ */
+static void padName(const char* name, const char* ext, char* entryName) {
+	memset(entryName, ' ', 11);
+	memcpy(entryName, name, strlen(name));
+	memcpy(entryName + 8, ext, strlen(ext));
+}
+
+/**
+ * Writes bytes at an offset in the image
+ *
+ * @param out The image
+ * @param offset Byte offset into the image
+ * @param data The bytes to write
+ * @param len Number of bytes to write
+ * @return 1 on success, otherwise 0
+ */
+static int writeAt(FILE* out, long offset, const void* data, long len) {
+	return fseek(out, offset, SEEK_SET) == 0 && fwrite(data, len, 1, out) == 1;
+}
+
+/**
+ * Writes the contents of every file, seven-digit tag after tag
+ *
+ * @param gen The generator
+ * @param out The image
+ * @param dataOffset Byte offset of cluster 2
+ * @return 1 on success, otherwise 0
+ */
+static int writeFileData(Generator* gen, FILE* out, long dataOffset) {
+	unsigned char* buffer = malloc(gen->sizeofCluster);
+	int ok = 1;
+	int f;
+	for (f = 0; f < gen->params->numFiles && ok; f++) {
+		GenFile* file = &gen->files[f];
+		char tag[16];
+		int tagLen = sprintf(tag, "F%07d ", f);
+		long pos = 0;
+		int c = file->firstCluster;
+		while (pos < file->size && ok) {
+			int len = file->size - pos < gen->sizeofCluster ? file->size - pos : gen->sizeofCluster;
+			int i;
+			for (i = 0; i < len; i++) {
+				buffer[i] = tag[(pos + i) % tagLen];
+			}
+			ok = writeAt(out, dataOffset + (long)(c - 2) * gen->sizeofCluster, buffer, len);
+			pos += len;
+			c = gen->fat[c];
+		}
+	}
+	free(buffer);
+	return ok;
+}
+
+/**
+ * Packs the FAT into the on-disk format of its type
+ *
+ * @param gen The generator
+ * @param fat Receives the packed FAT, zeroed beforehand
+ */
+static void packFAT(Generator* gen, unsigned char* fat) {
+	int fatType = gen->params->fatType;
+	int c;
+	for (c = 0; c < gen->numEntries; c++) {
+		uint32_t entry = gen->fat[c];
+		if (fatType == 12) {
+			entry &= 0xfff;
+			unsigned char* p = fat + c + c / 2;
+			if (c % 2 == 0) {
+				p[0] = entry;
+				p[1] = (p[1] & 0xf0) | (entry >> 8);
+			} else {
+				p[0] = (p[0] & 0x0f) | (entry << 4);
+				p[1] = entry >> 4;
+			}
+		} else if (fatType == 16) {
+			putLE(fat + 2 * c, entry & 0xffff, 2);
+		} else {
+			putLE(fat + 4L * c, entry & 0x0fffffff, 4);
+		}
+	}
+}
+
+/**
+ * Fills in a boot sector
+ *
+ * @param gen The generator
+ * @param bs Receives the boot sector, zeroed beforehand
+ * @param reservedSectors Sectors before the first FAT
+ * @param fatSectors Sectors in each copy of the FAT
+ * @param totalSectors Sectors in the whole volume
+ */
+static void fillBootSector(Generator* gen, unsigned char* bs, int reservedSectors, int fatSectors, long totalSectors) {
+	int fatType = gen->params->fatType;
+	bs[0] = 0xeb;
+	bs[1] = 0x58;
+	bs[2] = 0x90;
+	memcpy(bs + 3, "FATGEN  ", 8);
+	putLE(bs + 11, GEN_SECTOR, 2);
+	bs[13] = gen->params->sectorsPerCluster;
+	putLE(bs + 14, reservedSectors, 2);
+	bs[16] = 2;
+	putLE(bs + 17, fatType == 32 ? 0 : GEN_ROOT_ENTRIES, 2);
+	if (fatType != 32 && totalSectors < 65536) {
+		putLE(bs + 19, totalSectors, 2);
+	} else {
+		putLE(bs + 32, totalSectors, 4);
+	}
+	bs[21] = 0xf8;
+	putLE(bs + 24, 63, 2);
+	putLE(bs + 26, 255, 2);
+
+	// the rest of the BPB moves along by 28 bytes in FAT32
+	unsigned char* ext = bs + 36;
+	if (fatType == 32) {
+		putLE(bs + 36, fatSectors, 4);
+		putLE(bs + 44, 2, 4);
+		putLE(bs + 48, 1, 2);
+		putLE(bs + 50, 6, 2);
+		ext = bs + 64;
+	} else {
+		putLE(bs + 22, fatSectors, 2);
+	}
+	ext[0] = 0x80;
+	ext[2] = 0x29;
+	putLE(ext + 3, gen->params->seed * 2654435761u, 4);
+	memcpy(ext + 7, "NO NAME    ", 11);
+	memcpy(ext + 18, fatType == 12 ? "FAT12   " : fatType == 16 ? "FAT16   " : "FAT32   ", 8);
+	bs[510] = 0x55;
+	bs[511] = 0xaa;
+}
+
+/**
+ * Works out the tree of directories and which files go in each
+ *
+ * @param gen The generator
+ * @return 1 on success, 0 if the files do not fit in the root directory
+ */
+static int planTree(Generator* gen) {
+	const GenParams* params = gen->params;
+	int numDirs = 1;
+	int level = 1;
+	int k;
+	for (k = 0; k < params->depth; k++) {
+		level *= GEN_FANOUT;
+		numDirs += level;
+	}
+	gen->dirs = calloc(numDirs, sizeof(GenDir));
+	gen->dirs[0].path = joinPath("", "");
+	gen->dirs[0].parent = -1;
+	gen->numDirs = 1;
+
+	// breadth-first, so each level of directories follows the one above
+	int d;
+	for (d = 0; gen->numDirs < numDirs; d++) {
+		for (k = 0; k < GEN_FANOUT; k++) {
+			char name[9];
+			sprintf(name, "D%d", k + 1);
+			GenDir* dir = &gen->dirs[gen->numDirs++];
+			dir->path = joinPath(gen->dirs[d].path, name);
+			dir->parent = d;
+			gen->dirs[d].numSubdirs++;
+		}
+	}
+
+	// a fixed root directory takes files only while it has room
+	int fixedRoot = params->fatType != 32;
+	gen->files = calloc(params->numFiles > 0 ? params->numFiles : 1, sizeof(GenFile));
+	int f;
+	for (f = 0; f < params->numFiles; f++) {
+		GenFile* file = &gen->files[f];
+		file->dir = f % numDirs;
+		if (file->dir == 0 && fixedRoot && gen->dirs[0].numSubdirs + gen->dirs[0].numFiles >= GEN_ROOT_ENTRIES) {
+			if (numDirs == 1) {
+				return 0;
+			}
+			file->dir = 1;
+		}
+		gen->dirs[file->dir].numFiles++;
+
+		char name[16];
+		sprintf(name, "F%07d.DAT", f);
+		file->path = joinPath(gen->dirs[file->dir].path, name);
+		file->size = (long)(randomFraction(gen) * 2 * params->meanFileSize);
+	}
+	return 1;
+}
+
+/**
+ * Creates a synthetic disk image
+ *
+ * @param filename Where to write the image
+ * @param params What to put in it
+ * @param livePaths Receives the path of every file left in place, one per
+ *                  line, or NULL
+ * @param deletedPaths Receives the path of every deleted file, one per line
+ *                     and with the first letter it had, or NULL
+ * @param stats Receives what was generated
+ * @return 1 on success, 0 if the parameters are out of range, the files
+ *         do not fit in a volume of the chosen type, or the image could
+ *         not be written
+ */
+int generateImage(const char* filename, const GenParams* params,
+	FILE* livePaths, FILE* deletedPaths, GenStats* stats) {
+	int fatType = params->fatType;
+	int spc = params->sectorsPerCluster;
+	if ((fatType != 12 && fatType != 16 && fatType != 32) || params->numFiles < 0 || params->numFiles > 9999999
+		|| params->depth < 0 || params->depth > 8 || spc < 1 || spc > 128 || (spc & (spc - 1)) != 0
+		|| params->meanFileSize < 0 || params->fragmentation < 0 || params->deletedRatio < 0) {
+		return 0;
+	}
+
+	Generator gen = { 0 };
+	gen.params = params;
+	gen.random = 0x9e3779b97f4a7c15ull ^ params->seed;
+	gen.sizeofCluster = spc * GEN_SECTOR;
+	memset(stats, 0, sizeof(GenStats));
+
+	int ok = planTree(&gen);
+
+	// every directory holds its entries, with "." and ".." in all but the root
+	long needed = 0;
+	int d;
+	for (d = 0; d < gen.numDirs; d++) {
+		GenDir* dir = &gen.dirs[d];
+		int numEntries = dir->numSubdirs + dir->numFiles + (d > 0 ? 2 : 0);
+		dir->entries = malloc(32L * (numEntries > 0 ? numEntries : 1));
+		if (d > 0 || fatType == 32) {
+			dir->numClusters = (32L * numEntries + gen.sizeofCluster - 1) / gen.sizeofCluster;
+			if (dir->numClusters == 0) {
+				dir->numClusters = 1;
+			}
+			needed += dir->numClusters;
+		}
+	}
+	int f;
+	for (f = 0; f < params->numFiles; f++) {
+		needed += (gen.files[f].size + gen.sizeofCluster - 1) / gen.sizeofCluster;
+	}
+
+	// room for the files and for the holes fragmenting them leaves at the end
+	long numClusters = needed + needed / 8 + 2 * GEN_MAX_JUMP;
+	if (fatType == 12 && numClusters > 4084) {
+		ok = 0;
+	} else if (fatType == 16) {
+		numClusters = numClusters < 4085 ? 4085 : numClusters;
+		ok = ok && numClusters <= 65524;
+	} else if (fatType == 32) {
+		numClusters = numClusters < 65525 ? 65525 : numClusters;
+		ok = ok && numClusters <= 0x0ffffff5;
+	}
+
+	FILE* out = NULL;
+	if (ok) {
+		out = fopen(filename, "wb+");
+		ok = out != NULL;
+	}
+
+	if (ok) {
+		gen.numEntries = numClusters + 2;
+		gen.fat = calloc(gen.numEntries, sizeof(uint32_t));
+		gen.fat[0] = 0x0fffff00 | 0xf8;
+		gen.fat[1] = GEN_END;
+		gen.lowestFree = 2;
+
+		long fatBytes = fatType == 12 ? (gen.numEntries * 3 + 1) / 2 : fatType == 16 ? 2L * gen.numEntries : 4L * gen.numEntries;
+		int fatSectors = (fatBytes + GEN_SECTOR - 1) / GEN_SECTOR;
+		int reservedSectors = fatType == 32 ? 32 : 1;
+		int rootSectors = fatType == 32 ? 0 : GEN_ROOT_ENTRIES * 32 / GEN_SECTOR;
+		long rootOffset = (long)(reservedSectors + 2 * fatSectors) * GEN_SECTOR;
+		long dataOffset = rootOffset + (long)rootSectors * GEN_SECTOR;
+		long totalSectors = dataOffset / GEN_SECTOR + numClusters * spc;
+		ok = ftruncate(fileno(out), totalSectors * GEN_SECTOR) == 0;
+
+		// directories first, each in one run, then the files
+		for (d = 0; d < gen.numDirs; d++) {
+			gen.dirs[d].firstCluster = allocateChain(&gen, gen.dirs[d].numClusters, 0);
+		}
+		for (f = 0; f < params->numFiles; f++) {
+			int n = (gen.files[f].size + gen.sizeofCluster - 1) / gen.sizeofCluster;
+			gen.files[f].firstCluster = allocateChain(&gen, n, params->fragmentation);
+		}
+		ok = ok && writeFileData(&gen, out, dataOffset);
+
+		// the entries of each directory: ".", "..", subdirectories, files
+		char name[11];
+		for (d = 1; d < gen.numDirs; d++) {
+			GenDir* dir = &gen.dirs[d];
+			padName(".", "", name);
+			addEntry(dir, name, 0x10, dir->firstCluster, 0);
+			// ".." in a child of the root points at cluster 0, even in FAT32
+			padName("..", "", name);
+			addEntry(dir, name, 0x10, dir->parent > 0 ? gen.dirs[dir->parent].firstCluster : 0, 0);
+			padName(strrchr(dir->path, '/') ? strrchr(dir->path, '/') + 1 : dir->path, "", name);
+			addEntry(&gen.dirs[dir->parent], name, 0x10, dir->firstCluster, 0);
+		}
+		for (f = 0; f < params->numFiles; f++) {
+			GenFile* file = &gen.files[f];
+			char base[16];
+			sprintf(base, "F%07d", f);
+			padName(base, "DAT", name);
+			unsigned char* de = addEntry(&gen.dirs[file->dir], name, 0x20, file->firstCluster, file->size);
+
+			// deleted as DOS does it, leaving the data behind
+			if (params->deletedRatio > 0 && randomFraction(&gen) < params->deletedRatio) {
+				file->deleted = 1;
+				de[0] = 0xe5;
+				int c = file->firstCluster;
+				while (c >= 2 && c < gen.numEntries) {
+					int next = gen.fat[c];
+					gen.fat[c] = 0;
+					c = next;
+				}
+				stats->numDeleted++;
+				stats->deletedBytes += file->size;
+			} else {
+				stats->liveBytes += file->size;
+			}
+			FILE* list = file->deleted ? deletedPaths : livePaths;
+			if (list != NULL) {
+				fprintf(list, "%s\n", file->path);
+			}
+		}
+
+		// directories are written across their clusters in order
+		for (d = 0; d < gen.numDirs && ok; d++) {
+			GenDir* dir = &gen.dirs[d];
+			long len = 32L * dir->numEntries;
+			if (dir->firstCluster == 0) {
+				ok = len == 0 || writeAt(out, rootOffset, dir->entries, len);
+				continue;
+			}
+			int c = dir->firstCluster;
+			long pos;
+			for (pos = 0; pos < len && ok; pos += gen.sizeofCluster) {
+				long n = len - pos < gen.sizeofCluster ? len - pos : gen.sizeofCluster;
+				ok = writeAt(out, dataOffset + (long)(c - 2) * gen.sizeofCluster, dir->entries + pos, n);
+				c = gen.fat[c];
+			}
+		}
+
+		unsigned char* fat = calloc((long)fatSectors * GEN_SECTOR, 1);
+		packFAT(&gen, fat);
+		ok = ok && writeAt(out, (long)reservedSectors * GEN_SECTOR, fat, (long)fatSectors * GEN_SECTOR)
+			&& writeAt(out, (long)(reservedSectors + fatSectors) * GEN_SECTOR, fat, (long)fatSectors * GEN_SECTOR);
+		free(fat);
+
+		unsigned char sector[GEN_SECTOR] = { 0 };
+		fillBootSector(&gen, sector, reservedSectors, fatSectors, totalSectors);
+		ok = ok && writeAt(out, 0, sector, GEN_SECTOR);
+		if (fatType == 32) {
+			ok = ok && writeAt(out, 6L * GEN_SECTOR, sector, GEN_SECTOR);
+
+			long numFree = 0;
+			int c;
+			for (c = 2; c < gen.numEntries; c++) {
+				numFree += gen.fat[c] == 0;
+			}
+			memset(sector, 0, GEN_SECTOR);
+			putLE(sector, 0x41615252, 4);
+			putLE(sector + 484, 0x61417272, 4);
+			putLE(sector + 488, numFree, 4);
+			putLE(sector + 492, gen.lowestFree, 4);
+			putLE(sector + 508, 0xaa550000, 4);
+			ok = ok && writeAt(out, GEN_SECTOR, sector, GEN_SECTOR);
+		}
+
+		stats->numDirs = gen.numDirs - 1;
+		stats->numFiles = params->numFiles;
+		stats->numClusters = numClusters;
+		stats->imageSize = totalSectors * GEN_SECTOR;
+	}
+	if (out != NULL) {
+		ok = fclose(out) == 0 && ok;
+	}
+
+	for (d = 0; d < gen.numDirs; d++) {
+		free(gen.dirs[d].path);
+		free(gen.dirs[d].entries);
+	}
+	for (f = 0; f < params->numFiles && gen.files != NULL; f++) {
+		free(gen.files[f].path);
+	}
+	free(gen.dirs);
+	free(gen.files);
+	free(gen.fat);
+	return ok;
+}
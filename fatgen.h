@@ -0,0 +1,53 @@
+/**
+ * Synthetic FAT12, FAT16 and FAT32 images for benchmarking the tools.
+ *
+ * An image holds a tree of directories `depth` levels deep, each with
+ * GEN_FANOUT subdirectories, and `numFiles` files spread evenly over all
+ * of them. File sizes are drawn uniformly up to twice `meanFileSize`.
+ *
+ * Clusters are handed out the way DOS does it: a file starts at the
+ * lowest free cluster and carries on into the next free one. With
+ * probability `fragmentation` a cluster is instead taken from up to
+ * GEN_MAX_JUMP clusters further on, leaving a hole that later files
+ * fill, so files end up interleaved. A `deletedRatio` share of the files
+ * are deleted afterwards, as DOS deletes them: the first byte of the
+ * name becomes 0xe5 and the chain is zeroed, but the data stays.
+ *
+ * Everything is generated from `seed`, so the same parameters always
+ * give the same image. The volume is made just big enough for its
+ * files, within the cluster counts its FAT type allows.
+ */
+
+#ifndef FATGEN_H
+#define FATGEN_H
+
+#include <stdio.h>
+
+#define GEN_FANOUT 4
+#define GEN_MAX_JUMP 32
+
+typedef struct genparams {
+	int fatType;
+	int numFiles;
+	int depth;
+	double fragmentation;
+	int sectorsPerCluster;
+	double deletedRatio;
+	long meanFileSize;
+	unsigned int seed;
+} GenParams;
+
+typedef struct genstats {
+	int numDirs; // not counting the root directory
+	int numFiles;
+	int numDeleted;
+	long liveBytes; // total size of the files that are not deleted
+	long deletedBytes;
+	int numClusters;
+	long imageSize;
+} GenStats;
+
+int generateImage(const char* filename, const GenParams* params,
+	FILE* livePaths, FILE* deletedPaths, GenStats* stats);
+
+#endif
@@ -0,0 +1,345 @@
+#include <string.h>
+#include <pthread.h>
+#include "fathash.h"
+#include "fatstats.h"
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256Start[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/**
+ * Parses the name of a checksum
+ *
+ * @param name "crc32c" or "sha256"
+ * @return HASH_CRC32C or HASH_SHA256, or -1 if the name is not known
+ */
+int hashAlgorithm(const char* name) {
+	if (strcmp(name, "crc32c") == 0) {
+		return HASH_CRC32C;
+	}
+	if (strcmp(name, "sha256") == 0) {
+		return HASH_SHA256;
+	}
+	return -1;
+}
+
+/**
+ * @param algorithm HASH_CRC32C or HASH_SHA256
+ * @return The name hashAlgorithm takes for it
+ */
+const char* hashName(int algorithm) {
+	return algorithm == HASH_CRC32C ? "crc32c" : "sha256";
+}
+
+/*
+ * CRC32C. The CRC instructions take eight bytes at a time; the portable
+ * version looks up eight bytes at a time in tables built on first use.
+ */
+#if !defined(FAT_NO_SIMD) && defined(__SSE4_2__)
+#include <nmmintrin.h>
+
+static uint32_t crc32cBytes(uint32_t crc, const unsigned char* data, long len) {
+	uint64_t c = crc;
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		c = _mm_crc32_u64(c, word);
+		data += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)c;
+	while (len-- > 0) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return crc;
+}
+#elif !defined(FAT_NO_SIMD) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32cBytes(uint32_t crc, const unsigned char* data, long len) {
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc = __crc32cd(crc, word);
+		data += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = __crc32cb(crc, *data++);
+	}
+	return crc;
+}
+#else
+static uint32_t crcTables[8][256];
+static pthread_once_t crcTablesOnce = PTHREAD_ONCE_INIT;
+
+static void buildCRCTables() {
+	int i;
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		int k;
+		for (k = 0; k < 8; k++) {
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		}
+		crcTables[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		int t;
+		for (t = 1; t < 8; t++) {
+			crcTables[t][i] = (crcTables[t - 1][i] >> 8) ^ crcTables[0][crcTables[t - 1][i] & 0xff];
+		}
+	}
+}
+
+static uint32_t crc32cBytes(uint32_t crc, const unsigned char* data, long len) {
+	pthread_once(&crcTablesOnce, buildCRCTables);
+	while (len >= 8) {
+		uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+		crc = crcTables[7][low & 0xff] ^ crcTables[6][(low >> 8) & 0xff]
+			^ crcTables[5][(low >> 16) & 0xff] ^ crcTables[4][low >> 24]
+			^ crcTables[3][data[4]] ^ crcTables[2][data[5]]
+			^ crcTables[1][data[6]] ^ crcTables[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = (crc >> 8) ^ crcTables[0][(crc ^ *data++) & 0xff];
+	}
+	return crc;
+}
+#endif
+
+/*
+ * SHA-256 compression of whole 64-byte blocks.
+ */
+#if !defined(FAT_NO_SIMD) && defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+
+/**
+ * Compresses blocks with the SHA extensions
+ *
+ * The state is kept as ABEF and CDGH, the order sha256rnds2 wants. Each
+ * group of four rounds takes four message words, and the words for the
+ * groups after the first four are made by msg1 and msg2 as they go.
+ *
+ * @param state The chaining value
+ * @param data The blocks
+ * @param numBlocks How many there are
+ */
+static void sha256Blocks(uint32_t* state, const unsigned char* data, long numBlocks) {
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xb1); // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1b); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+	while (numBlocks-- > 0) {
+		__m128i saved0 = state0;
+		__m128i saved1 = state1;
+		__m128i words[4];
+		int g;
+		for (g = 0; g < 4; g++) {
+			words[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + g * 16)), byteSwap);
+		}
+		for (g = 0; g < 16; g++) {
+			__m128i rounds = _mm_add_epi32(words[g & 3], _mm_loadu_si128((const __m128i*)(sha256K + g * 4)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, rounds);
+			if (g >= 3 && g < 15) {
+				__m128i next = _mm_add_epi32(words[(g + 1) & 3], _mm_alignr_epi8(words[g & 3], words[(g - 1) & 3], 4));
+				words[(g + 1) & 3] = _mm_sha256msg2_epu32(next, words[g & 3]);
+			}
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(rounds, 0x0e));
+			if (g >= 1 && g < 13) {
+				words[(g - 1) & 3] = _mm_sha256msg1_epu32(words[(g - 1) & 3], words[g & 3]);
+			}
+		}
+		state0 = _mm_add_epi32(state0, saved0);
+		state1 = _mm_add_epi32(state1, saved1);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+	_mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, state1, 0xf0)); // DCBA
+	_mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+#else
+static inline uint32_t rotateRight(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+/**
+ * Compresses blocks as FIPS 180-4 gives it
+ *
+ * @param state The chaining value
+ * @param data The blocks
+ * @param numBlocks How many there are
+ */
+static void sha256Blocks(uint32_t* state, const unsigned char* data, long numBlocks) {
+	while (numBlocks-- > 0) {
+		uint32_t w[64];
+		int i;
+		for (i = 0; i < 16; i++) {
+			w[i] = (uint32_t)data[i * 4] << 24 | data[i * 4 + 1] << 16 | data[i * 4 + 2] << 8 | data[i * 4 + 3];
+		}
+		for (i = 16; i < 64; i++) {
+			uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (i = 0; i < 64; i++) {
+			uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25))
+				+ ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+			uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22))
+				+ ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+		data += 64;
+	}
+}
+#endif
+
+/**
+ * @param algorithm HASH_CRC32C or HASH_SHA256
+ * @return The name of the kernel the library was built to use for it
+ */
+const char* hashKernel(int algorithm) {
+	if (algorithm == HASH_CRC32C) {
+#if !defined(FAT_NO_SIMD) && defined(__SSE4_2__)
+		return "sse4.2";
+#elif !defined(FAT_NO_SIMD) && defined(__ARM_FEATURE_CRC32)
+		return "armv8-crc";
+#else
+		return "none";
+#endif
+	}
+#if !defined(FAT_NO_SIMD) && defined(__SHA__) && defined(__SSE4_1__)
+	return "sha-ni";
+#else
+	return "none";
+#endif
+}
+
+/**
+ * Starts a checksum
+ *
+ * @param h The checksum
+ * @param algorithm HASH_CRC32C or HASH_SHA256
+ */
+void startHash(Hasher* h, int algorithm) {
+	h->algorithm = algorithm;
+	h->crc = 0xffffffff;
+	memcpy(h->state, sha256Start, sizeof(sha256Start));
+	h->blockLen = 0;
+	h->length = 0;
+}
+
+/**
+ * Adds the next bytes to a checksum
+ *
+ * @param h The checksum
+ * @param data The bytes
+ * @param len Number of bytes
+ */
+void updateHash(Hasher* h, const unsigned char* data, long len) {
+	h->length += len;
+	countStat(STAT_BYTES_HASHED, len);
+	if (h->algorithm == HASH_CRC32C) {
+		h->crc = crc32cBytes(h->crc, data, len);
+		return;
+	}
+
+	// top up a partial block first, then compress whole blocks in place
+	if (h->blockLen > 0) {
+		int n = 64 - h->blockLen < len ? 64 - h->blockLen : (int)len;
+		memcpy(h->block + h->blockLen, data, n);
+		h->blockLen += n;
+		data += n;
+		len -= n;
+		if (h->blockLen < 64) {
+			return;
+		}
+		sha256Blocks(h->state, h->block, 1);
+		h->blockLen = 0;
+	}
+	sha256Blocks(h->state, data, len / 64);
+	data += len / 64 * 64;
+	h->blockLen = len % 64;
+	memcpy(h->block, data, h->blockLen);
+}
+
+/**
+ * Finishes a checksum
+ *
+ * @param h The checksum, which needs startHash again to be used again
+ * @param hex Receives the checksum in lower case hex;
+ *            must hold HASH_MAX_HEX bytes
+ * @return The length of `hex`
+ */
+int finishHash(Hasher* h, char* hex) {
+	static const char digits[] = "0123456789abcdef";
+	unsigned char digest[HASH_MAX_DIGEST];
+	int len;
+	int i;
+	if (h->algorithm == HASH_CRC32C) {
+		uint32_t crc = ~h->crc;
+		len = 4;
+		for (i = 0; i < 4; i++) {
+			digest[i] = crc >> (24 - 8 * i);
+		}
+	} else {
+		// a 1 bit, zeros up to 8 bytes short of a block, then the bit length
+		uint64_t bits = h->length * 8;
+		h->block[h->blockLen++] = 0x80;
+		if (h->blockLen > 56) {
+			memset(h->block + h->blockLen, 0, 64 - h->blockLen);
+			sha256Blocks(h->state, h->block, 1);
+			h->blockLen = 0;
+		}
+		memset(h->block + h->blockLen, 0, 56 - h->blockLen);
+		for (i = 0; i < 8; i++) {
+			h->block[56 + i] = bits >> (56 - 8 * i);
+		}
+		sha256Blocks(h->state, h->block, 1);
+		len = 32;
+		for (i = 0; i < 32; i++) {
+			digest[i] = h->state[i / 4] >> (24 - 8 * (i % 4));
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0xf];
+	}
+	hex[len * 2] = 0;
+	return len * 2;
+}
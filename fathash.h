@@ -0,0 +1,43 @@
+/**
+ * Checksums of extracted files, worked out as their data streams past.
+ *
+ * CRC32C is the Castagnoli CRC, as used by iSCSI and ext4, and is shown
+ * as eight hex digits. SHA-256 is shown as sha256sum shows it. Both are
+ * updated a chunk at a time, so a file is hashed from the same buffer
+ * it is written from and never read back.
+ *
+ * Where the compiler is allowed to use them, CRC32C runs on the SSE4.2
+ * or ARMv8 CRC instructions and SHA-256 on the x86 SHA extensions;
+ * otherwise, or with FAT_NO_SIMD, portable code is used. hashKernel
+ * tells which.
+ */
+
+#ifndef FATHASH_H
+#define FATHASH_H
+
+#include <stdint.h>
+
+#define HASH_CRC32C 0
+#define HASH_SHA256 1
+
+#define HASH_MAX_DIGEST 32
+// longest hex digest, counting the '\0'
+#define HASH_MAX_HEX (HASH_MAX_DIGEST * 2 + 1)
+
+typedef struct hasher {
+	int algorithm;
+	uint32_t crc;
+	uint32_t state[8]; // SHA-256 chaining value
+	unsigned char block[64]; // SHA-256 input not yet compressed
+	int blockLen;
+	uint64_t length; // bytes hashed so far
+} Hasher;
+
+int hashAlgorithm(const char* name);
+const char* hashName(int algorithm);
+const char* hashKernel(int algorithm);
+void startHash(Hasher* h, int algorithm);
+void updateHash(Hasher* h, const unsigned char* data, long len);
+int finishHash(Hasher* h, char* hex);
+
+#endif
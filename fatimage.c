@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include "fatimage.h"
+#include "faturing.h"
+#include "fatstats.h"
+
+/**
+ * Converts a backend name given on the command line to its constant
+ *
+ * @param name "stdio", "mmap" or "uring"
+ * @return The backend constant, or -1 if `name` is not a backend
+ */
+int imageBackend(const char* name) {
+	if (strcmp(name, "stdio") == 0) {
+		return IMAGE_STDIO;
+	}
+	if (strcmp(name, "mmap") == 0) {
+		return IMAGE_MMAP;
+	}
+	if (strcmp(name, "uring") == 0) {
+		return IMAGE_URING;
+	}
+	return -1;
+}
+
+/**
+ * Reads the rest of a non-seekable stream into memory
+ *
+ * @param img The image whose stream should be read
+ * @return 1 on success, otherwise 0
+ */
+static int slurpImage(Image* img) {
+	long capacity = 1 << 20;
+	unsigned char* data = malloc(capacity);
+	long size = 0;
+	size_t got;
+
+	while (data != NULL && (got = fread(data + size, 1, capacity - size, img->fs)) > 0) {
+		size += got;
+		if (size == capacity) {
+			capacity *= 2;
+			unsigned char* grown = realloc(data, capacity);
+			if (grown == NULL) {
+				free(data);
+			}
+			data = grown;
+		}
+	}
+	if (data == NULL) {
+		return 0;
+	}
+
+	fclose(img->fs);
+	img->fs = NULL;
+	img->map = data;
+	img->size = size;
+	img->mapped = 0;
+	return 1;
+}
+
+/**
+ * Opens a disk image with the requested backend
+ *
+ * If the image cannot be mapped, or io_uring is not available, the stdio
+ * backend is used instead.
+ *
+ * @param filename Path to the disk image
+ * @param writable 1 if the image will be modified, otherwise 0
+ * @param backend IMAGE_STDIO, IMAGE_MMAP or IMAGE_URING
+ * @return The opened image, or NULL if it could not be opened
+ */
+Image* openImage(const char* filename, int writable, int backend) {
+	FILE* fs = fopen(filename, writable ? "r+b" : "rb");
+	if (fs == NULL) {
+		return NULL;
+	}
+
+	Image* img = malloc(sizeof(Image));
+	img->backend = IMAGE_STDIO;
+	img->writable = writable;
+	img->fs = fs;
+	img->map = NULL;
+	img->size = 0;
+	img->mapped = 0;
+	img->rings = NULL;
+	pthread_mutex_init(&img->ringLock, NULL);
+
+	struct stat st;
+	int seekable = fstat(fileno(fs), &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+		&& fseek(fs, 0, SEEK_END) == 0;
+	if (seekable) {
+		img->size = ftell(fs);
+		rewind(fs);
+	} else {
+		// pipes can't seek back, so hold the whole stream in memory
+		if (writable || !slurpImage(img)) {
+			closeImage(img);
+			return NULL;
+		}
+		img->backend = IMAGE_MMAP;
+		return img;
+	}
+
+	if (backend == IMAGE_MMAP && img->size > 0) {
+		int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+		void* map = mmap(NULL, img->size, prot, MAP_SHARED, fileno(fs), 0);
+		if (map != MAP_FAILED) {
+			img->map = map;
+			img->mapped = 1;
+			img->backend = IMAGE_MMAP;
+		}
+	}
+
+	if (backend == IMAGE_URING) {
+		img->rings = openURing();
+		if (img->rings != NULL) {
+			img->backend = IMAGE_URING;
+		}
+	}
+
+	return img;
+}
+
+/**
+ * Gets `len` bytes of the image starting at `offset`
+ *
+ * With the mmap backend the returned pointer points into the mapping and
+ * `buffer` is left untouched; otherwise the bytes are read into `buffer`.
+ * Either way the result must be treated as read-only. Bytes past the end
+ * of the image read as zero.
+ *
+ * @param img The image to read from
+ * @param offset Byte offset into the image
+ * @param len Number of bytes wanted
+ * @param buffer Space for at least `len` bytes, used by the stdio backend
+ * @return A pointer to the requested bytes
+ */
+unsigned char* getImageSector(Image* img, long offset, int len, unsigned char* buffer) {
+	countStat(STAT_READS, 1);
+	countStat(STAT_BYTES_READ, len);
+	if (img->map != NULL) {
+		if (offset >= 0 && offset + len <= img->size) {
+			return img->map + offset;
+		}
+		long avail = img->size - offset;
+		if (avail < 0 || offset < 0) {
+			avail = 0;
+		}
+		memcpy(buffer, img->map + offset, avail);
+		memset(buffer + avail, 0, len - avail);
+		return buffer;
+	}
+
+	// positioned reads leave the shared file offset alone,
+	// so one image can be read from several threads at once
+	int got = 0;
+	ssize_t n;
+	while (got < len && (n = pread(fileno(img->fs), buffer + got, len - got, offset + got)) > 0) {
+		countStat(STAT_READ_CALLS, 1);
+		got += n;
+	}
+	if (got < len) {
+		memset(buffer + got, 0, len - got);
+	}
+	return buffer;
+}
+
+/**
+ * Copies `len` bytes of the image starting at `offset` into `dest`
+ *
+ * @param img The image to read from
+ * @param offset Byte offset into the image
+ * @param len Number of bytes to copy
+ * @param dest Where to put the bytes
+ */
+void readImage(Image* img, long offset, int len, void* dest) {
+	unsigned char* src = getImageSector(img, offset, len, dest);
+	if (src != dest) {
+		memcpy(dest, src, len);
+	}
+}
+
+#ifdef __linux__
+/**
+ * Copies part of an unmapped image to `out` without going through user space
+ *
+ * copy_file_range is tried first and sendfile second. Either may copy
+ * part of the range before failing, so `offset` and `len` are updated
+ * to describe whatever is left.
+ *
+ * @param img The image to copy from
+ * @param offset Byte offset into the image, advanced past the copied bytes
+ * @param len Number of bytes to copy, reduced by the copied bytes
+ * @param out The file to append to
+ */
+static void copyImageInKernel(Image* img, long* offset, long* len, FILE* out) {
+	int in = fileno(img->fs);
+	int fd = fileno(out);
+	ssize_t n = 0;
+	fflush(out);
+#ifdef SYS_copy_file_range
+	loff_t inOffset = *offset;
+	while (*len > 0 && (n = syscall(SYS_copy_file_range, in, &inOffset, fd, NULL, *len, 0)) > 0) {
+		countStat(STAT_READ_CALLS, 1);
+		countStat(STAT_BYTES_READ, n);
+		*offset += n;
+		*len -= n;
+	}
+#endif
+	off_t fileOffset = *offset;
+	while (*len > 0 && (n = sendfile(fd, in, &fileOffset, *len)) > 0) {
+		countStat(STAT_READ_CALLS, 1);
+		countStat(STAT_BYTES_READ, n);
+		*offset += n;
+		*len -= n;
+	}
+}
+#endif
+
+/**
+ * Appends `len` bytes of the image starting at `offset` to `out`
+ *
+ * Mapped images are written straight out of the mapping. Unmapped images
+ * are copied inside the kernel where possible, otherwise they are read
+ * in chunks of up to IMAGE_COPY_CHUNK bytes.
+ *
+ * @param img The image to copy from
+ * @param offset Byte offset into the image
+ * @param len Number of bytes to copy
+ * @param out The file to append to
+ * @return 1 on success, otherwise 0
+ */
+int copyImage(Image* img, long offset, long len, FILE* out) {
+#ifdef __linux__
+	if (img->map == NULL && offset >= 0 && offset + len <= img->size) {
+		countStat(STAT_READS, 1);
+		copyImageInKernel(img, &offset, &len, out);
+	}
+#endif
+	unsigned char* buffer = NULL;
+	if (len > 0) {
+		buffer = malloc(len < IMAGE_COPY_CHUNK ? len : IMAGE_COPY_CHUNK);
+		countStat(STAT_ALLOCATIONS, 1);
+	}
+	int ok = 1;
+	while (len > 0 && ok) {
+		int chunk = len < IMAGE_COPY_CHUNK ? len : IMAGE_COPY_CHUNK;
+		unsigned char* data = getImageSector(img, offset, chunk, buffer);
+		ok = fwrite(data, chunk, 1, out) == 1;
+		offset += chunk;
+		len -= chunk;
+	}
+	free(buffer);
+	return ok;
+}
+
+/**
+ * Takes an idle ring, creating one if every ring is in use
+ *
+ * @param img An image with the uring backend
+ * @return The ring, or NULL if none can be created
+ */
+static URing* acquireRing(Image* img) {
+	pthread_mutex_lock(&img->ringLock);
+	URing* ring = img->rings;
+	if (ring != NULL) {
+		img->rings = ring->next;
+	}
+	pthread_mutex_unlock(&img->ringLock);
+	return ring != NULL ? ring : openURing();
+}
+
+static void releaseRing(Image* img, URing* ring) {
+	pthread_mutex_lock(&img->ringLock);
+	ring->next = img->rings;
+	img->rings = ring;
+	pthread_mutex_unlock(&img->ringLock);
+}
+
+/**
+ * Carries out a batch of reads
+ *
+ * With the uring backend the reads are all submitted before waiting for
+ * any of them; otherwise they are made one after another.
+ *
+ * @param img The image to read from
+ * @param reads What to read and where to put it
+ * @param count Number of reads
+ */
+void readImageBatch(Image* img, ImageRead* reads, int count) {
+	if (img->backend == IMAGE_URING) {
+		URing* ring = acquireRing(img);
+		if (ring != NULL) {
+			int ok = uringReadBatch(ring, fileno(img->fs), reads, count);
+			releaseRing(img, ring);
+			if (ok) {
+				int r;
+				for (r = 0; r < count; r++) {
+					countStat(STAT_BYTES_READ, reads[r].len);
+				}
+				countStat(STAT_READS, count);
+				countStat(STAT_READ_CALLS, 1);
+				return;
+			}
+		}
+	}
+	int r;
+	for (r = 0; r < count; r++) {
+		readImage(img, reads[r].offset, reads[r].len, reads[r].dest);
+	}
+}
+
+/**
+ * Appends several parts of the image to `out`, one after another
+ *
+ * With the uring backend the parts are copied through io_uring, with
+ * reads and writes of many chunks in flight at once; otherwise each part
+ * is copied as by copyImage.
+ *
+ * @param img The image to copy from
+ * @param ranges The parts to copy
+ * @param count Number of parts
+ * @param out The file to append to
+ * @return 1 on success, otherwise 0
+ */
+int copyImageRanges(Image* img, const ImageRange* ranges, int count, FILE* out) {
+	if (img->backend == IMAGE_URING && fflush(out) == 0) {
+		off_t start = ftello(out);
+		URing* ring = start >= 0 ? acquireRing(img) : NULL;
+		if (ring != NULL) {
+			long total = 0;
+			int r;
+			for (r = 0; r < count; r++) {
+				total += ranges[r].len;
+			}
+			int ok = uringCopy(ring, fileno(img->fs), ranges, count, fileno(out), start);
+			releaseRing(img, ring);
+			countStat(STAT_READS, count);
+			countStat(STAT_BYTES_READ, total);
+			countStat(STAT_READ_CALLS, 1);
+			return fseeko(out, start + total, SEEK_SET) == 0 && ok;
+		}
+	}
+	int ok = 1;
+	int r;
+	for (r = 0; r < count && ok; r++) {
+		ok = copyImage(img, ranges[r].offset, ranges[r].len, out);
+	}
+	return ok;
+}
+
+/**
+ * Hands parts of the image to a callback a chunk at a time, in order
+ *
+ * Mapped images are handed over straight from the mapping; otherwise each
+ * chunk is read into one buffer, so it is still in cache when `sink` sees it.
+ *
+ * @param img The image to read from
+ * @param ranges Byte ranges of the image
+ * @param count Number of ranges
+ * @param sink Called with each chunk; returns 0 to stop
+ * @param context Passed to `sink`
+ * @return 1 on success, otherwise 0 if `sink` stopped
+ */
+int streamImageRanges(Image* img, const ImageRange* ranges, int count, ImageSink sink, void* context) {
+	unsigned char* buffer = NULL;
+	if (img->map == NULL) {
+		buffer = malloc(IMAGE_COPY_CHUNK);
+		countStat(STAT_ALLOCATIONS, 1);
+	}
+	int ok = 1;
+	int r;
+	for (r = 0; r < count && ok; r++) {
+		long offset = ranges[r].offset;
+		long len = ranges[r].len;
+		while (len > 0 && ok) {
+			int chunk = len < IMAGE_COPY_CHUNK ? len : IMAGE_COPY_CHUNK;
+			unsigned char* data = getImageSector(img, offset, chunk, buffer);
+			ok = sink(data, chunk, context);
+			offset += chunk;
+			len -= chunk;
+		}
+	}
+	free(buffer);
+	return ok;
+}
+
+/**
+ * Writes `len` bytes into the image at `offset`
+ *
+ * @param img The image to modify, opened as writable
+ * @param offset Byte offset into the image
+ * @param data The bytes to write
+ * @param len Number of bytes to write
+ * @return 1 on success, otherwise 0
+ */
+int writeImage(Image* img, long offset, const void* data, int len) {
+	if (!img->writable || offset < 0 || (img->map != NULL && offset + len > img->size)) {
+		return 0;
+	}
+	if (img->map != NULL) {
+		memcpy(img->map + offset, data, len);
+		return 1;
+	}
+	countStat(STAT_SEEKS, 1);
+	if (fseek(img->fs, offset, SEEK_SET) != 0) {
+		return 0;
+	}
+	// flush now so that later positioned reads see the change
+	return fwrite(data, len, 1, img->fs) == 1 && fflush(img->fs) == 0;
+}
+
+/**
+ * Tells the kernel that part of the image will be read soon
+ *
+ * This only starts the read; nothing waits for it.
+ *
+ * @param img The image
+ * @param offset Byte offset into the image
+ * @param len Number of bytes that will be wanted
+ */
+void adviseImage(Image* img, long offset, long len) {
+	if (offset < 0 || len <= 0) {
+		return;
+	}
+	if (img->mapped) {
+		// madvise needs a page aligned start
+		long page = sysconf(_SC_PAGESIZE);
+		long start = offset / page * page;
+		if (start < img->size) {
+			long end = offset + len < img->size ? offset + len : img->size;
+			madvise(img->map + start, end - start, MADV_WILLNEED);
+		}
+	} else if (img->fs != NULL) {
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fileno(img->fs), offset, len, POSIX_FADV_WILLNEED);
+#endif
+	}
+}
+
+/**
+ * Waits until every change made to an image has reached the disk
+ *
+ * @param img The image to sync, opened as writable
+ * @return 1 on success, otherwise 0
+ */
+int syncImage(Image* img) {
+	if (img->mapped) {
+		return msync(img->map, img->size, MS_SYNC) == 0;
+	}
+	if (img->fs == NULL) {
+		return 1;
+	}
+	return fflush(img->fs) == 0 && fsync(fileno(img->fs)) == 0;
+}
+
+/**
+ * Unmaps and closes a disk image, writing back any changes
+ *
+ * @param img The image to close
+ */
+void closeImage(Image* img) {
+	if (img->map != NULL) {
+		if (img->mapped) {
+			if (img->writable) {
+				msync(img->map, img->size, MS_SYNC);
+			}
+			munmap(img->map, img->size);
+		} else {
+			free(img->map);
+		}
+	}
+	if (img->fs != NULL) {
+		fclose(img->fs);
+	}
+	while (img->rings != NULL) {
+		URing* next = img->rings->next;
+		closeURing(img->rings);
+		img->rings = next;
+	}
+	pthread_mutex_destroy(&img->ringLock);
+	free(img);
+}
+
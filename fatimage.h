@@ -0,0 +1,88 @@
+/**
+ * Disk image access shared by the msdos tools.
+ *
+ * Three backends are available:
+ *  stdio	a positioned read for every request (the default)
+ *  mmap	the whole image is mapped once and sector requests return
+ *		pointers straight into the mapping, so no copy is made and
+ *		no syscall is issued per sector
+ *  uring	Linux only; single requests are served as with stdio, but
+ *		batches of reads and whole file copies are submitted through
+ *		io_uring with many requests in flight at once
+ *
+ * Inputs that cannot be seeked (pipes, fifos) are read into memory once
+ * when they are opened and are then served the same way as a mapping.
+ */
+
+#ifndef FATIMAGE_H
+#define FATIMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define IMAGE_STDIO 0
+#define IMAGE_MMAP 1
+#define IMAGE_URING 2
+
+// largest single read made when copying out of an unmapped image
+#define IMAGE_COPY_CHUNK (1 << 20)
+
+typedef struct image {
+	int backend;
+	int writable;
+	FILE* fs; // NULL once the image is held in memory
+	unsigned char* map; // mapping or in-memory copy of the whole image
+	long size;
+	int mapped; // 1 if `map` came from mmap, 0 if it was malloc'd
+	struct uring* rings; // idle io_uring instances, for the uring backend
+	pthread_mutex_t ringLock;
+} Image;
+
+// one of a batch of reads
+typedef struct imageread {
+	long offset;
+	int len;
+	unsigned char* dest;
+} ImageRead;
+
+// part of the image to be copied
+typedef struct imagerange {
+	long offset;
+	long len;
+} ImageRange;
+
+// takes the next chunk of a streamed range; returns 0 to stop the stream
+typedef int (*ImageSink)(const unsigned char* data, long len, void* context);
+
+// little-endian integers in the files the tools keep beside an image
+static inline void putLE(unsigned char* dest, uint64_t value, int len) {
+	int i;
+	for (i = 0; i < len; i++) {
+		dest[i] = value >> (8 * i);
+	}
+}
+
+static inline uint64_t getLE(const unsigned char* src, int len) {
+	uint64_t value = 0;
+	int i;
+	for (i = 0; i < len; i++) {
+		value |= (uint64_t)src[i] << (8 * i);
+	}
+	return value;
+}
+
+int imageBackend(const char* name);
+Image* openImage(const char* filename, int writable, int backend);
+unsigned char* getImageSector(Image* img, long offset, int len, unsigned char* buffer);
+void readImage(Image* img, long offset, int len, void* dest);
+void readImageBatch(Image* img, ImageRead* reads, int count);
+int copyImage(Image* img, long offset, long len, FILE* out);
+int copyImageRanges(Image* img, const ImageRange* ranges, int count, FILE* out);
+int streamImageRanges(Image* img, const ImageRange* ranges, int count, ImageSink sink, void* context);
+int writeImage(Image* img, long offset, const void* data, int len);
+void adviseImage(Image* img, long offset, long len);
+int syncImage(Image* img);
+void closeImage(Image* img);
+
+#endif
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fatindex.h"
+
+/*
+ * Index layout, all integers little-endian:
+ *  DIR_INDEX_MAGIC	8 bytes
+ *  volume serial	8 bytes
+ *  FAT checksum	8 bytes
+ *  image size	8 bytes
+ *  mtime seconds	8 bytes
+ *  mtime nanoseconds	8 bytes
+ *  directory count	4 bytes
+ *  entry count	4 bytes
+ * then for each directory:
+ *  key	8 bytes
+ *  entry count	4 bytes
+ * then every directory's entries, in the same order:
+ *  offset in image	8 bytes
+ *  entry	32 bytes
+ */
+#define INDEX_HEADER 56
+#define INDEX_DIR 12
+#define INDEX_ENTRY 40
+
+/**
+ * Hashes the active FAT
+ *
+ * @param img The disk image
+ * @param info The volume
+ * @return The 64-bit FNV-1a hash of the FAT's bytes
+ */
+static uint64_t checksumFAT(Image* img, FATInfo* info) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	long remaining = (long)info->numFATSectors * info->sizeofSector;
+	long offset = info->fatOffset;
+
+	unsigned char* buffer = malloc(IMAGE_COPY_CHUNK);
+	while (remaining > 0) {
+		int len = remaining < IMAGE_COPY_CHUNK ? remaining : IMAGE_COPY_CHUNK;
+		const unsigned char* fat = getImageSector(img, offset, len, buffer);
+		int i;
+		for (i = 0; i < len; i++) {
+			hash = (hash ^ fat[i]) * 0x100000001b3ull;
+		}
+		offset += len;
+		remaining -= len;
+	}
+	free(buffer);
+	return hash;
+}
+
+/**
+ * Records what a saved index has to match
+ *
+ * @param index The index
+ * @param img The disk image, which must be a file
+ * @param info The volume
+ * @return 1 on success, 0 if the image is not a file
+ */
+static int stampDirIndex(DirIndex* index, Image* img, FATInfo* info) {
+	struct stat st;
+	if (img->fs == NULL || fstat(fileno(img->fs), &st) != 0) {
+		return 0;
+	}
+	index->volumeSerial = info->volumeSerial;
+	index->fatChecksum = checksumFAT(img, info);
+	index->imageSize = st.st_size;
+	index->mtimeSec = st.st_mtim.tv_sec;
+	index->mtimeNsec = st.st_mtim.tv_nsec;
+	return 1;
+}
+
+static int slotOf(DirIndex* index, long key) {
+	int mask = index->numSlots - 1;
+	int s = (int)((unsigned long)key * 0x9e3779b1u) & mask;
+	while (index->slots[s] >= 0 && index->dirs[index->slots[s]].key != key) {
+		s = (s + 1) & mask;
+	}
+	return s;
+}
+
+static long dirKey(int cluster, int maxClusters) {
+	return (long)cluster * 2 + (maxClusters > 0);
+}
+
+/**
+ * Finds a directory in an index
+ *
+ * @param index The index
+ * @param cluster The cluster the directory starts at
+ * @param maxClusters As passed to scanDirectory
+ * @return The directory, or NULL if it has not been recorded
+ */
+IndexedDir* findIndexedDir(DirIndex* index, int cluster, int maxClusters) {
+	int s = slotOf(index, dirKey(cluster, maxClusters));
+	return index->slots[s] >= 0 ? &index->dirs[index->slots[s]] : NULL;
+}
+
+/**
+ * Records a directory's entries in an index
+ *
+ * The pointer returned may move when the next directory is added, but
+ * the entries it points to stay put until the index is freed.
+ *
+ * @param index The index
+ * @param cluster The cluster the directory starts at
+ * @param maxClusters As passed to scanDirectory
+ * @param entries The directory's entries in use; copied
+ * @param count Number of entries
+ * @return The recorded directory
+ */
+IndexedDir* addIndexedDir(DirIndex* index, int cluster, int maxClusters,
+	const IndexedEntry* entries, int count
+) {
+	if (index->numDirs == index->capacity) {
+		index->capacity = index->capacity ? index->capacity * 2 : 64;
+		index->dirs = realloc(index->dirs, index->capacity * sizeof(IndexedDir));
+	}
+	// keep the hash at most half full
+	if ((index->numDirs + 1) * 2 > index->numSlots) {
+		index->numSlots *= 2;
+		index->slots = realloc(index->slots, index->numSlots * sizeof(int));
+		memset(index->slots, -1, index->numSlots * sizeof(int));
+		int d;
+		for (d = 0; d < index->numDirs; d++) {
+			index->slots[slotOf(index, index->dirs[d].key)] = d;
+		}
+	}
+
+	IndexedDir* dir = &index->dirs[index->numDirs];
+	dir->key = dirKey(cluster, maxClusters);
+	dir->entries = arenaAlloc(index->arena, (count + 1) * sizeof(IndexedEntry));
+	memcpy(dir->entries, entries, count * sizeof(IndexedEntry));
+	dir->numEntries = count;
+	index->slots[slotOf(index, dir->key)] = index->numDirs++;
+
+	index->dirty = 1;
+	free(index->byOffset);
+	index->byOffset = NULL;
+	return dir;
+}
+
+/**
+ * Reads a saved index, if it is still valid for the image
+ *
+ * @param index The index, already stamped with the image's current state
+ *              unless `checkStamp` is 0
+ * @param checkStamp 1 to load the index only if it matches the stamp,
+ *                   0 to load it whatever image it was saved from and
+ *                   take the stamp it was saved with
+ * @return 1 if the saved directories were loaded, otherwise 0
+ */
+static int loadDirIndex(DirIndex* index, int checkStamp) {
+	FILE* in = fopen(index->filename, "rb");
+	if (in == NULL) {
+		return 0;
+	}
+
+	unsigned char header[INDEX_HEADER];
+	int ok = fread(header, sizeof(header), 1, in) == 1
+		&& memcmp(header, DIR_INDEX_MAGIC, 8) == 0;
+	if (ok && !checkStamp) {
+		index->volumeSerial = getLE(header + 8, 8);
+		index->fatChecksum = getLE(header + 16, 8);
+		index->imageSize = getLE(header + 24, 8);
+		index->mtimeSec = getLE(header + 32, 8);
+		index->mtimeNsec = getLE(header + 40, 8);
+	}
+	ok = ok
+		&& (long)getLE(header + 8, 8) == index->volumeSerial
+		&& getLE(header + 16, 8) == index->fatChecksum
+		&& (long)getLE(header + 24, 8) == index->imageSize
+		&& (long)getLE(header + 32, 8) == index->mtimeSec
+		&& (long)getLE(header + 40, 8) == index->mtimeNsec;
+	if (!ok) {
+		fclose(in);
+		return 0;
+	}
+
+	// a damaged or foreign file can claim any counts, so they must fit in it
+	int numDirs = getLE(header + 48, 4);
+	int numEntries = getLE(header + 52, 4);
+	struct stat st;
+	if (fstat(fileno(in), &st) != 0 || numDirs < 0 || numEntries < 0
+		|| (long)numDirs * INDEX_DIR + (long)numEntries * INDEX_ENTRY > (long)st.st_size - INDEX_HEADER
+	) {
+		fclose(in);
+		return 0;
+	}
+	unsigned char* dirs = malloc((long)numDirs * INDEX_DIR + 1);
+	unsigned char* raw = malloc((long)numEntries * INDEX_ENTRY + 1);
+	IndexedEntry* entries = malloc(((long)numEntries + 1) * sizeof(IndexedEntry));
+	ok = dirs != NULL && raw != NULL && entries != NULL
+		&& fread(dirs, INDEX_DIR, numDirs, in) == (size_t)numDirs
+		&& fread(raw, INDEX_ENTRY, numEntries, in) == (size_t)numEntries;
+
+	int e;
+	for (e = 0; e < numEntries && ok; e++) {
+		entries[e].posInFile = getLE(raw + (long)e * INDEX_ENTRY, 8);
+		memcpy(&entries[e].entry, raw + (long)e * INDEX_ENTRY + 8, sizeof(DirectoryEntry));
+	}
+
+	int d;
+	int first = 0;
+	for (d = 0; d < numDirs && ok; d++) {
+		long key = getLE(dirs + d * INDEX_DIR, 8);
+		int count = getLE(dirs + d * INDEX_DIR + 8, 4);
+		if (count < 0 || count > numEntries - first) {
+			ok = 0;
+			break;
+		}
+		addIndexedDir(index, key / 2, key % 2, entries + first, count);
+		first += count;
+	}
+
+	free(entries);
+	free(raw);
+	free(dirs);
+	fclose(in);
+	index->dirty = !ok;
+	return ok;
+}
+
+static DirIndex* newDirIndex(const char* filename) {
+	DirIndex* index = calloc(1, sizeof(DirIndex));
+	index->filename = strdup(filename);
+	index->numSlots = 64;
+	index->slots = malloc(index->numSlots * sizeof(int));
+	memset(index->slots, -1, index->numSlots * sizeof(int));
+	index->arena = newArena(64 * 1024);
+	return index;
+}
+
+/**
+ * Attaches an index to a volume, reading it if it has been saved before
+ *
+ * If there is no valid saved index an empty one is returned and filled
+ * in as directories are scanned.
+ *
+ * @param img The disk image
+ * @param info The volume
+ * @param filename Where the index is kept
+ * @return The index, or NULL if the image can't be indexed (it is not a
+ *         file)
+ */
+DirIndex* openDirIndex(Image* img, FATInfo* info, const char* filename) {
+	DirIndex* index = newDirIndex(filename);
+	if (!stampDirIndex(index, img, info)) {
+		freeDirIndex(index);
+		return NULL;
+	}
+
+	index->loaded = loadDirIndex(index, 1);
+	if (!index->loaded) {
+		// start again from nothing
+		resetArena(index->arena);
+		index->numDirs = 0;
+		memset(index->slots, -1, index->numSlots * sizeof(int));
+		index->dirty = 1;
+	}
+	return index;
+}
+
+/**
+ * Reads a saved index without checking it against any image
+ *
+ * This gives the directories as they were when the index was saved,
+ * to compare the image with as it is now.
+ *
+ * @param filename Where the index is kept
+ * @return The index, or NULL if there is no readable index there
+ */
+DirIndex* readDirIndex(const char* filename) {
+	DirIndex* index = newDirIndex(filename);
+	index->loaded = loadDirIndex(index, 0);
+	if (!index->loaded) {
+		freeDirIndex(index);
+		return NULL;
+	}
+	return index;
+}
+
+static int compareOffsets(const void* a, const void* b) {
+	long x = (*(IndexedEntry* const*)a)->posInFile;
+	long y = (*(IndexedEntry* const*)b)->posInFile;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Applies a change made to the image to any recorded entries it covers
+ *
+ * @param index The index
+ * @param offset Byte offset of the change in the image
+ * @param data The bytes written
+ * @param len Number of bytes written
+ */
+void updateDirIndex(DirIndex* index, long offset, const void* data, int len) {
+	if (index->byOffset == NULL) {
+		int total = 0;
+		int d;
+		for (d = 0; d < index->numDirs; d++) {
+			total += index->dirs[d].numEntries;
+		}
+		index->byOffset = malloc((total + 1) * sizeof(IndexedEntry*));
+		index->numByOffset = 0;
+		for (d = 0; d < index->numDirs; d++) {
+			int e;
+			for (e = 0; e < index->dirs[d].numEntries; e++) {
+				index->byOffset[index->numByOffset++] = &index->dirs[d].entries[e];
+			}
+		}
+		qsort(index->byOffset, index->numByOffset, sizeof(IndexedEntry*), compareOffsets);
+	}
+
+	const unsigned char* bytes = data;
+	int sizeofDirEntry = sizeof(DirectoryEntry);
+	// entries are aligned, so only whole entries need looking up
+	long start;
+	for (start = offset - offset % sizeofDirEntry; start < offset + len; start += sizeofDirEntry) {
+		IndexedEntry key = { start };
+		IndexedEntry* keyPtr = &key;
+		IndexedEntry** hit = bsearch(&keyPtr, index->byOffset, index->numByOffset,
+			sizeof(IndexedEntry*), compareOffsets);
+		if (hit == NULL) {
+			continue;
+		}
+		long from = offset > start ? offset : start;
+		long to = offset + len < start + sizeofDirEntry ? offset + len : start + sizeofDirEntry;
+		memcpy((unsigned char*)&(*hit)->entry + (from - start), bytes + (from - offset), to - from);
+		index->dirty = 1;
+	}
+}
+
+/**
+ * Writes an index out if it has changed
+ *
+ * Call this once every change to the image has been written, so that
+ * the index is stamped with the image as it is left.
+ *
+ * @param index The index
+ * @param img The disk image
+ * @param info The volume
+ * @return 1 on success, otherwise 0
+ */
+int saveDirIndex(DirIndex* index, Image* img, FATInfo* info) {
+	if (!index->dirty) {
+		return 1;
+	}
+	if (img->writable && !syncImage(img)) {
+		return 0;
+	}
+	if (!stampDirIndex(index, img, info)) {
+		return 0;
+	}
+
+	// write beside the old index and then replace it,
+	// so a reader never sees half an index
+	char* temp = malloc(strlen(index->filename) + 5);
+	sprintf(temp, "%s.new", index->filename);
+	FILE* out = fopen(temp, "wb");
+	if (out == NULL) {
+		free(temp);
+		return 0;
+	}
+
+	int numEntries = 0;
+	int d;
+	for (d = 0; d < index->numDirs; d++) {
+		numEntries += index->dirs[d].numEntries;
+	}
+
+	unsigned char header[INDEX_HEADER];
+	memcpy(header, DIR_INDEX_MAGIC, 8);
+	putLE(header + 8, index->volumeSerial, 8);
+	putLE(header + 16, index->fatChecksum, 8);
+	putLE(header + 24, index->imageSize, 8);
+	putLE(header + 32, index->mtimeSec, 8);
+	putLE(header + 40, index->mtimeNsec, 8);
+	putLE(header + 48, index->numDirs, 4);
+	putLE(header + 52, numEntries, 4);
+	int ok = fwrite(header, sizeof(header), 1, out) == 1;
+
+	for (d = 0; d < index->numDirs && ok; d++) {
+		unsigned char dir[INDEX_DIR];
+		putLE(dir, index->dirs[d].key, 8);
+		putLE(dir + 8, index->dirs[d].numEntries, 4);
+		ok = fwrite(dir, sizeof(dir), 1, out) == 1;
+	}
+	for (d = 0; d < index->numDirs && ok; d++) {
+		int e;
+		for (e = 0; e < index->dirs[d].numEntries && ok; e++) {
+			unsigned char entry[INDEX_ENTRY];
+			putLE(entry, index->dirs[d].entries[e].posInFile, 8);
+			memcpy(entry + 8, &index->dirs[d].entries[e].entry, sizeof(DirectoryEntry));
+			ok = fwrite(entry, sizeof(entry), 1, out) == 1;
+		}
+	}
+
+	ok = fclose(out) == 0 && ok;
+	ok = ok && rename(temp, index->filename) == 0;
+	if (!ok) {
+		remove(temp);
+	}
+	free(temp);
+
+	if (ok) {
+		index->dirty = 0;
+	}
+	return ok;
+}
+
+/**
+ * Frees an index without saving it
+ *
+ * @param index The index to free
+ */
+void freeDirIndex(DirIndex* index) {
+	if (index == NULL) {
+		return;
+	}
+	free(index->filename);
+	free(index->dirs);
+	free(index->slots);
+	free(index->byOffset);
+	freeArena(index->arena);
+	free(index);
+}
@@ -0,0 +1,69 @@
+/**
+ * Sidecar index of a volume's directories.
+ *
+ * While an index is attached to a volume, scanDirectory records every
+ * directory it reads: each entry in use, deleted or not, together with
+ * its byte offset in the image. The index is saved beside the image and
+ * on later runs scanDirectory visits the recorded entries without
+ * reading the directories again.
+ *
+ * A saved index is only trusted if the volume serial number, a checksum
+ * of the active FAT and the image's size and modification time all
+ * match what was recorded. Tools that change directory entries keep the
+ * index up to date with updateDirIndex and save it again afterwards.
+ * readDirIndex reads a saved index without these checks, as a record of
+ * the directories when it was saved.
+ */
+
+#ifndef FATINDEX_H
+#define FATINDEX_H
+
+#include <stdint.h>
+#include "fat.h"
+
+#define DIR_INDEX_MAGIC "FATDIR01"
+
+typedef struct indexedentry {
+	long posInFile;
+	DirectoryEntry entry;
+} IndexedEntry;
+
+typedef struct indexeddir {
+	long key; // starting cluster, doubled, plus 1 for a FAT12/16 root
+	IndexedEntry* entries;
+	int numEntries;
+} IndexedDir;
+
+typedef struct dirindex {
+	char* filename;
+
+	// what the image must still match for the index to be used
+	long volumeSerial;
+	uint64_t fatChecksum;
+	long imageSize;
+	long mtimeSec;
+	long mtimeNsec;
+
+	IndexedDir* dirs;
+	int numDirs;
+	int capacity;
+	int* slots; // hash of key to index in `dirs`, -1 if free
+	int numSlots;
+	Arena* arena; // owns every entry
+
+	int loaded; // 1 if read from a saved index
+	int dirty; // 1 if it has changed since it was read
+	IndexedEntry** byOffset; // every entry by posInFile, built when needed
+	int numByOffset;
+} DirIndex;
+
+DirIndex* openDirIndex(Image* img, FATInfo* info, const char* filename);
+DirIndex* readDirIndex(const char* filename);
+IndexedDir* findIndexedDir(DirIndex* index, int cluster, int maxClusters);
+IndexedDir* addIndexedDir(DirIndex* index, int cluster, int maxClusters,
+	const IndexedEntry* entries, int count);
+void updateDirIndex(DirIndex* index, long offset, const void* data, int len);
+int saveDirIndex(DirIndex* index, Image* img, FATInfo* info);
+void freeDirIndex(DirIndex* index);
+
+#endif
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "fatlookup.h"
+#include "fatstats.h"
+
+/**
+ * Checks a directory entry against one component of a path
+ *
+ * @param de The entry
+ * @param longName The entry's long name, or NULL if it has none
+ * @param component The component, not necessarily ending in a '\0'
+ * @param len Length of `component`
+ * @param deleted LOOKUP_DELETED to match deleted entries instead of
+ *                entries in use, ignoring the first letter of the short name
+ * @return 1 if the entry matches, otherwise 0
+ */
+static int matchComponent(const DirectoryEntry* de, const LongName* longName,
+	const char* component, int len, int deleted
+) {
+	if (de->attributes & ATTR_VOLUME_LABEL || de->filename[0] == DIRECTORY) {
+		return 0;
+	}
+	if ((de->filename[0] == DELETED) != (deleted == LOOKUP_DELETED)) {
+		return 0;
+	}
+
+	// a deleted long name is whole, unlike the short name
+	if (longName != NULL && longName->nameLen == len
+		&& strncasecmp(longName->name, component, len) == 0
+	) {
+		return 1;
+	}
+	char name[13];
+	int nameLen = entryName(de, name);
+	if (nameLen != len || len == 0) {
+		return 0;
+	}
+	int skip = deleted == LOOKUP_DELETED ? 1 : 0;
+	return strncasecmp(name + skip, component + skip, len - skip) == 0;
+}
+
+/**
+ * Looks through entries of a directory for one component of a path
+ *
+ * @param entries The entries
+ * @param numEntries How many there are
+ * @param posInFile Byte offset of `entries` in the image
+ * @param component The component
+ * @param len Length of `component`
+ * @param deleted As for matchComponent
+ * @param longName Long name slots found so far in the directory; left
+ *                 holding the matching entry's long name, if it has one
+ * @param named Receives 1 if the matching entry has a long name, otherwise 0
+ * @return The position of the matching entry, -1 if the directory goes on
+ *         past `entries` without one, or -2 if it ends within them
+ */
+static int findComponent(const DirectoryEntry* entries, int numEntries, long posInFile,
+	const char* component, int len, int deleted, LongName* longName, int* named
+) {
+	int e;
+	for (e = 0; e < numEntries; e++) {
+		if (entries[e].filename[0] == NOT_USED) {
+			countStat(STAT_ENTRIES, e);
+			return -2;
+		}
+		if (isLongNameSlot(&entries[e])) {
+			addLongNameSlot(longName, &entries[e], posInFile + e * (long)sizeof(DirectoryEntry));
+			continue;
+		}
+		*named = finishLongName(longName, &entries[e]);
+		if (matchComponent(&entries[e], *named ? longName : NULL, component, len, deleted)) {
+			countStat(STAT_ENTRIES, e + 1);
+			return e;
+		}
+		longName->numSlots = 0;
+	}
+	countStat(STAT_ENTRIES, numEntries);
+	return -1;
+}
+
+/**
+ * Finds the entry for one component of a path in a directory
+ *
+ * @param img The disk image
+ * @param info The volume
+ * @param cluster The cluster the directory starts at
+ * @param maxClusters Sectors in the FAT12/16 root directory, otherwise 0
+ * @param component The component
+ * @param len Length of `component`
+ * @param deleted As for matchComponent
+ * @param found Receives the entry, where it is and its long name
+ * @return 1 if the entry was found, otherwise 0
+ */
+static int findInDirectory(Image* img, FATInfo* info, int cluster, int maxClusters,
+	const char* component, int len, int deleted, FoundEntry* found
+) {
+	int sizeofBlock = maxClusters > 0 ? info->sizeofSector : info->sizeofCluster;
+	int maxBlocks = maxClusters;
+	long offset = (long)info->sizeofSector * getAbsoluteCluster(info, cluster);
+	if (maxClusters == 0) {
+		// a chain longer than the largest directory allowed must loop
+		maxBlocks = (MAX_DIRECTORY_ENTRIES * (long)sizeof(DirectoryEntry) + sizeofBlock - 1) / sizeofBlock;
+		if (!isChainCluster(info->table, cluster)) {
+			return 0;
+		}
+		offset = getClusterOffset(info, cluster);
+	}
+
+	// only written to if the image is not mapped
+	Sector buffer = malloc(sizeofBlock);
+	int result = 0;
+	int named = 0;
+	found->slots.numSlots = 0;
+	int block;
+	for (block = 0; block < maxBlocks; block++) {
+		Sector data = getImageSector(img, offset, sizeofBlock, buffer);
+		const DirectoryEntry* entries = (const DirectoryEntry*)data;
+		int e = findComponent(entries, sizeofBlock / sizeof(DirectoryEntry), offset,
+			component, len, deleted, &found->slots, &named);
+		if (e >= 0) {
+			found->entry = entries[e];
+			found->posInFile = offset + e * (long)sizeof(DirectoryEntry);
+			found->longName = named ? &found->slots : NULL;
+			result = 1;
+			break;
+		}
+		if (e == -2) {
+			break;
+		}
+
+		if (maxClusters > 0) {
+			offset += sizeofBlock;
+		} else {
+			cluster = getNextCluster(info, cluster);
+			if (!isChainCluster(info->table, cluster)) {
+				break;
+			}
+			offset = getClusterOffset(info, cluster);
+		}
+	}
+	free(buffer);
+	return result;
+}
+
+/**
+ * Adds a directory's name to the end of a path
+ *
+ * @param path The path, with room for the name
+ * @param pathLen Length of `path`
+ * @param name The name
+ * @param nameLen Length of `name`
+ * @return The new length of `path`
+ */
+static int appendComponent(char* path, int pathLen, const char* name, int nameLen) {
+	if (pathLen > 0) {
+		path[pathLen++] = '/';
+	}
+	memcpy(path + pathLen, name, nameLen + 1);
+	return pathLen + nameLen;
+}
+
+/**
+ * Finds the directory entry at a path
+ *
+ * @param img The disk image
+ * @param info The volume
+ * @param path Path from the root directory, such as DOCS/REPORT.TXT;
+ *             a leading '/' is allowed
+ * @param deleted LOOKUP_LIVE or LOOKUP_DELETED, for the last component
+ * @param found Receives the entry, where it is, its long name and the
+ *              path of its directory, by long and by short names
+ * @return 1 if the entry was found, otherwise 0
+ */
+int lookupPath(Image* img, FATInfo* info, const char* path, int deleted, FoundEntry* found) {
+	int cluster = info->rootCluster;
+	int maxClusters = info->numRootClusters;
+	int parentLen = 0;
+	int shortParentLen = 0;
+	found->parent[0] = 0;
+	found->shortParent[0] = 0;
+	while (*path == '/') {
+		path++;
+	}
+	if (*path == 0) {
+		return 0;
+	}
+
+	while (1) {
+		const char* slash = strchr(path, '/');
+		int len = slash != NULL ? slash - path : (int)strlen(path);
+		int last = slash == NULL || slash[1] == 0;
+		if (!findInDirectory(img, info, cluster, maxClusters, path, len,
+			last ? deleted : LOOKUP_LIVE, found)
+		) {
+			return 0;
+		}
+		if (last) {
+			return 1;
+		}
+
+		// only directories the walk would scan are looked in
+		if (!(found->entry.attributes & ATTR_SUB_DIR)
+			|| found->entry.attributes & (ATTR_HIDDEN | ATTR_SYSTEM_FILE)
+		) {
+			return 0;
+		}
+		char name[ENTRY_NAME_MAX];
+		int nameLen = entryLongName(&found->entry, found->longName, name);
+		char shortName[13];
+		int shortNameLen = entryName(&found->entry, shortName);
+		if (parentLen + nameLen + 2 > LOOKUP_MAX_PATH
+			|| shortParentLen + shortNameLen + 2 > LOOKUP_MAX_PATH
+		) {
+			return 0;
+		}
+		parentLen = appendComponent(found->parent, parentLen, name, nameLen);
+		shortParentLen = appendComponent(found->shortParent, shortParentLen, shortName, shortNameLen);
+		cluster = getEntryCluster(info, &found->entry);
+		maxClusters = 0;
+		path = slash + 1;
+	}
+}
@@ -0,0 +1,37 @@
+/**
+ * Finding one entry by its path without walking the whole tree.
+ *
+ * Only the directories named in the path are read, a sector of the
+ * FAT12/16 root directory or a cluster of any other directory at a time.
+ * Reading a directory stops at the entry that matches the next component
+ * of the path, or at the first entry that was never used, since no entry
+ * after it is in use either.
+ *
+ * Components are matched against long names and short names such as
+ * REPORT.TXT, ignoring case. Every directory on the way must be there and not be
+ * deleted, hidden or a system directory, as for the directory walk.
+ * Volume labels and the "." and ".." entries are never matched.
+ */
+
+#ifndef FATLOOKUP_H
+#define FATLOOKUP_H
+
+#include "fat.h"
+
+#define LOOKUP_LIVE 0 // the last component is an entry in use
+#define LOOKUP_DELETED 1 // it is a deleted entry, whatever its first letter was
+
+#define LOOKUP_MAX_PATH 4096
+
+typedef struct foundentry {
+	DirectoryEntry entry;
+	long posInFile; // byte offset of the entry in the image
+	const LongName* longName; // the entry's long name, NULL if it has none
+	char parent[LOOKUP_MAX_PATH]; // path of its directory as named on disk, "" for the root
+	char shortParent[LOOKUP_MAX_PATH]; // the same by short names
+	LongName slots; // where long names are collected
+} FoundEntry;
+
+int lookupPath(Image* img, FATInfo* info, const char* path, int deleted, FoundEntry* found);
+
+#endif
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fnmatch.h>
+#include "fatpattern.h"
+
+#ifndef FNM_CASEFOLD
+#define FNM_CASEFOLD 0
+#endif
+
+/**
+ * Adds a pattern to a list
+ *
+ * Leading '/'s are dropped, since every path is taken from the root
+ * directory, and empty patterns are ignored.
+ *
+ * @param list The list to add to, not yet matched against
+ * @param pattern The pattern; copied
+ */
+void addPattern(PatternList* list, const char* pattern) {
+	while (*pattern == '/') {
+		pattern++;
+	}
+	if (*pattern == 0) {
+		return;
+	}
+
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 16;
+		list->patterns = realloc(list->patterns, list->capacity * sizeof(char*));
+		list->matches = realloc(list->matches, list->capacity * sizeof(int));
+	}
+	list->patterns[list->count] = strdup(pattern);
+	list->matches[list->count] = 0;
+	list->count++;
+}
+
+/**
+ * Copies the patterns of a list into an empty one
+ *
+ * Matching counts each pattern's matches in the list, so every thread
+ * matching at the same time needs a copy of its own.
+ *
+ * @param dest The empty list to fill
+ * @param src The list to copy; its match counts are not copied
+ */
+void copyPatterns(PatternList* dest, const PatternList* src) {
+	int p;
+	for (p = 0; p < src->count; p++) {
+		addPattern(dest, src->patterns[p]);
+	}
+	dest->anyFirstLetter = src->anyFirstLetter;
+}
+
+/**
+ * Adds every line of a file to a list of patterns
+ *
+ * @param list The list to add to, not yet matched against
+ * @param filename The file to read, or "-" for stdin
+ * @return 1 on success, 0 if the file could not be opened
+ */
+int readPatterns(PatternList* list, const char* filename) {
+	FILE* in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	if (in == NULL) {
+		return 0;
+	}
+
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	while ((len = getline(&line, &capacity, in)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = 0;
+		}
+		addPattern(list, line);
+	}
+	free(line);
+
+	if (in != stdin) {
+		fclose(in);
+	}
+	return 1;
+}
+
+/**
+ * Finds the last component of a path
+ *
+ * @param path The path
+ * @return A pointer to the character after the last '/', or `path`
+ */
+const char* finalName(const char* path) {
+	const char* slash = strrchr(path, '/');
+	return slash != NULL ? slash + 1 : path;
+}
+
+/**
+ * Checks if a pattern has any wildcards
+ *
+ * @param pattern The pattern
+ * @return 1 if it may match more than one path, 0 if it is a plain path
+ */
+int hasWildcards(const char* pattern) {
+	return strpbrk(pattern, "*?[\\") != NULL;
+}
+
+/**
+ * Checks if every pattern in a list is a plain path
+ *
+ * @param list The patterns
+ * @return 1 if there are patterns and none has wildcards, otherwise 0
+ */
+int onlyPlainPaths(const PatternList* list) {
+	int p;
+	for (p = 0; p < list->count; p++) {
+		if (hasWildcards(list->patterns[p])) {
+			return 0;
+		}
+	}
+	return list->count > 0;
+}
+
+static int comparePaths(const void* a, const void* b) {
+	return strcasecmp(((const LiteralPattern*)a)->pattern, ((const LiteralPattern*)b)->pattern);
+}
+
+/*
+ * Orders paths by their directory, then by their name without its first
+ * character, so a path and a pattern that differ only in that character
+ * compare equal.
+ */
+static int comparePathsAnyFirst(const void* a, const void* b) {
+	const char* x = ((const LiteralPattern*)a)->pattern;
+	const char* y = ((const LiteralPattern*)b)->pattern;
+	const char* nameX = finalName(x);
+	const char* nameY = finalName(y);
+
+	int lenX = nameX - x;
+	int lenY = nameY - y;
+	int c = strncasecmp(x, y, lenX < lenY ? lenX : lenY);
+	if (c != 0 || lenX != lenY) {
+		return c != 0 ? c : lenX - lenY;
+	}
+	return strcasecmp(*nameX ? nameX + 1 : nameX, *nameY ? nameY + 1 : nameY);
+}
+
+/**
+ * Splits a list into sorted plain paths and patterns with wildcards
+ *
+ * @param list The list to index
+ */
+static void indexPatterns(PatternList* list) {
+	list->literals = malloc((list->count + 1) * sizeof(LiteralPattern));
+	list->globs = malloc((list->count + 1) * sizeof(int));
+	list->numLiterals = 0;
+	list->numGlobs = 0;
+
+	int p;
+	for (p = 0; p < list->count; p++) {
+		if (hasWildcards(list->patterns[p])) {
+			list->globs[list->numGlobs++] = p;
+		} else {
+			list->literals[list->numLiterals].pattern = list->patterns[p];
+			list->literals[list->numLiterals].index = p;
+			list->numLiterals++;
+		}
+	}
+	qsort(list->literals, list->numLiterals, sizeof(LiteralPattern),
+		list->anyFirstLetter ? comparePathsAnyFirst : comparePaths);
+}
+
+/**
+ * Checks a path against every pattern in a list
+ *
+ * Each pattern that matches has its count in `matches` increased.
+ *
+ * @param list The patterns
+ * @param path A path from the root directory, such as DOCS/REPORT.TXT
+ * @return The position in the list of the first pattern that matches,
+ *         or -1 if none do
+ */
+int matchPatterns(PatternList* list, const char* path) {
+	if (list->literals == NULL) {
+		indexPatterns(list);
+	}
+	int (*compare)(const void*, const void*) = list->anyFirstLetter ? comparePathsAnyFirst : comparePaths;
+	int found = -1;
+
+	LiteralPattern key = { path, -1 };
+	LiteralPattern* hit = bsearch(&key, list->literals, list->numLiterals, sizeof(LiteralPattern), compare);
+	if (hit != NULL) {
+		// the same path may have been given more than once
+		while (hit > list->literals && compare(&key, hit - 1) == 0) {
+			hit--;
+		}
+		for (; hit < list->literals + list->numLiterals && compare(&key, hit) == 0; hit++) {
+			list->matches[hit->index]++;
+			if (found < 0 || hit->index < found) {
+				found = hit->index;
+			}
+		}
+	}
+
+	if (list->numGlobs == 0) {
+		return found;
+	}
+
+	char* candidate = strdup(path);
+	int nameAt = finalName(path) - path;
+	int g;
+	for (g = 0; g < list->numGlobs; g++) {
+		int p = list->globs[g];
+		if (list->anyFirstLetter) {
+			// use the pattern's letter, if it has one where the name starts
+			const char* patternName = finalName(list->patterns[p]);
+			if (candidate[nameAt] == 0 || *patternName == 0) {
+				continue;
+			}
+			candidate[nameAt] = *patternName;
+		}
+		if (fnmatch(list->patterns[p], candidate, FNM_PATHNAME | FNM_PERIOD | FNM_CASEFOLD) == 0) {
+			list->matches[p]++;
+			if (found < 0 || p < found) {
+				found = p;
+			}
+		}
+	}
+	free(candidate);
+	return found;
+}
+
+/**
+ * Frees a list of patterns
+ *
+ * @param list The list to free; left empty
+ */
+void freePatterns(PatternList* list) {
+	int p;
+	for (p = 0; p < list->count; p++) {
+		free(list->patterns[p]);
+	}
+	free(list->patterns);
+	free(list->matches);
+	free(list->literals);
+	free(list->globs);
+	memset(list, 0, sizeof(PatternList));
+}
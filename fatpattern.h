@@ -0,0 +1,47 @@
+/**
+ * Path patterns for the batch modes of the msdos tools.
+ *
+ * Patterns are shell globs matched against a file's path from the root
+ * directory, such as *.BAK or DOCS/REPORT.TXT. Matching ignores case, as FAT short
+ * names do, and a wildcard never crosses a '/'.
+ *
+ * Patterns without wildcards are kept sorted and found by binary search,
+ * so a list of thousands of plain paths costs one lookup per file rather
+ * than one comparison per pattern.
+ */
+
+#ifndef FATPATTERN_H
+#define FATPATTERN_H
+
+typedef struct literalpattern {
+	const char* pattern;
+	int index; // position of the pattern in its list
+} LiteralPattern;
+
+typedef struct patternlist {
+	char** patterns;
+	int* matches; // how many files each pattern has matched
+	int count;
+	int capacity;
+
+	// when set, the first character of each file's name is taken to be
+	// unknown and the one in the pattern is used in its place
+	int anyFirstLetter;
+
+	// built the first time the list is matched against
+	LiteralPattern* literals; // sorted
+	int numLiterals;
+	int* globs;
+	int numGlobs;
+} PatternList;
+
+void addPattern(PatternList* list, const char* pattern);
+int readPatterns(PatternList* list, const char* filename);
+void copyPatterns(PatternList* dest, const PatternList* src);
+int matchPatterns(PatternList* list, const char* path);
+const char* finalName(const char* path);
+int hasWildcards(const char* pattern);
+int onlyPlainPaths(const PatternList* list);
+void freePatterns(PatternList* list);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "fatstats.h"
+
+atomic_long fatStats[NUM_STATS];
+atomic_long fatPhaseNanos[NUM_PHASES];
+
+static const char* statNames[NUM_STATS] = {
+	"reads", "bytes_read", "read_calls", "seeks", "fat_loads", "entries", "allocations",
+	"bytes_hashed"
+};
+
+static const char* phaseNames[NUM_PHASES] = {
+	"boot", "walk", "extract", "check", "write"
+};
+
+/**
+ * Parses the name of a statistics format
+ *
+ * @param name "text" or "json"
+ * @return 0 for text, 1 for JSON, or -1 if the name is not known
+ */
+int statsFormat(const char* name) {
+	if (strcmp(name, "text") == 0) {
+		return 0;
+	}
+	if (strcmp(name, "json") == 0) {
+		return 1;
+	}
+	return -1;
+}
+
+/**
+ * @return A monotonic timestamp in nanoseconds, for endPhase
+ */
+long startPhase() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Adds the time since a phase started to its total
+ *
+ * @param phase The phase
+ * @param start What startPhase returned when the phase started
+ */
+void endPhase(int phase, long start) {
+	atomic_fetch_add_explicit(&fatPhaseNanos[phase], startPhase() - start, memory_order_relaxed);
+}
+
+/**
+ * Prints every counter and phase time
+ *
+ * @param out Where to print them
+ * @param json 1 for one JSON object, 0 for a line each
+ */
+void printStats(FILE* out, int json) {
+	int i;
+	if (json) {
+		fprintf(out, "{");
+		for (i = 0; i < NUM_STATS; i++) {
+			fprintf(out, "\"%s\":%ld,", statNames[i], atomic_load(&fatStats[i]));
+		}
+		fprintf(out, "\"seconds\":{");
+		for (i = 0; i < NUM_PHASES; i++) {
+			fprintf(out, "%s\"%s\":%.6f", i > 0 ? "," : "", phaseNames[i], atomic_load(&fatPhaseNanos[i]) / 1e9);
+		}
+		fprintf(out, "}}\n");
+		return;
+	}
+	for (i = 0; i < NUM_STATS; i++) {
+		fprintf(out, "%-12s %ld\n", statNames[i], atomic_load(&fatStats[i]));
+	}
+	for (i = 0; i < NUM_PHASES; i++) {
+		fprintf(out, "%-12s %.6f s\n", phaseNames[i], atomic_load(&fatPhaseNanos[i]) / 1e9);
+	}
+}
@@ -0,0 +1,51 @@
+/**
+ * Counters for the hot paths of the msdos tools.
+ *
+ * The library counts what it does as it goes: reads from the image and
+ * the bytes they cover, the system calls that carried them out, seeks
+ * before writes, loads of FAT data, directory entries decoded, heap
+ * allocations and bytes checksummed. Tools add the time spent in each
+ * phase of a run. Every counter is a relaxed atomic add, cheap enough to
+ * be always on, and counts across all threads and images of a run.
+ *
+ * With the mmap backend reads are served from the mapping, so they need
+ * no system calls. Phase times are summed over the threads that ran
+ * them, so they can add up to more than the run took.
+ */
+
+#ifndef FATSTATS_H
+#define FATSTATS_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define STAT_READS 0 // reads of the image asked for
+#define STAT_BYTES_READ 1
+#define STAT_READ_CALLS 2 // pread, copy_file_range, sendfile and io_uring submissions
+#define STAT_SEEKS 3
+#define STAT_FAT_LOADS 4 // whole FAT12/16 tables and FAT32 cache pages read
+#define STAT_ENTRIES 5 // directory entries decoded
+#define STAT_ALLOCATIONS 6
+#define STAT_BYTES_HASHED 7 // file data run through a checksum
+#define NUM_STATS 8
+
+#define PHASE_BOOT 0 // boot sector and FAT
+#define PHASE_WALK 1 // directory tree
+#define PHASE_EXTRACT 2
+#define PHASE_CHECK 3 // msdosundel's validity checks
+#define PHASE_WRITE 4 // flushing changes to the image
+#define NUM_PHASES 5
+
+extern atomic_long fatStats[NUM_STATS];
+extern atomic_long fatPhaseNanos[NUM_PHASES];
+
+static inline void countStat(int stat, long n) {
+	atomic_fetch_add_explicit(&fatStats[stat], n, memory_order_relaxed);
+}
+
+int statsFormat(const char* name);
+long startPhase();
+void endPhase(int phase, long start);
+void printStats(FILE* out, int json);
+
+#endif
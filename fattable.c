@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include "fattable.h"
+#include "fatstats.h"
+
+/**
+ * Unpacks FAT12 entries one pair at a time
+ *
+ * Every three bytes hold two entries: UV WX YZ --> XUV YZW
+ *
+ * @param fat The raw FAT
+ * @param next Receives `count` decoded entries
+ * @param count The number of entries to decode
+ */
+void decodeFAT12Scalar(const unsigned char* fat, uint16_t* next, int count) {
+	int i;
+	for (i = 0; i + 1 < count; i += 2) {
+		const unsigned char* b = fat + i / 2 * 3;
+		next[i] = b[0] | ((b[1] & 0x0f) << 8);
+		next[i + 1] = (b[1] >> 4) | (b[2] << 4);
+	}
+	if (i < count) {
+		const unsigned char* b = fat + i / 2 * 3;
+		next[i] = b[0] | ((b[1] & 0x0f) << 8);
+	}
+}
+
+/*
+ * The vector kernels below all work the same way: each three-byte pair
+ * is widened into a 32-bit lane, the low entry is masked out of bits
+ * 0-11 and the high entry is shifted from bits 12-23 up to 16-27, which
+ * leaves the two entries side by side as 16-bit values.
+ *
+ * A kernel stops while enough input remains for its last (over-wide)
+ * load, so the scalar loop always finishes the table.
+ */
+#if !defined(FAT_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+
+/**
+ * Unpacks FAT12 entries sixteen at a time with AVX2
+ *
+ * @param fat The raw FAT
+ * @param next Receives `count` decoded entries
+ * @param count The number of entries to decode
+ * @return The number of entries decoded
+ */
+static int decodeFAT12Vector(const unsigned char* fat, uint16_t* next, int count) {
+	const __m256i spread = _mm256_setr_epi8(
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i lowMask = _mm256_set1_epi32(0x00000fff);
+	const __m256i highMask = _mm256_set1_epi32(0x0fff0000);
+	int i;
+	// 24 bytes are used but 28 are loaded
+	for (i = 0; i + 19 <= count; i += 16) {
+		const unsigned char* b = fat + i / 2 * 3;
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)b)),
+			_mm_loadu_si128((const __m128i*)(b + 12)), 1);
+		v = _mm256_shuffle_epi8(v, spread);
+		v = _mm256_or_si256(_mm256_and_si256(v, lowMask),
+			_mm256_and_si256(_mm256_slli_epi32(v, 4), highMask));
+		_mm256_storeu_si256((__m256i*)(next + i), v);
+	}
+	return i;
+}
+#elif !defined(FAT_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+
+/**
+ * Unpacks FAT12 entries eight at a time with SSE2
+ *
+ * SSE2 has no byte shuffle, so the pairs are lined up with whole-register
+ * byte shifts and interleaved into 32-bit lanes.
+ *
+ * @param fat The raw FAT
+ * @param next Receives `count` decoded entries
+ * @param count The number of entries to decode
+ * @return The number of entries decoded
+ */
+static int decodeFAT12Vector(const unsigned char* fat, uint16_t* next, int count) {
+	const __m128i lowMask = _mm_set1_epi32(0x00000fff);
+	const __m128i highMask = _mm_set1_epi32(0x0fff0000);
+	int i;
+	// 12 bytes are used but 16 are loaded
+	for (i = 0; i + 11 <= count; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(fat + i / 2 * 3));
+		__m128i lo = _mm_unpacklo_epi32(x, _mm_srli_si128(x, 3));
+		__m128i hi = _mm_unpacklo_epi32(_mm_srli_si128(x, 6), _mm_srli_si128(x, 9));
+		__m128i v = _mm_unpacklo_epi64(lo, hi);
+		v = _mm_or_si128(_mm_and_si128(v, lowMask),
+			_mm_and_si128(_mm_slli_epi32(v, 4), highMask));
+		_mm_storeu_si128((__m128i*)(next + i), v);
+	}
+	return i;
+}
+#elif !defined(FAT_NO_SIMD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+/**
+ * Unpacks FAT12 entries sixteen at a time with NEON
+ *
+ * vld3 already splits the pairs into their first, second and third bytes,
+ * so no widening trick is needed here.
+ *
+ * @param fat The raw FAT
+ * @param next Receives `count` decoded entries
+ * @param count The number of entries to decode
+ * @return The number of entries decoded
+ */
+static int decodeFAT12Vector(const unsigned char* fat, uint16_t* next, int count) {
+	const uint8x8_t nibble = vdup_n_u8(0x0f);
+	int i;
+	for (i = 0; i + 16 <= count; i += 16) {
+		uint8x8x3_t b = vld3_u8(fat + i / 2 * 3);
+		uint16x8x2_t e;
+		e.val[0] = vorrq_u16(vmovl_u8(b.val[0]), vshll_n_u8(vand_u8(b.val[1], nibble), 8));
+		e.val[1] = vorrq_u16(vmovl_u8(vshr_n_u8(b.val[1], 4)), vshll_n_u8(b.val[2], 4));
+		vst2q_u16(next + i, e);
+	}
+	return i;
+}
+#elif !defined(FAT_NO_SIMD)
+#define FAT_NO_SIMD
+#endif
+
+/**
+ * Unpacks FAT12 entries, using the vector kernel when one is available
+ *
+ * @param fat The raw FAT
+ * @param next Receives `count` decoded entries
+ * @param count The number of entries to decode
+ */
+void decodeFAT12(const unsigned char* fat, uint16_t* next, int count) {
+	int done = 0;
+#ifndef FAT_NO_SIMD
+	done = decodeFAT12Vector(fat, next, count);
+#endif
+	// done is always even, so the rest starts on a pair boundary
+	decodeFAT12Scalar(fat + done / 2 * 3, next + done, count - done);
+}
+
+/**
+ * @return The name of the vector kernel used by decodeFAT12,
+ *         or "none" if the library was built without one
+ */
+const char* decodeFAT12Kernel() {
+#ifdef FAT_NO_SIMD
+	return "none";
+#elif defined(__AVX2__)
+	return "avx2";
+#elif defined(__SSE2__)
+	return "sse2";
+#else
+	return "neon";
+#endif
+}
+
+/**
+ * Unpacks little-endian FAT16 entries
+ *
+ * @param fat The raw FAT
+ * @param next Receives `count` decoded entries
+ * @param count The number of entries to decode
+ */
+void decodeFAT16(const unsigned char* fat, uint16_t* next, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		next[i] = fat[2 * i] | (fat[2 * i + 1] << 8);
+	}
+}
+
+/**
+ * Moves a cache slot to the most recently used end of the list
+ *
+ * @param table The FAT32 table
+ * @param slot The slot that was just used
+ */
+static void touchFATPage(FATTable* table, int slot) {
+	FATPage* p = table->cache + slot;
+	if (table->newest == slot) {
+		return;
+	}
+	// unlink
+	if (p->older >= 0) {
+		table->cache[p->older].newer = p->newer;
+	} else {
+		table->oldest = p->newer;
+	}
+	table->cache[p->newer].older = p->older;
+	// and put back in front
+	p->older = table->newest;
+	p->newer = -1;
+	table->cache[table->newest].newer = slot;
+	table->newest = slot;
+}
+
+/**
+ * Reads and decodes a page of a FAT32 table into the least recently used slot
+ *
+ * @param table The FAT32 table, with its lock held
+ * @param page The page to load
+ * @return The slot now holding `page`
+ */
+static int loadFATPage(FATTable* table, int page) {
+	int slot = table->oldest;
+	FATPage* p = table->cache + slot;
+	if (p->page >= 0) {
+		table->pageSlot[p->page] = -1;
+	}
+
+	countStat(STAT_FAT_LOADS, 1);
+	unsigned char buffer[FAT_PAGE_ENTRIES * 4];
+	unsigned char* raw = getImageSector(table->img, table->offset + (long)page * sizeof(buffer),
+		sizeof(buffer), buffer);
+	int i;
+	for (i = 0; i < FAT_PAGE_ENTRIES; i++) {
+		const unsigned char* b = raw + 4 * i;
+		p->entries[i] = (b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24)) & FAT32_ENTRY_MASK;
+	}
+	p->page = page;
+	table->pageSlot[page] = slot;
+	touchFATPage(table, slot);
+	return slot;
+}
+
+/**
+ * Looks up a FAT32 entry that is known to be inside the table
+ *
+ * @param table The FAT32 table, with its lock held if it is not mapped
+ * @param cluster The cluster to look up
+ * @return The entry for `cluster`
+ */
+static int getFAT32Entry(FATTable* table, int cluster) {
+	if (table->map != NULL) {
+		const unsigned char* b = table->map + 4L * cluster;
+		return (b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24)) & FAT32_ENTRY_MASK;
+	}
+	int page = cluster / FAT_PAGE_ENTRIES;
+	int slot = table->pageSlot[page];
+	if (slot < 0) {
+		slot = loadFATPage(table, page);
+	} else {
+		touchFATPage(table, slot);
+	}
+	return table->cache[slot].entries[cluster % FAT_PAGE_ENTRIES];
+}
+
+/**
+ * Reads and decodes the first copy of the FAT
+ *
+ * FAT32 tables are only set up here; their entries are read on demand.
+ *
+ * @param img The disk image, which must stay open while the table is used
+ * @param fatType 12, 16 or 32
+ * @param offset Byte offset of the FAT in the image
+ * @param numBytes Size of one copy of the FAT in bytes
+ * @param numEntries Number of clusters on the disk, including the two reserved ones
+ * @return The decoded table
+ */
+FATTable* loadFATTable(Image* img, int fatType, long offset, long numBytes, int numEntries) {
+	FATTable* table = calloc(1, sizeof(FATTable));
+	table->fatType = fatType;
+
+	// never decode past the end of the FAT itself
+	long capacity = 0;
+	if (fatType == 12) {
+		capacity = numBytes * 2 / 3;
+	} else if (fatType == 16) {
+		capacity = numBytes / 2;
+	} else if (fatType == 32) {
+		capacity = numBytes / 4;
+	}
+	if (numEntries > capacity) {
+		numEntries = capacity;
+	}
+	if (numEntries < 0) {
+		numEntries = 0;
+	}
+	table->numEntries = numEntries;
+
+	if (fatType == 32) {
+		table->img = img;
+		table->offset = offset;
+		if (img->map != NULL && offset + 4L * numEntries <= img->size) {
+			table->map = img->map + offset;
+			return table;
+		}
+
+		int numPages = (numEntries + FAT_PAGE_ENTRIES - 1) / FAT_PAGE_ENTRIES;
+		int cacheSize = numPages < FAT_CACHE_PAGES ? numPages : FAT_CACHE_PAGES;
+		if (cacheSize < 1) {
+			cacheSize = 1;
+		}
+		table->pageSlot = malloc((numPages + 1) * sizeof(int));
+		int i;
+		for (i = 0; i <= numPages; i++) {
+			table->pageSlot[i] = -1;
+		}
+		// every slot starts out empty, linked oldest to newest
+		table->cache = malloc(cacheSize * sizeof(FATPage));
+		for (i = 0; i < cacheSize; i++) {
+			table->cache[i].page = -1;
+			table->cache[i].older = i - 1;
+			table->cache[i].newer = i + 1 < cacheSize ? i + 1 : -1;
+		}
+		table->oldest = 0;
+		table->newest = cacheSize - 1;
+		pthread_mutex_init(&table->lock, NULL);
+		return table;
+	}
+
+	table->next = malloc((numEntries + 1) * sizeof(uint16_t));
+
+	countStat(STAT_FAT_LOADS, 1);
+	unsigned char* buffer = malloc(numBytes);
+	unsigned char* fat = getImageSector(img, offset, numBytes, buffer);
+	if (fatType == 12) {
+		decodeFAT12(fat, table->next, numEntries);
+	} else if (fatType == 16) {
+		decodeFAT16(fat, table->next, numEntries);
+	}
+	free(buffer);
+
+	return table;
+}
+
+/**
+ * Looks up the FAT entry for a cluster
+ *
+ * @param table The decoded FAT
+ * @param cluster The cluster to look up
+ * @return The entry for `cluster`, or 0 if it is outside the FAT
+ */
+int getFATEntry(FATTable* table, int cluster) {
+	if (cluster < 0 || cluster >= table->numEntries) {
+		return 0;
+	}
+	if (table->fatType != 32) {
+		return table->next[cluster];
+	}
+	if (table->cache == NULL) {
+		return getFAT32Entry(table, cluster);
+	}
+	pthread_mutex_lock(&table->lock);
+	int entry = getFAT32Entry(table, cluster);
+	pthread_mutex_unlock(&table->lock);
+	return entry;
+}
+
+/**
+ * Checks if a FAT entry points at another cluster of a chain
+ *
+ * @param table The decoded FAT
+ * @param cluster The FAT entry to check
+ * @return 1 if `cluster` is a usable data cluster, otherwise 0
+ */
+int isChainCluster(FATTable* table, int cluster) {
+	int bad = table->fatType == 12 ? 0xff7 : table->fatType == 16 ? 0xfff7 : 0x0ffffff7;
+	return cluster > 1 && cluster < bad && cluster < table->numEntries;
+}
+
+/**
+ * Follows a cluster chain and merges consecutive clusters into runs
+ *
+ * @param table The decoded FAT
+ * @param start The first cluster of the chain
+ * @param maxClusters Stop after this many clusters, which also stops looping chains
+ * @param chain Receives the runs; zero it before first use and free it with freeClusterChain
+ */
+void getClusterChain(FATTable* table, int start, int maxClusters, ClusterChain* chain) {
+	int cluster = start;
+	chain->numRuns = 0;
+	chain->numClusters = 0;
+
+	// hold the page cache for the whole walk rather than per cluster
+	if (table->cache != NULL) {
+		pthread_mutex_lock(&table->lock);
+	}
+	while (chain->numClusters < maxClusters && isChainCluster(table, cluster)) {
+		if (chain->numRuns > 0 && chain->runs[chain->numRuns - 1].start + chain->runs[chain->numRuns - 1].length == cluster) {
+			chain->runs[chain->numRuns - 1].length++;
+		} else {
+			if (chain->numRuns == chain->capacity) {
+				chain->capacity = chain->capacity ? chain->capacity * 2 : 8;
+				chain->runs = realloc(chain->runs, chain->capacity * sizeof(ClusterRun));
+				countStat(STAT_ALLOCATIONS, 1);
+			}
+			chain->runs[chain->numRuns].start = cluster;
+			chain->runs[chain->numRuns].length = 1;
+			chain->numRuns++;
+		}
+		chain->numClusters++;
+		cluster = table->fatType == 32 ? getFAT32Entry(table, cluster) : table->next[cluster];
+	}
+	if (table->cache != NULL) {
+		pthread_mutex_unlock(&table->lock);
+	}
+}
+
+/**
+ * Frees the runs of a cluster chain
+ *
+ * @param chain The chain to free
+ */
+void freeClusterChain(ClusterChain* chain) {
+	free(chain->runs);
+	chain->runs = NULL;
+	chain->numRuns = 0;
+	chain->capacity = 0;
+	chain->numClusters = 0;
+}
+
+/**
+ * Frees a decoded FAT
+ *
+ * @param table The table to free
+ */
+void freeFATTable(FATTable* table) {
+	if (table->cache != NULL) {
+		pthread_mutex_destroy(&table->lock);
+	}
+	free(table->next);
+	free(table->cache);
+	free(table->pageSlot);
+	free(table);
+}
+
@@ -0,0 +1,79 @@
+/**
+ * Decoded copy of a file allocation table.
+ *
+ * FAT12 and FAT16 tables are read once and every entry is unpacked into
+ * a flat array indexed by cluster number, so following a cluster chain
+ * is plain array indexing with no further I/O or allocation.
+ *
+ * A FAT32 table can be hundreds of megabytes, so it is never loaded
+ * whole. Entries are read straight out of the mapping when the image is
+ * mapped; otherwise the FAT is read in pages of FAT_PAGE_ENTRIES entries
+ * and up to FAT_CACHE_PAGES decoded pages are kept, least recently used
+ * first out.
+ */
+
+#ifndef FATTABLE_H
+#define FATTABLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "fatimage.h"
+
+#define FAT_PAGE_ENTRIES 1024
+#define FAT_CACHE_PAGES 256
+
+// FAT32 entries only use their low 28 bits
+#define FAT32_ENTRY_MASK 0x0fffffff
+
+typedef struct fatpage {
+	int page; // which page of the FAT is held here, -1 if none
+	int newer; // neighbouring slots in least recently used order
+	int older;
+	uint32_t entries[FAT_PAGE_ENTRIES];
+} FATPage;
+
+typedef struct fattable {
+	int fatType;
+	int numEntries;
+	uint16_t* next; // FAT12/16: next[c] is the FAT entry for cluster c
+
+	// FAT32 only
+	Image* img;
+	long offset; // byte offset of the FAT in the image
+	const unsigned char* map; // the raw FAT, if the image is mapped
+	FATPage* cache;
+	int* pageSlot; // for each page of the FAT, its cache slot or -1
+	int newest; // most and least recently used cache slots
+	int oldest;
+	pthread_mutex_t lock; // the cache is shared by extraction threads
+} FATTable;
+
+typedef struct clusterrun {
+	int start;
+	int length; // number of consecutive clusters starting at `start`
+} ClusterRun;
+
+/*
+ * A cluster chain stored as runs of consecutive clusters. The run array
+ * is kept between calls to getClusterChain so it only grows, and the
+ * cluster count is tracked as runs are added.
+ */
+typedef struct clusterchain {
+	ClusterRun* runs;
+	int numRuns;
+	int capacity;
+	int numClusters;
+} ClusterChain;
+
+void decodeFAT12Scalar(const unsigned char* fat, uint16_t* next, int count);
+void decodeFAT12(const unsigned char* fat, uint16_t* next, int count);
+const char* decodeFAT12Kernel();
+void decodeFAT16(const unsigned char* fat, uint16_t* next, int count);
+FATTable* loadFATTable(Image* img, int fatType, long offset, long numBytes, int numEntries);
+int getFATEntry(FATTable* table, int cluster);
+int isChainCluster(FATTable* table, int cluster);
+void getClusterChain(FATTable* table, int start, int maxClusters, ClusterChain* chain);
+void freeClusterChain(ClusterChain* chain);
+void freeFATTable(FATTable* table);
+
+#endif
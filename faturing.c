@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "faturing.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+/**
+ * Creates a ring
+ *
+ * @return The ring, or NULL if the kernel doesn't support io_uring
+ */
+URing* openURing() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	URing* ring = calloc(1, sizeof(URing));
+	ring->fd = fd;
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	int single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && ring->cqRingSize > ring->sqRingSize) {
+		ring->sqRingSize = ring->cqRingSize;
+	}
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	ring->cqRing = single ? ring->sqRing : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQES);
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		closeURing(ring);
+		return NULL;
+	}
+
+	char* sq = ring->sqRing;
+	char* cq = ring->cqRing;
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return ring;
+}
+
+/**
+ * Prepares a vectored read or write of one buffer
+ *
+ * readv and writev are used rather than read and write since they have
+ * been supported for as long as io_uring itself.
+ *
+ * @param ring The ring
+ * @param opcode IORING_OP_READV or IORING_OP_WRITEV
+ * @param fd The file to read or write
+ * @param iov Describes the buffer; must stay put until the request completes
+ * @param offset Byte offset in the file
+ * @param tag Returned with the request's completion
+ */
+static void prepareRequest(URing* ring, int opcode, int fd, struct iovec* iov, long offset, uint64_t tag) {
+	unsigned tail = *ring->sqTail;
+	unsigned slot = tail & ring->sqMask;
+	struct io_uring_sqe* sqe = &ring->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	ring->sqArray[slot] = slot;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+/**
+ * Submits prepared requests and waits for one to complete
+ *
+ * @param ring The ring
+ * @param tag Receives the completed request's tag
+ * @param result Receives its result: bytes transferred or -errno
+ * @return 1 on success, 0 if the ring failed
+ */
+static int waitRequest(URing* ring, uint64_t* tag, int* result) {
+	for (;;) {
+		unsigned head = *ring->cqHead;
+		if (ring->queued == 0 && head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+			*tag = cqe->user_data;
+			*result = cqe->res;
+			__atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+			return 1;
+		}
+
+		int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, ring->queued ? 0 : 1,
+			ring->queued ? 0 : IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			return 0;
+		}
+		ring->queued -= n;
+	}
+}
+
+/**
+ * Reads a batch of ranges of a file, keeping as many reads in flight as
+ * the ring allows
+ *
+ * Bytes past the end of the file read as zero.
+ *
+ * @param ring The ring
+ * @param fd The file to read
+ * @param reads What to read and where to put it
+ * @param count Number of reads
+ * @return 1 on success, otherwise 0
+ */
+int uringReadBatch(URing* ring, int fd, ImageRead* reads, int count) {
+	struct iovec* iovs = malloc((count + 1) * sizeof(struct iovec));
+	int* done = calloc(count + 1, sizeof(int));
+	int next = 0;
+	int inFlight = 0;
+	int ok = 1;
+
+	while (ok && (next < count || inFlight > 0)) {
+		while (next < count && inFlight < URING_DEPTH) {
+			iovs[next].iov_base = reads[next].dest;
+			iovs[next].iov_len = reads[next].len;
+			prepareRequest(ring, IORING_OP_READV, fd, &iovs[next], reads[next].offset, next);
+			next++;
+			inFlight++;
+		}
+
+		uint64_t tag;
+		int result;
+		if (!waitRequest(ring, &tag, &result)) {
+			ok = 0;
+			break;
+		}
+		inFlight--;
+		ImageRead* read = &reads[tag];
+		if (result < 0 && result != -EINTR && result != -EAGAIN) {
+			ok = 0;
+			continue;
+		}
+		if (result == 0) {
+			// the end of the file
+			memset(read->dest + done[tag], 0, read->len - done[tag]);
+			continue;
+		}
+		if (result > 0) {
+			done[tag] += result;
+		}
+		if (done[tag] < read->len) {
+			// short read, ask for the rest
+			iovs[tag].iov_base = read->dest + done[tag];
+			iovs[tag].iov_len = read->len - done[tag];
+			prepareRequest(ring, IORING_OP_READV, fd, &iovs[tag], read->offset + done[tag], tag);
+			inFlight++;
+		}
+	}
+
+	// a failed ring may still hold requests pointing at our buffers
+	while (!ok && inFlight > 0) {
+		uint64_t tag;
+		int result;
+		if (!waitRequest(ring, &tag, &result)) {
+			break;
+		}
+		inFlight--;
+	}
+
+	free(done);
+	free(iovs);
+	return ok;
+}
+
+typedef struct copyslot {
+	int writing; // 0 while the chunk is being read, 1 while it is written
+	long from; // where the chunk starts in the input
+	long to; // where it goes in the output
+	int len;
+	int done; // bytes read or written so far
+	struct iovec iov;
+} CopySlot;
+
+/**
+ * Starts the read, or the rest of the read or write, of a slot's chunk
+ */
+static void continueSlot(URing* ring, CopySlot* slots, int s, int in, int out) {
+	CopySlot* slot = &slots[s];
+	slot->iov.iov_base = ring->buffers + (long)s * URING_CHUNK + slot->done;
+	slot->iov.iov_len = slot->len - slot->done;
+	if (slot->writing) {
+		prepareRequest(ring, IORING_OP_WRITEV, out, &slot->iov, slot->to + slot->done, s);
+	} else {
+		prepareRequest(ring, IORING_OP_READV, in, &slot->iov, slot->from + slot->done, s);
+	}
+}
+
+/**
+ * Copies ranges of one file, one after another, into another file
+ *
+ * The ranges are split into chunks. Each chunk is written at its place
+ * in the output as soon as it has been read, so reads and writes of
+ * different chunks overlap.
+ *
+ * @param ring The ring
+ * @param in The file to copy from
+ * @param ranges The ranges of `in` to copy
+ * @param count Number of ranges
+ * @param out The file to copy to
+ * @param outOffset Where in `out` the first range goes
+ * @return 1 on success, otherwise 0
+ */
+int uringCopy(URing* ring, int in, const ImageRange* ranges, int count, int out, long outOffset) {
+	if (ring->buffers == NULL) {
+		ring->buffers = malloc((long)URING_DEPTH * URING_CHUNK);
+	}
+	CopySlot slots[URING_DEPTH];
+	int freeSlots[URING_DEPTH];
+	int numFree = URING_DEPTH;
+	int s;
+	for (s = 0; s < URING_DEPTH; s++) {
+		freeSlots[s] = s;
+	}
+
+	int range = 0;
+	long pos = 0; // within the current range
+	int inFlight = 0;
+	int ok = 1;
+	for (;;) {
+		// hand out the next chunks to idle buffers
+		while (ok && numFree > 0 && range < count) {
+			if (pos >= ranges[range].len) {
+				range++;
+				pos = 0;
+				continue;
+			}
+			s = freeSlots[--numFree];
+			slots[s].writing = 0;
+			slots[s].from = ranges[range].offset + pos;
+			slots[s].to = outOffset;
+			slots[s].len = ranges[range].len - pos < URING_CHUNK ? ranges[range].len - pos : URING_CHUNK;
+			slots[s].done = 0;
+			continueSlot(ring, slots, s, in, out);
+			inFlight++;
+			pos += slots[s].len;
+			outOffset += slots[s].len;
+		}
+		if (inFlight == 0) {
+			break;
+		}
+
+		uint64_t tag;
+		int result;
+		if (!waitRequest(ring, &tag, &result)) {
+			ok = 0;
+			break;
+		}
+		inFlight--;
+		CopySlot* slot = &slots[tag];
+		if (result == -EINTR || result == -EAGAIN) {
+			result = 0;
+		} else if (result < 0 || (result == 0 && slot->writing)) {
+			ok = 0;
+			freeSlots[numFree++] = tag;
+			continue;
+		} else if (result == 0) {
+			// read past the end of the input, which copies as zeros
+			memset(ring->buffers + (long)tag * URING_CHUNK + slot->done, 0, slot->len - slot->done);
+			result = slot->len - slot->done;
+		}
+
+		slot->done += result;
+		if (slot->done == slot->len) {
+			if (slot->writing) {
+				freeSlots[numFree++] = tag;
+				continue;
+			}
+			slot->writing = 1;
+			slot->done = 0;
+		}
+		if (!ok) {
+			freeSlots[numFree++] = tag;
+			continue;
+		}
+		continueSlot(ring, slots, tag, in, out);
+		inFlight++;
+	}
+	return ok;
+}
+
+/**
+ * Frees a ring
+ *
+ * @param ring The ring to free
+ */
+void closeURing(URing* ring) {
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqesSize);
+	}
+	if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+		munmap(ring->sqRing, ring->sqRingSize);
+	}
+	close(ring->fd);
+	free(ring->buffers);
+	free(ring);
+}
+
+#else
+
+URing* openURing() {
+	return NULL;
+}
+
+int uringReadBatch(URing* ring, int fd, ImageRead* reads, int count) {
+	return 0;
+}
+
+int uringCopy(URing* ring, int in, const ImageRange* ranges, int count, int out, long outOffset) {
+	return 0;
+}
+
+void closeURing(URing* ring) {
+}
+
+#endif
@@ -0,0 +1,51 @@
+/**
+ * Asynchronous reads and copies through io_uring.
+ *
+ * This is the engine behind the uring image backend. It talks to the
+ * kernel through the raw io_uring system calls, so it needs nothing
+ * beyond the kernel headers. Each ring keeps up to URING_DEPTH requests
+ * in flight; a copy moves through URING_DEPTH buffers of URING_CHUNK
+ * bytes, each one written out as soon as its read completes.
+ *
+ * Rings are not shared between threads. On systems without io_uring
+ * openURing fails and the image falls back to the stdio backend.
+ */
+
+#ifndef FATURING_H
+#define FATURING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "fatimage.h"
+
+#define URING_DEPTH 32
+#define URING_CHUNK (128 * 1024)
+
+typedef struct uring {
+	int fd;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sqRing;
+	size_t sqRingSize;
+	void* cqRing; // the same mapping as sqRing on newer kernels
+	size_t cqRingSize;
+	size_t sqesSize;
+	unsigned queued; // requests prepared but not yet submitted
+
+	unsigned char* buffers; // for uringCopy, allocated when first needed
+	struct uring* next; // next idle ring of the same image
+} URing;
+
+URing* openURing();
+int uringReadBatch(URing* ring, int fd, ImageRead* reads, int count);
+int uringCopy(URing* ring, int in, const ImageRange* ranges, int count, int out, long outOffset);
+void closeURing(URing* ring);
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include "fat.h"
+#include "fatusage.h"
+
+#define USAGE_USED 0x01 // allocated to a chain
+#define USAGE_START 0x02 // a directory entry starts a chain here
+#define USAGE_STARTS 0x04 // more than one does
+#define USAGE_LOST 0x08 // no directory entry's chain reaches it
+#define USAGE_CLAIMED 0x10 // at the root of a set: a directory entry starts a chain in it
+
+/**
+ * Finds the set a cluster is in, pointing every cluster on the way
+ * straight at the root
+ *
+ * @param set The union-find parents
+ * @param cluster The cluster
+ * @return The root of its set
+ */
+static int findSet(int* set, int cluster) {
+	int root = cluster;
+	while (set[root] != root) {
+		root = set[root];
+	}
+	while (set[cluster] != root) {
+		int next = set[cluster];
+		set[cluster] = root;
+		cluster = next;
+	}
+	return root;
+}
+
+/**
+ * @param usage The volume
+ * @param cluster A cluster in use
+ * @return The cluster that follows it, or 0 if its chain ends there
+ */
+static int nextInChain(VolumeUsage* usage, int cluster) {
+	FATTable* table = usage->table;
+	int entry = table->fatType != 32 ? table->next[cluster] : getFATEntry(table, cluster);
+	return isChainCluster(table, entry) && (usage->flags[entry] & USAGE_USED) ? entry : 0;
+}
+
+/**
+ * Counts free and bad clusters and groups the rest into chains,
+ * in one pass over the FAT
+ *
+ * @param table The decoded FAT, which must outlive the result
+ * @return What was found, to be completed by addUsageStart and finishUsage
+ */
+VolumeUsage* scanFATUsage(FATTable* table) {
+	VolumeUsage* usage = calloc(1, sizeof(VolumeUsage));
+	int numEntries = table->numEntries;
+	usage->table = table;
+	usage->numEntries = numEntries;
+	usage->set = malloc((numEntries + 1) * sizeof(int));
+	usage->fragments = calloc(numEntries + 1, sizeof(int));
+	usage->refs = calloc(numEntries + 1, sizeof(int));
+	usage->flags = calloc(numEntries + 1, 1);
+
+	int bad = table->fatType == 12 ? BAD_CLUSTER_12 : table->fatType == 16 ? BAD_CLUSTER_16 : BAD_CLUSTER_32;
+	int* set = usage->set;
+	int c;
+	for (c = 0; c < numEntries; c++) {
+		set[c] = c;
+	}
+	for (c = 2; c < numEntries; c++) {
+		int entry = table->fatType != 32 ? table->next[c] : getFATEntry(table, c);
+		if (entry == 0) {
+			usage->numFree++;
+			continue;
+		}
+		if (entry == bad) {
+			usage->numBad++;
+			continue;
+		}
+		usage->flags[c] |= USAGE_USED;
+		usage->numUsed++;
+		if (isChainCluster(table, entry)) {
+			usage->refs[entry]++;
+			// the lower root becomes the root of both sets
+			int a = findSet(set, c);
+			int b = findSet(set, entry);
+			if (a < b) {
+				set[b] = a;
+			} else {
+				set[a] = b;
+			}
+		}
+	}
+	return usage;
+}
+
+/**
+ * Records the first cluster of a file or directory found by the walk
+ *
+ * @param usage The volume
+ * @param cluster The entry's first cluster, 0 for an empty file
+ * @param isDirectory 1 for a directory, which is not in the histogram
+ */
+void addUsageStart(VolumeUsage* usage, int cluster, int isDirectory) {
+	if (isDirectory) {
+		usage->numDirs++;
+	} else {
+		usage->numFiles++;
+	}
+	if (cluster < 2 || cluster >= usage->numEntries || !(usage->flags[cluster] & USAGE_USED)) {
+		if (!isDirectory) {
+			usage->histogram[0]++;
+		}
+		return;
+	}
+
+	usage->flags[cluster] |= usage->flags[cluster] & USAGE_START ? USAGE_STARTS : USAGE_START;
+	usage->flags[findSet(usage->set, cluster)] |= USAGE_CLAIMED;
+	if (isDirectory) {
+		return;
+	}
+	// counted once every chain is known
+	if (usage->numStarts == usage->startCapacity) {
+		usage->startCapacity = usage->startCapacity ? usage->startCapacity * 2 : 64;
+		usage->starts = realloc(usage->starts, usage->startCapacity * sizeof(int));
+	}
+	usage->starts[usage->numStarts++] = cluster;
+}
+
+/**
+ * Counts lost chains, cross-linked clusters and the fragments of every
+ * file once the walk is done
+ *
+ * @param usage The volume
+ */
+void finishUsage(VolumeUsage* usage) {
+	int* refs = usage->refs;
+	uint8_t* flags = usage->flags;
+	int c;
+
+	// peel lost chains off from their heads; a cluster is lost once
+	// every FAT entry pointing at it is, unless a directory entry starts it
+	int* heads = malloc((usage->numEntries + 1) * sizeof(int));
+	int numHeads = 0;
+	for (c = 2; c < usage->numEntries; c++) {
+		if ((flags[c] & USAGE_USED) && refs[c] == 0 && !(flags[c] & USAGE_START)) {
+			heads[numHeads++] = c;
+			usage->numLostChains++;
+		}
+	}
+	while (numHeads > 0) {
+		c = heads[--numHeads];
+		flags[c] |= USAGE_LOST;
+		usage->numLostClusters++;
+		int next = nextInChain(usage, c);
+		if (next != 0 && --refs[next] == 0 && !(flags[next] & USAGE_START)) {
+			heads[numHeads++] = next;
+		}
+	}
+	free(heads);
+
+	// only the entries of chains still claimed count from here on
+	for (c = 2; c < usage->numEntries; c++) {
+		if (!(flags[c] & USAGE_USED) || (flags[c] & USAGE_LOST)) {
+			continue;
+		}
+		int root = findSet(usage->set, c);
+		if (!(flags[root] & USAGE_CLAIMED)) {
+			// a loop that no chain leads into
+			flags[c] |= USAGE_LOST;
+			usage->numLostClusters++;
+			continue;
+		}
+		int pointers = refs[c] + ((flags[c] & USAGE_START) != 0) + ((flags[c] & USAGE_STARTS) != 0);
+		if (pointers > 1) {
+			usage->numCrossLinked++;
+		}
+		// a fragment starts wherever a chain does or jumps to
+		int follows = c > 2 && (flags[c - 1] & USAGE_USED) && !(flags[c - 1] & USAGE_LOST)
+			&& nextInChain(usage, c - 1) == c;
+		if (refs[c] == 0 || refs[c] > follows) {
+			usage->fragments[root]++;
+		}
+	}
+
+	int s;
+	for (s = 0; s < usage->numStarts; s++) {
+		int fragments = usage->fragments[findSet(usage->set, usage->starts[s])];
+		usage->numFragments += fragments;
+		if (fragments > 1) {
+			usage->numFragmented++;
+		}
+		int bucket = 1;
+		while (bucket < USAGE_BUCKETS - 1 && fragments >= usageBucketLow(bucket + 1)) {
+			bucket++;
+		}
+		usage->histogram[bucket]++;
+	}
+}
+
+/**
+ * @param bucket A bucket of the fragment histogram
+ * @return The fewest fragments a file in `bucket` has
+ */
+int usageBucketLow(int bucket) {
+	return bucket == 0 ? 0 : 1 << (bucket - 1);
+}
+
+/**
+ * Frees what was found about a volume
+ *
+ * @param usage The volume
+ */
+void freeVolumeUsage(VolumeUsage* usage) {
+	free(usage->set);
+	free(usage->fragments);
+	free(usage->refs);
+	free(usage->flags);
+	free(usage->starts);
+	free(usage);
+}
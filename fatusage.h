@@ -0,0 +1,64 @@
+/**
+ * How full and how fragmented a volume is.
+ *
+ * Everything comes from one linear pass over the FAT, one directory walk
+ * and a linear pass over what they found. The FAT pass counts free and bad
+ * clusters and how many entries point at each cluster, and joins every
+ * cluster to the one its entry points at with a union-find, so the
+ * clusters of each chain end up in one set without following any chain.
+ *
+ * The walk hands over the first cluster of every file and directory.
+ * Clusters that nothing points at and no walk entry starts are the heads
+ * of lost chains, and are peeled off a cluster at a time: a cluster is
+ * lost once every entry pointing at it is, so a lost chain that runs
+ * into a file's chain stops there and is never counted as the file's.
+ * Loops that no chain leads into are lost too.
+ *
+ * Of the clusters left, those that more than one FAT entry or directory
+ * entry points at are cross-linked. A fragment starts at a cluster that
+ * nothing points at, or that some entry points at from anywhere but the
+ * cluster just before it; the fragments of each chain are then added up
+ * in its set. Cross-linked chains share a set, so their fragments are
+ * counted together.
+ */
+
+#ifndef FATUSAGE_H
+#define FATUSAGE_H
+
+#include <stdint.h>
+#include "fattable.h"
+
+// files by number of fragments: none, 1, 2-3, 4-7, ... and the rest
+#define USAGE_BUCKETS 8
+
+typedef struct volumeusage {
+	int numEntries;
+	int numFree;
+	int numBad;
+	int numUsed;
+	int numCrossLinked;
+	int numLostChains;
+	int numLostClusters;
+	int numFiles;
+	int numDirs;
+	int numFragmented; // files in more than one fragment
+	long numFragments; // over every file
+	long histogram[USAGE_BUCKETS];
+
+	FATTable* table;
+	int* set; // union-find parent of each cluster
+	int* fragments; // for the cluster at the root of each set, the fragments in the set
+	int* refs; // FAT entries pointing at each cluster, then only the ones not lost
+	uint8_t* flags; // USAGE_ flags in fatusage.c
+	int* starts; // first cluster of every file with one, in walk order
+	int numStarts;
+	int startCapacity;
+} VolumeUsage;
+
+VolumeUsage* scanFATUsage(FATTable* table);
+void addUsageStart(VolumeUsage* usage, int cluster, int isDirectory);
+void finishUsage(VolumeUsage* usage);
+int usageBucketLow(int bucket);
+void freeVolumeUsage(VolumeUsage* usage);
+
+#endif
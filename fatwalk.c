@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include "fatwalk.h"
+#include "fatindex.h"
+
+static void addPendingDir(DirLevel* level, int cluster, int maxClusters, long offset, void* context) {
+	if (level->count == level->capacity) {
+		level->capacity = level->capacity ? level->capacity * 2 : 64;
+		level->dirs = realloc(level->dirs, level->capacity * sizeof(PendingDir));
+	}
+	PendingDir* dir = &level->dirs[level->count++];
+	dir->cluster = cluster;
+	dir->maxClusters = maxClusters;
+	dir->offset = offset;
+	dir->context = context;
+}
+
+/**
+ * Starts a walk at the root directory
+ *
+ * @param img The disk image
+ * @param info The volume
+ * @param context Handed back with the root directory
+ * @return The walk, to be freed with freeDirWalk
+ */
+DirWalk* startDirWalk(Image* img, FATInfo* info, void* context) {
+	DirWalk* walk = calloc(1, sizeof(DirWalk));
+	walk->img = img;
+	walk->info = info;
+	walk->queued = calloc(info->table->numEntries, 1);
+
+	long offset;
+	if (info->numRootClusters > 0) {
+		offset = (long)info->sizeofSector * getAbsoluteCluster(info, info->rootCluster);
+	} else {
+		offset = getClusterOffset(info, info->rootCluster);
+		if (info->rootCluster < info->table->numEntries) {
+			walk->queued[info->rootCluster] = 1;
+		}
+	}
+	addPendingDir(&walk->next, info->rootCluster, info->numRootClusters, offset, context);
+	return walk;
+}
+
+/**
+ * Adds a subdirectory to the walk
+ *
+ * It is handed back with the next level, and is ignored if it has been
+ * queued before, so a damaged image whose directories loop still ends.
+ *
+ * @param walk The walk
+ * @param cluster The cluster the subdirectory starts at
+ * @param context Handed back with the subdirectory
+ */
+void queueDirectory(DirWalk* walk, int cluster, void* context) {
+	if (!isChainCluster(walk->info->table, cluster) || walk->queued[cluster]) {
+		return;
+	}
+	walk->queued[cluster] = 1;
+	addPendingDir(&walk->next, cluster, 0, getClusterOffset(walk->info, cluster), context);
+}
+
+static int comparePendingDirs(const void* a, const void* b) {
+	long x = ((const PendingDir*)a)->offset;
+	long y = ((const PendingDir*)b)->offset;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Asks for every cluster of a level's directories to be read ahead
+ *
+ * @param walk The walk, with the level in `current`
+ */
+static void prefetchLevel(DirWalk* walk) {
+	FATInfo* info = walk->info;
+	int d;
+	for (d = 0; d < walk->current.count; d++) {
+		PendingDir* dir = &walk->current.dirs[d];
+		if (info->index != NULL && findIndexedDir(info->index, dir->cluster, dir->maxClusters) != NULL) {
+			// it won't be read at all
+			continue;
+		}
+		if (dir->maxClusters > 0) {
+			adviseImage(walk->img, dir->offset, (long)dir->maxClusters * info->sizeofSector);
+			continue;
+		}
+		getClusterChain(info->table, dir->cluster, info->table->numEntries, &walk->chain);
+		int r;
+		for (r = 0; r < walk->chain.numRuns; r++) {
+			adviseImage(walk->img, getClusterOffset(info, walk->chain.runs[r].start),
+				(long)walk->chain.runs[r].length * info->sizeofCluster);
+		}
+	}
+}
+
+/**
+ * Gets the next directory to scan
+ *
+ * @param walk The walk
+ * @param cluster Receives the cluster the directory starts at
+ * @param maxClusters Receives the value to pass to scanDirectory
+ * @param context Receives the context it was queued with
+ * @return 1 if there is another directory, 0 once the walk is over
+ */
+int nextDirectory(DirWalk* walk, int* cluster, int* maxClusters, void** context) {
+	if (walk->position == walk->current.count) {
+		if (walk->next.count == 0) {
+			return 0;
+		}
+		// move on to the next level, keeping both arrays for reuse
+		DirLevel done = walk->current;
+		walk->current = walk->next;
+		walk->next = done;
+		walk->next.count = 0;
+		walk->position = 0;
+
+		qsort(walk->current.dirs, walk->current.count, sizeof(PendingDir), comparePendingDirs);
+		prefetchLevel(walk);
+	}
+
+	PendingDir* dir = &walk->current.dirs[walk->position++];
+	*cluster = dir->cluster;
+	*maxClusters = dir->maxClusters;
+	*context = dir->context;
+	return 1;
+}
+
+/**
+ * Frees a walk
+ *
+ * @param walk The walk to free
+ */
+void freeDirWalk(DirWalk* walk) {
+	free(walk->current.dirs);
+	free(walk->next.dirs);
+	free(walk->queued);
+	freeClusterChain(&walk->chain);
+	free(walk);
+}
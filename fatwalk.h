@@ -0,0 +1,48 @@
+/**
+ * Breadth-first walk of a volume's directory tree.
+ *
+ * Rather than each visitor recursing into scanDirectory, visitors queue
+ * the subdirectories they find and the tool scans the directories the
+ * walk hands back one at a time, so no buffers are held per level.
+ *
+ * Directories are handed back a level at a time. Each level is sorted
+ * by where its directories start on disk, and the kernel is asked to
+ * start reading the whole level before the first of them is scanned, so
+ * the reads are issued in one sweep across the image instead of jumping
+ * back and forth.
+ */
+
+#ifndef FATWALK_H
+#define FATWALK_H
+
+#include "fat.h"
+
+typedef struct pendingdir {
+	int cluster;
+	int maxClusters; // as passed to scanDirectory
+	long offset; // where the directory starts in the image
+	void* context;
+} PendingDir;
+
+typedef struct dirlevel {
+	PendingDir* dirs;
+	int count;
+	int capacity;
+} DirLevel;
+
+typedef struct dirwalk {
+	Image* img;
+	FATInfo* info;
+	DirLevel current; // the level being handed back
+	DirLevel next; // directories found while scanning it
+	int position; // next directory to hand back from `current`
+	unsigned char* queued; // 1 for each cluster already queued
+	ClusterChain chain; // reused to find each directory's clusters
+} DirWalk;
+
+DirWalk* startDirWalk(Image* img, FATInfo* info, void* context);
+void queueDirectory(DirWalk* walk, int cluster, void* context);
+int nextDirectory(DirWalk* walk, int* cluster, int* maxClusters, void** context);
+void freeDirWalk(DirWalk* walk);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fatwrite.h"
+#include "fatstats.h"
+
+/*
+ * Journal layout, all integers little-endian:
+ *  JOURNAL_MAGIC	8 bytes
+ *  sector size	4 bytes
+ *  sector count	4 bytes
+ * then for each sector, in ascending order:
+ *  offset	8 bytes
+ *  original	sector size bytes
+ */
+#define JOURNAL_HEADER 16
+
+/**
+ * Creates an empty write-back buffer
+ *
+ * @param img The image to modify, opened as writable
+ * @param sizeofSector Size of the sectors changes are grouped into
+ * @return The new buffer
+ */
+WriteBuffer* newWriteBuffer(Image* img, int sizeofSector) {
+	WriteBuffer* wb = malloc(sizeof(WriteBuffer));
+	wb->img = img;
+	wb->sizeofSector = sizeofSector;
+	wb->sectors = NULL;
+	wb->numSectors = 0;
+	wb->capacity = 0;
+	wb->numSlots = 64;
+	wb->slots = malloc(wb->numSlots * sizeof(int));
+	memset(wb->slots, -1, wb->numSlots * sizeof(int));
+	return wb;
+}
+
+static int slotOf(WriteBuffer* wb, long sector) {
+	int mask = wb->numSlots - 1;
+	int s = (int)((unsigned long)sector * 0x9e3779b1u) & mask;
+	while (wb->slots[s] >= 0 && wb->sectors[wb->slots[s]].offset / wb->sizeofSector != sector) {
+		s = (s + 1) & mask;
+	}
+	return s;
+}
+
+/**
+ * Gets the buffered copy of a sector, reading it in if needed
+ *
+ * @param wb The buffer
+ * @param sector Sector number in the image
+ * @return The buffered sector
+ */
+static DirtySector* getDirtySector(WriteBuffer* wb, long sector) {
+	int s = slotOf(wb, sector);
+	if (wb->slots[s] >= 0) {
+		return &wb->sectors[wb->slots[s]];
+	}
+
+	if (wb->numSectors == wb->capacity) {
+		wb->capacity = wb->capacity ? wb->capacity * 2 : 64;
+		wb->sectors = realloc(wb->sectors, wb->capacity * sizeof(DirtySector));
+	}
+	// keep the hash at most half full
+	if ((wb->numSectors + 1) * 2 > wb->numSlots) {
+		wb->numSlots *= 2;
+		wb->slots = realloc(wb->slots, wb->numSlots * sizeof(int));
+		memset(wb->slots, -1, wb->numSlots * sizeof(int));
+		int d;
+		for (d = 0; d < wb->numSectors; d++) {
+			wb->slots[slotOf(wb, wb->sectors[d].offset / wb->sizeofSector)] = d;
+		}
+		s = slotOf(wb, sector);
+	}
+
+	DirtySector* ds = &wb->sectors[wb->numSectors];
+	ds->offset = sector * wb->sizeofSector;
+	ds->original = malloc(wb->sizeofSector);
+	ds->data = malloc(wb->sizeofSector);
+	countStat(STAT_ALLOCATIONS, 2);
+	readImage(wb->img, ds->offset, wb->sizeofSector, ds->original);
+	memcpy(ds->data, ds->original, wb->sizeofSector);
+	wb->slots[s] = wb->numSectors++;
+	return ds;
+}
+
+/**
+ * Records a change to the image without writing it yet
+ *
+ * @param wb The buffer
+ * @param offset Byte offset into the image
+ * @param data The bytes to write
+ * @param len Number of bytes to write
+ */
+void bufferWrite(WriteBuffer* wb, long offset, const void* data, int len) {
+	const unsigned char* bytes = data;
+	while (len > 0) {
+		DirtySector* ds = getDirtySector(wb, offset / wb->sizeofSector);
+		int at = offset - ds->offset;
+		int n = wb->sizeofSector - at < len ? wb->sizeofSector - at : len;
+		memcpy(ds->data + at, bytes, n);
+		offset += n;
+		bytes += n;
+		len -= n;
+	}
+}
+
+/**
+ * Reads from the image with every buffered change made
+ *
+ * @param wb The buffer
+ * @param offset Byte offset into the image
+ * @param data Receives the bytes
+ * @param len Number of bytes to read
+ */
+void bufferRead(WriteBuffer* wb, long offset, void* data, int len) {
+	unsigned char* bytes = data;
+	while (len > 0) {
+		long sector = offset / wb->sizeofSector;
+		int at = offset - sector * wb->sizeofSector;
+		int n = wb->sizeofSector - at < len ? wb->sizeofSector - at : len;
+		int s = slotOf(wb, sector);
+		if (wb->slots[s] >= 0) {
+			memcpy(bytes, wb->sectors[wb->slots[s]].data + at, n);
+		} else {
+			readImage(wb->img, offset, n, bytes);
+		}
+		offset += n;
+		bytes += n;
+		len -= n;
+	}
+}
+
+static int compareSectors(const void* a, const void* b) {
+	long x = ((const DirtySector*)a)->offset;
+	long y = ((const DirtySector*)b)->offset;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Saves the original contents of every dirty sector
+ *
+ * @param wb The buffer, sorted by offset
+ * @param journal Path of the journal to create
+ * @param sync 1 to wait for the journal to reach the disk
+ * @return 1 on success, otherwise 0
+ */
+static int writeJournal(WriteBuffer* wb, const char* journal, int sync) {
+	FILE* out = fopen(journal, "wb");
+	if (out == NULL) {
+		return 0;
+	}
+
+	unsigned char header[JOURNAL_HEADER];
+	memcpy(header, JOURNAL_MAGIC, 8);
+	putLE(header + 8, wb->sizeofSector, 4);
+	putLE(header + 12, wb->numSectors, 4);
+	int ok = fwrite(header, sizeof(header), 1, out) == 1;
+
+	int d;
+	for (d = 0; d < wb->numSectors && ok; d++) {
+		unsigned char offset[8];
+		putLE(offset, wb->sectors[d].offset, 8);
+		ok = fwrite(offset, sizeof(offset), 1, out) == 1
+			&& fwrite(wb->sectors[d].original, wb->sizeofSector, 1, out) == 1;
+	}
+
+	ok = fflush(out) == 0 && ok;
+	if (sync) {
+		ok = fsync(fileno(out)) == 0 && ok;
+	}
+	return fclose(out) == 0 && ok;
+}
+
+/**
+ * Writes every dirty sector to the image, once each, in ascending order
+ *
+ * If a journal is wanted it is written in full first, so the image is
+ * never changed without a way to put it back. With `sync` set, the
+ * journal reaches the disk before the image is touched and the image
+ * reaches the disk before this returns.
+ *
+ * The buffer is empty afterwards and can be used again.
+ *
+ * @param wb The buffer
+ * @param journal Path of the undo journal to create, or NULL for none
+ * @param sync 1 to wait for each step to reach the disk
+ * @return 1 on success, otherwise 0
+ */
+int flushWriteBuffer(WriteBuffer* wb, const char* journal, int sync) {
+	qsort(wb->sectors, wb->numSectors, sizeof(DirtySector), compareSectors);
+
+	int ok = 1;
+	if (journal != NULL && !writeJournal(wb, journal, sync)) {
+		// nothing has been written, so the image is left as it was
+		ok = 0;
+	}
+
+	int d;
+	for (d = 0; d < wb->numSectors && ok; d++) {
+		// the last sector may run past the end of the image
+		int len = wb->sizeofSector;
+		if (wb->img->size > 0 && wb->sectors[d].offset + len > wb->img->size) {
+			len = wb->img->size - wb->sectors[d].offset;
+		}
+		ok = writeImage(wb->img, wb->sectors[d].offset, wb->sectors[d].data, len);
+	}
+	if (ok && sync) {
+		ok = syncImage(wb->img);
+	}
+
+	for (d = 0; d < wb->numSectors; d++) {
+		free(wb->sectors[d].data);
+		free(wb->sectors[d].original);
+	}
+	wb->numSectors = 0;
+	memset(wb->slots, -1, wb->numSlots * sizeof(int));
+	return ok;
+}
+
+/**
+ * Frees a write-back buffer, dropping any changes not yet flushed
+ *
+ * @param wb The buffer to free
+ */
+void freeWriteBuffer(WriteBuffer* wb) {
+	int d;
+	for (d = 0; d < wb->numSectors; d++) {
+		free(wb->sectors[d].data);
+		free(wb->sectors[d].original);
+	}
+	free(wb->sectors);
+	free(wb->slots);
+	free(wb);
+}
+
+/**
+ * Puts back the sectors saved in an undo journal
+ *
+ * @param img The image the journal was written for, opened as writable
+ * @param journal Path of the journal
+ * @param sync 1 to wait for the image to reach the disk
+ * @return The number of sectors restored, or -1 if the journal could
+ *         not be read or is not a journal
+ */
+int undoJournal(Image* img, const char* journal, int sync) {
+	FILE* in = fopen(journal, "rb");
+	if (in == NULL) {
+		return -1;
+	}
+
+	unsigned char header[JOURNAL_HEADER];
+	if (fread(header, sizeof(header), 1, in) != 1 || memcmp(header, JOURNAL_MAGIC, 8) != 0) {
+		fclose(in);
+		return -1;
+	}
+	int sizeofSector = getLE(header + 8, 4);
+	int numSectors = getLE(header + 12, 4);
+
+	unsigned char* sector = malloc(sizeofSector);
+	int restored = 0;
+	int d;
+	for (d = 0; d < numSectors; d++) {
+		unsigned char offset[8];
+		// a journal cut short was never followed by writes to the image
+		if (fread(offset, sizeof(offset), 1, in) != 1 || fread(sector, sizeofSector, 1, in) != 1) {
+			break;
+		}
+		long at = getLE(offset, 8);
+		int len = sizeofSector;
+		if (img->size > 0 && at + len > img->size) {
+			len = img->size - at;
+		}
+		if (!writeImage(img, at, sector, len)) {
+			restored = -1;
+			break;
+		}
+		restored++;
+	}
+	free(sector);
+	fclose(in);
+
+	if (restored >= 0 && sync && !syncImage(img)) {
+		restored = -1;
+	}
+	return restored;
+}
@@ -0,0 +1,48 @@
+/**
+ * Write-back buffer for changes to directory entries and the FAT.
+ *
+ * Changes are collected per sector instead of being written as they are
+ * made. Each sector is read the first time it is changed, every later
+ * change to it is made in memory, and flushWriteBuffer writes each dirty
+ * sector once, in ascending order.
+ *
+ * Before anything is written, the original contents of every dirty
+ * sector can be saved to an undo journal. undoJournal puts them back,
+ * which recovers an image whose flush was interrupted or reverses one
+ * that completed.
+ *
+ * bufferRead sees the image as it will be once the buffer is flushed,
+ * for changes that only replace part of a byte, like FAT12 entries.
+ */
+
+#ifndef FATWRITE_H
+#define FATWRITE_H
+
+#include "fatimage.h"
+
+#define JOURNAL_MAGIC "FATUNDO1"
+
+typedef struct dirtysector {
+	long offset;
+	unsigned char* data; // the sector with every change made
+	unsigned char* original; // the sector as it was first read
+} DirtySector;
+
+typedef struct writebuffer {
+	Image* img;
+	int sizeofSector;
+	DirtySector* sectors;
+	int numSectors;
+	int capacity;
+	int* slots; // hash of sector number to index in `sectors`, -1 if free
+	int numSlots;
+} WriteBuffer;
+
+WriteBuffer* newWriteBuffer(Image* img, int sizeofSector);
+void bufferWrite(WriteBuffer* wb, long offset, const void* data, int len);
+void bufferRead(WriteBuffer* wb, long offset, void* data, int len);
+int flushWriteBuffer(WriteBuffer* wb, const char* journal, int sync);
+void freeWriteBuffer(WriteBuffer* wb);
+int undoJournal(Image* img, const char* journal, int sync);
+
+#endif
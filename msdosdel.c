@@ -1,205 +1,265 @@
 /**
- * BootStrapSector is the first 512 bytes of the FAT.
- * Two byte fields are little-endian
+ * Marks files on a FAT12, FAT16 or FAT32 disk image as deleted.
  *
- * The format of this sector is:
- * byte(s) contents
- * ------- -------------------------------------------------------
- *  00-02	first instruction of bootstrap routine
- *  03-10	OEM name
- *  11-12	number of bytes per sector
- *     13	number of sectors per cluster
- *  14-15	number of reserved sectors
- *     16	number of copies of the file allocation table
- *  17-18	number of entries in root directory
- *  19-20	total number of sectors
- *     21	media descriptor byte
- *  22-23	number of sectors in each copy of file allocation table
- *  24-25	number of sectors per track
- *  26-27	number of sides
- *  28-29	number of hidden sectors
- *  30-509	bootstrap routine and partition information
- *     510	hexadecimal 55
- *     511	hexadecimal AA
+ * usage: msdosdel [-i stdio|mmap|uring] [-f listfile] [-J journal] [-s] [-S text|json] [-x index] filename [pattern...]
+ *        msdosdel [-i stdio|mmap|uring] [-s] -U journal filename
+ *        msdosdel [-i stdio|mmap|uring] [-j threads] [-s] [-S text|json] -m -f listfile filename...
+ *
+ * With no patterns the files are listed and one is chosen interactively.
+ * Otherwise every file whose path matches one of the patterns, given as
+ * arguments or one per line in listfile ("-" for stdin), is deleted
+ * without asking, e.g. msdosdel disk.img '*.BAK' DOCS/REPORT.TXT
+ * When every pattern is a plain path, each file is looked up on its own
+ * and only the directories on its path are read; see fatlookup.h.
+ *
+ * Changes are written at the end, each sector once. -J saves the sectors
+ * about to change to an undo journal first, -s waits for the journal and
+ * the image to reach the disk, and -U puts back the sectors in a journal.
+ * With -x the directory tree is kept in an index file, as for msdosdir.
+ * A deleted file's clusters are freed in every copy of the FAT; a
+ * deleted directory keeps its clusters so it can still be restored.
+ *
+ * -S prints the counters in fatstats.h to stderr at the end, as text or
+ * as one JSON object.
+ *
+ * With -m every argument is an image, and the patterns in listfile are
+ * deleted from each of them, -j images at a time. The output for each
+ * image is printed under its name, in the order the images were given.
+ * A journal or an index is a single file, so -J, -U and -x cannot be
+ * used with -m.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
-
-typedef unsigned char BYTE;
-typedef struct pair {
-	BYTE bytes[2];
-} BytePair;
-
-typedef struct triplet {
-	BYTE bytes[3];
-} ByteTriplet;
-
-typedef struct quad {
-	BYTE bytes[4];
-} ByteQuad;
-
-typedef struct bootsector {
-	ByteTriplet firstInstruction; // This is often a jump instruction to the boot sector code itself
-	BYTE OEM[8];
-	BytePair numBytesPerSector;
-	BYTE numSectorsPerCluster;
-	BytePair numReservedSectors;
-	BYTE numCopiesFAT;
-	BytePair numEntriesRootDir;
-	BytePair numSectors;
-	BYTE mediaDescriptor;
-	BytePair numSectorsInFAT;
-	BytePair numSectorsPerTrack;
-	BytePair numSides;
-	ByteQuad numHiddenSectors;
-	ByteQuad largeSectors;
-	BYTE physicalDiskNum;
-	BYTE currentHead;
-	BYTE signature;
-	ByteQuad volumeSN;
-	BYTE volumeLabel[11];
-	BYTE formatType[8]; // FAT12 or FAT16 in this program
-	BYTE bootstrap[448];
-	BYTE hex55AA[2]; // the last bytes of the boot sector are, by definition, 55 AA.  This is a sanity check.
-} BootSector;
-
-typedef struct info {
-	int fatType;
-	int numClusters;
-	int numFATSectors;
-	int numCopiesFAT;
-	int sizeofSector;
-	int firstDataSector;
-	int numRootEntries;
-	int numRootClusters;
-	int reservedSectors;
-	int filesFound;
-	long totalSize;
-} FATInfo;
-
-FATInfo* fatInfo;
-
-typedef BYTE* Sector;
+#include <string.h>
+#include <unistd.h>
+#include "fat.h"
+#include "fatpattern.h"
+#include "fatwrite.h"
+#include "fatindex.h"
+#include "fatwalk.h"
+#include "fatlookup.h"
+#include "fatbatch.h"
+#include "fatchain.h"
+#include "fatstats.h"
 
 typedef struct dirlist {
-	char name[13];
-	int posInFile;
+	const char* name; // last component of `path`
+	char* path; // from the root directory, e.g. DOCS/REPORT.TXT, by long names where there are any
+	char* shortPath; // the same by short names; `path` itself if that has none
+	long posInFile;
+	long* slots; // byte offsets of its long name slots, deleted along with it
+	int numSlots;
+	int startingCluster;
+	int isDirectory;
 	struct dirlist* next;
 } DirectoryList;
 
-DirectoryList* dirListHead;
-DirectoryList* dirListTail;
+// a directory queued on the walk
+typedef struct dirpaths {
+	const char* path;
+	const char* shortPath;
+} DirPaths;
+
+// how every image is changed; set once before any image is opened
+int backend = IMAGE_STDIO;
+const char* journal;
+const char* indexFile;
+int syncWrites;
+int statsOutput = -1; // format of the -S statistics, -1 for none
+int batch;
+int manyImages;
+PatternList patterns;
 
 /*
- * 00-07	Filename
- * 08-10	Filename extension
- *    11	File attributes
- *    12	Reserved for use by WinNT
- *    13	Time created (tenth of a second)
- * 14-15	Time created
- * 		Hour	5 bits
- * 		Minutes	6 bits
- * 		Seconds	5 bits
- * 16-17	Date created
- * 		Year	7 bits
- * 		Month	4 bits
- * 		Day	5 bits
- * 18-19	Date last accessed
- * 20-21	Upper half of entry's first cluster, 0 for FAT12 and FAT16
- * 22-23	Time last modified
- * 24-25	Date last modified
- * 26-27	Lower half of entry's first cluster
- * 28-31	File size in bytes
- */
-typedef struct direntry {
-	BYTE filename[8];
-	BYTE extension[3];
-	BYTE attributes;
-	BYTE reserved;
-	BYTE timeCreatedTenthSec;
-	BytePair timeCreated;
-	BytePair dateCreated;
-	BytePair dateAccessed;
-	BytePair startingClusterUpper;
-	BytePair timeModified;
-	BytePair dateModified;
-	BytePair startingCluster;
-	ByteQuad fileSize;
-} DirectoryEntry;
-/*
- * Directory entry special values for first byte
- * 0x00	Filename never used.
- * 0xe5	The filename has been used, but the file has been deleted.
- * 0x05	The first character of the filename is actually 0xe5.
- * 0x2e	The entry is for a directory, not a normal file.
- * 	If the second byte is also 0x2e, the cluster field contains the cluster number of this directory's parent directory.
- *	If the parent directory is the root directory (which is statically allocated and doesn't have a cluster number), cluster number 0x0000 is specified here.
+ * Everything kept about the image being changed. With -m several images
+ * are changed on different threads at once, so none of this is global.
  */
-const int NOT_USED = 0x00;
-const int DELETED = 0xe5;
-const int ACTUAL_E5 = 0x05;
-const int DIRECTORY = 0x2e;
-
-// Directory entry attributes
-const int ATTR_READ_ONLY = 0x01; // File is read only
-const int ATTR_HIDDEN = 0x02; // Hidden file
-const int ATTR_SYSTEM_FILE = 0x04; // Indicates a system file. These are hidden as well
-const int ATTR_VOLUME_LABEL = 0x08; // Disk's volume label. Only found in the root directory
-const int ATTR_SUB_DIR = 0x10; // The entry describes a subdirectory
-const int ATTR_ARCHIVE = 0x20; // Archive flag. Set when the file is modified. Used by backup programs
-const int ATTR_UNUSED1 = 0x40; // Not used; must be set to 0
-const int ATTR_UNUSED2 = 0x80; // Not used; must be set to 0
-
-// FAT entry special values
-const int AVAILABLE_12 = 0x000;
-const int AVAILABLE_16 = 0x0000;
-const int RESERVED_12 = 0x001;
-const int RESERVED_16 = 0x0001;
-const int BAD_CLUSTER_12 = 0xff7;
-const int BAD_CLUSTER_16 = 0xfff7;
-const int END_MARKER_12 = 0xff8;
-const int END_MARKER_16 = 0xfff8;
-
-const int FIRST_ROOT_CLUSTER = 2;
+typedef struct volume {
+	FATInfo* fatInfo;
+	DirWalk* walk; // directories still to be scanned, NULL when files are looked up by path
+	DirectoryList* dirListHead;
+	DirectoryList* dirListTail;
+	Arena* dirListArena; // owns every node of the directory list
+	WriteBuffer* changes; // entry and FAT changes not yet written to the image
+	const char* path; // path of the directory being scanned, "" for the root
+	const char* shortPath; // the same by short names, `path` itself if that has none
+	FILE* out;
+} Volume;
 
-int le2be2(BytePair bytes);
-int le2be3(ByteTriplet bytes, int which);
-int le2be4(ByteQuad bytes);
-int getNumberClusters(BootSector* bs);
-int getFATType(BootSector* bs);
-int getAbsoluteCluster(int relativeCluster);
-int clusterRelativeToRoot(int absoluteCluster);
-int getNextCluster(Sector fatSector, int cluster);
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster);
+int deleteFromImage(const char* filename, FILE* out, void* arg);
+char* joinPath(Arena* arena, const char* parent, const char* name, int nameLen);
+void listEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context);
+void lookupFiles(Volume* v, Image* img);
 void flush();
-void deleteFile(FILE* fs);
-void readBootStrapSector(FILE* fs, BootSector* bs);
-void scanDirectorySector(FILE* fs, Sector directory, int posInFile);
-void scanDirectory(FILE* fs, int cluster, int maxClusters);
-void hexDump(char *desc, void *addr, int len);
+void deleteFile(Volume* v, Image* img);
+int deleteFiles(Volume* v, Image* img, PatternList* patterns);
+void changeEntry(Volume* v, long posInFile, BYTE value);
+void removeFile(Volume* v, DirectoryList* file);
 
 int main (int argc, char *argv[]) {
-	if (argc != 2) {
-		printf("usage: %s filename\n", argv[0]);
+	const char* listFile = NULL;
+	const char* undoFile = NULL;
+	int numThreads = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:f:j:J:mS:U:sx:")) != -1) {
+		if (opt == 'i') {
+			backend = imageBackend(optarg);
+		} else if (opt == 'f') {
+			listFile = optarg;
+		} else if (opt == 'j') {
+			numThreads = atoi(optarg);
+		} else if (opt == 'J') {
+			journal = optarg;
+		} else if (opt == 'm') {
+			manyImages = 1;
+		} else if (opt == 'U') {
+			undoFile = optarg;
+		} else if (opt == 's') {
+			syncWrites = 1;
+		} else if (opt == 'S') {
+			statsOutput = statsFormat(optarg);
+			if (statsOutput < 0) {
+				backend = -1;
+			}
+		} else if (opt == 'x') {
+			indexFile = optarg;
+		} else {
+			backend = -1;
+		}
+	}
+	if (manyImages && (listFile == NULL || journal != NULL || undoFile != NULL || indexFile != NULL)) {
+		backend = -1;
+	}
+	if (backend < 0 || numThreads < 1 || optind >= argc) {
+		printf("usage: %s [-i stdio|mmap|uring] [-f listfile] [-J journal] [-s] [-S text|json] [-x index] filename [pattern...]\n", argv[0]);
+		printf("       %s [-i stdio|mmap|uring] [-s] -U journal filename\n", argv[0]);
+		printf("       %s [-i stdio|mmap|uring] [-j threads] [-s] [-S text|json] -m -f listfile filename...\n", argv[0]);
 		return 0;
 	}
-	// assume argv[1] is a filename to open
-	FILE* file = fopen(argv[1], "r+b");
-	if (file == 0) {
-		printf("Could not open file %s\n", argv[1]);
+	
+	int a;
+	for (a = optind + 1; a < argc && !manyImages; a++) {
+		addPattern(&patterns, argv[a]);
+	}
+	if (listFile != NULL && !readPatterns(&patterns, listFile)) {
+		printf("Could not open file %s\n", listFile);
+		return 1;
+	}
+	batch = listFile != NULL || optind + 1 < argc;
+	
+	// put back what an earlier run changed instead of making changes
+	if (undoFile != NULL) {
+		freePatterns(&patterns);
+		Image* img = openImage(argv[optind], 1, backend);
+		if (img == 0) {
+			printf("Could not open file %s\n", argv[optind]);
+			return 1;
+		}
+		int restored = undoJournal(img, undoFile, syncWrites);
+		closeImage(img);
+		if (restored < 0) {
+			printf("Could not undo the changes saved in %s\n", undoFile);
+			return 1;
+		}
+		printf("%d sector(s) restored from %s\n", restored, undoFile);
+		return 0;
+	}
+	
+	// assume the remaining argument is a filename to open, or with -m all of them
+	int status = runImageBatch(argv + optind, manyImages ? argc - optind : 1, numThreads,
+		deleteFromImage, NULL, stdout);
+	freePatterns(&patterns);
+	if (statsOutput >= 0) {
+		fflush(stdout);
+		printStats(stderr, statsOutput);
+	}
+	
+	return status;
+}
+
+/**
+ * Deletes files from one disk image
+ * 
+ * @param filename The image to change
+ * @param out Where messages go
+ * @param arg Unused
+ * @return 0 on success, otherwise 1
+ */
+int deleteFromImage(const char* filename, FILE* out, void* arg) {
+	Volume v = { 0 };
+	v.out = out;
+	
+	if (manyImages) {
+		fprintf(out, "Image %s\n", filename);
+	}
+	Image* img = openImage(filename, 1, backend);
+	if (img == 0) {
+		fprintf(out, "Could not open file %s\n", filename);
 		return 1;
 	}
+	
+	long phase = startPhase();
 	BootSector* bs = malloc(sizeof(BootSector));
-	readBootStrapSector(file, bs);
-	scanDirectory(file, FIRST_ROOT_CLUSTER, fatInfo->numRootClusters);
+	v.fatInfo = readBootStrapSector(img, bs);
+	if (indexFile != NULL) {
+		v.fatInfo->index = openDirIndex(img, v.fatInfo, indexFile);
+	}
+	endPhase(PHASE_BOOT, phase);
 	
-	deleteFile(file);
+	phase = startPhase();
+	v.dirListArena = newArena(64 * 1024);
+	v.dirListHead = arenaAlloc(v.dirListArena, sizeof(DirectoryList));
+	v.dirListHead->next = NULL;
+	v.dirListTail = v.dirListHead;
+	v.changes = newWriteBuffer(img, v.fatInfo->sizeofSector);
+	if (batch && onlyPlainPaths(&patterns)) {
+		lookupFiles(&v, img);
+	} else {
+		DirPaths root = { "", "" };
+		v.walk = startDirWalk(img, v.fatInfo, &root);
+		int cluster;
+		int maxClusters;
+		void* context;
+		while (nextDirectory(v.walk, &cluster, &maxClusters, &context)) {
+			DirPaths* dir = context;
+			v.path = dir->path;
+			v.shortPath = strcmp(dir->shortPath, dir->path) == 0 ? dir->path : dir->shortPath;
+			scanDirectory(img, v.fatInfo, cluster, maxClusters, 1, listEntry, &v);
+		}
+		freeDirWalk(v.walk);
+	}
+	endPhase(PHASE_WALK, phase);
+	
+	int status = 0;
+	if (batch) {
+		// each image counts its own matches
+		PatternList imagePatterns = { 0 };
+		copyPatterns(&imagePatterns, &patterns);
+		status = deleteFiles(&v, img, &imagePatterns);
+		freePatterns(&imagePatterns);
+	} else {
+		deleteFile(&v, img);
+	}
+	
+	// every change is written here, each sector once
+	phase = startPhase();
+	int written = flushWriteBuffer(v.changes, journal, syncWrites);
+	endPhase(PHASE_WRITE, phase);
+	if (!written) {
+		fprintf(out, "Could not write the changes to the disk image\n");
+		status = 1;
+	} else if (v.fatInfo->index != NULL && !saveDirIndex(v.fatInfo->index, img, v.fatInfo)) {
+		fprintf(out, "Could not save the directory index %s\n", indexFile);
+	}
 	
+	freeWriteBuffer(v.changes);
 	free(bs);
-	fclose(file);
+	freeArena(v.dirListArena);
+	freeFATInfo(v.fatInfo);
+	closeImage(img);
 	
-	return 0;
+	return status;
 }
 
 /**
@@ -213,451 +273,255 @@ void flush() {
 /**
  * Allows the user to select a file to mark as deleted
  * 
- * @param fs A file handle to the disk image
+ * @param v The image being changed
+ * @param img The disk image
  */
-void deleteFile(FILE* fs) {
+void deleteFile(Volume* v, Image* img) {
 	int counter = 0;
-	dirListTail = dirListHead->next;
+	v->dirListTail = v->dirListHead->next;
 	
 	// print out the list of files
-	while (dirListTail != NULL) {
+	while (v->dirListTail != NULL) {
 		counter++;
-		printf("%d) %s\n", counter, dirListTail->name);
-		dirListTail = dirListTail->next;
+		fprintf(v->out, "%d) %s\n", counter, v->dirListTail->name);
+		v->dirListTail = v->dirListTail->next;
 	}
 	
 	// ask for the number in the list of the file to delete
 	int n = -1;
 	char dummy;
 	while (n < 0 || n > counter) {
-		printf("Which file do you want to delete? [1 - %d, 0 to quit] ", counter);
+		fprintf(v->out, "Which file do you want to delete? [1 - %d, 0 to quit] ", counter);
 		scanf("%d", &n);
 		flush();
 	}
 	
 	if (n != 0) {
-		dirListTail = dirListHead;
+		v->dirListTail = v->dirListHead;
 		for (counter = 0; counter < n; counter++) {
-			dirListTail = dirListTail->next;
+			v->dirListTail = v->dirListTail->next;
 		}
 		
 		// confirm that this is the file to delete
 		char c;
-		printf("Delete %s? [y/n] ", dirListTail->name);
+		fprintf(v->out, "Delete %s? [y/n] ", v->dirListTail->name);
 		scanf("%c", &c);
 		flush();
 		
 		if (c == 'y' || c == 'Y') {
-			printf("Deleting %s\n", dirListTail->name);
+			fprintf(v->out, "Deleting %s\n", v->dirListTail->name);
 			
 			// find the first byte of the file's directory entry
 			// and write DELETED to it to mark it as deleted
-			fseek(fs, dirListTail->posInFile, SEEK_SET);
-			fwrite(&DELETED, 1, 1, fs);
+			removeFile(v, v->dirListTail);
 		}
 	}
 }
 
 /**
- * Converts a two-byte little-endian value to a big-endian integer
+ * Changes the first byte of a directory entry once `changes` is flushed,
+ * and in the directory index straight away
  * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
+ * @param v The image being changed
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param value The new first byte
  */
-int le2be2(BytePair bytes) {
-	return (bytes.bytes[0] + (bytes.bytes[1] << 8));
-}
-
-/**
- * Extracts a twelve-bit little-endian value from a trio of bytes
- * and converts it to a big-endian integer
- * 
- * @param bytes The bytes to convert
- * @param which The first or second value stored in `bytes`
- * @return The extracted value
- */
-int le2be3(ByteTriplet bytes, int which) {
-	if (which != 1 && which != 2) {
-		which = 1;
-	}
-	
-	int firstByte = (int)bytes.bytes[0];
-	int secondByte = (int)bytes.bytes[1];
-	int thirdByte = (int)bytes.bytes[2];
-	int result = 0;
-	//UV WX YZ --> XUV YZW
-	
-	if (which == 1) {
-		result = firstByte; // UV
-		result += ((secondByte & 0x0f) << 8); // X
-	} else {
-		result = (thirdByte << 4); // YZ
-		result += ((secondByte & 0xf0) >> 4); // W
+void changeEntry(Volume* v, long posInFile, BYTE value) {
+	bufferWrite(v->changes, posInFile, &value, 1);
+	if (v->fatInfo->index != NULL) {
+		updateDirIndex(v->fatInfo->index, posInFile, &value, 1);
 	}
-	
-	return result;
 }
 
 /**
- * Converts a four-byte little-endian value to a big-endian integer
+ * Marks a file and its long name as deleted and frees its clusters
+ * once `changes` is flushed
  * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
- */
-int le2be4(ByteQuad bytes) {
-	int res = bytes.bytes[0];
-	int i;
-	for (i = 1; i < 4; i++) {
-		res += bytes.bytes[i] << (8 * i);
-	}
-	return res;
-}
-
-/**
- * Calculates the total number of clusters in the filesystem
+ * A directory keeps its clusters, so the files in it are not lost
+ * and it can still be restored.
  * 
- * @param bs The bootsector of the filesystem
- * @return The number of clusters in the filesystem
+ * @param v The image being changed
+ * @param file The file to delete
  */
-int getNumberClusters(BootSector* bs) {
-	unsigned int root_dir_sectors = ((le2be2(bs->numEntriesRootDir) * 32) + (le2be2(bs->numBytesPerSector) - 1)) / le2be2(bs->numBytesPerSector);
-	unsigned int data_sectors;
-	if (le2be2(bs->numSectors) != 0) {
-		data_sectors = le2be2(bs->numSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
-	} else {
-		data_sectors = le2be4(bs->largeSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
+void removeFile(Volume* v, DirectoryList* file) {
+	int s;
+	for (s = 0; s < file->numSlots; s++) {
+		changeEntry(v, file->slots[s], DELETED);
 	}
-	return (int)(data_sectors / bs->numSectorsPerCluster);
-}
-
-/**
- * Determines if the FAT is FAT12, FAT16, or FAT32
- * 
- * @param bs The bootsector of the filesystem
- * @return The number version of FAT
- */
-int getFATType(BootSector* bs) {
-	int total_clusters = getNumberClusters(bs);
-	if (total_clusters < 4085) {
-		return 12;
-	} else {
-		if (total_clusters < 65525) {
-			return 16;
-		} else {
-			return 32;
-		}
+	changeEntry(v, file->posInFile, DELETED);
+	if (!file->isDirectory) {
+		// the whole chain is freed, however long it is
+		FATTable* table = v->fatInfo->table;
+		ClusterChain chain = { 0 };
+		getClusterChain(table, file->startingCluster, table->numEntries, &chain);
+		freeChain(v->changes, v->fatInfo, &chain);
+		freeClusterChain(&chain);
 	}
 }
 
 /**
- * Calculates a cluster's actual position in the user data section
- * because of the fact that clusters are numbered starting at 2
+ * Deletes every file matching a list of patterns
  * 
- * @param relativeCluster The cluster whose position is to be calculated
- * @return The actual position of the cluster in the user data section
- */
-int getAbsoluteCluster(int relativeCluster) {
-	return relativeCluster - 2 + fatInfo->firstDataSector;
-}
-
-/**
- * Calculates a cluster's position in the filesystem
- * after the boot sector and FATs
+ * All the entries are marked in one pass once the whole image has been
+ * scanned. The marks and the freed chains are buffered and written when
+ * `changes` is flushed.
  * 
- * @param absoluteCluster The cluster's position in the user data section
- * @return The position of the cluster after the boot sector and FATs
- */
-int clusterRelativeToRoot(int absoluteCluster) {
-	return absoluteCluster + fatInfo->numRootClusters;
-}
-
-/**
- * Reads information from the bootstrap sector into a BootSector object
- *
- * @param fs File handle to the disk image
- * @param bs The BootSector object to receive the data
+ * @param v The image being changed
+ * @param img The disk image
+ * @param patterns The paths or patterns of the files to delete
+ * @return 0 if every pattern matched a file, otherwise 1
  */
-void readBootStrapSector(FILE* fs, BootSector* bs) {
-	fread(bs, sizeof(BootSector), 1, fs);
-	
-	fatInfo = malloc(sizeof(FATInfo));
-	fatInfo->fatType = getFATType(bs);
-	fatInfo->numFATSectors = le2be2(bs->numSectorsInFAT);
-	fatInfo->numCopiesFAT = bs->numCopiesFAT;
-	fatInfo->sizeofSector = le2be2(bs->numBytesPerSector);
-	fatInfo->firstDataSector = fatInfo->numCopiesFAT * le2be2(bs->numSectorsInFAT) + 1;
-	fatInfo->numRootEntries = le2be2(bs->numEntriesRootDir);
-	fatInfo->numRootClusters = fatInfo->numRootEntries * sizeof(DirectoryEntry) / fatInfo->sizeofSector;
-	fatInfo->reservedSectors = le2be2(bs->numReservedSectors);
+int deleteFiles(Volume* v, Image* img, PatternList* patterns) {
+	int numMarks = 0;
+	DirectoryList* file;
 	
-	dirListHead = malloc(sizeof(DirectoryList));
-	dirListTail = dirListHead;
-}
-
-/**
- * Scans a sector of a directory and its information to a list
- * 
- * @param fs - The file handle for the filesystem
- * @param directory - The sector to scan
- */
-void scanDirectorySector(FILE* fs, Sector directory, int posInFile) {
-	int sizeofDirEntry = sizeof(DirectoryEntry);
-	int entriesPerSector = fatInfo->sizeofSector / sizeofDirEntry;
+	for (file = v->dirListHead->next; file != NULL; file = file->next) {
+		// "." and ".." can't be deleted on their own
+		if (strcmp(file->name, ".") == 0 || strcmp(file->name, "..") == 0) {
+			continue;
+		}
+		// a pattern can use short names, long names or both, and
+		// every pattern naming the file is credited with it
+		int match = matchPatterns(patterns, file->path);
+		if (file->shortPath != file->path) {
+			int shortMatch = matchPatterns(patterns, file->shortPath);
+			match = match >= 0 ? match : shortMatch;
+		}
+		if (match >= 0) {
+			fprintf(v->out, "Deleting %s\n", file->path);
+			removeFile(v, file);
+			numMarks++;
+		}
+	}
 	
-	int e;
-	for (e = 0; e < entriesPerSector; e++) {
-		int b;
-		int offset = e * sizeofDirEntry;
-		
-		if (directory[offset] != DELETED && directory[offset] != NOT_USED) {
-			DirectoryEntry* de = malloc(sizeofDirEntry);
-			for (b = 0; b < 8; b++) {
-				de->filename[b] = directory[offset + b];
-			}
-			if (de->filename[0] == ACTUAL_E5) {
-				de->filename[0] = 0xe5;
-			}
-			for (b = 0; b < 3; b++) {
-				de->extension[b] = directory[offset + 8 + b];
-			}
-			de->attributes = directory[offset + 11];
-			de->reserved = directory[offset + 12];
-			de->timeCreatedTenthSec = directory[offset + 13];
-			de->timeCreated.bytes[0] = directory[offset + 14];
-			de->timeCreated.bytes[0] = directory[offset + 15];
-			de->dateCreated.bytes[0] = directory[offset + 16];
-			de->dateCreated.bytes[0] = directory[offset + 17];
-			de->dateAccessed.bytes[0] = directory[offset + 18];
-			de->dateAccessed.bytes[0] = directory[offset + 19];
-			de->startingClusterUpper.bytes[0] = directory[offset + 20];
-			de->startingClusterUpper.bytes[0] = directory[offset + 21];
-			de->timeModified.bytes[0] = directory[offset + 22];
-			de->timeModified.bytes[1] = directory[offset + 23];
-			de->dateModified.bytes[0] = directory[offset + 24];
-			de->dateModified.bytes[1] = directory[offset + 25];
-			de->startingCluster.bytes[0] = directory[offset + 26];
-			de->startingCluster.bytes[1] = directory[offset + 27];
-			for (b = 0; b < 4; b++) {
-				de->fileSize.bytes[b] = directory[offset + 28 + b];
-			}
-			
-			if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
-				&& !(de->attributes & ATTR_VOLUME_LABEL)
-			) {
-				if (directory[offset] == DIRECTORY || de->attributes & ATTR_SUB_DIR) {
-					if (directory[offset + 1] != DIRECTORY) {
-						// don't scan if second byte in entry is also DIRECTORY
-						// this indicates that the cluster points to the parent
-						// which will result in infinite recursion
-						scanDirectory(fs, le2be2(de->startingCluster), 0);
-					}
-				}
-				
-				dirListTail->next = malloc(sizeof(DirectoryList));
-				dirListTail = dirListTail->next;
-				int i;
-				for (i = 7; i > 0; i--) {
-					if (de->filename[i] != ' ') {
-						break;
-					} else {
-						de->filename[i] = 0;
-					}
-				}
-				for (i = 2; i >= 0; i--) {
-					if (de->extension[i] != ' ') {
-						break;
-					} else {
-						de->extension[i] = 0;
-					}
-				}
-				
-				int pos = 0;
-				// loop through until the end of the filename
-				for (i = 0; i < 8; i++) {
-					if (de->filename[i]) {
-						dirListTail->name[pos] = de->filename[i];
-						pos++;
-					} else {
-						break;
-					}
-				}
-				// if there is an extension
-				// add the '.' and loop through extension
-				if (de->extension[0]) {
-					dirListTail->name[pos] = '.';
-					pos++;
-					for (i = 0; i < 3; i++) {
-						if (de->extension[i]) {
-							dirListTail->name[pos] = de->extension[i];
-							pos++;
-						} else {
-							break;
-						}
-					}
-				}
-				// make sure the string is properly terminated
-				dirListTail->name[pos] = 0;
-				dirListTail->posInFile = posInFile + e * sizeofDirEntry;
-				dirListTail->next = NULL;
-			}
-			
-			free(de);
+	int status = 0;
+	int p;
+	for (p = 0; p < patterns->count; p++) {
+		if (patterns->matches[p] == 0) {
+			fprintf(v->out, "No files match %s\n", patterns->patterns[p]);
+			status = 1;
 		}
 	}
+	fprintf(v->out, "%d file(s) deleted\n", numMarks);
+	
+	return status;
 }
 
 /**
- * Gets the next cluster in a file's cluster chain
+ * Makes the path of an entry from its directory's path
  * 
- * @param fatSector The sector of the FAT containing the current cluster
- * @param cluster The current cluster in the chain
- * @return The next cluster in the chain
+ * @param arena Owns the path
+ * @param parent Path of the directory, "" for the root
+ * @param name The entry's name
+ * @param nameLen Length of `name`
+ * @return The path
  */
-int getNextCluster(Sector fatSector, int cluster) {
-	int nextCluster;
-	int offset;
-	// even: i / 2 * 3
-	// odd: (i - 1) / 2 * 3 + 1
-	if (fatInfo->fatType == 12) {
-		ByteTriplet *bt = malloc(sizeof(ByteTriplet));
-		if (cluster % 2) {
-			offset = (cluster - 1) / 2 * 3 + 1;
-			bt->bytes[1] = fatSector[offset];
-			bt->bytes[2] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 2);
-		} else {
-			offset = cluster / 2 * 3;
-			bt->bytes[0] = fatSector[offset];
-			bt->bytes[1] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 1);
-		}
-		free(bt);
-	} else if (fatInfo->fatType == 16) {
-		BytePair *bp = malloc(sizeof(BytePair));
-		offset = cluster * 2;
-		bp->bytes[0] = fatSector[offset];
-		bp->bytes[1] = fatSector[offset + 1];
-		nextCluster = le2be2(*bp);
-		free(bp);
-	} else {
-		nextCluster = -1;
+char* joinPath(Arena* arena, const char* parent, const char* name, int nameLen) {
+	int parentLen = strlen(parent);
+	char* path = arenaAlloc(arena, parentLen + nameLen + 2);
+	if (parentLen > 0) {
+		memcpy(path, parent, parentLen);
+		path[parentLen++] = '/';
 	}
-	return nextCluster;
+	memcpy(path + parentLen, name, nameLen + 1);
+	return path;
 }
 
 /**
- * Makes sure the correct FAT sector has been read in to get
- * the next cluster in a chain
+ * Adds an entry of the directory being scanned to the list of files,
+ * and queues it to be scanned too if it is a subdirectory
  * 
- * @param fs A file handle to the disk image
- * @param fatSector The currently held FAT sector
- * @param curFATSector The position of `fatSector` in the FAT
- * @param nextCluster The cluster that will be checked
- * @return The FAT sector that `nextCluster` is within
+ * @param img The disk image
+ * @param de The entry
+ * @param longName Its long name, or NULL if it has none
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param context The Volume being scanned
  */
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster) {
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int entriesPerFATSector;
-	if (fatInfo->fatType == 12) {
-		entriesPerFATSector = sizeofSector * 2 / 3;
-	} else if (fatInfo->fatType == 16) {
-		entriesPerFATSector = sizeofSector / 2;
-	} else {
-		return fatSector;
-	}
-	
-	// check if the cluster being searched for is within the
-	// currently loaded FAT sector. If not, get the right one
-	
-	// the smallest cluster available in this FAT sector
-	int fatSectorMin = curFATSector * entriesPerFATSector;
-	
-	// if cluster being searched for is less than the lowest
-	// available or higher than the highest available
-	if (nextCluster < fatSectorMin || nextCluster > (fatSectorMin + entriesPerFATSector)) {
-		
-		// get the sector num required to contain nextCluster
-		curFATSector = sizeofSector * (nextCluster / entriesPerFATSector);
+void listEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context) {
+	Volume* v = context;
+	if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
+		&& !(de->attributes & ATTR_VOLUME_LABEL)
+	) {
+		char name[ENTRY_NAME_MAX];
+		int nameLen = entryLongName(de, longName, name);
+		char* path = joinPath(v->dirListArena, v->path, name, nameLen);
+		char* shortPath = path;
+		if (longName != NULL || v->shortPath != v->path) {
+			char shortName[13];
+			int shortNameLen = entryName(de, shortName);
+			shortPath = joinPath(v->dirListArena, v->shortPath, shortName, shortNameLen);
+		}
 		
-		// free the existing FAT sector
-		free(fatSector);
+		int isDirectory = de->filename[0] == DIRECTORY || de->attributes & ATTR_SUB_DIR;
+		if (isDirectory && v->walk != NULL) {
+			if (de->filename[0] != DIRECTORY) {
+				// don't scan the "." and ".." entries
+				// they point back at this directory and its parent
+				// which will result in infinite recursion
+				// the subdirectory is scanned with the next level
+				DirPaths* dir = arenaAlloc(v->dirListArena, sizeof(DirPaths));
+				dir->path = path;
+				dir->shortPath = shortPath;
+				queueDirectory(v->walk, getEntryCluster(v->fatInfo, de), dir);
+			}
+		}
 		
-		// malloc and read the new sector
-		fatSector = malloc(sizeofSector);
-		fseek(fs, startFAT + sizeofSector * curFATSector, SEEK_SET);
-		fread(fatSector, sizeofSector, 1, fs);
+		v->dirListTail->next = arenaAlloc(v->dirListArena, sizeof(DirectoryList));
+		v->dirListTail = v->dirListTail->next;
+		v->dirListTail->name = finalName(path);
+		v->dirListTail->path = path;
+		v->dirListTail->shortPath = shortPath;
+		v->dirListTail->posInFile = posInFile;
+		v->dirListTail->slots = NULL;
+		v->dirListTail->numSlots = 0;
+		if (longName != NULL) {
+			v->dirListTail->numSlots = longName->numSlots;
+			v->dirListTail->slots = arenaAlloc(v->dirListArena, longName->numSlots * sizeof(long));
+			memcpy(v->dirListTail->slots, longName->slotPos, longName->numSlots * sizeof(long));
+		}
+		v->dirListTail->startingCluster = getEntryCluster(v->fatInfo, de);
+		v->dirListTail->isDirectory = isDirectory;
+		v->dirListTail->next = NULL;
 	}
-	
-	return fatSector;
 }
 
 /**
- * Scans through a directory and extracts file information
+ * Adds the file at each pattern's path to the list of files,
+ * reading only the directories on the way to it
  * 
- * @param fs - The file handle for the filesystem
- * @param cluster - The cluster to start at
- * @param maxClusters - Only used for root directories.
- *                      Indicates how many contiguous clusters to check
+ * @param v The image being changed
+ * @param img The disk image
  */
-void scanDirectory(FILE* fs, int cluster, int maxClusters) {
-	int numFATSectors = fatInfo->numFATSectors;
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int endOfDir = 0;
-	int clusterCount = 0;
-	int nextCluster = cluster;
-	int curFATSector = -1;
-	
-	// malloc here just to be sure all frees have something to free
-	Sector fatSector = malloc(sizeofSector);
-	
-	while (!endOfDir) {
-		
-		// if we've got a good cluster
-		if ((fatInfo->fatType == 12 && nextCluster > RESERVED_12 && nextCluster < BAD_CLUSTER_12) ||
-			(fatInfo->fatType == 16 && nextCluster > RESERVED_16 && nextCluster < BAD_CLUSTER_16)
-		) {
-			
-			// get the correct address for this cluster
-			int absoluteCluster = getAbsoluteCluster(nextCluster);
-			
-			Sector fileSector = malloc(sizeofSector);
-			fseek(fs, sizeofSector * absoluteCluster, SEEK_SET);
-			fread(fileSector, sizeofSector, 1, fs);
-			
-			scanDirectorySector(fs, fileSector, sizeofSector * absoluteCluster);
-			
-			free(fileSector);
-		} else {
-			
-			// otherwise stop searching
-			endOfDir = 1;
-			break;
+void lookupFiles(Volume* v, Image* img) {
+	FoundEntry* found = malloc(sizeof(FoundEntry));
+	// positions of the entries listed so far, kept at most half full
+	int numSlots = 64;
+	while (numSlots < patterns.count * 2) {
+		numSlots *= 2;
+	}
+	long* listed = malloc(numSlots * sizeof(long));
+	memset(listed, -1, numSlots * sizeof(long));
+	int p;
+	for (p = 0; p < patterns.count; p++) {
+		if (!lookupPath(img, v->fatInfo, patterns.patterns[p], LOOKUP_LIVE, found)) {
+			continue;
 		}
-		
-		fatSector = getCorrectFATSector(fs, fatSector, curFATSector, nextCluster);
-		
-		// if doing root directory, increment the cluster count
-		if (maxClusters > 0) {
-			// next cluster = start cluster + how many done so far
-			clusterCount++;
-			nextCluster = cluster + clusterCount;
-			if (clusterCount >= maxClusters) {
-				endOfDir = 1;
-				break;
-			}
-		} else {
-			// get the next cluster based on the current cluster
-			nextCluster = getNextCluster(fatSector, nextCluster);
-			if ((fatInfo->fatType == 12 && nextCluster >= END_MARKER_12) ||
-				(fatInfo->fatType == 16 && nextCluster >= END_MARKER_16)
-			) {
-				endOfDir = 1;
-				break;
-			}
+		// the same file can be named by more than one path; its
+		// patterns are still all credited when the list is matched
+		int s = (int)((unsigned long)found->posInFile * 0x9e3779b1u) & (numSlots - 1);
+		while (listed[s] >= 0 && listed[s] != found->posInFile) {
+			s = (s + 1) & (numSlots - 1);
+		}
+		if (listed[s] == found->posInFile) {
+			continue;
 		}
+		listed[s] = found->posInFile;
+		
+		// list the entry as if it had been found in its directory
+		v->path = found->parent;
+		v->shortPath = strcmp(found->shortParent, found->parent) == 0 ? found->parent : found->shortParent;
+		listEntry(img, &found->entry, found->longName, found->posInFile, v);
 	}
-	
-	free(fatSector);
+	free(found);
+	free(listed);
 }
@@ -1,634 +1,602 @@
 /**
- * BootStrapSector is the first 512 bytes of the FAT.
- * Two byte fields are little-endian
+ * Lists every file on a FAT12, FAT16 or FAT32 disk image.
  *
- * The format of this sector is:
- * byte(s) contents
- * ------- -------------------------------------------------------
- *  00-02	first instruction of bootstrap routine
- *  03-10	OEM name
- *  11-12	number of bytes per sector
- *     13	number of sectors per cluster
- *  14-15	number of reserved sectors
- *     16	number of copies of the file allocation table
- *  17-18	number of entries in root directory
- *  19-20	total number of sectors
- *     21	media descriptor byte
- *  22-23	number of sectors in each copy of file allocation table
- *  24-25	number of sectors per track
- *  26-27	number of sides
- *  28-29	number of hidden sectors
- *  30-509	bootstrap routine and partition information
- *     510	hexadecimal 55
- *     511	hexadecimal AA
+ * usage: msdosdir [-a] [-D snapshot] [-i stdio|mmap|uring] [-j threads] [-o text|jsonl|csv] [-S text|json] [-x index] filename...
+ *
+ * With -x the directory tree is saved to an index file the first time and
+ * read back from it while the image is unchanged.
+ *
+ * -o jsonl and -o csv print one record per file or directory, with its
+ * full path, instead of the listing meant for people. The "." and ".."
+ * entries and the per-directory headers and totals are left out. FAT12
+ * volumes have no created or accessed fields, so those are null (JSON)
+ * or empty (CSV).
+ *
+ * A file with a VFAT long name has it shown after its dates in the text
+ * listing, and is under it in the paths of the records.
+ *
+ * Given more than one image, the images are listed -j at a time and their
+ * listings are printed in the order the images were given. Each text
+ * listing is headed by the image's name, and each record gets an "image"
+ * field. -x can only be used with a single image.
+ *
+ * -a prints how the volume is used instead of listing it: free, used and
+ * bad clusters, lost chains and cross-linked clusters, and how many files
+ * are in how many fragments. It is worked out from one pass over the FAT
+ * and one walk of every directory, hidden ones included; see fatusage.h.
+ * -o jsonl prints it as one JSON object per image, and -o csv is not
+ * supported.
+ *
+ * -D lists only what has changed since an earlier snapshot of the
+ * volume, which is another image of it or a directory index saved from
+ * one: every file or directory added, removed, or whose size, first
+ * cluster or modification time changed; see fatdiff.h. The records of
+ * -o jsonl and -o csv get a "change" field. Run as
+ * msdosdir -D disk.idx -x disk.idx disk.img, each run compares the image
+ * with the index saved by the one before and saves a new one. -D can
+ * only be used with a single image.
+ *
+ * -S prints the counters in fatstats.h to stderr once every image is
+ * listed, as text or as one JSON object.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fat.h"
+#include "fatindex.h"
+#include "fatwalk.h"
+#include "fatformat.h"
+#include "fatbatch.h"
+#include "fatstats.h"
+#include "fatusage.h"
+#include "fatdiff.h"
 
-typedef unsigned char BYTE;
-typedef struct pair {
-	BYTE bytes[2];
-} BytePair;
-
-typedef struct triplet {
-	BYTE bytes[3];
-} ByteTriplet;
-
-typedef struct quad {
-	BYTE bytes[4];
-} ByteQuad;
+#define LIST_TEXT 0
+#define LIST_JSONL 1
+#define LIST_CSV 2
 
-typedef struct bootsector {
-	ByteTriplet firstInstruction; // This is often a jump instruction to the boot sector code itself
-	BYTE OEM[8];
-	BytePair numBytesPerSector;
-	BYTE numSectorsPerCluster;
-	BytePair numReservedSectors;
-	BYTE numCopiesFAT;
-	BytePair numEntriesRootDir;
-	BytePair numSectors;
-	BYTE mediaDescriptor;
-	BytePair numSectorsInFAT;
-	BytePair numSectorsPerTrack;
-	BytePair numSides;
-	ByteQuad numHiddenSectors;
-	ByteQuad largeSectors;
-	BYTE physicalDiskNum;
-	BYTE currentHead;
-	BYTE signature;
-	ByteQuad volumeSN;
-	BYTE volumeLabel[11];
-	BYTE formatType[8]; // FAT12 or FAT16 in this program
-	BYTE bootstrap[448];
-	BYTE hex55AA[2]; // the last bytes of the boot sector are, by definition, 55 AA.  This is a sanity check.
-} BootSector;
+// how every image is listed; set once before any image is opened
+int backend = IMAGE_STDIO;
+int listFormat = LIST_TEXT;
+const char* indexFile;
+const char* snapshotFile;
+int numImages;
+int statsOutput = -1; // format of the -S statistics, -1 for none
+int analyze; // 1 to print how the volume is used instead of listing it
 
-typedef struct info {
-	int fatType;
-	int numClusters;
-	int numFATSectors;
-	int numCopiesFAT;
-	int sizeofSector;
-	int firstDataSector;
-	int numRootEntries;
-	int numRootClusters;
-	int reservedSectors;
-	int filesFound;
-	long totalSize;
-} FATInfo;
-
-FATInfo* fatInfo;
-
-typedef BYTE* Sector;
-
-/*
- * 00-07	Filename
- * 08-10	Filename extension
- *    11	File attributes
- *    12	Reserved for use by WinNT
- *    13	Time created (tenth of a second)
- * 14-15	Time created
- * 		Hour	5 bits
- * 		Minutes	6 bits
- * 		Seconds	5 bits
- * 16-17	Date created
- * 		Year	7 bits
- * 		Month	4 bits
- * 		Day	5 bits
- * 18-19	Date last accessed
- * 20-21	Upper half of entry's first cluster, 0 for FAT12 and FAT16
- * 22-23	Time last modified
- * 24-25	Date last modified
- * 26-27	Lower half of entry's first cluster
- * 28-31	File size in bytes
- */
-typedef struct direntry {
-	BYTE filename[8];
-	BYTE extension[3];
-	BYTE attributes;
-	BYTE reserved;
-	BYTE timeCreatedTenthSec;
-	BytePair timeCreated;
-	BytePair dateCreated;
-	BytePair dateAccessed;
-	BytePair startingClusterUpper;
-	BytePair timeModified;
-	BytePair dateModified;
-	BytePair startingCluster;
-	ByteQuad fileSize;
-} DirectoryEntry;
 /*
- * Directory entry special values for first byte
- * 0x00	Filename never used.
- * 0xe5	The filename has been used, but the file has been deleted.
- * 0x05	The first character of the filename is actually 0xe5.
- * 0x2e	The entry is for a directory, not a normal file.
- * 	If the second byte is also 0x2e, the cluster field contains the cluster number of this directory's parent directory.
- *	If the parent directory is the root directory (which is statically allocated and doesn't have a cluster number), cluster number 0x0000 is specified here.
+ * Everything kept while listing one image. Images can be listed on
+ * several threads at once, so none of this is global.
  */
-const int NOT_USED = 0x00;
-const int DELETED = 0xe5;
-const int ACTUAL_E5 = 0x05;
-const int DIRECTORY = 0x2e;
-
-// Directory entry attributes
-const int ATTR_READ_ONLY = 0x01; // File is read only
-const int ATTR_HIDDEN = 0x02; // Hidden file
-const int ATTR_SYSTEM_FILE = 0x04; // Indicates a system file. These are hidden as well
-const int ATTR_VOLUME_LABEL = 0x08; // Disk's volume label. Only found in the root directory
-const int ATTR_SUB_DIR = 0x10; // The entry describes a subdirectory
-const int ATTR_ARCHIVE = 0x20; // Archive flag. Set when the file is modified. Used by backup programs
-const int ATTR_UNUSED1 = 0x40; // Not used; must be set to 0
-const int ATTR_UNUSED2 = 0x80; // Not used; must be set to 0
-
-// FAT entry special values
-const int AVAILABLE_12 = 0x000;
-const int AVAILABLE_16 = 0x0000;
-const int RESERVED_12 = 0x001;
-const int RESERVED_16 = 0x0001;
-const int BAD_CLUSTER_12 = 0xff7;
-const int BAD_CLUSTER_16 = 0xfff7;
-const int END_MARKER_12 = 0xff8;
-const int END_MARKER_16 = 0xfff8;
-
-const int FIRST_ROOT_CLUSTER = 2;
+typedef struct listing {
+	const char* imageName;
+	FATInfo* fatInfo;
+	DirWalk* walk; // directories still to be listed
+	Arena* pathArena; // owns the path of every directory queued by the walk
+	const char* path; // path of the directory being listed, "" for the root
+	FILE* out;
+	FormatBuffer* output; // where records go, for every format but LIST_TEXT
+	VolumeUsage* usage; // what the walk has found so far, with -a
+	const char* change; // with -D, what happened to the entry being formatted
+	
+	// running totals over every directory of the image listed so far
+	int filesFound;
+	long totalSize;
+} Listing;
 
-int le2be2(BytePair bytes);
-int le2be3(ByteTriplet bytes, int which);
-int le2be4(ByteQuad bytes);
-int getNumberClusters(BootSector* bs);
-int getFATType(BootSector* bs);
-int getAbsoluteCluster(int relativeCluster);
-int clusterRelativeToRoot(int absoluteCluster);
-int getNextCluster(Sector fatSector, int cluster);
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster);
-void displayBootStrapInfo(BootSector* bs);
-void readBootStrapSector(FILE* fs, BootSector* bs);
-void displayDirectoryEntry(DirectoryEntry* de);
-void scanDirectorySector(FILE* fs, Sector directory);
-void scanDirectory(FILE* fs, int cluster, int maxClusters);
-void hexDump(char *desc, void *addr, int len);
+int listImage(const char* filename, FILE* out, void* arg);
+void displayDirectoryEntry(Listing* l, const DirectoryEntry* de, const LongName* longName);
+void formatRecord(Listing* l, const DirectoryEntry* de, const char* path, int pathLen);
+void listEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context);
+void listDirectory(Listing* l, Image* img, int cluster, int maxClusters, const char* path);
+void usageEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context);
+void printUsage(Listing* l);
+void listChange(int change, const DirectoryEntry* de, const char* path, void* context);
 
 int main (int argc, char *argv[]) {
-	if (argc != 2) {
-		printf("usage: %s filename\n", argv[0]);
-		return 0;
+	int numThreads = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "aD:i:j:o:S:x:")) != -1) {
+		if (opt == 'a') {
+			analyze = 1;
+		} else if (opt == 'D') {
+			snapshotFile = optarg;
+		} else if (opt == 'i') {
+			backend = imageBackend(optarg);
+		} else if (opt == 'j') {
+			numThreads = atoi(optarg);
+		} else if (opt == 'o') {
+			if (strcmp(optarg, "jsonl") == 0) {
+				listFormat = LIST_JSONL;
+			} else if (strcmp(optarg, "csv") == 0) {
+				listFormat = LIST_CSV;
+			} else if (strcmp(optarg, "text") != 0) {
+				backend = -1;
+			}
+		} else if (opt == 'S') {
+			statsOutput = statsFormat(optarg);
+			if (statsOutput < 0) {
+				backend = -1;
+			}
+		} else if (opt == 'x') {
+			indexFile = optarg;
+		} else {
+			backend = -1;
+		}
 	}
-	// assume argv[1] is a filename to open
-	FILE* file = fopen(argv[1], "r");
-	if (file == 0) {
-		printf("Could not open file %s\n", argv[1]);
-		return 1;
+	numImages = argc - optind;
+	if (backend < 0 || numThreads < 1 || numImages < 1 || (indexFile != NULL && numImages > 1)
+		|| (analyze && listFormat == LIST_CSV)
+		|| (snapshotFile != NULL && (analyze || numImages > 1))
+	) {
+		printf("usage: %s [-a] [-D snapshot] [-i stdio|mmap|uring] [-j threads] [-o text|jsonl|csv] [-S text|json] [-x index] filename...\n", argv[0]);
+		return 0;
 	}
-	BootSector* bs = malloc(sizeof(BootSector));
-	readBootStrapSector(file, bs);
-	scanDirectory(file, FIRST_ROOT_CLUSTER, fatInfo->numRootClusters);
 	
-	free(bs);
-	fclose(file);
-	
-	return 0;
-}
-
-/**
- * Converts a two-byte little-endian value to a big-endian integer
- * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
- */
-int le2be2(BytePair bytes) {
-	return (bytes.bytes[0] + (bytes.bytes[1] << 8));
-}
-
-/**
- * Extracts a twelve-bit little-endian value from a trio of bytes
- * and converts it to a big-endian integer
- * 
- * @param bytes The bytes to convert
- * @param which The first or second value stored in `bytes`
- * @return The extracted value
- */
-int le2be3(ByteTriplet bytes, int which) {
-	if (which != 1 && which != 2) {
-		which = 1;
+	// one header for the records of every image
+	if (listFormat == LIST_CSV) {
+		if (numImages > 1) {
+			printf("image,");
+		}
+		printf(snapshotFile != NULL ? "path,change," : "path,");
+		printf("type,size,cluster,attributes,modified,created,accessed\n");
 	}
 	
-	int firstByte = (int)bytes.bytes[0];
-	int secondByte = (int)bytes.bytes[1];
-	int thirdByte = (int)bytes.bytes[2];
-	int result = 0;
-	//UV WX YZ --> XUV YZW
-	
-	if (which == 1) {
-		result = firstByte; // UV
-		result += ((secondByte & 0x0f) << 8); // X
-	} else {
-		result = (thirdByte << 4); // YZ
-		result += ((secondByte & 0xf0) >> 4); // W
+	// the remaining arguments are the images to list
+	int status = runImageBatch(argv + optind, numImages, numThreads, listImage, NULL, stdout);
+	if (statsOutput >= 0) {
+		fflush(stdout);
+		printStats(stderr, statsOutput);
 	}
-	
-	return result;
+	return status;
 }
 
 /**
- * Converts a four-byte little-endian value to a big-endian integer
+ * Lists every file on one disk image
  * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
+ * @param filename The image to list
+ * @param out Where the listing goes
+ * @param arg Unused
+ * @return 0 on success, otherwise 1
  */
-int le2be4(ByteQuad bytes) {
-	int res = bytes.bytes[0];
-	int i;
-	for (i = 1; i < 4; i++) {
-		res += bytes.bytes[i] << (8 * i);
+int listImage(const char* filename, FILE* out, void* arg) {
+	Listing l = { 0 };
+	l.imageName = filename;
+	l.out = out;
+	
+	if (numImages > 1 && listFormat == LIST_TEXT) {
+		fprintf(out, "Image %s\n", filename);
 	}
-	return res;
-}
-
-/**
- * Calculates the total number of clusters in the filesystem
- * 
- * @param bs The bootsector of the filesystem
- * @return The number of clusters in the filesystem
- */
-int getNumberClusters(BootSector* bs) {
-	unsigned int root_dir_sectors = ((le2be2(bs->numEntriesRootDir) * 32) + (le2be2(bs->numBytesPerSector) - 1)) / le2be2(bs->numBytesPerSector);
-	unsigned int data_sectors;
-	if (le2be2(bs->numSectors) != 0) {
-		data_sectors = le2be2(bs->numSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
-	} else {
-		data_sectors = le2be4(bs->largeSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
+	// read before the index is opened, which may be the same file
+	Snapshot* snapshot = NULL;
+	if (snapshotFile != NULL) {
+		snapshot = openSnapshot(snapshotFile, backend);
+		if (snapshot == NULL) {
+			fprintf(out, "Could not open the snapshot %s\n", snapshotFile);
+			return 1;
+		}
 	}
-	return (int)(data_sectors / bs->numSectorsPerCluster);
-}
-
-/**
- * Determines if the FAT is FAT12, FAT16, or FAT32
- * 
- * @param bs The bootsector of the filesystem
- * @return The number version of FAT
- */
-int getFATType(BootSector* bs) {
-	int total_clusters = getNumberClusters(bs);
-	if (total_clusters < 4085) {
-		return 12;
+	Image* img = openImage(filename, 0, backend);
+	if (img == 0) {
+		fprintf(out, "Could not open file %s\n", filename);
+		if (snapshot != NULL) {
+			freeSnapshot(snapshot);
+		}
+		return 1;
+	}
+	long phase = startPhase();
+	BootSector* bs = malloc(sizeof(BootSector));
+	l.fatInfo = readBootStrapSector(img, bs);
+	if (indexFile != NULL) {
+		l.fatInfo->index = openDirIndex(img, l.fatInfo, indexFile);
+	}
+	endPhase(PHASE_BOOT, phase);
+	if (listFormat != LIST_TEXT) {
+		l.output = newFormatBuffer(out, FORMAT_BUFFER);
+	}
+	if (analyze) {
+		phase = startPhase();
+		l.usage = scanFATUsage(l.fatInfo->table);
+		if (l.fatInfo->fatType == 32) {
+			// the root directory is a chain like any other
+			addUsageStart(l.usage, l.fatInfo->rootCluster, 1);
+		}
+		endPhase(PHASE_CHECK, phase);
+	}
+	
+	phase = startPhase();
+	if (snapshot != NULL) {
+		DiffStats stats;
+		diffSnapshot(snapshot, img, l.fatInfo, listChange, &l, &stats);
+		if (listFormat == LIST_TEXT) {
+			fprintf(out, "%5d change(s), %d of %d directories unchanged\n",
+				stats.numChanges, stats.numSame, stats.numDirs);
+		}
+		freeSnapshot(snapshot);
 	} else {
-		if (total_clusters < 65525) {
-			return 16;
-		} else {
-			return 32;
+		l.pathArena = newArena(64 * 1024);
+		l.walk = startDirWalk(img, l.fatInfo, "");
+		int cluster;
+		int maxClusters;
+		void* context;
+		while (nextDirectory(l.walk, &cluster, &maxClusters, &context)) {
+			listDirectory(&l, img, cluster, maxClusters, context);
 		}
+		freeDirWalk(l.walk);
+		freeArena(l.pathArena);
+	}
+	endPhase(PHASE_WALK, phase);
+	if (l.usage != NULL) {
+		finishUsage(l.usage);
+		printUsage(&l);
+		freeVolumeUsage(l.usage);
 	}
-}
-
-/**
- * Calculates a cluster's actual position in the user data section
- * because of the fact that clusters are numbered starting at 2
- * 
- * @param relativeCluster The cluster whose position is to be calculated
- * @return The actual position of the cluster in the user data section
- */
-int getAbsoluteCluster(int relativeCluster) {
-	return relativeCluster - 2 + fatInfo->firstDataSector;
-}
-
-/**
- * Calculates a cluster's position in the filesystem
- * after the boot sector and FATs
- * 
- * @param absoluteCluster The cluster's position in the user data section
- * @return The position of the cluster after the boot sector and FATs
- */
-int clusterRelativeToRoot(int absoluteCluster) {
-	return absoluteCluster + fatInfo->numRootClusters;
-}
-
-/**
- * Prints out the information in the bootstrap sector
- */
-void displayBootStrapInfo(BootSector* bs) {
-	printf("OEM:                 %.*s\n", 8, bs->OEM);
-	printf("Bytes Per Sector:    %d\n", le2be2(bs->numBytesPerSector));
-	printf("Sectors Per Cluster: %d\n", bs->numSectorsPerCluster);
-	printf("Reserved Sectors:    %d\n", le2be2(bs->numReservedSectors));
-	printf("FATs:                %d\n", bs->numCopiesFAT);
-	printf("Entries in Root:     %d\n", le2be2(bs->numEntriesRootDir));
-	printf("Sectors:             %d\n", le2be2(bs->numSectors));
-	printf("Media:               0x%02x\n", bs->mediaDescriptor);
-	printf("FAT Sectors:         %d\n", le2be2(bs->numSectorsInFAT));
-	printf("Sectors Per Track:   %d\n", le2be2(bs->numSectorsPerTrack));
-	printf("Sides:               %d\n", le2be2(bs->numSides));
-	printf("Hidden Sectors:      %d\n", le2be4(bs->numHiddenSectors));
-	printf("Large Sectors:       %d\n", le2be4(bs->largeSectors));
-	printf("Disk Number:         %d\n", bs->physicalDiskNum);
-	printf("Current Head:        %d\n", bs->currentHead);
-	printf("Signature:           0x%02x\n", bs->signature);
-	printf("Volume SN:           0x%08x\n", le2be4(bs->volumeSN));
-	printf("Volume Label:        %.*s\n", 11, bs->volumeLabel);
-	printf("Format Type:         %.*s\n", 8, bs->formatType);
-	printf("FAT Type is FAT%d, disk has %d clusters\n", fatInfo->fatType, getNumberClusters(bs));
-}
-
-/**
- * Reads information from the bootstrap sector into a BootSector object
- *
- * @param fs File handle to the disk image
- * @param bs The BootSector object to receive the data
- */
-void readBootStrapSector(FILE* fs, BootSector* bs) {
-	fread(bs, sizeof(BootSector), 1, fs);
 	
-	fatInfo = malloc(sizeof(FATInfo));
-	fatInfo->fatType = getFATType(bs);
-	fatInfo->numFATSectors = le2be2(bs->numSectorsInFAT);
-	fatInfo->numCopiesFAT = bs->numCopiesFAT;
-	fatInfo->sizeofSector = le2be2(bs->numBytesPerSector);
-	fatInfo->firstDataSector = fatInfo->numCopiesFAT * le2be2(bs->numSectorsInFAT) + 1;
-	fatInfo->numRootEntries = le2be2(bs->numEntriesRootDir);
-	fatInfo->numRootClusters = fatInfo->numRootEntries * sizeof(DirectoryEntry) / fatInfo->sizeofSector;
-	fatInfo->reservedSectors = le2be2(bs->numReservedSectors);
-	fatInfo->filesFound = 0;
-	fatInfo->totalSize = 0;
+	int status = 0;
+	if (l.output != NULL && !freeFormatBuffer(l.output)) {
+		fprintf(stderr, "Error writing the listing!\n");
+		status = 1;
+	}
+	if (l.fatInfo->index != NULL && !saveDirIndex(l.fatInfo->index, img, l.fatInfo)) {
+		fprintf(out, "Could not save the directory index %s\n", indexFile);
+	}
+	
+	free(bs);
+	freeFATInfo(l.fatInfo);
+	closeImage(img);
+	
+	return status;
 }
 
 /**
  * Displays the information in a directory entry
  * 
+ * @param l The image being listed
  * @param de The directory entry to display
+ * @param longName Its long name, shown after everything else, or NULL
  */
-void displayDirectoryEntry(DirectoryEntry* de) {
-	int dateModified = le2be2(de->dateModified);
+void displayDirectoryEntry(Listing* l, const DirectoryEntry* de, const LongName* longName) {
+	// the entry is read in place, so fix up its first character in a copy
+	BYTE filename[8];
+	memcpy(filename, de->filename, 8);
+	if (filename[0] == ACTUAL_E5) {
+		filename[0] = 0xe5;
+	}
+	
+	int dateModified = entryDateModified(de);
 	int yearModified = ((dateModified & 0xfe00) >> 9);
 	int monthModified = (dateModified & 0x1e0) >> 5;
 	int dayModified = (dateModified & 0x1f);
 	yearModified = yearModified + 1980;
 	
-	int timeModified = le2be2(de->timeModified);
+	int timeModified = entryTimeModified(de);
 	int hourModified = (timeModified & 0xf800) >> 11;
 	int minModified = (timeModified & 0x7e0) >> 5;
 	int secModified = (timeModified & 0x1f);
 	secModified = secModified * 2;
 	
-	if (fatInfo->fatType == 12) {
+	const char* space = longName != NULL ? " " : "";
+	const char* name = longName != NULL ? longName->name : "";
+	if (l->fatInfo->fatType == 12) {
 		// FAT12 does not use the created and accessed fields
-		printf("%8.*s %3.*s %10d  %02d-%02d-%04d %02d:%02d:%02d\n",
-			8, de->filename, 3, de->extension, le2be4(de->fileSize),
+		fprintf(l->out, "%8.*s %3.*s %10ld  %02d-%02d-%04d %02d:%02d:%02d%s%s\n",
+			8, filename, 3, de->extension, entryFileSize(de),
 			monthModified, dayModified, yearModified,
-			hourModified, minModified, secModified);
+			hourModified, minModified, secModified, space, name);
 	} else {
-		int timeCreated = le2be2(de->timeCreated);
+		int timeCreated = entryTimeCreated(de);
 		int hourCreated = (timeCreated & 0xf800) >> 11;
 		int minCreated = (timeCreated & 0x7e0) >> 5;
 		int secCreated = (timeCreated & 0x1f);
 		secCreated = secCreated * 2; // time resolution of 2 seconds
 		
-		int dateCreated = le2be2(de->dateCreated);
+		int dateCreated = entryDateCreated(de);
 		int yearCreated = ((dateCreated & 0xfe00) >> 9);
 		int monthCreated = (dateCreated & 0x1e0) >> 5;
 		int dayCreated = (dateCreated & 0x1f);
 		yearCreated = yearCreated + 1980; // year is offset by 1980
 		
-		int dateAccessed = le2be2(de->dateAccessed);
+		int dateAccessed = entryDateAccessed(de);
 		int yearAccessed = ((dateAccessed & 0xfe00) >> 9);
 		int monthAccessed = (dateAccessed & 0x1e0) >> 5;
 		int dayAccessed = (dateAccessed & 0x1f);
 		yearAccessed = yearAccessed + 1980;
 		
-		printf("%8.*s %3.*s %10d  %02d-%02d-%04d %02d:%02d:%02d  %02d-%02d-%04d  %02d-%02d-%04d %02d:%02d:%02d\n",
-			8, de->filename, 3, de->extension, le2be4(de->fileSize),
+		fprintf(l->out, "%8.*s %3.*s %10ld  %02d-%02d-%04d %02d:%02d:%02d  %02d-%02d-%04d  %02d-%02d-%04d %02d:%02d:%02d%s%s\n",
+			8, filename, 3, de->extension, entryFileSize(de),
 			monthCreated, dayCreated, yearCreated,
 			hourCreated, minCreated, secCreated,
 			monthAccessed, dayAccessed, yearAccessed,
 			monthModified, dayModified, yearModified,
-			hourModified, minModified, secModified);
+			hourModified, minModified, secModified, space, name);
 	}
 }
 
 /**
- * Scans a sector of a directory and prints out its entries
+ * Formats a directory entry as one JSON Lines or CSV record
  * 
- * @param fs The file handle for the filesystem
- * @param directory The sector to scan
+ * @param l The image being listed
+ * @param de The directory entry
+ * @param path Full path of the entry
+ * @param pathLen Length of `path`
  */
-void scanDirectorySector(FILE* fs, Sector directory) {
-	int sizeofDirEntry = sizeof(DirectoryEntry);
-	int entriesPerSector = fatInfo->sizeofSector / sizeofDirEntry;
+void formatRecord(Listing* l, const DirectoryEntry* de, const char* path, int pathLen) {
+	FormatBuffer* output = l->output;
+	int isDir = (de->attributes & ATTR_SUB_DIR) != 0;
+	int hasCreated = l->fatInfo->fatType != 12;
 	
-	int e;
-	for (e = 0; e < entriesPerSector; e++) {
-		int b;
-		int offset = e * sizeofDirEntry;
-		
-		if (directory[offset] != DELETED && directory[offset] != NOT_USED) {
-			DirectoryEntry* de = malloc(sizeofDirEntry);
-			for (b = 0; b < 8; b++) {
-				de->filename[b] = directory[offset + b];
-			}
-			if (de->filename[0] == ACTUAL_E5) {
-				de->filename[0] = 0xe5;
-			}
-			for (b = 0; b < 3; b++) {
-				de->extension[b] = directory[offset + 8 + b];
-			}
-			de->attributes = directory[offset + 11];
-			de->reserved = directory[offset + 12];
-			de->timeCreatedTenthSec = directory[offset + 13];
-			de->timeCreated.bytes[0] = directory[offset + 14];
-			de->timeCreated.bytes[0] = directory[offset + 15];
-			de->dateCreated.bytes[0] = directory[offset + 16];
-			de->dateCreated.bytes[0] = directory[offset + 17];
-			de->dateAccessed.bytes[0] = directory[offset + 18];
-			de->dateAccessed.bytes[0] = directory[offset + 19];
-			de->startingClusterUpper.bytes[0] = directory[offset + 20];
-			de->startingClusterUpper.bytes[0] = directory[offset + 21];
-			de->timeModified.bytes[0] = directory[offset + 22];
-			de->timeModified.bytes[1] = directory[offset + 23];
-			de->dateModified.bytes[0] = directory[offset + 24];
-			de->dateModified.bytes[1] = directory[offset + 25];
-			de->startingCluster.bytes[0] = directory[offset + 26];
-			de->startingCluster.bytes[1] = directory[offset + 27];
-			for (b = 0; b < 4; b++) {
-				de->fileSize.bytes[b] = directory[offset + 28 + b];
-			}
-			
-			if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
-				&& !(de->attributes & ATTR_VOLUME_LABEL)
-			) {
-				fatInfo->filesFound++;
-				fatInfo->totalSize += le2be4(de->fileSize);
-				
-				displayDirectoryEntry(de);
-				
-				if (directory[offset] == DIRECTORY || de->attributes & ATTR_SUB_DIR) {
-					if (directory[offset + 1] != DIRECTORY) {
-						// don't scan if second byte in entry is also DIRECTORY
-						// this indicates that the cluster points to the parent
-						// which will result in infinite recursion
-						scanDirectory(fs, le2be2(de->startingCluster), 0);
-					}
-				}
-			}
-			
-			free(de);
+	if (listFormat == LIST_JSONL) {
+		if (numImages > 1) {
+			formatLiteral(output, "{\"image\":");
+			formatJSONString(output, l->imageName, strlen(l->imageName));
+			formatLiteral(output, ",\"path\":");
+		} else {
+			formatLiteral(output, "{\"path\":");
 		}
-	}
-}
-
-/**
- * Gets the next cluster in a file's cluster chain
- * 
- * @param fatSector The sector of the FAT containing the current cluster
- * @param cluster The current cluster in the chain
- * @return The next cluster in the chain
- */
-int getNextCluster(Sector fatSector, int cluster) {
-	int nextCluster;
-	int offset;
-	// even: i / 2 * 3
-	// odd: (i - 1) / 2 * 3 + 1
-	if (fatInfo->fatType == 12) {
-		ByteTriplet *bt = malloc(sizeof(ByteTriplet));
-		if (cluster % 2) {
-			offset = (cluster - 1) / 2 * 3 + 1;
-			bt->bytes[1] = fatSector[offset];
-			bt->bytes[2] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 2);
+		formatJSONString(output, path, pathLen);
+		if (l->change != NULL) {
+			formatLiteral(output, ",\"change\":\"");
+			formatChars(output, l->change, strlen(l->change));
+			formatLiteral(output, "\"");
+		}
+		if (isDir) {
+			formatLiteral(output, ",\"type\":\"dir\",\"size\":");
+		} else {
+			formatLiteral(output, ",\"type\":\"file\",\"size\":");
+		}
+		formatInt(output, entryFileSize(de));
+		formatLiteral(output, ",\"cluster\":");
+		formatInt(output, getEntryCluster(l->fatInfo, de));
+		formatLiteral(output, ",\"attributes\":\"");
+		formatHex(output, de->attributes, 2);
+		formatLiteral(output, "\",\"modified\":\"");
+		formatDate(output, entryDateModified(de));
+		formatLiteral(output, "T");
+		formatTime(output, entryTimeModified(de));
+		if (hasCreated) {
+			formatLiteral(output, "\",\"created\":\"");
+			formatDate(output, entryDateCreated(de));
+			formatLiteral(output, "T");
+			formatTime(output, entryTimeCreated(de));
+			formatLiteral(output, "\",\"accessed\":\"");
+			formatDate(output, entryDateAccessed(de));
+			formatLiteral(output, "\"}\n");
 		} else {
-			offset = cluster / 2 * 3;
-			bt->bytes[0] = fatSector[offset];
-			bt->bytes[1] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 1);
+			formatLiteral(output, "\",\"created\":null,\"accessed\":null}\n");
 		}
-		free(bt);
-	} else if (fatInfo->fatType == 16) {
-		BytePair *bp = malloc(sizeof(BytePair));
-		offset = cluster * 2;
-		bp->bytes[0] = fatSector[offset];
-		bp->bytes[1] = fatSector[offset + 1];
-		nextCluster = le2be2(*bp);
-		free(bp);
 	} else {
-		nextCluster = -1;
+		if (numImages > 1) {
+			formatCSVString(output, l->imageName, strlen(l->imageName));
+			formatLiteral(output, ",");
+		}
+		formatCSVString(output, path, pathLen);
+		if (l->change != NULL) {
+			formatLiteral(output, ",");
+			formatChars(output, l->change, strlen(l->change));
+		}
+		if (isDir) {
+			formatLiteral(output, ",dir,");
+		} else {
+			formatLiteral(output, ",file,");
+		}
+		formatInt(output, entryFileSize(de));
+		formatLiteral(output, ",");
+		formatInt(output, getEntryCluster(l->fatInfo, de));
+		formatLiteral(output, ",");
+		formatHex(output, de->attributes, 2);
+		formatLiteral(output, ",");
+		formatDate(output, entryDateModified(de));
+		formatLiteral(output, "T");
+		formatTime(output, entryTimeModified(de));
+		if (hasCreated) {
+			formatLiteral(output, ",");
+			formatDate(output, entryDateCreated(de));
+			formatLiteral(output, "T");
+			formatTime(output, entryTimeCreated(de));
+			formatLiteral(output, ",");
+			formatDate(output, entryDateAccessed(de));
+			formatLiteral(output, "\n");
+		} else {
+			formatLiteral(output, ",,\n");
+		}
 	}
-	return nextCluster;
 }
 
 /**
- * Makes sure the correct FAT sector has been read in to get
- * the next cluster in a chain
+ * Prints out an entry of the directory being listed
+ * and queues it to be listed too if it is a subdirectory
  * 
- * @param fs A file handle to the disk image
- * @param fatSector The currently held FAT sector
- * @param curFATSector The position of `fatSector` in the FAT
- * @param nextCluster The cluster that will be checked
- * @return The FAT sector that `nextCluster` is within
+ * @param img The disk image
+ * @param de The entry
+ * @param longName Its long name, or NULL if it has none
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param context The Listing of the image
  */
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster) {
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int entriesPerFATSector;
-	if (fatInfo->fatType == 12) {
-		entriesPerFATSector = sizeofSector * 2 / 3;
-	} else if (fatInfo->fatType == 16) {
-		entriesPerFATSector = sizeofSector / 2;
-	} else {
-		return fatSector;
-	}
-	
-	// check if the cluster being searched for is within the
-	// currently loaded FAT sector. If not, get the right one
-	
-	// the smallest cluster available in this FAT sector
-	int fatSectorMin = curFATSector * entriesPerFATSector;
-	
-	// if cluster being searched for is less than the lowest
-	// available or higher than the highest available
-	if (nextCluster < fatSectorMin || nextCluster > (fatSectorMin + entriesPerFATSector)) {
+void listEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context) {
+	Listing* l = context;
+	if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
+		&& !(de->attributes & ATTR_VOLUME_LABEL)
+	) {
+		l->filesFound++;
+		l->totalSize += entryFileSize(de);
 		
-		// get the sector num required to contain nextCluster
-		curFATSector = sizeofSector * (nextCluster / entriesPerFATSector);
+		const char* parent = l->path;
+		char name[ENTRY_NAME_MAX];
+		int nameLen = entryLongName(de, longName, name);
+		int parentLen = strlen(parent);
+		char path[parentLen + nameLen + 2];
+		if (parentLen > 0) {
+			memcpy(path, parent, parentLen);
+			path[parentLen++] = '/';
+		}
+		memcpy(path + parentLen, name, nameLen + 1);
 		
-		// free the existing FAT sector
-		free(fatSector);
+		if (listFormat == LIST_TEXT) {
+			displayDirectoryEntry(l, de, longName);
+		} else if (de->filename[0] != DIRECTORY) {
+			formatRecord(l, de, path, parentLen + nameLen);
+		}
 		
-		// malloc and read the new sector
-		fatSector = malloc(sizeofSector);
-		fseek(fs, startFAT + sizeofSector * curFATSector, SEEK_SET);
-		fread(fatSector, sizeofSector, 1, fs);
+		if (de->filename[0] == DIRECTORY || de->attributes & ATTR_SUB_DIR) {
+			if (de->filename[0] != DIRECTORY) {
+				// don't scan the "." and ".." entries
+				// they point back at this directory and its parent
+				// which will result in infinite recursion
+				// the subdirectory is scanned with the next level
+				char* dirPath = arenaAlloc(l->pathArena, parentLen + nameLen + 1);
+				memcpy(dirPath, path, parentLen + nameLen + 1);
+				queueDirectory(l->walk, getEntryCluster(l->fatInfo, de), dirPath);
+			}
+		}
 	}
-	
-	return fatSector;
 }
 
 /**
  * Scans through a directory and lists its contents
  * 
- * @param fs - The file handle for the filesystem
+ * @param l - The image being listed
+ * @param img - The disk image
  * @param cluster - The cluster to start at
  * @param maxClusters - Only used for root directories.
  *                      Indicates how many contiguous clusters to check
+ * @param path - Path of the directory, "" for the root
  */
-void scanDirectory(FILE* fs, int cluster, int maxClusters) {
-	int numFATSectors = fatInfo->numFATSectors;
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int endOfDir = 0;
-	int clusterCount = 0;
-	int nextCluster = cluster;
-	int curFATSector = -1;
+void listDirectory(Listing* l, Image* img, int cluster, int maxClusters, const char* path) {
+	l->path = path;
+	if (l->usage != NULL) {
+		scanDirectory(img, l->fatInfo, cluster, maxClusters, 1, usageEntry, l);
+		return;
+	}
+	if (listFormat != LIST_TEXT) {
+		scanDirectory(img, l->fatInfo, cluster, maxClusters, 1, listEntry, l);
+		return;
+	}
 	
-	if (fatInfo->fatType == 12) {
-		printf("FILENAME EXT       SIZE             MODIFIED\n");
+	if (l->fatInfo->fatType == 12) {
+		fprintf(l->out, "FILENAME EXT       SIZE             MODIFIED\n");
 	} else {
-		printf("FILENAME EXT       SIZE              CREATED    ACCESSED             MODIFIED\n");
+		fprintf(l->out, "FILENAME EXT       SIZE              CREATED    ACCESSED             MODIFIED\n");
 	}
 	
-	// malloc here just to be sure all frees have something to free
-	Sector fatSector = malloc(sizeofSector);
+	scanDirectory(img, l->fatInfo, cluster, maxClusters, 1, listEntry, l);
 	
-	while (!endOfDir) {
-		
-		// if we've got a good cluster
-		if ((fatInfo->fatType == 12 && nextCluster > RESERVED_12 && nextCluster < BAD_CLUSTER_12) ||
-			(fatInfo->fatType == 16 && nextCluster > RESERVED_16 && nextCluster < BAD_CLUSTER_16)
-		) {
-			
-			// get the correct address for this cluster
-			int absoluteCluster = getAbsoluteCluster(nextCluster);
-			
-			Sector fileSector = malloc(sizeofSector);
-			fseek(fs, sizeofSector * absoluteCluster, SEEK_SET);
-			fread(fileSector, sizeofSector, 1, fs);
-			
-			scanDirectorySector(fs, fileSector);
-			
-			free(fileSector);
-		} else {
-			
-			// otherwise stop searching
-			endOfDir = 1;
-			break;
-		}
-		
-		fatSector = getCorrectFATSector(fs, fatSector, curFATSector, nextCluster);
-		
-		// if doing root directory, increment the cluster count
-		if (maxClusters > 0) {
-			// next cluster = start cluster + how many done so far
-			clusterCount++;
-			nextCluster = cluster + clusterCount;
-			if (clusterCount >= maxClusters) {
-				endOfDir = 1;
-				break;
+	fprintf(l->out, "%5d file(s) %9ld bytes\n", l->filesFound, l->totalSize);
+}
+
+/**
+ * Hands the first cluster of an entry of the directory being analyzed
+ * to the usage count and queues it to be analyzed too if it is a subdirectory
+ * 
+ * @param img The disk image
+ * @param de The entry
+ * @param longName Its long name, or NULL if it has none
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param context The Listing of the image
+ */
+void usageEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context) {
+	Listing* l = context;
+	// the "." and ".." entries point back at chains that are already counted
+	if (de->attributes & ATTR_VOLUME_LABEL || de->filename[0] == DIRECTORY) {
+		return;
+	}
+	int cluster = getEntryCluster(l->fatInfo, de);
+	int isDir = (de->attributes & ATTR_SUB_DIR) != 0;
+	addUsageStart(l->usage, cluster, isDir);
+	if (isDir) {
+		queueDirectory(l->walk, cluster, "");
+	}
+}
+
+/**
+ * Prints how an analyzed volume is used
+ * 
+ * @param l The image that was analyzed
+ */
+void printUsage(Listing* l) {
+	VolumeUsage* u = l->usage;
+	int b;
+	if (listFormat == LIST_TEXT) {
+		fprintf(l->out, "%10d clusters %10d used %10d free %10d bad\n",
+			u->numEntries - 2, u->numUsed, u->numFree, u->numBad);
+		fprintf(l->out, "%10d files    %10d directories\n", u->numFiles, u->numDirs);
+		fprintf(l->out, "%10d fragmented files %10ld fragments\n", u->numFragmented, u->numFragments);
+		fprintf(l->out, "%10d lost chains %10d lost clusters\n", u->numLostChains, u->numLostClusters);
+		fprintf(l->out, "%10d cross-linked clusters\n", u->numCrossLinked);
+		fprintf(l->out, " FRAGMENTS      FILES\n");
+		for (b = 0; b < USAGE_BUCKETS; b++) {
+			char range[24];
+			int low = usageBucketLow(b);
+			int high = usageBucketLow(b + 1) - 1;
+			if (b == USAGE_BUCKETS - 1) {
+				sprintf(range, "%d+", low);
+			} else if (high > low) {
+				sprintf(range, "%d-%d", low, high);
+			} else {
+				sprintf(range, "%d", low);
 			}
-		} else {
-			// get the next cluster based on the current cluster
-			nextCluster = getNextCluster(fatSector, nextCluster);
+			fprintf(l->out, "%10s %10ld\n", range, u->histogram[b]);
 		}
+		return;
 	}
 	
-	free(fatSector);
-	
-	printf("%5d file(s) %9ld bytes\n", fatInfo->filesFound, fatInfo->totalSize);
+	FormatBuffer* output = l->output;
+	if (numImages > 1) {
+		formatLiteral(output, "{\"image\":");
+		formatJSONString(output, l->imageName, strlen(l->imageName));
+		formatLiteral(output, ",\"clusters\":");
+	} else {
+		formatLiteral(output, "{\"clusters\":");
+	}
+	formatInt(output, u->numEntries - 2);
+	formatLiteral(output, ",\"used\":");
+	formatInt(output, u->numUsed);
+	formatLiteral(output, ",\"free\":");
+	formatInt(output, u->numFree);
+	formatLiteral(output, ",\"bad\":");
+	formatInt(output, u->numBad);
+	formatLiteral(output, ",\"files\":");
+	formatInt(output, u->numFiles);
+	formatLiteral(output, ",\"dirs\":");
+	formatInt(output, u->numDirs);
+	formatLiteral(output, ",\"fragmented_files\":");
+	formatInt(output, u->numFragmented);
+	formatLiteral(output, ",\"fragments\":");
+	formatInt(output, u->numFragments);
+	formatLiteral(output, ",\"lost_chains\":");
+	formatInt(output, u->numLostChains);
+	formatLiteral(output, ",\"lost_clusters\":");
+	formatInt(output, u->numLostClusters);
+	formatLiteral(output, ",\"cross_linked\":");
+	formatInt(output, u->numCrossLinked);
+	// files with no fragments, 1, 2-3, 4-7 and so on
+	formatLiteral(output, ",\"histogram\":[");
+	for (b = 0; b < USAGE_BUCKETS; b++) {
+		if (b > 0) {
+			formatLiteral(output, ",");
+		}
+		formatInt(output, u->histogram[b]);
+	}
+	formatLiteral(output, "]}\n");
+}
+
+/**
+ * Prints a change found by comparing the image with a snapshot
+ * 
+ * @param change DIFF_ADDED, DIFF_CHANGED or DIFF_REMOVED
+ * @param de The entry
+ * @param path Path of the entry from the root directory
+ * @param context The Listing of the image
+ */
+void listChange(int change, const DirectoryEntry* de, const char* path, void* context) {
+	static const char* changeNames[] = { "added", "changed", "removed" };
+	Listing* l = context;
+	if (listFormat == LIST_TEXT) {
+		fprintf(l->out, "%-8s %s\n", changeNames[change], path);
+		return;
+	}
+	l->change = changeNames[change];
+	formatRecord(l, de, path, strlen(path));
+	l->change = NULL;
 }
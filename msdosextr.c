@@ -1,676 +1,603 @@
 /**
- * BootStrapSector is the first 512 bytes of the FAT.
- * Two byte fields are little-endian
+ * Extracts every file on a FAT12, FAT16 or FAT32 disk image into the current directory.
  *
- * The format of this sector is:
- * byte(s) contents
- * ------- -------------------------------------------------------
- *  00-02	first instruction of bootstrap routine
- *  03-10	OEM name
- *  11-12	number of bytes per sector
- *     13	number of sectors per cluster
- *  14-15	number of reserved sectors
- *     16	number of copies of the file allocation table
- *  17-18	number of entries in root directory
- *  19-20	total number of sectors
- *     21	media descriptor byte
- *  22-23	number of sectors in each copy of file allocation table
- *  24-25	number of sectors per track
- *  26-27	number of sides
- *  28-29	number of hidden sectors
- *  30-509	bootstrap routine and partition information
- *     510	hexadecimal 55
- *     511	hexadecimal AA
+ * With -o the whole tree is instead streamed to stdout as one tar or cpio
+ * archive, keeping each file's path and modification time, and progress
+ * messages go to stderr. Archive members are written in walk order by a
+ * single writer, so -j has no effect then.
+ *
+ * Given paths after the image, such as /DOCS/REPORT.TXT, only those files
+ * are extracted, and only the directories on the way to them are read;
+ * see fatlookup.h.
+ *
+ * Files and archive members are named by their VFAT long names where
+ * they have them, and a path given can use either name.
+ *
+ * With -D only the files added or changed since an earlier snapshot of
+ * the volume are extracted, and the ones removed are listed; the snapshot
+ * is another image of it or a directory index saved from one, as for
+ * msdosdir -D. Unchanged files are not read at all.
+ *
+ * With -c each file is checksummed with CRC32C or SHA-256 as its data is
+ * written, from the same buffer, and a manifest of "checksum  name" lines
+ * that sha256sum -c can check is written to -m (manifest.crc32c or
+ * manifest.sha256 by default). Names in it are the files' names when
+ * extracting into the current directory and their paths otherwise. -n
+ * only checksums the files, writing none of them; its manifest goes to
+ * stdout unless -m is given. -m or -n alone use SHA-256. See fathash.h.
+ *
+ * -S prints the counters in fatstats.h to stderr at the end, as text or
+ * as one JSON object.
+ *
+ * usage: msdosextr [-c crc32c|sha256] [-D snapshot] [-i stdio|mmap|uring] [-j threads] [-m manifest] [-n] [-o tar|cpio] [-S text|json] [-x index] filename [path...]
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include "fat.h"
+#include "fatindex.h"
+#include "fatwalk.h"
+#include "fatpattern.h"
+#include "fatdiff.h"
+#include "fatlookup.h"
+#include "fatarchive.h"
+#include "fathash.h"
+#include "fatstats.h"
 
-typedef unsigned char BYTE;
-typedef struct pair {
-	BYTE bytes[2];
-} BytePair;
-
-typedef struct triplet {
-	BYTE bytes[3];
-} ByteTriplet;
-
-typedef struct quad {
-	BYTE bytes[4];
-} ByteQuad;
+FATInfo* fatInfo;
+DirWalk* walk; // directories still to be extracted
+Arena* pathArena; // owns the path of every directory queued by the walk
 
-typedef struct bootsector {
-	ByteTriplet firstInstruction; // This is often a jump instruction to the boot sector code itself
-	BYTE OEM[8];
-	BytePair numBytesPerSector;
-	BYTE numSectorsPerCluster;
-	BytePair numReservedSectors;
-	BYTE numCopiesFAT;
-	BytePair numEntriesRootDir;
-	BytePair numSectors;
-	BYTE mediaDescriptor;
-	BytePair numSectorsInFAT;
-	BytePair numSectorsPerTrack;
-	BytePair numSides;
-	ByteQuad numHiddenSectors;
-	ByteQuad largeSectors;
-	BYTE physicalDiskNum;
-	BYTE currentHead;
-	BYTE signature;
-	ByteQuad volumeSN;
-	BYTE volumeLabel[11];
-	BYTE formatType[8]; // FAT12 or FAT16 in this program
-	BYTE bootstrap[448];
-	BYTE hex55AA[2]; // the last bytes of the boot sector are, by definition, 55 AA.  This is a sanity check.
-} BootSector;
+Archive* archive; // NULL when extracting into the current directory
+FILE* messages; // stdout, or stderr when stdout carries the archive or manifest
 
-typedef struct info {
-	int fatType;
-	int numClusters;
-	int numFATSectors;
-	int numCopiesFAT;
-	int sizeofSector;
-	int firstDataSector;
-	int numRootEntries;
-	int numRootClusters;
-	int reservedSectors;
-	int filesFound;
-	long totalSize;
-} FATInfo;
+int hashAlg = -1; // HASH_ algorithm for the manifest, or -1 for none
+int hashOnly; // checksum files without writing them
+FILE* manifest;
 
-FATInfo* fatInfo;
+// totals over every extracted file, updated by every extraction thread
+atomic_int filesFound;
+atomic_long totalSize;
 
-typedef BYTE* Sector;
-
-/*
- * 00-07	Filename
- * 08-10	Filename extension
- *    11	File attributes
- *    12	Reserved for use by WinNT
- *    13	Time created (tenth of a second)
- * 14-15	Time created
- * 		Hour	5 bits
- * 		Minutes	6 bits
- * 		Seconds	5 bits
- * 16-17	Date created
- * 		Year	7 bits
- * 		Month	4 bits
- * 		Day	5 bits
- * 18-19	Date last accessed
- * 20-21	Upper half of entry's first cluster, 0 for FAT12 and FAT16
- * 22-23	Time last modified
- * 24-25	Date last modified
- * 26-27	Lower half of entry's first cluster
- * 28-31	File size in bytes
- */
-typedef struct direntry {
-	BYTE filename[8];
-	BYTE extension[3];
-	BYTE attributes;
-	BYTE reserved;
-	BYTE timeCreatedTenthSec;
-	BytePair timeCreated;
-	BytePair dateCreated;
-	BytePair dateAccessed;
-	BytePair startingClusterUpper;
-	BytePair timeModified;
-	BytePair dateModified;
-	BytePair startingCluster;
-	ByteQuad fileSize;
-} DirectoryEntry;
 /*
- * Directory entry special values for first byte
- * 0x00	Filename never used.
- * 0xe5	The filename has been used, but the file has been deleted.
- * 0x05	The first character of the filename is actually 0xe5.
- * 0x2e	The entry is for a directory, not a normal file.
- * 	If the second byte is also 0x2e, the cluster field contains the cluster number of this directory's parent directory.
- *	If the parent directory is the root directory (which is statically allocated and doesn't have a cluster number), cluster number 0x0000 is specified here.
+ * Files waiting to be extracted when running with more than one thread.
+ * The directory walk fills this in before any thread starts.
  */
-const int NOT_USED = 0x00;
-const int DELETED = 0xe5;
-const int ACTUAL_E5 = 0x05;
-const int DIRECTORY = 0x2e;
+typedef struct job {
+	DirectoryEntry entry;
+	const char* path; // the file's path, in jobArena
+	char digest[HASH_MAX_HEX]; // its checksum once extracted, "" if none
+} Job;
 
-// Directory entry attributes
-const int ATTR_READ_ONLY = 0x01; // File is read only
-const int ATTR_HIDDEN = 0x02; // Hidden file
-const int ATTR_SYSTEM_FILE = 0x04; // Indicates a system file. These are hidden as well
-const int ATTR_VOLUME_LABEL = 0x08; // Disk's volume label. Only found in the root directory
-const int ATTR_SUB_DIR = 0x10; // The entry describes a subdirectory
-const int ATTR_ARCHIVE = 0x20; // Archive flag. Set when the file is modified. Used by backup programs
-const int ATTR_UNUSED1 = 0x40; // Not used; must be set to 0
-const int ATTR_UNUSED2 = 0x80; // Not used; must be set to 0
+Job* jobs;
+Arena* jobArena;
+int numJobs;
+int jobCapacity;
+atomic_int nextJob;
 
-// FAT entry special values
-const int AVAILABLE_12 = 0x000;
-const int AVAILABLE_16 = 0x0000;
-const int RESERVED_12 = 0x001;
-const int RESERVED_16 = 0x0001;
-const int BAD_CLUSTER_12 = 0xff7;
-const int BAD_CLUSTER_16 = 0xfff7;
-const int END_MARKER_12 = 0xff8;
-const int END_MARKER_16 = 0xfff8;
+int numThreads = 1;
 
-const int FIRST_ROOT_CLUSTER = 2;
-
-int le2be2(BytePair bytes);
-int le2be3(ByteTriplet bytes, int which);
-int le2be4(ByteQuad bytes);
-int getNumberClusters(BootSector* bs);
-int getFATType(BootSector* bs);
-int getAbsoluteCluster(int relativeCluster);
-int clusterRelativeToRoot(int absoluteCluster);
-int getNextCluster(Sector fatSector, int cluster);
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster);
-void extractFile(FILE* fs, DirectoryEntry* de);
-void readBootStrapSector(FILE* fs, BootSector* bs);
-void scanDirectorySector(FILE* fs, Sector directory);
-void scanDirectory(FILE* fs, int cluster, int maxClusters);
-void hexDump(char *desc, void *addr, int len);
+int hashChunk(const unsigned char* data, long len, void* context);
+void extractFile(Image* img, const DirectoryEntry* de, const char* path, char* digest);
+void addManifestLine(const char* digest, const char* path);
+void extractWithManifest(Image* img, const DirectoryEntry* de, const char* path);
+void addJob(const DirectoryEntry* de, const char* path);
+void* extractWorker(void* img);
+void extractJobs(Image* img);
+void extractEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context);
+void extractDirectory(Image* img, int cluster, int maxClusters, const char* path);
+int extractPaths(Image* img, char** paths, int numPaths);
+void extractChange(int change, const DirectoryEntry* de, const char* path, void* img);
 
 int main (int argc, char *argv[]) {
-	if (argc != 2) {
-		printf("usage: %s filename\n", argv[0]);
+	int backend = IMAGE_STDIO;
+	const char* indexFile = NULL;
+	const char* snapshotFile = NULL;
+	const char* manifestFile = NULL;
+	int format = -1;
+	int statsOutput = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:D:i:j:m:no:S:x:")) != -1) {
+		if (opt == 'c') {
+			hashAlg = hashAlgorithm(optarg);
+			if (hashAlg < 0) {
+				backend = -1;
+			}
+		} else if (opt == 'D') {
+			snapshotFile = optarg;
+		} else if (opt == 'i') {
+			backend = imageBackend(optarg);
+		} else if (opt == 'm') {
+			manifestFile = optarg;
+		} else if (opt == 'n') {
+			hashOnly = 1;
+		} else if (opt == 'o') {
+			format = archiveFormat(optarg);
+			if (format < 0) {
+				backend = -1;
+			}
+		} else if (opt == 'S') {
+			statsOutput = statsFormat(optarg);
+			if (statsOutput < 0) {
+				backend = -1;
+			}
+		} else if (opt == 'x') {
+			indexFile = optarg;
+		} else if (opt == 'j') {
+			numThreads = atoi(optarg);
+		} else {
+			backend = -1;
+		}
+	}
+	if (backend < 0 || numThreads < 1 || optind >= argc || (snapshotFile != NULL && optind + 1 < argc)
+		|| (hashOnly && format >= 0)
+	) {
+		printf("usage: %s [-c crc32c|sha256] [-D snapshot] [-i stdio|mmap|uring] [-j threads] [-m manifest] [-n] [-o tar|cpio] [-S text|json] [-x index] filename [path...]\n", argv[0]);
 		return 0;
 	}
-	// assume argv[1] is a filename to open
-	FILE* file = fopen(argv[1], "r");
-	if (file == 0) {
-		printf("Could not open file %s\n", argv[1]);
+	// assume the next argument is a filename to open, and any after it paths in it
+	messages = stdout;
+	if (format >= 0) {
+		messages = stderr;
+		archive = openArchive(stdout, format);
+		// every member goes through the one stream, in order
+		numThreads = 1;
+	}
+	if ((hashOnly || manifestFile != NULL) && hashAlg < 0) {
+		hashAlg = HASH_SHA256;
+	}
+	if (hashAlg >= 0) {
+		if (manifestFile == NULL && hashOnly) {
+			messages = stderr;
+			manifest = stdout;
+		} else {
+			char defaultFile[32];
+			snprintf(defaultFile, sizeof(defaultFile), "manifest.%s", hashName(hashAlg));
+			if (manifestFile == NULL) {
+				manifestFile = defaultFile;
+			}
+			manifest = fopen(manifestFile, "w");
+			if (manifest == NULL) {
+				fprintf(messages, "Could not open the manifest %s\n", manifestFile);
+				return 1;
+			}
+		}
+	}
+	// read before the index is opened, which may be the same file
+	Snapshot* snapshot = NULL;
+	if (snapshotFile != NULL) {
+		snapshot = openSnapshot(snapshotFile, backend);
+		if (snapshot == NULL) {
+			fprintf(messages, "Could not open the snapshot %s\n", snapshotFile);
+			return 1;
+		}
+	}
+	Image* img = openImage(argv[optind], 0, backend);
+	if (img == 0) {
+		fprintf(messages, "Could not open file %s\n", argv[optind]);
 		return 1;
 	}
+	long phase = startPhase();
 	BootSector* bs = malloc(sizeof(BootSector));
-	readBootStrapSector(file, bs);
-	scanDirectory(file, FIRST_ROOT_CLUSTER, fatInfo->numRootClusters);
+	fatInfo = readBootStrapSector(img, bs);
+	if (indexFile != NULL) {
+		fatInfo->index = openDirIndex(img, fatInfo, indexFile);
+	}
+	endPhase(PHASE_BOOT, phase);
+	
+	int status = 0;
+	phase = startPhase();
+	long extracting = atomic_load(&fatPhaseNanos[PHASE_EXTRACT]);
+	if (optind + 1 < argc) {
+		status = extractPaths(img, argv + optind + 1, argc - optind - 1);
+	} else if (snapshot != NULL) {
+		DiffStats stats;
+		diffSnapshot(snapshot, img, fatInfo, extractChange, img, &stats);
+		freeSnapshot(snapshot);
+	} else {
+		pathArena = newArena(64 * 1024);
+		walk = startDirWalk(img, fatInfo, "");
+		int cluster;
+		int maxClusters;
+		void* context;
+		while (nextDirectory(walk, &cluster, &maxClusters, &context)) {
+			extractDirectory(img, cluster, maxClusters, context);
+		}
+		freeDirWalk(walk);
+		freeArena(pathArena);
+	}
+	// files extracted along the way count as extraction, not walking
+	endPhase(PHASE_WALK, phase + atomic_load(&fatPhaseNanos[PHASE_EXTRACT]) - extracting);
+	if (numThreads > 1) {
+		extractJobs(img);
+	}
+	if (numThreads > 1 || optind + 1 < argc || snapshotFile != NULL) {
+		fprintf(messages, "%5d file(s) %9ld bytes\n", filesFound, totalSize);
+	}
+	
+	if (archive != NULL && !closeArchive(archive)) {
+		fprintf(messages, "Error writing the archive!\n");
+		status = 1;
+	}
+	if (manifest != NULL && manifest != stdout && fclose(manifest) != 0) {
+		fprintf(messages, "Error writing the manifest!\n");
+		status = 1;
+	}
+	if (fatInfo->index != NULL && !saveDirIndex(fatInfo->index, img, fatInfo)) {
+		fprintf(messages, "Could not save the directory index %s\n", indexFile);
+	}
 	
 	free(bs);
-	fclose(file);
+	freeFATInfo(fatInfo);
+	closeImage(img);
+	if (statsOutput >= 0) {
+		fflush(stdout);
+		printStats(stderr, statsOutput);
+	}
 	
-	return 0;
+	return status;
 }
 
+// where hashChunk sends each chunk
+typedef struct hashsink {
+	Hasher hasher;
+	FILE* out; // NULL when only checksumming
+} HashSink;
+
 /**
- * Converts a two-byte little-endian value to a big-endian integer
+ * Adds a chunk of a file to its checksum, then writes it out
  * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
+ * @param data The chunk
+ * @param len Its length
+ * @param context The HashSink
+ * @return 1 on success, otherwise 0
  */
-int le2be2(BytePair bytes) {
-	return (bytes.bytes[0] + (bytes.bytes[1] << 8));
+int hashChunk(const unsigned char* data, long len, void* context) {
+	HashSink* sink = context;
+	updateHash(&sink->hasher, data, len);
+	return sink->out == NULL || fwrite(data, len, 1, sink->out) == 1;
 }
 
 /**
- * Extracts a twelve-bit little-endian value from a trio of bytes
- * and converts it to a big-endian integer
+ * Reads a file's data from the disk image and writes it to file,
+ * or appends it to the archive
  * 
- * @param bytes The bytes to convert
- * @param which The first or second value stored in `bytes`
- * @return The extracted value
+ * @param img The disk image
+ * @param de The directory entry of the file to extract
+ * @param path Path of the file from the root directory; outside an archive
+ *             only its last component, the file's name, is used
+ * @param digest Receives the file's checksum if hashAlg is set, or "" if
+ *               there is none; must hold HASH_MAX_HEX bytes
  */
-int le2be3(ByteTriplet bytes, int which) {
-	if (which != 1 && which != 2) {
-		which = 1;
-	}
+void extractFile(Image* img, const DirectoryEntry* de, const char* path, char* digest) {
+	const char* filename = finalName(path);
+	const char* shownName = archive != NULL || hashOnly ? path : filename;
+	digest[0] = 0;
+	
+	fprintf(messages, "%s file %s\n", hashOnly ? "Checksumming" : "Extracting", shownName);
 	
-	int firstByte = (int)bytes.bytes[0];
-	int secondByte = (int)bytes.bytes[1];
-	int thirdByte = (int)bytes.bytes[2];
-	int result = 0;
-	//UV WX YZ --> XUV YZW
+	int sizeofCluster = fatInfo->sizeofCluster;
+	long size = entryFileSize(de);
 	
-	if (which == 1) {
-		result = firstByte; // UV
-		result += ((secondByte & 0x0f) << 8); // X
+	FILE *f;
+	if (hashOnly) {
+		f = NULL;
+	} else if (archive != NULL) {
+		f = archive->out;
+		if (!writeArchiveHeader(archive, path, 0, size, fatTimestamp(entryDateModified(de), entryTimeModified(de)))) {
+			fprintf(messages, "Error writing file %s!\n", path);
+			return;
+		}
 	} else {
-		result = (thirdByte << 4); // YZ
-		result += ((secondByte & 0xf0) >> 4); // W
+		f = fopen(filename, "wb");
+		if (f == NULL) {
+			printf("Error opening file %s to write!\n", filename);
+			return;
+		}
 	}
 	
-	return result;
-}
-
-/**
- * Converts a four-byte little-endian value to a big-endian integer
- * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
- */
-int le2be4(ByteQuad bytes) {
-	int res = bytes.bytes[0];
-	int i;
-	for (i = 1; i < 4; i++) {
-		res += bytes.bytes[i] << (8 * i);
+	// resolve the chain up front so each run of consecutive
+	// clusters can be copied with one large request
+	ClusterChain chain = { 0 };
+	int maxClusters = (size + sizeofCluster - 1) / sizeofCluster;
+	getClusterChain(fatInfo->table, getEntryCluster(fatInfo, de), maxClusters, &chain);
+	
+	ImageRange* ranges = malloc((chain.numRuns + 1) * sizeof(ImageRange));
+	int numRanges = 0;
+	int r;
+	for (r = 0; r < chain.numRuns && size > 0; r++) {
+		long sizeToCopy = (long)chain.runs[r].length * sizeofCluster;
+		if (sizeToCopy > size) {
+			sizeToCopy = size;
+		}
+		
+		ranges[numRanges].offset = getClusterOffset(fatInfo, chain.runs[r].start);
+		ranges[numRanges].len = sizeToCopy;
+		numRanges++;
+		size -= sizeToCopy;
 	}
-	return res;
-}
-
-/**
- * Calculates the total number of clusters in the filesystem
- * 
- * @param bs The bootsector of the filesystem
- * @return The number of clusters in the filesystem
- */
-int getNumberClusters(BootSector* bs) {
-	unsigned int root_dir_sectors = ((le2be2(bs->numEntriesRootDir) * 32) + (le2be2(bs->numBytesPerSector) - 1)) / le2be2(bs->numBytesPerSector);
-	unsigned int data_sectors;
-	if (le2be2(bs->numSectors) != 0) {
-		data_sectors = le2be2(bs->numSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
+	
+	int ok;
+	HashSink sink;
+	if (hashAlg >= 0) {
+		// each chunk is checksummed from the buffer it is written from
+		startHash(&sink.hasher, hashAlg);
+		sink.out = f;
+		ok = streamImageRanges(img, ranges, numRanges, hashChunk, &sink);
 	} else {
-		data_sectors = le2be4(bs->largeSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
+		// the whole file is handed over at once so the uring
+		// backend can keep reads of every run in flight
+		ok = copyImageRanges(img, ranges, numRanges, f);
+	}
+	if (archive != NULL) {
+		// a short chain still gets a member of the size in its header
+		long copied = entryFileSize(de) - size;
+		static const unsigned char zero = 0;
+		while (ok && copied < entryFileSize(de)) {
+			ok = fputc(0, f) != EOF;
+			if (hashAlg >= 0) {
+				updateHash(&sink.hasher, &zero, 1);
+			}
+			copied++;
+		}
+		ok = ok && finishArchiveMember(archive, copied);
+	} else if (f != NULL) {
+		ok = fclose(f) == 0 && ok;
+	}
+	if (!ok) {
+		fprintf(messages, "Error writing file %s!\n", shownName);
+	} else if (hashAlg >= 0) {
+		finishHash(&sink.hasher, digest);
 	}
-	return (int)(data_sectors / bs->numSectorsPerCluster);
+	
+	free(ranges);
+	freeClusterChain(&chain);
+	
+	filesFound++;
+	totalSize += entryFileSize(de);
 }
 
 /**
- * Determines if the FAT is FAT12, FAT16, or FAT32
+ * Lists a file in the manifest
  * 
- * @param bs The bootsector of the filesystem
- * @return The number version of FAT
+ * @param digest Its checksum, or "" to leave it out
+ * @param path Path of the file from the root directory
  */
-int getFATType(BootSector* bs) {
-	int total_clusters = getNumberClusters(bs);
-	if (total_clusters < 4085) {
-		return 12;
-	} else {
-		if (total_clusters < 65525) {
-			return 16;
-		} else {
-			return 32;
-		}
+void addManifestLine(const char* digest, const char* path) {
+	if (manifest != NULL && digest[0] != 0) {
+		fprintf(manifest, "%s  %s\n", digest, archive != NULL || hashOnly ? path : finalName(path));
 	}
 }
 
 /**
- * Calculates a cluster's actual position in the user data section
- * because of the fact that clusters are numbered starting at 2
+ * Extracts a file on this thread, listing it in the manifest
  * 
- * @param relativeCluster The cluster whose position is to be calculated
- * @return The actual position of the cluster in the user data section
+ * @param img The disk image
+ * @param de The directory entry of the file to extract
+ * @param path Path of the file from the root directory
  */
-int getAbsoluteCluster(int relativeCluster) {
-	return relativeCluster - 2 + fatInfo->firstDataSector;
+void extractWithManifest(Image* img, const DirectoryEntry* de, const char* path) {
+	char digest[HASH_MAX_HEX];
+	long phase = startPhase();
+	extractFile(img, de, path, digest);
+	endPhase(PHASE_EXTRACT, phase);
+	addManifestLine(digest, path);
 }
 
 /**
- * Calculates a cluster's position in the filesystem
- * after the boot sector and FATs
+ * Queues a file to be extracted once the directory walk is done
  * 
- * @param absoluteCluster The cluster's position in the user data section
- * @return The position of the cluster after the boot sector and FATs
+ * @param de The directory entry of the file to extract
+ * @param path Path of the file from the root directory
  */
-int clusterRelativeToRoot(int absoluteCluster) {
-	return absoluteCluster + fatInfo->numRootClusters;
+void addJob(const DirectoryEntry* de, const char* path) {
+	if (numJobs == jobCapacity) {
+		jobCapacity = jobCapacity ? jobCapacity * 2 : 64;
+		jobs = realloc(jobs, jobCapacity * sizeof(Job));
+	}
+	if (jobArena == NULL) {
+		jobArena = newArena(64 * 1024);
+	}
+	int pathLen = strlen(path);
+	char* copy = arenaAlloc(jobArena, pathLen + 1);
+	memcpy(copy, path, pathLen + 1);
+	jobs[numJobs].entry = *de;
+	jobs[numJobs].path = copy;
+	numJobs++;
 }
 
 /**
- * Reads information from the bootstrap sector into a BootSector object
- *
- * @param fs File handle to the disk image
- * @param bs The BootSector object to receive the data
+ * Extracts queued files until there are none left
+ * 
+ * @param img The disk image, shared by all workers
+ * @return NULL
  */
-void readBootStrapSector(FILE* fs, BootSector* bs) {
-	fread(bs, sizeof(BootSector), 1, fs);
-	
-	fatInfo = malloc(sizeof(FATInfo));
-	fatInfo->fatType = getFATType(bs);
-	fatInfo->numFATSectors = le2be2(bs->numSectorsInFAT);
-	fatInfo->numCopiesFAT = bs->numCopiesFAT;
-	fatInfo->sizeofSector = le2be2(bs->numBytesPerSector);
-	fatInfo->firstDataSector = fatInfo->numCopiesFAT * le2be2(bs->numSectorsInFAT) + 1;
-	fatInfo->numRootEntries = le2be2(bs->numEntriesRootDir);
-	fatInfo->numRootClusters = fatInfo->numRootEntries * sizeof(DirectoryEntry) / fatInfo->sizeofSector;
-	fatInfo->reservedSectors = le2be2(bs->numReservedSectors);
-	fatInfo->filesFound = 0;
-	fatInfo->totalSize = 0;
+void* extractWorker(void* img) {
+	int job;
+	while ((job = atomic_fetch_add(&nextJob, 1)) < numJobs) {
+		long phase = startPhase();
+		extractFile(img, &jobs[job].entry, jobs[job].path, jobs[job].digest);
+		endPhase(PHASE_EXTRACT, phase);
+	}
+	return NULL;
 }
 
 /**
- * Reads a file's data from the disk image and writes it to file
+ * Extracts every queued file on a pool of numThreads threads
  * 
- * @param fs A file handle to the disk image
- * @param de The directory entry of the file to extract
+ * @param img The disk image
  */
-void extractFile(FILE* fs, DirectoryEntry* de) {
-	int i;
-	for (i = 7; i > 0; i--) {
-		if (de->filename[i] != ' ') {
-			break;
-		} else {
-			de->filename[i] = 0;
-		}
-	}
-	for (i = 2; i >= 0; i--) {
-		if (de->extension[i] != ' ') {
-			break;
-		} else {
-			de->extension[i] = 0;
-		}
-	}
+void extractJobs(Image* img) {
+	pthread_t* threads = malloc(numThreads * sizeof(pthread_t));
+	int started;
 	
-	// create a string with the file's name
-	char filename[13];
-	int pos = 0;
-	// loop through until the end of the filename
-	for (i = 0; i < 8; i++) {
-		if (de->filename[i]) {
-			filename[pos] = de->filename[i];
-			pos++;
-		} else {
+	atomic_store(&nextJob, 0);
+	for (started = 0; started < numThreads; started++) {
+		if (pthread_create(&threads[started], NULL, extractWorker, img) != 0) {
 			break;
 		}
 	}
-	// if there is an extension
-	// add the '.' and loop through extension
-	if (de->extension[0]) {
-		filename[pos] = '.';
-		pos++;
-		for (i = 0; i < 3; i++) {
-			if (de->extension[i]) {
-				filename[pos] = de->extension[i];
-				pos++;
-			} else {
-				break;
-			}
-		}
+	// if no thread could be started, do the work here instead
+	if (started == 0) {
+		extractWorker(img);
 	}
-	// make sure the string is properly terminated
-	filename[pos] = 0;
-	
-	printf("Extracting file %s\n", filename);
 	
-	int numFATSectors = fatInfo->numFATSectors;
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int endOfFile = 0;
-	int clusterCount = 0;
-	int nextCluster = le2be2(de->startingCluster);
-	int curFATSector = -1;
-	int size = le2be4(de->fileSize);
-	
-	FILE *f = fopen(filename, "wb");
-	if (f == NULL) {
-		printf("Error opening file %s to write!\n", filename);
-		return;
+	int t;
+	for (t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
 	}
-	
-	// malloc here just to be sure all frees have something to free
-	Sector fatSector = malloc(sizeofSector);
-	
-	while (!endOfFile) {
-		
-		// if we've got a good cluster
-		if ((fatInfo->fatType == 12 && nextCluster > RESERVED_12 && nextCluster < BAD_CLUSTER_12) ||
-			(fatInfo->fatType == 16 && nextCluster > RESERVED_16 && nextCluster < BAD_CLUSTER_16)
-		) {
-			
-			// get the correct address for this cluster
-			int absoluteCluster = clusterRelativeToRoot(getAbsoluteCluster(nextCluster));
-			int sizeToRead;
-			if (size > sizeofSector) {
-				sizeToRead = sizeofSector;
-			} else {
-				sizeToRead = size;
-			}
-			
-			Sector fileSector = malloc(sizeToRead);
-			fseek(fs, sizeofSector * absoluteCluster, SEEK_SET);
-			fread(fileSector, sizeToRead, 1, fs);
-			
-			// write out the sector
-			//hexDump("file sector", fileSector, sizeToRead);
-			
-			fwrite(fileSector, sizeToRead, 1, f);
-			
-			free(fileSector);
-			
-			size -= sizeofSector;
-			if (size <= 0) {
-				endOfFile = 1;
-				break;
-			}
-		} else {
-			
-			// otherwise stop searching
-			endOfFile = 1;
-			break;
-		}
-		
-		fatSector = getCorrectFATSector(fs, fatSector, curFATSector, nextCluster);
-		
-		// get the next cluster based on the current cluster
-		nextCluster = getNextCluster(fatSector, nextCluster);
+	// listed in walk order, whichever thread finished first
+	int job;
+	for (job = 0; job < numJobs; job++) {
+		addManifestLine(jobs[job].digest, jobs[job].path);
 	}
 	
-	free(fatSector);
-	fclose(f);
-	
-	fatInfo->filesFound++;
-	fatInfo->totalSize += le2be4(de->fileSize);				
+	free(threads);
+	free(jobs);
+	freeArena(jobArena);
+	jobs = NULL;
+	jobArena = NULL;
+	numJobs = 0;
+	jobCapacity = 0;
 }
 
 /**
- * Scans a sector of a directory and extracts each file
+ * Extracts an entry of a directory, or queues its contents
+ * to be extracted if it is a subdirectory
  * 
- * @param fs - The file handle for the filesystem
- * @param directory - The sector to scan
+ * @param img The disk image
+ * @param de The entry
+ * @param longName Its long name, or NULL if it has none
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param context Path of the directory being scanned, "" for the root
  */
-void scanDirectorySector(FILE* fs, Sector directory) {
-	int sizeofDirEntry = sizeof(DirectoryEntry);
-	int entriesPerSector = fatInfo->sizeofSector / sizeofDirEntry;
-	
-	int e;
-	for (e = 0; e < entriesPerSector; e++) {
-		int b;
-		int offset = e * sizeofDirEntry;
+void extractEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context) {
+	if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
+		&& !(de->attributes & ATTR_VOLUME_LABEL)
+	) {
+		// only directories keep their path, for the entries they hold
+		const char* parent = context;
+		char name[ENTRY_NAME_MAX];
+		int nameLen = entryLongName(de, longName, name);
+		int parentLen = strlen(parent);
+		char path[parentLen + nameLen + 2];
+		if (parentLen > 0) {
+			memcpy(path, parent, parentLen);
+			path[parentLen++] = '/';
+		}
+		memcpy(path + parentLen, name, nameLen + 1);
 		
-		if (directory[offset] != DELETED && directory[offset] != NOT_USED) {
-			DirectoryEntry* de = malloc(sizeofDirEntry);
-			for (b = 0; b < 8; b++) {
-				de->filename[b] = directory[offset + b];
-			}
-			if (de->filename[0] == ACTUAL_E5) {
-				de->filename[0] = 0xe5;
-			}
-			for (b = 0; b < 3; b++) {
-				de->extension[b] = directory[offset + 8 + b];
-			}
-			de->attributes = directory[offset + 11];
-			de->reserved = directory[offset + 12];
-			de->timeCreatedTenthSec = directory[offset + 13];
-			de->timeCreated.bytes[0] = directory[offset + 14];
-			de->timeCreated.bytes[0] = directory[offset + 15];
-			de->dateCreated.bytes[0] = directory[offset + 16];
-			de->dateCreated.bytes[0] = directory[offset + 17];
-			de->dateAccessed.bytes[0] = directory[offset + 18];
-			de->dateAccessed.bytes[0] = directory[offset + 19];
-			de->startingClusterUpper.bytes[0] = directory[offset + 20];
-			de->startingClusterUpper.bytes[0] = directory[offset + 21];
-			de->timeModified.bytes[0] = directory[offset + 22];
-			de->timeModified.bytes[1] = directory[offset + 23];
-			de->dateModified.bytes[0] = directory[offset + 24];
-			de->dateModified.bytes[1] = directory[offset + 25];
-			de->startingCluster.bytes[0] = directory[offset + 26];
-			de->startingCluster.bytes[1] = directory[offset + 27];
-			for (b = 0; b < 4; b++) {
-				de->fileSize.bytes[b] = directory[offset + 28 + b];
-			}
-			
-			if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
-				&& !(de->attributes & ATTR_VOLUME_LABEL)
-			) {
-				if (directory[offset] == DIRECTORY || de->attributes & ATTR_SUB_DIR) {
-					if (directory[offset + 1] != DIRECTORY) {
-						// don't scan if second byte in entry is also DIRECTORY
-						// this indicates that the cluster points to the parent
-						// which will result in infinite recursion
-						scanDirectory(fs, le2be2(de->startingCluster), 0);
-					}
-				} else {
-					// don't want to try to extract a directory
-					extractFile(fs, de);
+		if (de->filename[0] == DIRECTORY || de->attributes & ATTR_SUB_DIR) {
+			if (de->filename[0] != DIRECTORY) {
+				// don't scan the "." and ".." entries
+				// they point back at this directory and its parent
+				// which will result in infinite recursion
+				// the subdirectory is scanned with the next level
+				char* dirPath = arenaAlloc(pathArena, parentLen + nameLen + 1);
+				memcpy(dirPath, path, parentLen + nameLen + 1);
+				queueDirectory(walk, getEntryCluster(fatInfo, de), dirPath);
+				
+				// the walk reaches a directory only after its parent,
+				// so the archive has every parent before its children
+				if (archive != NULL && !writeArchiveHeader(archive, path, 1, 0,
+					fatTimestamp(entryDateModified(de), entryTimeModified(de)))) {
+					fprintf(messages, "Error writing directory %s!\n", path);
 				}
 			}
-			
-			free(de);
+		} else if (numThreads > 1) {
+			// extracted by the thread pool after the walk
+			addJob(de, path);
+		} else {
+			// don't want to try to extract a directory
+			extractWithManifest(img, de, path);
 		}
 	}
 }
 
 /**
- * Gets the next cluster in a file's cluster chain
+ * Scans through a directory and extracts its contents
  * 
- * @param fatSector The sector of the FAT containing the current cluster
- * @param cluster The current cluster in the chain
- * @return The next cluster in the chain
+ * @param img - The disk image
+ * @param cluster - The cluster to start at
+ * @param maxClusters - Only used for root directories.
+ *                      Indicates how many contiguous clusters to check
+ * @param path - Path of the directory, "" for the root
  */
-int getNextCluster(Sector fatSector, int cluster) {
-	int nextCluster;
-	int offset;
-	// even: i / 2 * 3
-	// odd: (i - 1) / 2 * 3 + 1
-	if (fatInfo->fatType == 12) {
-		ByteTriplet *bt = malloc(sizeof(ByteTriplet));
-		if (cluster % 2) {
-			offset = (cluster - 1) / 2 * 3 + 1;
-			bt->bytes[1] = fatSector[offset];
-			bt->bytes[2] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 2);
-		} else {
-			offset = cluster / 2 * 3;
-			bt->bytes[0] = fatSector[offset];
-			bt->bytes[1] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 1);
-		}
-		free(bt);
-	} else if (fatInfo->fatType == 16) {
-		BytePair *bp = malloc(sizeof(BytePair));
-		offset = cluster * 2;
-		bp->bytes[0] = fatSector[offset];
-		bp->bytes[1] = fatSector[offset + 1];
-		nextCluster = le2be2(*bp);
-		free(bp);
-	} else {
-		nextCluster = -1;
+void extractDirectory(Image* img, int cluster, int maxClusters, const char* path) {
+	scanDirectory(img, fatInfo, cluster, maxClusters, 1, extractEntry, (void*)path);
+	
+	if (numThreads == 1) {
+		fprintf(messages, "%5d file(s) %9ld bytes\n", filesFound, totalSize);
 	}
-	return nextCluster;
 }
 
 /**
- * Makes sure the correct FAT sector has been read in to get
- * the next cluster in a chain
+ * Extracts the files at a list of paths, reading only
+ * the directories on the way to each of them
  * 
- * @param fs A file handle to the disk image
- * @param fatSector The currently held FAT sector
- * @param curFATSector The position of `fatSector` in the FAT
- * @param nextCluster The cluster that will be checked
- * @return The FAT sector that `nextCluster` is within
+ * @param img The disk image
+ * @param paths Paths from the root directory, such as /DOCS/REPORT.TXT
+ * @param numPaths Number of paths
+ * @return 0 if every path is a file that was found, otherwise 1
  */
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster) {
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int entriesPerFATSector;
-	if (fatInfo->fatType == 12) {
-		entriesPerFATSector = sizeofSector * 2 / 3;
-	} else if (fatInfo->fatType == 16) {
-		entriesPerFATSector = sizeofSector / 2;
-	} else {
-		return fatSector;
-	}
-	
-	// check if the cluster being searched for is within the
-	// currently loaded FAT sector. If not, get the right one
-	
-	// the smallest cluster available in this FAT sector
-	int fatSectorMin = curFATSector * entriesPerFATSector;
-	
-	// if cluster being searched for is less than the lowest
-	// available or higher than the highest available
-	if (nextCluster < fatSectorMin || nextCluster > (fatSectorMin + entriesPerFATSector)) {
-		
-		// get the sector num required to contain nextCluster
-		curFATSector = sizeofSector * (nextCluster / entriesPerFATSector);
+int extractPaths(Image* img, char** paths, int numPaths) {
+	int status = 0;
+	int p;
+	FoundEntry* found = malloc(sizeof(FoundEntry));
+	for (p = 0; p < numPaths; p++) {
+		if (!lookupPath(img, fatInfo, paths[p], LOOKUP_LIVE, found)
+			|| found->entry.attributes & (ATTR_HIDDEN | ATTR_SYSTEM_FILE | ATTR_SUB_DIR)
+		) {
+			fprintf(messages, "No file %s\n", paths[p]);
+			status = 1;
+			continue;
+		}
 		
-		// free the existing FAT sector
-		free(fatSector);
+		// the archive gets the path with the names as they are on disk
+		char name[ENTRY_NAME_MAX];
+		int nameLen = entryLongName(&found->entry, found->longName, name);
+		int parentLen = strlen(found->parent);
+		char fullPath[parentLen + nameLen + 2];
+		memcpy(fullPath, found->parent, parentLen);
+		if (parentLen > 0) {
+			fullPath[parentLen++] = '/';
+		}
+		memcpy(fullPath + parentLen, name, nameLen + 1);
 		
-		// malloc and read the new sector
-		fatSector = malloc(sizeofSector);
-		fseek(fs, startFAT + sizeofSector * curFATSector, SEEK_SET);
-		fread(fatSector, sizeofSector, 1, fs);
+		if (numThreads > 1) {
+			addJob(&found->entry, fullPath);
+		} else {
+			extractWithManifest(img, &found->entry, fullPath);
+		}
 	}
-	
-	return fatSector;
+	free(found);
+	return status;
 }
 
 /**
- * Scans through a directory and lists its contents
+ * Extracts a file that was added or changed since a snapshot,
+ * or notes one that was removed
  * 
- * @param fs - The file handle for the filesystem
- * @param cluster - The cluster to start at
- * @param maxClusters - Only used for root directories.
- *                      Indicates how many contiguous clusters to check
+ * @param change DIFF_ADDED, DIFF_CHANGED or DIFF_REMOVED
+ * @param de The entry
+ * @param path Path of the entry from the root directory
+ * @param img The disk image
  */
-void scanDirectory(FILE* fs, int cluster, int maxClusters) {
-	int numFATSectors = fatInfo->numFATSectors;
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int endOfDir = 0;
-	int clusterCount = 0;
-	int nextCluster = cluster;
-	int curFATSector = -1;
-	
-	// malloc here just to be sure all frees have something to free
-	Sector fatSector = malloc(sizeofSector);
-	
-	while (!endOfDir) {
-		
-		// if we've got a good cluster
-		if ((fatInfo->fatType == 12 && nextCluster > RESERVED_12 && nextCluster < BAD_CLUSTER_12) ||
-			(fatInfo->fatType == 16 && nextCluster > RESERVED_16 && nextCluster < BAD_CLUSTER_16)
-		) {
-			
-			// get the correct address for this cluster
-			int absoluteCluster = getAbsoluteCluster(nextCluster);
-			
-			Sector fileSector = malloc(sizeofSector);
-			fseek(fs, sizeofSector * absoluteCluster, SEEK_SET);
-			fread(fileSector, sizeofSector, 1, fs);
-			
-			scanDirectorySector(fs, fileSector);
-			
-			free(fileSector);
-		} else {
-			
-			// otherwise stop searching
-			endOfDir = 1;
-			break;
-		}
-		
-		fatSector = getCorrectFATSector(fs, fatSector, curFATSector, nextCluster);
-		
-		// if doing root directory, increment the cluster count
-		if (maxClusters > 0) {
-			// next cluster = start cluster + how many done so far
-			clusterCount++;
-			nextCluster = cluster + clusterCount;
-			if (clusterCount >= maxClusters) {
-				endOfDir = 1;
-				break;
-			}
-		} else {
-			// get the next cluster based on the current cluster
-			nextCluster = getNextCluster(fatSector, nextCluster);
-			if ((fatInfo->fatType == 12 && nextCluster >= END_MARKER_12) ||
-				(fatInfo->fatType == 16 && nextCluster >= END_MARKER_16)
-			) {
-				endOfDir = 1;
-				break;
-			}
+void extractChange(int change, const DirectoryEntry* de, const char* path, void* img) {
+	if (change == DIFF_REMOVED) {
+		fprintf(messages, "Removed %s\n", path);
+	} else if (de->attributes & ATTR_SUB_DIR) {
+		if (change == DIFF_ADDED && archive != NULL && !writeArchiveHeader(archive, path, 1, 0,
+			fatTimestamp(entryDateModified(de), entryTimeModified(de)))) {
+			fprintf(messages, "Error writing directory %s!\n", path);
 		}
+	} else if (numThreads > 1) {
+		addJob(de, path);
+	} else {
+		extractWithManifest(img, de, path);
 	}
-	
-	free(fatSector);
-	
-	printf("%5d file(s) %9ld bytes\n", fatInfo->filesFound, fatInfo->totalSize);
 }
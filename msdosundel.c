@@ -1,219 +1,358 @@
 /**
- * BootStrapSector is the first 512 bytes of the FAT.
- * Two byte fields are little-endian
+ * Restores deleted files on a FAT12, FAT16 or FAT32 disk image.
  *
- * The format of this sector is:
- * byte(s) contents
- * ------- -------------------------------------------------------
- *  00-02	first instruction of bootstrap routine
- *  03-10	OEM name
- *  11-12	number of bytes per sector
- *     13	number of sectors per cluster
- *  14-15	number of reserved sectors
- *     16	number of copies of the file allocation table
- *  17-18	number of entries in root directory
- *  19-20	total number of sectors
- *     21	media descriptor byte
- *  22-23	number of sectors in each copy of file allocation table
- *  24-25	number of sectors per track
- *  26-27	number of sides
- *  28-29	number of hidden sectors
- *  30-509	bootstrap routine and partition information
- *     510	hexadecimal 55
- *     511	hexadecimal AA
+ * usage: msdosundel [-i stdio|mmap|uring] [-f listfile] [-J journal] [-s] [-S text|json] [-x index] filename [pattern...]
+ *        msdosundel [-i stdio|mmap|uring] [-s] -U journal filename
+ *        msdosundel [-i stdio|mmap|uring] [-j threads] [-s] [-S text|json] -m -f listfile filename...
+ *
+ * With no patterns the deleted files are listed and one is chosen
+ * interactively. Otherwise every deleted file whose path matches one of
+ * the patterns, given as arguments or one per line in listfile ("-" for
+ * stdin), is restored without asking. The first letter of a deleted name
+ * is lost, so the first letter of each pattern's name stands for it and
+ * is the one restored, e.g. msdosundel disk.img DOCS/GONE.TXT 'R*.BAK'
+ * A file that had a VFAT long name keeps it when deleted, and is listed
+ * and matched by it. The lost letter is then worked out from the checksum
+ * in its long name slots, which are restored along with it.
+ * When every pattern is a plain path, each file is looked up on its own
+ * and only the directories on its path are read; see fatlookup.h. The
+ * rest of the tree is then only walked if a file found this way has to
+ * be checked against every other file's clusters.
+ *
+ * Changes are written at the end, each sector once. -J saves the sectors
+ * about to change to an undo journal first, -s waits for the journal and
+ * the image to reach the disk, and -U puts back the sectors in a journal.
+ * With -x the directory tree is kept in an index file, as for msdosdir.
+ * A restored file whose chain was freed has it rebuilt from the free
+ * clusters and linked again in every copy of the FAT.
+ *
+ * -S prints the counters in fatstats.h to stderr at the end, as text or
+ * as one JSON object.
+ *
+ * With -m every argument is an image, and the patterns in listfile are
+ * restored on each of them, -j images at a time. The output for each
+ * image is printed under its name, in the order the images were given.
+ * A journal or an index is a single file, so -J, -U and -x cannot be
+ * used with -m.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
-
-typedef unsigned char BYTE;
-typedef struct pair {
-	BYTE bytes[2];
-} BytePair;
-
-typedef struct triplet {
-	BYTE bytes[3];
-} ByteTriplet;
-
-typedef struct quad {
-	BYTE bytes[4];
-} ByteQuad;
-
-typedef struct bootsector {
-	ByteTriplet firstInstruction; // This is often a jump instruction to the boot sector code itself
-	BYTE OEM[8];
-	BytePair numBytesPerSector;
-	BYTE numSectorsPerCluster;
-	BytePair numReservedSectors;
-	BYTE numCopiesFAT;
-	BytePair numEntriesRootDir;
-	BytePair numSectors;
-	BYTE mediaDescriptor;
-	BytePair numSectorsInFAT;
-	BytePair numSectorsPerTrack;
-	BytePair numSides;
-	ByteQuad numHiddenSectors;
-	ByteQuad largeSectors;
-	BYTE physicalDiskNum;
-	BYTE currentHead;
-	BYTE signature;
-	ByteQuad volumeSN;
-	BYTE volumeLabel[11];
-	BYTE formatType[8]; // FAT12 or FAT16 in this program
-	BYTE bootstrap[448];
-	BYTE hex55AA[2]; // the last bytes of the boot sector are, by definition, 55 AA.  This is a sanity check.
-} BootSector;
-
-typedef struct info {
-	int fatType;
-	int numClusters;
-	int numFATSectors;
-	int numCopiesFAT;
-	int sizeofSector;
-	int firstDataSector;
-	int numRootEntries;
-	int numRootClusters;
-	int reservedSectors;
-	int filesFound;
-	long totalSize;
-} FATInfo;
-
-FATInfo* fatInfo;
-
-typedef BYTE* Sector;
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <limits.h>
+#include "fat.h"
+#include "fatpattern.h"
+#include "fatwrite.h"
+#include "fatindex.h"
+#include "fatwalk.h"
+#include "fatlookup.h"
+#include "fatbatch.h"
+#include "fatcarve.h"
+#include "fatchain.h"
+#include "fatstats.h"
 
 typedef struct dirlist {
 	BYTE name[13];
-	int posInFile;
+	char* path; // from the root directory, e.g. DOCS/REPORT.TXT, by long names where there are any
+	char* shortPath; // the same by short names; `path` itself if that has none
+	const char* longName; // last component of `path` if the file has a long name, otherwise NULL
+	long posInFile;
+	long* slots; // byte offsets of its long name slots, as found
+	int numSlots;
+	BYTE shortName[11]; // as on disk, for a deleted file with a long name
+	BYTE checksum; // of the short name, as given in the slots
 	int startingCluster;
 	int timeModified;
-	int fileSize;
+	long fileSize;
 	struct dirlist* next;
 } DirectoryList;
 
-typedef struct clusterlist {
-	int cluster;
-	struct clusterlist* next;
-} ClusterList;
+// a directory queued on the walk
+typedef struct dirpaths {
+	const char* path;
+	const char* shortPath;
+} DirPaths;
 
-DirectoryList* dirListHead;
-DirectoryList* dirListTail;
+const int CLUSTER_UNOWNED = INT_MIN;
 
-/*
- * 00-07	Filename
- * 08-10	Filename extension
- *    11	File attributes
- *    12	Reserved for use by WinNT
- *    13	Time created (tenth of a second)
- * 14-15	Time created
- * 		Hour	5 bits
- * 		Minutes	6 bits
- * 		Seconds	5 bits
- * 16-17	Date created
- * 		Year	7 bits
- * 		Month	4 bits
- * 		Day	5 bits
- * 18-19	Date last accessed
- * 20-21	Upper half of entry's first cluster, 0 for FAT12 and FAT16
- * 22-23	Time last modified
- * 24-25	Date last modified
- * 26-27	Lower half of entry's first cluster
- * 28-31	File size in bytes
- */
-typedef struct direntry {
-	BYTE filename[8];
-	BYTE extension[3];
-	BYTE attributes;
-	BYTE reserved;
-	BYTE timeCreatedTenthSec;
-	BytePair timeCreated;
-	BytePair dateCreated;
-	BytePair dateAccessed;
-	BytePair startingClusterUpper;
-	BytePair timeModified;
-	BytePair dateModified;
-	BytePair startingCluster;
-	ByteQuad fileSize;
-} DirectoryEntry;
-/*
- * Directory entry special values for first byte
- * 0x00	Filename never used.
- * 0xe5	The filename has been used, but the file has been deleted.
- * 0x05	The first character of the filename is actually 0xe5.
- * 0x2e	The entry is for a directory, not a normal file.
- * 	If the second byte is also 0x2e, the cluster field contains the cluster number of this directory's parent directory.
- *	If the parent directory is the root directory (which is statically allocated and doesn't have a cluster number), cluster number 0x0000 is specified here.
- */
-const int NOT_USED = 0x00;
-const int DELETED = 0xe5;
-const int ACTUAL_E5 = 0x05;
-const int DIRECTORY = 0x2e;
+// returned by checkValid, along with the CARVE_ results
+#define CHAIN_INTACT (CARVE_GAPS + 1)
 
-// Directory entry attributes
-const int ATTR_READ_ONLY = 0x01; // File is read only
-const int ATTR_HIDDEN = 0x02; // Hidden file
-const int ATTR_SYSTEM_FILE = 0x04; // Indicates a system file. These are hidden as well
-const int ATTR_VOLUME_LABEL = 0x08; // Disk's volume label. Only found in the root directory
-const int ATTR_SUB_DIR = 0x10; // The entry describes a subdirectory
-const int ATTR_ARCHIVE = 0x20; // Archive flag. Set when the file is modified. Used by backup programs
-const int ATTR_UNUSED1 = 0x40; // Not used; must be set to 0
-const int ATTR_UNUSED2 = 0x80; // Not used; must be set to 0
+// how every image is changed; set once before any image is opened
+int backend = IMAGE_STDIO;
+const char* journal;
+const char* indexFile;
+int syncWrites;
+int statsOutput = -1; // format of the -S statistics, -1 for none
+int batch;
+int manyImages;
+PatternList patterns;
 
-// FAT entry special values
-const int AVAILABLE_12 = 0x000;
-const int AVAILABLE_16 = 0x0000;
-const int RESERVED_12 = 0x001;
-const int RESERVED_16 = 0x0001;
-const int BAD_CLUSTER_12 = 0xff7;
-const int BAD_CLUSTER_16 = 0xfff7;
-const int END_MARKER_12 = 0xff8;
-const int END_MARKER_16 = 0xfff8;
-
-const int FIRST_ROOT_CLUSTER = 2;
-
-int le2be2(BytePair bytes);
-int le2be3(ByteTriplet bytes, int which);
-int le2be4(ByteQuad bytes);
-int getNumberClusters(BootSector* bs);
-int getFATType(BootSector* bs);
-int getAbsoluteCluster(int relativeCluster);
-int clusterRelativeToRoot(int absoluteCluster);
-int getNextCluster(Sector fatSector, int cluster);
+/*
+ * Everything kept about the image being changed. With -m several images
+ * are changed on different threads at once, so none of this is global.
+ */
+typedef struct volume {
+	FATInfo* fatInfo;
+	DirWalk* walk; // directories still to be scanned, NULL when files are looked up by path
+	int lookedUp; // 1 if only the files named by the patterns are listed
+	DirectoryList* dirListHead;
+	DirectoryList* dirListTail;
+	Arena* dirListArena; // owns every node of the directory list
+	WriteBuffer* changes; // entry and FAT changes not yet written to the image
+	const char* path; // path of the directory being scanned, "" for the root
+	const char* shortPath; // the same by short names, `path` itself if that has none
+	FILE* out;
+	
+	// for every cluster, the modification time of the most recently
+	// modified file whose chain reaches it, or CLUSTER_UNOWNED. Built once
+	// from the directory list the first time a file is checked.
+	int* clusterNewestOwner;
+	
+	// free clusters, read from the FAT the first time a chain is carved
+	FreeMap* freeClusters;
+} Volume;
+
+int restoreOnImage(const char* filename, FILE* out, void* arg);
 int isAlphabetical(char c);
-int verifySize(ClusterList* clusters, int fileSize);
-int checkValid(FILE* fs, DirectoryList fileToCheck, int posInList);
-int clusterListsCollide(ClusterList* cl1, ClusterList* cl2);
-ClusterList* getClusters(FILE* fs, int startingCluster, int fileSize);
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster);
+char recoverFirstLetter(const DirectoryList* file);
+void restoreLongName(Volume* v, const DirectoryList* file);
+int verifySize(Volume* v, ClusterChain* clusters, long fileSize);
+int checkValid(Volume* v, Image* img, DirectoryList fileToCheck, ClusterChain* cl);
+const char* describeRecovery(int how);
+void buildClusterOwners(Volume* v, Image* img);
+void listFiles(Volume* v, Image* img);
+void lookupFiles(Volume* v, Image* img);
+void getClusters(Volume* v, int startingCluster, long fileSize, ClusterChain* clusters);
+char* joinPath(Arena* arena, const char* parent, const char* name, int nameLen);
+void listEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context);
 void flush();
-void undeleteFile(FILE* fs);
-void freeClusterList(ClusterList* cl);
-void readBootStrapSector(FILE* fs, BootSector* bs);
-void scanDirectorySector(FILE* fs, Sector directory, int posInFile);
-void scanDirectory(FILE* fs, int cluster, int maxClusters);
-void hexDump(char *desc, void *addr, int len);
+void undeleteFile(Volume* v, Image* img);
+int undeleteFiles(Volume* v, Image* img, PatternList* patterns);
+void changeEntry(Volume* v, long posInFile, BYTE value);
 
 int main (int argc, char *argv[]) {
-	if (argc != 2) {
-		printf("usage: %s filename\n", argv[0]);
+	const char* listFile = NULL;
+	const char* undoFile = NULL;
+	int numThreads = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:f:j:J:mS:U:sx:")) != -1) {
+		if (opt == 'i') {
+			backend = imageBackend(optarg);
+		} else if (opt == 'f') {
+			listFile = optarg;
+		} else if (opt == 'j') {
+			numThreads = atoi(optarg);
+		} else if (opt == 'J') {
+			journal = optarg;
+		} else if (opt == 'm') {
+			manyImages = 1;
+		} else if (opt == 'U') {
+			undoFile = optarg;
+		} else if (opt == 's') {
+			syncWrites = 1;
+		} else if (opt == 'S') {
+			statsOutput = statsFormat(optarg);
+			if (statsOutput < 0) {
+				backend = -1;
+			}
+		} else if (opt == 'x') {
+			indexFile = optarg;
+		} else {
+			backend = -1;
+		}
+	}
+	if (manyImages && (listFile == NULL || journal != NULL || undoFile != NULL || indexFile != NULL)) {
+		backend = -1;
+	}
+	if (backend < 0 || numThreads < 1 || optind >= argc) {
+		printf("usage: %s [-i stdio|mmap|uring] [-f listfile] [-J journal] [-s] [-S text|json] [-x index] filename [pattern...]\n", argv[0]);
+		printf("       %s [-i stdio|mmap|uring] [-s] -U journal filename\n", argv[0]);
+		printf("       %s [-i stdio|mmap|uring] [-j threads] [-s] [-S text|json] -m -f listfile filename...\n", argv[0]);
 		return 0;
 	}
-	// assume argv[1] is a filename to open
-	FILE* file = fopen(argv[1], "r+b");
-	if (file == 0) {
-		printf("Could not open file %s\n", argv[1]);
+	
+	// names are matched whatever their lost first letter was
+	patterns.anyFirstLetter = 1;
+	int a;
+	for (a = optind + 1; a < argc && !manyImages; a++) {
+		addPattern(&patterns, argv[a]);
+	}
+	if (listFile != NULL && !readPatterns(&patterns, listFile)) {
+		printf("Could not open file %s\n", listFile);
 		return 1;
 	}
+	batch = listFile != NULL || optind + 1 < argc;
+	
+	// put back what an earlier run changed instead of making changes
+	if (undoFile != NULL) {
+		freePatterns(&patterns);
+		Image* img = openImage(argv[optind], 1, backend);
+		if (img == 0) {
+			printf("Could not open file %s\n", argv[optind]);
+			return 1;
+		}
+		int restored = undoJournal(img, undoFile, syncWrites);
+		closeImage(img);
+		if (restored < 0) {
+			printf("Could not undo the changes saved in %s\n", undoFile);
+			return 1;
+		}
+		printf("%d sector(s) restored from %s\n", restored, undoFile);
+		return 0;
+	}
+	
+	// assume the remaining argument is a filename to open, or with -m all of them
+	int status = runImageBatch(argv + optind, manyImages ? argc - optind : 1, numThreads,
+		restoreOnImage, NULL, stdout);
+	freePatterns(&patterns);
+	if (statsOutput >= 0) {
+		fflush(stdout);
+		printStats(stderr, statsOutput);
+	}
+	
+	return status;
+}
+
+/**
+ * Restores deleted files on one disk image
+ * 
+ * @param filename The image to change
+ * @param out Where messages go
+ * @param arg Unused
+ * @return 0 on success, otherwise 1
+ */
+int restoreOnImage(const char* filename, FILE* out, void* arg) {
+	Volume v = { 0 };
+	v.out = out;
+	
+	if (manyImages) {
+		fprintf(out, "Image %s\n", filename);
+	}
+	Image* img = openImage(filename, 1, backend);
+	if (img == 0) {
+		fprintf(out, "Could not open file %s\n", filename);
+		return 1;
+	}
+	
+	long phase = startPhase();
 	BootSector* bs = malloc(sizeof(BootSector));
-	readBootStrapSector(file, bs);
-	scanDirectory(file, FIRST_ROOT_CLUSTER, fatInfo->numRootClusters);
+	v.fatInfo = readBootStrapSector(img, bs);
+	if (indexFile != NULL) {
+		v.fatInfo->index = openDirIndex(img, v.fatInfo, indexFile);
+	}
+	endPhase(PHASE_BOOT, phase);
+	
+	phase = startPhase();
+	v.dirListArena = newArena(64 * 1024);
+	v.dirListHead = arenaAlloc(v.dirListArena, sizeof(DirectoryList));
+	v.dirListHead->next = NULL;
+	v.dirListTail = v.dirListHead;
+	v.changes = newWriteBuffer(img, v.fatInfo->sizeofSector);
+	if (batch && onlyPlainPaths(&patterns)) {
+		lookupFiles(&v, img);
+	} else {
+		listFiles(&v, img);
+	}
+	endPhase(PHASE_WALK, phase);
+	
+	int status = 0;
+	if (batch) {
+		// each image counts its own matches
+		PatternList imagePatterns = { 0 };
+		copyPatterns(&imagePatterns, &patterns);
+		status = undeleteFiles(&v, img, &imagePatterns);
+		freePatterns(&imagePatterns);
+	} else {
+		undeleteFile(&v, img);
+	}
 	
-	undeleteFile(file);
+	// every change is written here, each sector once
+	phase = startPhase();
+	int written = flushWriteBuffer(v.changes, journal, syncWrites);
+	endPhase(PHASE_WRITE, phase);
+	if (!written) {
+		fprintf(out, "Could not write the changes to the disk image\n");
+		status = 1;
+	} else if (v.fatInfo->index != NULL && !saveDirIndex(v.fatInfo->index, img, v.fatInfo)) {
+		fprintf(out, "Could not save the directory index %s\n", indexFile);
+	}
 	
+	freeWriteBuffer(v.changes);
 	free(bs);
-	fclose(file);
+	free(v.clusterNewestOwner);
+	freeFreeMap(v.freeClusters);
+	freeArena(v.dirListArena);
+	freeFATInfo(v.fatInfo);
+	closeImage(img);
 	
-	return 0;
+	return status;
+}
+
+/**
+ * Adds every file on the image, deleted or not, to the list of files
+ * 
+ * @param v The image being changed
+ * @param img The disk image
+ */
+void listFiles(Volume* v, Image* img) {
+	DirPaths root = { "", "" };
+	v->walk = startDirWalk(img, v->fatInfo, &root);
+	int cluster;
+	int maxClusters;
+	void* context;
+	while (nextDirectory(v->walk, &cluster, &maxClusters, &context)) {
+		DirPaths* dir = context;
+		v->path = dir->path;
+		v->shortPath = strcmp(dir->shortPath, dir->path) == 0 ? dir->path : dir->shortPath;
+		scanDirectory(img, v->fatInfo, cluster, maxClusters, 0, listEntry, v);
+	}
+	freeDirWalk(v->walk);
+	v->walk = NULL;
+}
+
+/**
+ * Adds the deleted file at each pattern's path to the list of files,
+ * reading only the directories on the way to it
+ * 
+ * @param v The image being changed
+ * @param img The disk image
+ */
+void lookupFiles(Volume* v, Image* img) {
+	v->lookedUp = 1;
+	int p;
+	FoundEntry* found = malloc(sizeof(FoundEntry));
+	// positions of the entries listed so far, kept at most half full
+	int numSlots = 64;
+	while (numSlots < patterns.count * 2) {
+		numSlots *= 2;
+	}
+	long* listed = malloc(numSlots * sizeof(long));
+	memset(listed, -1, numSlots * sizeof(long));
+	for (p = 0; p < patterns.count; p++) {
+		if (!lookupPath(img, v->fatInfo, patterns.patterns[p], LOOKUP_DELETED, found)) {
+			continue;
+		}
+		// the same file can be named by more than one path; its
+		// patterns are still all credited when the list is matched
+		int s = (int)((unsigned long)found->posInFile * 0x9e3779b1u) & (numSlots - 1);
+		while (listed[s] >= 0 && listed[s] != found->posInFile) {
+			s = (s + 1) & (numSlots - 1);
+		}
+		if (listed[s] == found->posInFile) {
+			continue;
+		}
+		listed[s] = found->posInFile;
+		
+		// list the entry as if it had been found in its directory
+		v->path = found->parent;
+		v->shortPath = strcmp(found->shortParent, found->parent) == 0 ? found->parent : found->shortParent;
+		listEntry(img, &found->entry, found->longName, found->posInFile, v);
+	}
+	free(found);
+	free(listed);
 }
 
 /**
@@ -225,671 +364,526 @@ void flush() {
 }
 
 /**
- * Checks a cluster list against a file size
+ * Checks a cluster chain against a file size
  * to determine if the file is the correct size
  * 
- * @param clusters The list of clusters to check
+ * @param v The image being changed
+ * @param clusters The chain of clusters to check
  * @param fileSize The intended size of the file
  * @return 1 if the file is the correct size, otherwise 0
  */
-int verifySize(ClusterList* clusters, int fileSize) {
-	int count = 0;
-	clusters = clusters->next;
-	while (clusters != NULL) {
-		count++;
-		clusters = clusters->next;
-	}
-	
-	int estimatedSize = count * fatInfo->sizeofSector;
+int verifySize(Volume* v, ClusterChain* clusters, long fileSize) {
+	long estimatedSize = (long)clusters->numClusters * v->fatInfo->sizeofCluster;
 	if (estimatedSize < fileSize) {
 		return 0;
 	}
 	
-	if (estimatedSize > (fileSize + fatInfo->sizeofSector)) {
+	if (estimatedSize > (fileSize + v->fatInfo->sizeofCluster)) {
 		return 0;
 	}
 	return 1;
 }
 
 /**
- * Gets a list of all the clusters in a file's cluster chain
+ * Gets all the clusters in a file's cluster chain
  * 
- * @param fs A file handle to the disk image
+ * The chain is followed for one cluster more than `fileSize` needs
+ * if possible, so that verifySize can tell if it is too long.
+ * 
+ * @param v The image being changed
  * @param startingCluster Where in the FAT the file starts
  * @param fileSize The intended size of the file
- * @return The list of the file's clusters
+ * @param clusters Receives the file's clusters
  */
-ClusterList* getClusters(FILE* fs, int startingCluster, int fileSize) {
-	int sizeofSector = fatInfo->sizeofSector;
-	int endOfFile = 0;
-	int nextCluster = startingCluster;
-	int curFATSector = -1;
-	
-	
-	// malloc here just to be sure all frees have something to free
-	Sector fatSector = malloc(sizeofSector);
-	
-	ClusterList* cl = malloc(sizeof(ClusterList));
-	ClusterList* t = cl;
-	
-	while (!endOfFile) {
-		
-		// if we've got a good cluster
-		if ((fatInfo->fatType == 12 && nextCluster > RESERVED_12 && nextCluster < BAD_CLUSTER_12) ||
-			(fatInfo->fatType == 16 && nextCluster > RESERVED_16 && nextCluster < BAD_CLUSTER_16)
-		) {
-			// already went too far so stop
-			// don't want to stop as soon as fileSize < 0
-			// because it might actually end there
-			// instead, let it read one more if possible
-			// to be sure if it's too big, meaning it's bad
-			if (fileSize < -sizeofSector) {
-				endOfFile = 1;
-				break;
-			}
-			
-			fileSize -= sizeofSector;
-		} else {
-			
-			// otherwise stop searching
-			endOfFile = 1;
-			break;
-		}
-		
-		fatSector = getCorrectFATSector(fs, fatSector, curFATSector, nextCluster);
-		
-		t->next = malloc(sizeof(ClusterList));
-		t = t->next;
-		t->cluster = nextCluster;
-		t->next = NULL;
-		
-		// get the next cluster based on the current cluster
-		nextCluster = getNextCluster(fatSector, nextCluster);
-	}
-	
-	free(fatSector);
-	
-	return cl;
+void getClusters(Volume* v, int startingCluster, long fileSize, ClusterChain* clusters) {
+	int maxClusters = fileSize / v->fatInfo->sizeofCluster + 2;
+	getClusterChain(v->fatInfo->table, startingCluster, maxClusters, clusters);
 }
 
 /**
- * Compares two ClusterLists to see if they have any of the same clusters
+ * Records, for every cluster, the newest file that claims it
  * 
- * @param cl1 One of the cluster lists to check
- * @param cl2 One of the cluster lists to check
- * @param 1 if the cluster lists share a cluster, otherwise 0
+ * Each file's chain is followed the same way getClusters follows it,
+ * so the whole directory list is covered in one pass. When only the
+ * files named by path were listed, every file is listed first.
+ * 
+ * @param v The image being changed
+ * @param img The disk image
  */
-int clusterListsCollide(ClusterList* cl1, ClusterList* cl2) {
-	ClusterList* tmp;
-	// the heads of the lists are empty
-	cl1 = cl1->next;
-	cl2 = cl2->next;
-	
-	while (cl1 != NULL) {
-		tmp = cl2;
-		while (tmp != NULL) {
-			if (cl1->cluster == tmp->cluster) {
-				return 1;
+void buildClusterOwners(Volume* v, Image* img) {
+	int numEntries = v->fatInfo->table->numEntries;
+	int* owners = malloc(numEntries * sizeof(int));
+	v->clusterNewestOwner = owners;
+	
+	int c;
+	for (c = 0; c < numEntries; c++) {
+		owners[c] = CLUSTER_UNOWNED;
+	}
+	
+	// the files looked up stay in the list, to be restored
+	DirectoryList* files = v->dirListHead;
+	if (v->lookedUp) {
+		DirectoryList* tail = v->dirListTail;
+		v->dirListHead = arenaAlloc(v->dirListArena, sizeof(DirectoryList));
+		v->dirListHead->next = NULL;
+		v->dirListTail = v->dirListHead;
+		listFiles(v, img);
+		v->dirListTail = tail;
+		DirectoryList* everyFile = v->dirListHead;
+		v->dirListHead = files;
+		files = everyFile;
+	}
+	
+	// one chain is reused for every file so its runs are only allocated once
+	ClusterChain chain = { 0 };
+	DirectoryList* file;
+	for (file = files->next; file != NULL; file = file->next) {
+		getClusters(v, file->startingCluster, file->fileSize, &chain);
+		
+		int r;
+		for (r = 0; r < chain.numRuns; r++) {
+			for (c = chain.runs[r].start; c < chain.runs[r].start + chain.runs[r].length; c++) {
+				if (file->timeModified > owners[c]) {
+					owners[c] = file->timeModified;
+				}
 			}
-			tmp = tmp->next;
 		}
-		cl1 = cl1->next;
 	}
-	return 0;
+	freeClusterChain(&chain);
 }
 
 /**
- * Frees malloc'd memory from a ClusterList
+ * Checks that a deleted file has not been overwritten at all,
+ * and finds the clusters it would be restored from
  * 
- * @param cl The cluster list to free
- */
-void freeClusterList(ClusterList* cl) {
-	ClusterList* tmp;
-	
-	while (cl != NULL) {
-		tmp = cl;
-		cl = cl->next;
-		free(tmp);
-	}
-}
-
-/**
- * Checks that a deleted file has not been overwritten at all
+ * If the file's first cluster is free, its chain was zeroed when it was
+ * deleted, so the chain is carved out of the free clusters instead;
+ * see fatcarve.h. A chain that runs through a cluster another restored
+ * file has claimed is never given back.
  * 
- * @param fs A file handle to the disk image
+ * @param v The image being changed
+ * @param img The disk image
  * @param fileToCheck The file to be undeleted if valid
- * @param posInList the file's position in the list of all files
- * @return 1 if the file is valid and can be undeleted, otherwise 0
+ * @param cl Receives the file's clusters; zero it before first use and
+ *           free it with freeClusterChain
+ * @return CHAIN_INTACT, CARVE_CONTIGUOUS or CARVE_GAPS for where the
+ *         file's clusters came from, or CARVE_NONE if it cannot be undeleted
  */
-int checkValid(FILE* fs, DirectoryList fileToCheck, int posInList) {
-	
-	// get the cluster list for this file now so its size can be checked
-	// and so it doesn't have to be gotten later while comparing to other files
-	ClusterList* cl = getClusters(fs, fileToCheck.startingCluster, fileToCheck.fileSize);
+int checkValid(Volume* v, Image* img, DirectoryList fileToCheck, ClusterChain* cl) {
 	
-	// check that the file has the correct size first
-	// if its chain can be followed to an incorrect size
-	// then it is known that it has been overwritten somewhere
-	if (!verifySize(cl, fileToCheck.fileSize)) {
-		freeClusterList(cl);
-		return 0;
+	if (v->freeClusters == NULL) {
+		v->freeClusters = buildFreeMap(v->fatInfo->table);
 	}
 	
-	int counter = 0;
-	dirListTail = dirListHead->next;
-	while (dirListTail != NULL) {
-		counter++;
-		// don't check against the same file
-		if (counter != posInList) {
-			// only scan file's sectors if it was more recently modified
-			// than fileToCheck. if fileToCheck was modified more recently
-			// than this file, then it is assumed that this file cannot
-			// have overwritten fileToCheck
-			if (dirListTail->timeModified > fileToCheck.timeModified) {
-				ClusterList* cl2 = getClusters(fs, dirListTail->startingCluster, dirListTail->fileSize);
-				if (clusterListsCollide(cl, cl2)) {
-					freeClusterList(cl);
-					freeClusterList(cl2);
-					return 0;
+	int how = CHAIN_INTACT;
+	if (isFreeCluster(v->freeClusters, fileToCheck.startingCluster)) {
+		// a directory's size is 0, but it has at least one cluster
+		int sizeofCluster = v->fatInfo->sizeofCluster;
+		int numClusters = (fileToCheck.fileSize + sizeofCluster - 1) / sizeofCluster;
+		if (numClusters == 0) {
+			numClusters = 1;
+		}
+		how = carveChain(v->freeClusters, fileToCheck.startingCluster, numClusters, CARVE_MAX_GAP, cl);
+		if (how == CARVE_NONE) {
+			return CARVE_NONE;
+		}
+	} else {
+		// get the cluster chain for this file now so its size can be checked
+		getClusters(v, fileToCheck.startingCluster, fileToCheck.fileSize, cl);
+		
+		// a cluster the FAT still shows as free but that is no longer free
+		// in the map has been claimed by a file restored before this one
+		FATTable* table = v->fatInfo->table;
+		int r;
+		for (r = 0; r < cl->numRuns; r++) {
+			int c;
+			for (c = cl->runs[r].start; c < cl->runs[r].start + cl->runs[r].length; c++) {
+				int entry = table->fatType != 32 ? table->next[c] : getFATEntry(table, c);
+				if (entry == 0 && !isFreeCluster(v->freeClusters, c)) {
+					return CARVE_NONE;
 				}
-				freeClusterList(cl2);
 			}
 		}
-		dirListTail = dirListTail->next;
+		
+		// check that the file has the correct size first
+		// if its chain can be followed to an incorrect size
+		// then it is known that it has been overwritten somewhere
+		if (!verifySize(v, cl, fileToCheck.fileSize)) {
+			return CARVE_NONE;
+		}
 	}
 	
-	freeClusterList(cl);
-	return 1;
+	if (v->clusterNewestOwner == NULL) {
+		buildClusterOwners(v, img);
+	}
+	
+	// if any cluster also belongs to a file that was modified more
+	// recently than fileToCheck, that file may have overwritten it.
+	// files modified before fileToCheck are assumed not to have.
+	// fileToCheck's own claims carry its own time, so never count
+	int r;
+	int c;
+	for (r = 0; r < cl->numRuns; r++) {
+		for (c = cl->runs[r].start; c < cl->runs[r].start + cl->runs[r].length; c++) {
+			if (v->clusterNewestOwner[c] > fileToCheck.timeModified) {
+				return CARVE_NONE;
+			}
+		}
+	}
+	
+	return how;
+}
+
+/**
+ * Describes where a restored file's clusters came from
+ * 
+ * @param how What checkValid returned
+ * @return A note to print after the file's name
+ */
+const char* describeRecovery(int how) {
+	if (how == CARVE_CONTIGUOUS) {
+		return " (chain rebuilt from contiguous free clusters)";
+	}
+	if (how == CARVE_GAPS) {
+		return " (chain rebuilt by searching free clusters)";
+	}
+	return "";
 }
 
 /**
  * Allows the user to select a deleted file to restore
  * 
- * @param fs A file handle to the disk image
+ * @param v The image being changed
+ * @param img The disk image
  */
-void undeleteFile(FILE* fs) {
+void undeleteFile(Volume* v, Image* img) {
 	int counter = 0;
-	dirListTail = dirListHead->next;
+	v->dirListTail = v->dirListHead->next;
 	
 	// print out only the delete files
-	while (dirListTail != NULL) {
-		if (dirListTail->name[0] == DELETED) {
+	while (v->dirListTail != NULL) {
+		if (v->dirListTail->name[0] == DELETED) {
 			counter++;
-			printf("%d) %s\n", counter, dirListTail->name);
+			fprintf(v->out, "%d) %s\n", counter, v->dirListTail->longName != NULL
+				? v->dirListTail->longName : (const char*)v->dirListTail->name);
 		}
-		dirListTail = dirListTail->next;
+		v->dirListTail = v->dirListTail->next;
 	}
 	
 	// ask for the number in the list of the file to undelete
 	int n = -1;
 	char dummy;
 	while (n < 0 || n > counter) {
-		printf("Which file do you want to restore? [1 - %d, 0 to quit] ", counter);
+		fprintf(v->out, "Which file do you want to restore? [1 - %d, 0 to quit] ", counter);
 		scanf("%d", &n);
 		flush();
 	}
 	
 	if (n != 0) {
-		dirListTail = dirListHead;
+		v->dirListTail = v->dirListHead;
 		for (counter = 0; counter < n;) {
-			dirListTail = dirListTail->next;
-			if (dirListTail->name[0] == DELETED) {
+			v->dirListTail = v->dirListTail->next;
+			if (v->dirListTail->name[0] == DELETED) {
 				counter++;
 			}
 		}
 		
 		// confirm that this is the file to undelete
 		char c;
-		DirectoryList fileToUndelete = *dirListTail;
-		printf("Restore %s? [y/n] ", fileToUndelete.name);
+		DirectoryList fileToUndelete = *v->dirListTail;
+		const char* name = fileToUndelete.longName != NULL
+			? fileToUndelete.longName : (const char*)fileToUndelete.name;
+		fprintf(v->out, "Restore %s? [y/n] ", name);
 		scanf("%c", &c);
 		flush();
 		
 		if (c == 'y' || c == 'Y') {
 			
 			// make sure the file is not overwritten anywhere
-			int valid = checkValid(fs, fileToUndelete, counter - 1);
-			if (!valid) {
-				printf("Unfortunately, this file cannot be restored.\n");
+			ClusterChain cl = { 0 };
+			long phase = startPhase();
+			int how = checkValid(v, img, fileToUndelete, &cl);
+			endPhase(PHASE_CHECK, phase);
+			if (how == CARVE_NONE) {
+				fprintf(v->out, "Unfortunately, this file cannot be restored.\n");
 			} else {
-				c = 0;
-				while (!isAlphabetical(c)) {
-					printf("Enter the first letter of the file name: ");
+				// a long name's checksum gives the letter away
+				c = recoverFirstLetter(&fileToUndelete);
+				while (c == 0) {
+					fprintf(v->out, "Enter the first letter of the file name: ");
 					scanf("%c", &c);
 					flush();
+					c = isAlphabetical(c) ? c : 0;
+				}
+				fprintf(v->out, "Restoring %s%s\n", name, describeRecovery(how));
+				changeEntry(v, fileToUndelete.posInFile, toupper(c));
+				restoreLongName(v, &fileToUndelete);
+				if (how != CHAIN_INTACT) {
+					linkChain(v->changes, v->fatInfo, &cl);
 				}
-				printf("Restoring %s\n", fileToUndelete.name);
-				fseek(fs, fileToUndelete.posInFile, SEEK_SET);
-				fwrite(&c, 1, 1, fs);
 			}
+			freeClusterChain(&cl);
 		}
 	}
 }
 
 /**
- * Checks if a character is a letter
+ * Changes the first byte of a directory entry once `changes` is flushed,
+ * and in the directory index straight away
  * 
- * @param c The character to check
- * @return 1 if `c` is a letter, otherwise 0
+ * @param v The image being changed
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param value The new first byte
  */
-int isAlphabetical(char c) {
-	if (c >= 'a' && c <= 'z') {
-		return 1;
+void changeEntry(Volume* v, long posInFile, BYTE value) {
+	bufferWrite(v->changes, posInFile, &value, 1);
+	if (v->fatInfo->index != NULL) {
+		updateDirIndex(v->fatInfo->index, posInFile, &value, 1);
 	}
-	if (c >= 'A' && c <= 'Z') {
-		return 1;
-	}
-	return 0;
 }
 
 /**
- * Converts a two-byte little-endian value to a big-endian integer
+ * Restores every deleted file matching a list of patterns
  * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
- */
-int le2be2(BytePair bytes) {
-	return (bytes.bytes[0] + (bytes.bytes[1] << 8));
-}
-
-/**
- * Extracts a twelve-bit little-endian value from a trio of bytes
- * and converts it to a big-endian integer
+ * Each file is checked the same way as when restoring interactively.
+ * The first letters of the files that can be restored are buffered and
+ * written when `changes` is flushed, along with the links of every carved
+ * chain. Every restored chain is claimed as it is found, so no two
+ * restored files are given the same clusters.
  * 
- * @param bytes The bytes to convert
- * @param which The first or second value stored in `bytes`
- * @return The extracted value
+ * @param v The image being changed
+ * @param img The disk image
+ * @param patterns The paths or patterns of the files to restore
+ * @return 0 if every pattern matched a file and every matching file can
+ *         be restored, otherwise 1
  */
-int le2be3(ByteTriplet bytes, int which) {
-	if (which != 1 && which != 2) {
-		which = 1;
+int undeleteFiles(Volume* v, Image* img, PatternList* patterns) {
+	int numLetters = 0;
+	int status = 0;
+	DirectoryList* file;
+	ClusterChain cl = { 0 };
+	
+	for (file = v->dirListHead->next; file != NULL; file = file->next) {
+		if (file->name[0] != DELETED) {
+			continue;
+		}
+		// a pattern can use short names, long names or both, and
+		// every pattern naming the file is credited with it
+		int p = matchPatterns(patterns, file->path);
+		if (file->shortPath != file->path) {
+			int shortMatch = matchPatterns(patterns, file->shortPath);
+			p = p >= 0 ? p : shortMatch;
+		}
+		if (p < 0) {
+			continue;
+		}
+		
+		// a long name's checksum gives the letter away
+		char c = recoverFirstLetter(file);
+		if (c == 0) {
+			c = finalName(patterns->patterns[p])[0];
+			if (!isAlphabetical(c)) {
+				fprintf(v->out, "%s does not give the first letter of %s\n", patterns->patterns[p], file->path);
+				status = 1;
+				continue;
+			}
+		}
+		// show the name the file will have
+		if (file->longName == NULL) {
+			file->path[finalName(file->path) - file->path] = toupper(c);
+		}
+		file->shortPath[finalName(file->shortPath) - file->shortPath] = toupper(c);
+		long phase = startPhase();
+		int how = checkValid(v, img, *file, &cl);
+		endPhase(PHASE_CHECK, phase);
+		if (how == CARVE_NONE) {
+			fprintf(v->out, "%s cannot be restored\n", file->path);
+			status = 1;
+			continue;
+		}
+		
+		fprintf(v->out, "Restoring %s%s\n", file->path, describeRecovery(how));
+		changeEntry(v, file->posInFile, toupper(c));
+		restoreLongName(v, file);
+		// intact chains are claimed too, for any free cluster they end on
+		claimChain(v->freeClusters, &cl);
+		if (how != CHAIN_INTACT) {
+			linkChain(v->changes, v->fatInfo, &cl);
+		}
+		numLetters++;
 	}
 	
-	int firstByte = (int)bytes.bytes[0];
-	int secondByte = (int)bytes.bytes[1];
-	int thirdByte = (int)bytes.bytes[2];
-	int result = 0;
-	//UV WX YZ --> XUV YZW
-	
-	if (which == 1) {
-		result = firstByte; // UV
-		result += ((secondByte & 0x0f) << 8); // X
-	} else {
-		result = (thirdByte << 4); // YZ
-		result += ((secondByte & 0xf0) >> 4); // W
+	int p;
+	for (p = 0; p < patterns->count; p++) {
+		if (patterns->matches[p] == 0) {
+			fprintf(v->out, "No deleted files match %s\n", patterns->patterns[p]);
+			status = 1;
+		}
 	}
+	fprintf(v->out, "%d file(s) restored\n", numLetters);
+	freeClusterChain(&cl);
 	
-	return result;
+	return status;
 }
 
 /**
- * Converts a four-byte little-endian value to a big-endian integer
+ * Checks if a character is a letter
  * 
- * @param bytes The bytes to convert
- * @return The big-endian value of `bytes`
+ * @param c The character to check
+ * @return 1 if `c` is a letter, otherwise 0
  */
-int le2be4(ByteQuad bytes) {
-	int res = bytes.bytes[0];
-	int i;
-	for (i = 1; i < 4; i++) {
-		res += bytes.bytes[i] << (8 * i);
+int isAlphabetical(char c) {
+	if (c >= 'a' && c <= 'z') {
+		return 1;
 	}
-	return res;
-}
-
-/**
- * Calculates the total number of clusters in the filesystem
- * 
- * @param bs The bootsector of the filesystem
- * @return The number of clusters in the filesystem
- */
-int getNumberClusters(BootSector* bs) {
-	unsigned int root_dir_sectors = ((le2be2(bs->numEntriesRootDir) * 32) + (le2be2(bs->numBytesPerSector) - 1)) / le2be2(bs->numBytesPerSector);
-	unsigned int data_sectors;
-	if (le2be2(bs->numSectors) != 0) {
-		data_sectors = le2be2(bs->numSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
-	} else {
-		data_sectors = le2be4(bs->largeSectors) - (le2be2(bs->numReservedSectors) + (bs->numCopiesFAT * le2be2(bs->numSectorsInFAT)) + root_dir_sectors);
+	if (c >= 'A' && c <= 'Z') {
+		return 1;
 	}
-	return (int)(data_sectors / bs->numSectorsPerCluster);
+	return 0;
 }
 
 /**
- * Determines if the FAT is FAT12, FAT16, or FAT32
+ * Works out the first letter of a deleted file's short name from the
+ * checksum its long name slots keep
  * 
- * @param bs The bootsector of the filesystem
- * @return The number version of FAT
+ * Each first byte gives a different checksum, so at most one matches.
+ * 
+ * @param file The deleted file
+ * @return The letter, or 0 if the file has no long name or no letter
+ *         gives its checksum
  */
-int getFATType(BootSector* bs) {
-	int total_clusters = getNumberClusters(bs);
-	if (total_clusters < 4085) {
-		return 12;
-	} else {
-		if (total_clusters < 65525) {
-			return 16;
-		} else {
-			return 32;
+char recoverFirstLetter(const DirectoryList* file) {
+	if (file->longName == NULL) {
+		return 0;
+	}
+	BYTE shortName[11];
+	memcpy(shortName, file->shortName, 11);
+	int c;
+	// short names are in upper case
+	for (c = '!'; c <= '~'; c++) {
+		if (c >= 'a' && c <= 'z') {
+			continue;
+		}
+		shortName[0] = c;
+		if (shortNameChecksum(shortName) == file->checksum) {
+			return c;
 		}
 	}
+	return 0;
 }
 
 /**
- * Calculates a cluster's actual position in the user data section
- * because of the fact that clusters are numbered starting at 2
- * 
- * @param relativeCluster The cluster whose position is to be calculated
- * @return The actual position of the cluster in the user data section
- */
-int getAbsoluteCluster(int relativeCluster) {
-	return relativeCluster - 2 + fatInfo->firstDataSector;
-}
-
-/**
- * Calculates a cluster's position in the filesystem
- * after the boot sector and FATs
+ * Puts back the sequence numbers of a restored file's long name slots
+ * once `changes` is flushed
  * 
- * @param absoluteCluster The cluster's position in the user data section
- * @return The position of the cluster after the boot sector and FATs
- */
-int clusterRelativeToRoot(int absoluteCluster) {
-	return absoluteCluster + fatInfo->numRootClusters;
-}
-
-/**
- * Reads information from the bootstrap sector into a BootSector object
- *
- * @param fs File handle to the disk image
- * @param bs The BootSector object to receive the data
- */
-void readBootStrapSector(FILE* fs, BootSector* bs) {
-	fread(bs, sizeof(BootSector), 1, fs);
-	
-	fatInfo = malloc(sizeof(FATInfo));
-	fatInfo->fatType = getFATType(bs);
-	fatInfo->numFATSectors = le2be2(bs->numSectorsInFAT);
-	fatInfo->numCopiesFAT = bs->numCopiesFAT;
-	fatInfo->sizeofSector = le2be2(bs->numBytesPerSector);
-	fatInfo->firstDataSector = fatInfo->numCopiesFAT * le2be2(bs->numSectorsInFAT) + 1;
-	fatInfo->numRootEntries = le2be2(bs->numEntriesRootDir);
-	fatInfo->numRootClusters = fatInfo->numRootEntries * sizeof(DirectoryEntry) / fatInfo->sizeofSector;
-	fatInfo->reservedSectors = le2be2(bs->numReservedSectors);
-	
-	dirListHead = malloc(sizeof(DirectoryList));
-	dirListTail = dirListHead;
-}
-
-/**
- * Scans a sector of a directory and extracts information
+ * The first slot found holds the end of the name, so it is numbered
+ * highest and marked as the last.
  * 
- * @param fs - The file handle for the filesystem
- * @param directory - The sector to scan
+ * @param v The image being changed
+ * @param file The file being restored
  */
-void scanDirectorySector(FILE* fs, Sector directory, int posInFile) {
-	int sizeofDirEntry = sizeof(DirectoryEntry);
-	int entriesPerSector = fatInfo->sizeofSector / sizeofDirEntry;
-	
-	int e;
-	for (e = 0; e < entriesPerSector; e++) {
-		int b;
-		int offset = e * sizeofDirEntry;
-		
-		if (directory[offset] != NOT_USED) {
-			DirectoryEntry* de = malloc(sizeofDirEntry);
-			
-			// only get relevant details
-			de->timeModified.bytes[0] = directory[offset + 22];
-			de->timeModified.bytes[1] = directory[offset + 23];
-			de->dateModified.bytes[0] = directory[offset + 24];
-			de->dateModified.bytes[1] = directory[offset + 25];
-			de->startingCluster.bytes[0] = directory[offset + 26];
-			de->startingCluster.bytes[1] = directory[offset + 27];
-			for (b = 0; b < 4; b++) {
-				de->fileSize.bytes[b] = directory[offset + 28 + b];
-			}
-			
-			if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
-				&& !(de->attributes & ATTR_VOLUME_LABEL)
-			) {
-				if (directory[offset] == DIRECTORY || de->attributes & ATTR_SUB_DIR) {
-					if (directory[offset + 1] != DIRECTORY) {
-						// don't scan if second byte in entry is also DIRECTORY
-						// this indicates that the cluster points to the parent
-						// which will result in infinite recursion
-						scanDirectory(fs, le2be2(de->startingCluster), 0);
-					}
-				}
-			}
-			
-			// make an entry in the list for every file, deleted or not
-			// this way we only have to scan the filesystem once
-			dirListTail->next = malloc(sizeof(DirectoryList));
-			dirListTail = dirListTail->next;
-			
-			// only care about the name if the file was deleted
-			if (directory[offset] == DELETED) {
-				for (b = 0; b < 8; b++) {
-					de->filename[b] = directory[offset + b];
-				}
-				if (de->filename[0] == ACTUAL_E5) {
-					de->filename[0] = 0xe5;
-				}
-				for (b = 0; b < 3; b++) {
-					de->extension[b] = directory[offset + 8 + b];
-				}
-				int i;
-				for (i = 7; i > 0; i--) {
-					if (de->filename[i] != ' ') {
-						break;
-					} else {
-						de->filename[i] = 0;
-					}
-				}
-				for (i = 2; i >= 0; i--) {
-					if (de->extension[i] != ' ') {
-						break;
-					} else {
-						de->extension[i] = 0;
-					}
-				}
-				
-				int pos = 0;
-				// loop through until the end of the filename
-				for (i = 0; i < 8; i++) {
-					if (de->filename[i]) {
-						dirListTail->name[pos] = 0xff & de->filename[i];
-						pos++;
-					} else {
-						break;
-					}
-				}
-				// if there is an extension
-				// add the '.' and loop through extension
-				if (de->extension[0]) {
-					dirListTail->name[pos] = '.';
-					pos++;
-					for (i = 0; i < 3; i++) {
-						if (de->extension[i]) {
-							dirListTail->name[pos] = de->extension[i];
-							pos++;
-						} else {
-							break;
-						}
-					}
-				}
-				// make sure the string is properly terminated
-				dirListTail->name[pos] = 0;
-			} else {
-				// not a deleted file
-				// give the name a letter so it'll be ignored
-				// while printing out the list of deleted files
-				dirListTail->name[0] = directory[offset];
-			}
-			
-			dirListTail->posInFile = posInFile + e * sizeofDirEntry;
-			dirListTail->startingCluster = le2be2(de->startingCluster);
-			int timeModified = le2be2(de->timeModified);
-			int dateModified = le2be2(de->dateModified);
-			dirListTail->timeModified = timeModified | (dateModified << 16);
-			dirListTail->fileSize = le2be4(de->fileSize);
-			dirListTail->next = NULL;
-		
-			free(de);
-		}
+void restoreLongName(Volume* v, const DirectoryList* file) {
+	int s;
+	for (s = 0; s < file->numSlots; s++) {
+		BYTE seq = file->numSlots - s;
+		changeEntry(v, file->slots[s], s == 0 ? seq | LONG_NAME_LAST : seq);
 	}
 }
 
 /**
- * Gets the next cluster in a file's cluster chain
+ * Makes the path of an entry from its directory's path
  * 
- * @param fatSector The sector of the FAT containing the current cluster
- * @param cluster The current cluster in the chain
- * @return The next cluster in the chain
+ * @param arena Owns the path
+ * @param parent Path of the directory, "" for the root
+ * @param name The entry's name
+ * @param nameLen Length of `name`
+ * @return The path
  */
-int getNextCluster(Sector fatSector, int cluster) {
-	int nextCluster;
-	int offset;
-	// even: i / 2 * 3
-	// odd: (i - 1) / 2 * 3 + 1
-	if (fatInfo->fatType == 12) {
-		ByteTriplet *bt = malloc(sizeof(ByteTriplet));
-		if (cluster % 2) {
-			offset = (cluster - 1) / 2 * 3 + 1;
-			bt->bytes[1] = fatSector[offset];
-			bt->bytes[2] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 2);
-		} else {
-			offset = cluster / 2 * 3;
-			bt->bytes[0] = fatSector[offset];
-			bt->bytes[1] = fatSector[offset + 1];
-			nextCluster = le2be3(*bt, 1);
-		}
-		free(bt);
-	} else if (fatInfo->fatType == 16) {
-		BytePair *bp = malloc(sizeof(BytePair));
-		offset = cluster * 2;
-		bp->bytes[0] = fatSector[offset];
-		bp->bytes[1] = fatSector[offset + 1];
-		nextCluster = le2be2(*bp);
-		free(bp);
-	} else {
-		nextCluster = -1;
+char* joinPath(Arena* arena, const char* parent, const char* name, int nameLen) {
+	int parentLen = strlen(parent);
+	char* path = arenaAlloc(arena, parentLen + nameLen + 2);
+	if (parentLen > 0) {
+		memcpy(path, parent, parentLen);
+		path[parentLen++] = '/';
 	}
-	return nextCluster;
+	memcpy(path + parentLen, name, nameLen + 1);
+	return path;
 }
 
 /**
- * Makes sure the correct FAT sector has been read in to get
- * the next cluster in a chain
+ * Adds an entry of the directory being scanned to the list of files,
+ * and queues it to be scanned too if it is a subdirectory
  * 
- * @param fs A file handle to the disk image
- * @param fatSector The currently held FAT sector
- * @param curFATSector The position of `fatSector` in the FAT
- * @param nextCluster The cluster that will be checked
- * @return The FAT sector that `nextCluster` is within
+ * @param img The disk image
+ * @param de The entry
+ * @param longName Its long name, or NULL if it has none
+ * @param posInFile Byte offset of the entry in the disk image
+ * @param context The Volume being scanned
  */
-Sector getCorrectFATSector(FILE* fs, Sector fatSector, int curFATSector, int nextCluster) {
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int entriesPerFATSector;
-	if (fatInfo->fatType == 12) {
-		entriesPerFATSector = sizeofSector * 2 / 3;
-	} else if (fatInfo->fatType == 16) {
-		entriesPerFATSector = sizeofSector / 2;
-	} else {
-		return fatSector;
+void listEntry(Image* img, const DirectoryEntry* de, const LongName* longName, long posInFile, void* context) {
+	Volume* v = context;
+	char name[13];
+	int nameLen = entryName(de, name);
+	char fullName[ENTRY_NAME_MAX];
+	int fullNameLen = entryLongName(de, longName, fullName);
+	
+	char* path = joinPath(v->dirListArena, v->path, fullName, fullNameLen);
+	char* shortPath = path;
+	if (longName != NULL || v->shortPath != v->path) {
+		shortPath = joinPath(v->dirListArena, v->shortPath, name, nameLen);
 	}
-	
-	// check if the cluster being searched for is within the
-	// currently loaded FAT sector. If not, get the right one
-	
-	// the smallest cluster available in this FAT sector
-	int fatSectorMin = curFATSector * entriesPerFATSector;
-	
-	// if cluster being searched for is less than the lowest
-	// available or higher than the highest available
-	if (nextCluster < fatSectorMin || nextCluster > (fatSectorMin + entriesPerFATSector)) {
-		
-		// get the sector num required to contain nextCluster
-		curFATSector = sizeofSector * (nextCluster / entriesPerFATSector);
-		
-		// free the existing FAT sector
-		free(fatSector);
-		
-		// malloc and read the new sector
-		fatSector = malloc(sizeofSector);
-		fseek(fs, startFAT + sizeofSector * curFATSector, SEEK_SET);
-		fread(fatSector, sizeofSector, 1, fs);
+	if (de->filename[0] == DELETED) {
+		// the first letter is lost, so show that it is unknown
+		shortPath[finalName(shortPath) - shortPath] = '?';
 	}
 	
-	return fatSector;
-}
-
-/**
- * Scans through a directory and extracts file information
- * 
- * @param fs - The file handle for the filesystem
- * @param cluster - The cluster to start at
- * @param maxClusters - Only used for root directories.
- *                      Indicates how many contiguous clusters to check
- */
-void scanDirectory(FILE* fs, int cluster, int maxClusters) {
-	int numFATSectors = fatInfo->numFATSectors;
-	int sizeofSector = fatInfo->sizeofSector;
-	int startFAT = sizeofSector * fatInfo->reservedSectors;
-	int endOfDir = 0;
-	int clusterCount = 0;
-	int nextCluster = cluster;
-	int curFATSector = -1;
-	
-	// malloc here just to be sure all frees have something to free
-	Sector fatSector = malloc(sizeofSector);
-	
-	while (!endOfDir) {
-		
-		// if we've got a good cluster
-		if ((fatInfo->fatType == 12 && nextCluster > RESERVED_12 && nextCluster < BAD_CLUSTER_12) ||
-			(fatInfo->fatType == 16 && nextCluster > RESERVED_16 && nextCluster < BAD_CLUSTER_16)
-		) {
-			
-			// get the correct address for this cluster
-			int absoluteCluster = getAbsoluteCluster(nextCluster);
-			
-			Sector fileSector = malloc(sizeofSector);
-			fseek(fs, sizeofSector * absoluteCluster, SEEK_SET);
-			fread(fileSector, sizeofSector, 1, fs);
-			
-			scanDirectorySector(fs, fileSector, sizeofSector * absoluteCluster);
-			
-			free(fileSector);
-		} else {
-			
-			// otherwise stop searching
-			endOfDir = 1;
-			break;
-		}
-		
-		fatSector = getCorrectFATSector(fs, fatSector, curFATSector, nextCluster);
-		
-		// if doing root directory, increment the cluster count
-		if (maxClusters > 0) {
-			// next cluster = start cluster + how many done so far
-			clusterCount++;
-			nextCluster = cluster + clusterCount;
-			if (clusterCount >= maxClusters) {
-				endOfDir = 1;
-				break;
-			}
-		} else {
-			// get the next cluster based on the current cluster
-			nextCluster = getNextCluster(fatSector, nextCluster);
-			if ((fatInfo->fatType == 12 && nextCluster >= END_MARKER_12) ||
-				(fatInfo->fatType == 16 && nextCluster >= END_MARKER_16)
-			) {
-				endOfDir = 1;
-				break;
+	if (!(de->attributes & ATTR_HIDDEN) && !(de->attributes & ATTR_SYSTEM_FILE)
+		&& !(de->attributes & ATTR_VOLUME_LABEL) && v->walk != NULL
+	) {
+		if (de->filename[0] == DIRECTORY || de->attributes & ATTR_SUB_DIR) {
+			if (de->filename[0] != DIRECTORY) {
+				// don't scan the "." and ".." entries
+				// they point back at this directory and its parent
+				// which will result in infinite recursion
+				// the subdirectory is scanned with the next level
+				DirPaths* dir = arenaAlloc(v->dirListArena, sizeof(DirPaths));
+				dir->path = path;
+				dir->shortPath = shortPath;
+				queueDirectory(v->walk, getEntryCluster(v->fatInfo, de), dir);
 			}
 		}
 	}
 	
-	free(fatSector);
+	// make an entry in the list for every file, deleted or not
+	// this way we only have to scan the filesystem once
+	v->dirListTail->next = arenaAlloc(v->dirListArena, sizeof(DirectoryList));
+	v->dirListTail = v->dirListTail->next;
+	
+	// only care about the name if the file was deleted
+	if (de->filename[0] == DELETED) {
+		memcpy(v->dirListTail->name, name, nameLen + 1);
+	} else {
+		// not a deleted file
+		// give the name a letter so it'll be ignored
+		// while printing out the list of deleted files
+		v->dirListTail->name[0] = de->filename[0];
+	}
+	
+	v->dirListTail->path = path;
+	v->dirListTail->shortPath = shortPath;
+	v->dirListTail->longName = longName != NULL ? finalName(path) : NULL;
+	v->dirListTail->posInFile = posInFile;
+	v->dirListTail->slots = NULL;
+	v->dirListTail->numSlots = 0;
+	if (longName != NULL) {
+		v->dirListTail->numSlots = longName->numSlots;
+		v->dirListTail->slots = arenaAlloc(v->dirListArena, longName->numSlots * sizeof(long));
+		memcpy(v->dirListTail->slots, longName->slotPos, longName->numSlots * sizeof(long));
+		memcpy(v->dirListTail->shortName, de->filename, 11);
+		v->dirListTail->checksum = longName->checksum;
+	}
+	v->dirListTail->startingCluster = getEntryCluster(v->fatInfo, de);
+	v->dirListTail->timeModified = entryTimeModified(de) | (entryDateModified(de) << 16);
+	v->dirListTail->fileSize = entryFileSize(de);
+	v->dirListTail->next = NULL;
 }